@@ -0,0 +1,168 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Pool of threads for the slow administrative commands (see aux_pool.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "aux_pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct aux_job {
+    struct aux_job *next;
+    conn *c;
+    ENGINE_ERROR_CODE (*run)(conn *c);
+    hrtime_t queued;
+};
+
+static struct {
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    bool initialized;
+    bool shutdown;
+    int nthreads;
+    cb_thread_t *tids;
+    /* The jobs waiting for a thread (oldest first) */
+    struct aux_job *head;
+    struct aux_job *tail;
+    struct aux_pool_stats stats;
+} pool;
+
+static void aux_pool_thread(void *arg) {
+    (void)arg;
+
+    cb_mutex_enter(&pool.mutex);
+    while (!pool.shutdown) {
+        struct aux_job *job = pool.head;
+        ENGINE_ERROR_CODE ret;
+        uint64_t usec;
+
+        if (job == NULL) {
+            cb_cond_wait(&pool.cond, &pool.mutex);
+            continue;
+        }
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        --pool.stats.queued;
+        cb_mutex_exit(&pool.mutex);
+
+        ret = job->run(job->c);
+        usec = (gethrtime() - job->queued) / 1000;
+        if (ret != ENGINE_EWOULDBLOCK) {
+            job->c->aux_done = true;
+            notify_job_complete(job->c, ret);
+        }
+        free(job);
+
+        cb_mutex_enter(&pool.mutex);
+        pool.stats.jobs++;
+        pool.stats.job_usec += usec;
+        if (usec > pool.stats.job_max_usec) {
+            pool.stats.job_max_usec = usec;
+        }
+    }
+    cb_mutex_exit(&pool.mutex);
+}
+
+bool aux_pool_init(int nthreads) {
+    int ii;
+
+    cb_mutex_initialize(&pool.mutex);
+    cb_cond_initialize(&pool.cond);
+    pool.initialized = true;
+
+    if (nthreads == 0) {
+        return true;
+    }
+
+    pool.tids = calloc(nthreads, sizeof(cb_thread_t));
+    if (pool.tids == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to allocate memory for the aux threads");
+        return false;
+    }
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        if (cb_create_thread(&pool.tids[ii], aux_pool_thread, NULL, 0) != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to create aux thread: %s", strerror(errno));
+            aux_pool_shutdown();
+            return false;
+        }
+        pool.nthreads++;
+    }
+
+    return true;
+}
+
+void aux_pool_shutdown(void) {
+    int ii;
+
+    if (!pool.initialized) {
+        return;
+    }
+
+    cb_mutex_enter(&pool.mutex);
+    pool.shutdown = true;
+    cb_cond_broadcast(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+
+    for (ii = 0; ii < pool.nthreads; ++ii) {
+        cb_join_thread(pool.tids[ii]);
+    }
+    free(pool.tids);
+    pool.tids = NULL;
+    pool.nthreads = 0;
+
+    while (pool.head != NULL) {
+        struct aux_job *job = pool.head;
+        pool.head = job->next;
+        free(job);
+    }
+    pool.tail = NULL;
+}
+
+bool aux_pool_enabled(void) {
+    return pool.nthreads > 0;
+}
+
+bool aux_pool_submit(conn *c, ENGINE_ERROR_CODE (*run)(conn *c)) {
+    struct aux_job *job;
+
+    if (!aux_pool_enabled() || (job = malloc(sizeof(*job))) == NULL) {
+        return false;
+    }
+    job->next = NULL;
+    job->c = c;
+    job->run = run;
+    job->queued = gethrtime();
+
+    cb_mutex_enter(&pool.mutex);
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    if (++pool.stats.queued > pool.stats.queued_max) {
+        pool.stats.queued_max = pool.stats.queued;
+    }
+    cb_cond_signal(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+    return true;
+}
+
+void aux_pool_get_stats(struct aux_pool_stats *stats) {
+    if (!pool.initialized) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    cb_mutex_enter(&pool.mutex);
+    *stats = pool.stats;
+    cb_mutex_exit(&pool.mutex);
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Pool of threads for the slow administrative commands.
+ *
+ * Some commands (the stats which walk the connections or the engine's
+ * memory, FLUSH, CONFIG_VALIDATE and the engine commands known to be
+ * slow) may keep a worker thread busy for milliseconds, and all of the
+ * other clients of the worker wait for them. With "aux_threads" set, the
+ * executor of such a command parks the connection in EWOULDBLOCK and
+ * queues the slow part for the pool. A pool thread runs it and hands the
+ * connection back to its worker with notify_job_complete(), with
+ * c->aux_done set, and the executor is called again to send the response.
+ */
+
+#ifndef AUX_POOL_H
+#define AUX_POOL_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct aux_pool_stats {
+    /* # of jobs waiting for a pool thread right now */
+    uint64_t queued;
+    /* The most jobs that have been waiting at the same time */
+    uint64_t queued_max;
+    /* # of jobs run on the pool */
+    uint64_t jobs;
+    /* Total and longest time from a job being queued to it being done */
+    uint64_t job_usec;
+    uint64_t job_max_usec;
+};
+
+/*
+ * Start the pool threads (none if nthreads is 0).
+ * Returns false (and logs why) if they couldn't be started.
+ */
+bool aux_pool_init(int nthreads);
+
+/* Stop the pool threads; queued jobs are dropped */
+void aux_pool_shutdown(void);
+
+/* Are there pool threads to submit jobs to? */
+bool aux_pool_enabled(void);
+
+/*
+ * Run job(c) on a pool thread. The connection must not be touched by its
+ * worker until the job hands it back: unless the job returns
+ * ENGINE_EWOULDBLOCK (in which case the engine notifies the worker when
+ * it is done) the pool sets c->aux_done and calls notify_job_complete()
+ * with the status the job returned.
+ * Returns false if the job couldn't be queued.
+ */
+bool aux_pool_submit(conn *c, ENGINE_ERROR_CODE (*job)(conn *c));
+
+void aux_pool_get_stats(struct aux_pool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
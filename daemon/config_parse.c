@@ -18,6 +18,7 @@
 #include "config_util.h"
 #include "config_parse.h"
 #include "connections.h"
+#include "ssl_sessions.h"
 
 static void do_asprintf(char **strp, const char *fmt, ...)
 {
@@ -335,6 +336,144 @@ static bool get_require_sasl(cJSON *o, struct settings *settings,
     }
 }
 
+static bool get_ktls(cJSON *o, struct settings *settings, char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->ktls, error_msg)) {
+        settings->has.ktls = true;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool get_ssl_handshake_threads(cJSON *o, struct settings *settings,
+                                      char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->ssl_handshake_threads,
+                       error_msg)) {
+        return false;
+    }
+    if (settings->ssl_handshake_threads < 0) {
+        do_asprintf(error_msg, "%s must be a positive number of threads (or 0)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.ssl_handshake_threads = true;
+    return true;
+}
+
+static bool get_aux_threads(cJSON *o, struct settings *settings,
+                            char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->aux_threads, error_msg)) {
+        return false;
+    }
+    if (settings->aux_threads < 0) {
+        do_asprintf(error_msg, "%s must be a positive number of threads (or 0)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.aux_threads = true;
+    return true;
+}
+
+static bool get_time_slice_usec(cJSON *o, struct settings *settings,
+                                char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->time_slice_usec, error_msg)) {
+        return false;
+    }
+    if (settings->time_slice_usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number of usec (or 0)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.time_slice_usec = true;
+    return true;
+}
+
+static bool get_slow_cmd_usec(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->slow_cmd_usec, error_msg)) {
+        return false;
+    }
+    if (settings->slow_cmd_usec < 0) {
+        do_asprintf(error_msg, "%s must be a positive number of usec (or 0)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.slow_cmd_usec = true;
+    return true;
+}
+
+static bool get_slow_cmd_keys(cJSON *o, struct settings *settings,
+                              char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->slow_cmd_keys, error_msg)) {
+        settings->has.slow_cmd_keys = true;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/* Max # of CPUs in one of the cpu_affinity lists */
+#define MAX_AFFINITY_CPUS 1024
+
+static bool get_cpu_list(cJSON *o, int **cpus, int *count, char **error_msg) {
+    const char *list = NULL;
+    int *parsed;
+    int num;
+
+    if (!get_string_value(o, o->string, &list, error_msg)) {
+        return false;
+    }
+    parsed = malloc(MAX_AFFINITY_CPUS * sizeof(int));
+    if (parsed == NULL) {
+        do_asprintf(error_msg, "Failed to allocate memory for %s\n",
+                    o->string);
+        free((char*)list);
+        return false;
+    }
+    num = parse_cpu_list(list, parsed, MAX_AFFINITY_CPUS);
+    if (num <= 0) {
+        do_asprintf(error_msg, "Invalid list of CPUs specified for %s: %s\n",
+                    o->string, list);
+        free(parsed);
+        free((char*)list);
+        return false;
+    }
+    free((char*)list);
+    free(*cpus);
+    *cpus = parsed;
+    *count = num;
+    return true;
+}
+
+static bool get_cpu_affinity(cJSON *o, struct settings *settings,
+                             char **error_msg) {
+    cJSON *p;
+
+    if (o->type != cJSON_Object) {
+        do_asprintf(error_msg, "Invalid entry for cpu_affinity\n");
+        return false;
+    }
+    for (p = o->child; p != NULL; p = p->next) {
+        if (strcasecmp("workers", p->string) == 0) {
+            if (!get_cpu_list(p, &settings->worker_cpus,
+                              &settings->num_worker_cpus, error_msg)) {
+                return false;
+            }
+        } else if (strcasecmp("dispatcher", p->string) == 0) {
+            if (!get_cpu_list(p, &settings->dispatcher_cpus,
+                              &settings->num_dispatcher_cpus, error_msg)) {
+                return false;
+            }
+        } else {
+            do_asprintf(error_msg, "Unknown attribute for cpu_affinity: %s\n",
+                        p->string);
+            return false;
+        }
+    }
+    settings->has.cpu_affinity = true;
+    return true;
+}
+
 static bool get_extension(cJSON *r, struct extension_settings *ext_settings,
                           char **error_msg) {
     if (r->type == cJSON_Object) {
@@ -495,6 +634,22 @@ static bool get_interface_ssl(int idx, cJSON *r, struct interface* iface,
                                     error_msg)) {
                     return false;
                 }
+            } else if (strcasecmp("session_cache", p->string) == 0) {
+                if (!get_int_value(p, "interface ssl session_cache",
+                                   &iface->ssl.session_cache, error_msg)) {
+                    return false;
+                }
+            } else if (strcasecmp("session_timeout", p->string) == 0) {
+                if (!get_int_value(p, "interface ssl session_timeout",
+                                   &iface->ssl.session_timeout, error_msg)) {
+                    return false;
+                }
+            } else if (strcasecmp("ticket_key_rotation", p->string) == 0) {
+                if (!get_int_value(p, "interface ssl ticket_key_rotation",
+                                   &iface->ssl.ticket_key_rotation,
+                                   error_msg)) {
+                    return false;
+                }
             } else {
                 do_asprintf(error_msg, "Unknown attribute for ssl: %s\n",
                             p->string);
@@ -503,6 +658,13 @@ static bool get_interface_ssl(int idx, cJSON *r, struct interface* iface,
             p = p->next;
         }
 
+        if (iface->ssl.session_cache < 0 || iface->ssl.session_timeout < 0 ||
+            iface->ssl.ticket_key_rotation < 0) {
+            do_asprintf(error_msg, "The ssl session_cache, session_timeout "
+                        "and ticket_key_rotation can't be negative\n");
+            return false;
+        }
+
         if (key && cert) {
             if (!get_absolute_file(key, &iface->ssl.key, error_msg)) {
                 return false;
@@ -529,6 +691,9 @@ static bool handle_interface(int idx, cJSON *r, struct interface* iface_list,
     iface->ipv4 = true;
     iface->ipv6 = true;
     iface->tcp_nodelay = true;
+    iface->ssl.session_cache = 20480;
+    iface->ssl.session_timeout = 3600;
+    iface->ssl.ticket_key_rotation = 3600;
 
     if (r->type == cJSON_Object) {
         struct {
@@ -635,6 +800,110 @@ static bool get_datatype(cJSON *o, struct settings *settings,
     }
 }
 
+static bool get_reuseport(cJSON *o, struct settings *settings,
+                          char **error_msg) {
+    if (get_bool_value(o, o->string, &settings->reuseport, error_msg)) {
+        settings->has.reuseport = true;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool get_placement(cJSON *o, struct settings *settings,
+                          char **error_msg) {
+    static const struct {
+        const char *name;
+        enum conn_placement placement;
+    } policies[] = {
+        { "round_robin", PLACEMENT_ROUND_ROBIN },
+        { "least_connections", PLACEMENT_LEAST_CONNECTIONS },
+        { "least_cpu", PLACEMENT_LEAST_CPU },
+        { "weighted", PLACEMENT_WEIGHTED },
+        { "incoming_cpu", PLACEMENT_INCOMING_CPU }
+    };
+    const char *ptr = NULL;
+    size_t ii;
+
+    if (!get_string_value(o, o->string, &ptr, error_msg)) {
+        return false;
+    }
+    for (ii = 0; ii < sizeof(policies) / sizeof(policies[0]); ++ii) {
+        if (strcasecmp(ptr, policies[ii].name) == 0) {
+            settings->placement = policies[ii].placement;
+            settings->has.placement = true;
+            free((char*)ptr);
+            return true;
+        }
+    }
+
+    do_asprintf(error_msg, "Invalid value specified for %s: %s\n",
+                o->string, ptr);
+    free((char*)ptr);
+    return false;
+}
+
+static bool get_migration_threshold(cJSON *o, struct settings *settings,
+                                    char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->migration_threshold,
+                       error_msg)) {
+        return false;
+    }
+    if (settings->migration_threshold < 0 ||
+        settings->migration_threshold > 100) {
+        do_asprintf(error_msg, "%s must be a percentage (0-100)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.migration_threshold = true;
+    return true;
+}
+
+static bool get_io_backend(cJSON *o, struct settings *settings,
+                           char **error_msg) {
+    static const struct {
+        const char *name;
+        enum io_backend backend;
+    } backends[] = {
+        { "libevent", IO_BACKEND_LIBEVENT },
+        { "io_uring", IO_BACKEND_IO_URING }
+    };
+    const char *ptr = NULL;
+    size_t ii;
+
+    if (!get_string_value(o, o->string, &ptr, error_msg)) {
+        return false;
+    }
+    for (ii = 0; ii < sizeof(backends) / sizeof(backends[0]); ++ii) {
+        if (strcasecmp(ptr, backends[ii].name) == 0) {
+            settings->io_backend = backends[ii].backend;
+            settings->has.io_backend = true;
+            free((char*)ptr);
+            return true;
+        }
+    }
+
+    do_asprintf(error_msg, "Invalid value specified for %s: %s\n",
+                o->string, ptr);
+    free((char*)ptr);
+    return false;
+}
+
+static bool get_zerocopy_threshold(cJSON *o, struct settings *settings,
+                                   char **error_msg) {
+    if (!get_int_value(o, o->string, &settings->zerocopy_threshold,
+                       error_msg)) {
+        return false;
+    }
+    if (settings->zerocopy_threshold < 0) {
+        do_asprintf(error_msg, "%s must be a positive number of bytes (or 0)\n",
+                    o->string);
+        return false;
+    }
+    settings->has.zerocopy_threshold = true;
+    return true;
+}
+
 /* reconfig (dynamic config update) handlers *********************************/
 
 typedef bool (*dynamic_validate_handler)(const struct settings *new_settings,
@@ -899,6 +1168,143 @@ static bool dyna_validate_datatype(const struct settings *new_settings,
     }
 }
 
+static bool dyna_validate_reuseport(const struct settings *new_settings,
+                                    cJSON* errors)
+{
+    /* the listening sockets are only created during startup */
+    if (!new_settings->has.reuseport) {
+        return true;
+    }
+    if (new_settings->reuseport == settings.reuseport) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'reuseport' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_io_backend(const struct settings *new_settings,
+                                     cJSON* errors)
+{
+    /* the rings are set up when the worker threads are created */
+    if (!new_settings->has.io_backend) {
+        return true;
+    }
+    if (new_settings->io_backend == settings.io_backend) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'io_backend' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_zerocopy_threshold(const struct settings *new_settings,
+                                             cJSON* errors)
+{
+    /* zerocopy_threshold *is* dynamic */
+    return true;
+}
+
+static bool dyna_validate_ktls(const struct settings *new_settings,
+                               cJSON* errors)
+{
+    /* ktls *is* dynamic (it applies to new connections) */
+    return true;
+}
+
+static bool dyna_validate_ssl_handshake_threads(const struct settings *new_settings,
+                                                cJSON* errors)
+{
+    if (!new_settings->has.ssl_handshake_threads) {
+        return true;
+    }
+
+    if (new_settings->ssl_handshake_threads == settings.ssl_handshake_threads) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'ssl_handshake_threads' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_aux_threads(const struct settings *new_settings,
+                                      cJSON* errors)
+{
+    if (!new_settings->has.aux_threads) {
+        return true;
+    }
+
+    if (new_settings->aux_threads == settings.aux_threads) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'aux_threads' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool same_cpus(const int *a, int na, const int *b, int nb) {
+    return na == nb && (na == 0 || memcmp(a, b, na * sizeof(int)) == 0);
+}
+
+static bool dyna_validate_cpu_affinity(const struct settings *new_settings,
+                                       cJSON* errors)
+{
+    if (!new_settings->has.cpu_affinity) {
+        return true;
+    }
+
+    if (same_cpus(new_settings->worker_cpus, new_settings->num_worker_cpus,
+                  settings.worker_cpus, settings.num_worker_cpus) &&
+        same_cpus(new_settings->dispatcher_cpus,
+                  new_settings->num_dispatcher_cpus,
+                  settings.dispatcher_cpus, settings.num_dispatcher_cpus)) {
+        return true;
+    } else {
+        cJSON_AddItemToArray(errors,
+                             cJSON_CreateString("'cpu_affinity' is not a dynamic setting."));
+        return false;
+    }
+}
+
+static bool dyna_validate_time_slice_usec(const struct settings *new_settings,
+                                          cJSON* errors)
+{
+    /* time_slice_usec *is* dynamic */
+    return true;
+}
+
+static bool dyna_validate_slow_cmd_usec(const struct settings *new_settings,
+                                        cJSON* errors)
+{
+    /* slow_cmd_usec *is* dynamic */
+    return true;
+}
+
+static bool dyna_validate_slow_cmd_keys(const struct settings *new_settings,
+                                        cJSON* errors)
+{
+    /* slow_cmd_keys *is* dynamic */
+    return true;
+}
+
+static bool dyna_validate_placement(const struct settings *new_settings,
+                                    cJSON* errors)
+{
+    /* connection_placement *is* dynamic */
+    return true;
+}
+
+static bool dyna_validate_migration_threshold(const struct settings *new_settings,
+                                              cJSON* errors)
+{
+    /* connection_migration *is* dynamic */
+    return true;
+}
+
 /* dynamic reconfiguration handlers ******************************************/
 
 static void dyna_reconfig_iface_maxconns(const struct interface *new_if,
@@ -963,9 +1369,12 @@ static void dyna_reconfig_iface_nodelay(const struct interface *new_if,
 
 static void dyna_reconfig_iface_ssl(const struct interface *new_if,
                                     struct interface *cur_if) {
+    bool changed = false;
+
     if (cur_if->ssl.cert != NULL && strcmp(new_if->ssl.cert,
                                            cur_if->ssl.cert) != 0) {
         const char *old_cert = cur_if->ssl.cert;
+        changed = true;
         cur_if->ssl.cert = strdup(new_if->ssl.cert);
         /* TODO: change to EXTENSION_LOG_INFO */
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -977,6 +1386,7 @@ static void dyna_reconfig_iface_ssl(const struct interface *new_if,
     if (cur_if->ssl.key != NULL && strcmp(new_if->ssl.key,
                                            cur_if->ssl.key) != 0) {
         const char *old_key = cur_if->ssl.key;
+        changed = true;
         cur_if->ssl.key = strdup(new_if->ssl.key);
         /* TODO: change to EXTENSION_LOG_INFO */
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -984,6 +1394,24 @@ static void dyna_reconfig_iface_ssl(const struct interface *new_if,
             cur_if->host, cur_if->port, old_key, cur_if->ssl.key);
         free((char*)old_key);
     }
+
+    if (new_if->ssl.session_cache != cur_if->ssl.session_cache ||
+        new_if->ssl.session_timeout != cur_if->ssl.session_timeout ||
+        new_if->ssl.ticket_key_rotation != cur_if->ssl.ticket_key_rotation) {
+        changed = true;
+        cur_if->ssl.session_cache = new_if->ssl.session_cache;
+        cur_if->ssl.session_timeout = new_if->ssl.session_timeout;
+        cur_if->ssl.ticket_key_rotation = new_if->ssl.ticket_key_rotation;
+        /* TODO: change to EXTENSION_LOG_INFO */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Changed ssl session settings for interface %s:%hu",
+            cur_if->host, cur_if->port);
+    }
+
+    if (changed && cur_if->ssl.cert != NULL) {
+        /* The new connections get a context with the new settings */
+        ssl_sessions_invalidate((int)(cur_if - settings.interfaces));
+    }
 }
 
 static void dyna_reconfig_interfaces(const struct settings *new_settings) {
@@ -1060,6 +1488,72 @@ static void dyna_reconfig_verbosity(const struct settings *new_settings) {
     }
 }
 
+static void dyna_reconfig_placement(const struct settings *new_settings) {
+    if (new_settings->has.placement &&
+        new_settings->placement != settings.placement) {
+        settings.placement = new_settings->placement;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed connection_placement to %s",
+            conn_placement_text(settings.placement));
+    }
+}
+
+static void dyna_reconfig_migration_threshold(const struct settings *new_settings) {
+    if (new_settings->has.migration_threshold &&
+        new_settings->migration_threshold != settings.migration_threshold) {
+        settings.migration_threshold = new_settings->migration_threshold;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed connection_migration to %d",
+            settings.migration_threshold);
+    }
+}
+
+static void dyna_reconfig_time_slice_usec(const struct settings *new_settings) {
+    if (new_settings->has.time_slice_usec &&
+        new_settings->time_slice_usec != settings.time_slice_usec) {
+        settings.time_slice_usec = new_settings->time_slice_usec;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed time_slice_usec to %d", settings.time_slice_usec);
+    }
+}
+
+static void dyna_reconfig_slow_cmd_usec(const struct settings *new_settings) {
+    if (new_settings->has.slow_cmd_usec &&
+        new_settings->slow_cmd_usec != settings.slow_cmd_usec) {
+        settings.slow_cmd_usec = new_settings->slow_cmd_usec;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed slow_cmd_usec to %d", settings.slow_cmd_usec);
+    }
+}
+
+static void dyna_reconfig_slow_cmd_keys(const struct settings *new_settings) {
+    if (new_settings->has.slow_cmd_keys &&
+        new_settings->slow_cmd_keys != settings.slow_cmd_keys) {
+        settings.slow_cmd_keys = new_settings->slow_cmd_keys;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed slow_cmd_keys to %s",
+            settings.slow_cmd_keys ? "true" : "false");
+    }
+}
+
+static void dyna_reconfig_zerocopy_threshold(const struct settings *new_settings) {
+    if (new_settings->has.zerocopy_threshold &&
+        new_settings->zerocopy_threshold != settings.zerocopy_threshold) {
+        settings.zerocopy_threshold = new_settings->zerocopy_threshold;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed zerocopy_threshold to %d",
+            settings.zerocopy_threshold);
+    }
+}
+
+static void dyna_reconfig_ktls(const struct settings *new_settings) {
+    if (new_settings->has.ktls && new_settings->ktls != settings.ktls) {
+        settings.ktls = new_settings->ktls;
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+            "Changed ktls to %s", settings.ktls ? "true" : "false");
+    }
+}
+
 /* list of handlers for each setting */
 
 struct {
@@ -1086,6 +1580,25 @@ struct {
     { "verbosity", get_verbosity, dyna_validate_verbosity, dyna_reconfig_verbosity },
     { "bio_drain_buffer_sz", get_bio_drain_sz, dyna_validate_bio_drain_sz, NULL },
     { "datatype_support", get_datatype, dyna_validate_datatype, NULL },
+    { "reuseport", get_reuseport, dyna_validate_reuseport, NULL },
+    { "connection_placement", get_placement, dyna_validate_placement,
+      dyna_reconfig_placement },
+    { "connection_migration", get_migration_threshold,
+      dyna_validate_migration_threshold, dyna_reconfig_migration_threshold },
+    { "io_backend", get_io_backend, dyna_validate_io_backend, NULL },
+    { "zerocopy_threshold", get_zerocopy_threshold,
+      dyna_validate_zerocopy_threshold, dyna_reconfig_zerocopy_threshold },
+    { "ktls", get_ktls, dyna_validate_ktls, dyna_reconfig_ktls },
+    { "ssl_handshake_threads", get_ssl_handshake_threads,
+      dyna_validate_ssl_handshake_threads, NULL },
+    { "aux_threads", get_aux_threads, dyna_validate_aux_threads, NULL },
+    { "time_slice_usec", get_time_slice_usec,
+      dyna_validate_time_slice_usec, dyna_reconfig_time_slice_usec },
+    { "slow_cmd_usec", get_slow_cmd_usec,
+      dyna_validate_slow_cmd_usec, dyna_reconfig_slow_cmd_usec },
+    { "slow_cmd_keys", get_slow_cmd_keys,
+      dyna_validate_slow_cmd_keys, dyna_reconfig_slow_cmd_keys },
+    { "cpu_affinity", get_cpu_affinity, dyna_validate_cpu_affinity, NULL },
     { NULL, NULL, NULL, NULL }
 };
 
@@ -1258,4 +1771,6 @@ void free_settings(struct settings* s) {
     free((char*)s->engine_module);
     free((char*)s->engine_config);
     free((char*)s->config);
+    free(s->worker_cpus);
+    free(s->dispatcher_cpus);
 }
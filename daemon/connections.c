@@ -16,6 +16,10 @@
  */
 
 #include "connections.h"
+#include "ssl_sessions.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "stream_compress.h"
 
 #include <cJSON.h>
 
@@ -41,15 +45,19 @@ enum loan_res {
 
 static void conn_loan_buffers(conn *c);
 static void conn_return_buffers(conn *c);
-static bool conn_reset_buffersize(conn *c);
+static void conn_return_lists(conn *c);
+static enum loan_res conn_loan_read_buffer(conn *c);
+static void conn_return_read_buffer(conn *c);
+static int rbuf_class_of(size_t size);
 static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf,
                                              struct net_buf *conn_buf);
 static void conn_return_single_buffer(conn *c, struct net_buf *thread_buf,
                                       struct net_buf *conn_buf);
 static int conn_constructor(conn *c);
+static void conn_free_resources(conn *c);
 static void conn_destructor(conn *c);
-static conn *allocate_connection(void);
-static void release_connection(conn *c);
+static conn *allocate_connection(LIBEVENT_THREAD *thread);
+static void release_connection(conn *c, LIBEVENT_THREAD *thread);
 
 static cJSON* get_connection_stats(const conn *c);
 
@@ -77,17 +85,23 @@ void destroy_connections(void)
 }
 
 void run_event_loop(conn* c) {
+    /* The connection is no longer ours to look at once it's destroyed */
+    LIBEVENT_THREAD *thread = c->thread;
 
+    /* The connection may have moved to another thread or bucket */
+    c->thread_stats = NULL;
     if (!is_listen_thread()) {
         conn_loan_buffers(c);
     }
 
+    c->slice_start = gethrtime();
     do {
         if (settings.verbose) {
             settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                     "%d - Running task: (%s)\n", c->sfd, state_text(c->state));
         }
     } while (c->state(c));
+    c->busy_time += gethrtime() - c->slice_start;
 
     if (!is_listen_thread()) {
         conn_return_buffers(c);
@@ -97,7 +111,11 @@ void run_event_loop(conn* c) {
         /* Actually free the memory from this connection. Unsafe to dereference
          * c after this point.
          */
-        release_connection(c);
+        release_connection(c, thread);
+        c = NULL;
+    } else if (c->state == conn_migrate) {
+        /* Another thread owns the connection after this */
+        thread_migrate_conn(c);
         c = NULL;
     }
 }
@@ -105,8 +123,8 @@ void run_event_loop(conn* c) {
 conn *conn_new(const SOCKET sfd, in_port_t parent_port,
                STATE_FUNC init_state, int event_flags,
                unsigned int read_buffer_size, struct event_base *base,
-               struct timeval *timeout) {
-    conn *c = allocate_connection();
+               struct timeval *timeout, LIBEVENT_THREAD *thread) {
+    conn *c = allocate_connection(thread);
     if (c == NULL) {
         return NULL;
     }
@@ -121,19 +139,9 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
             if (parent_port == settings.interfaces[ii].port) {
                 c->nodelay = settings.interfaces[ii].tcp_nodelay;
                 if (settings.interfaces[ii].ssl.cert != NULL) {
-                    const char *cert = settings.interfaces[ii].ssl.cert;
-                    const char *pkey = settings.interfaces[ii].ssl.key;
-
-                    c->ssl.ctx = SSL_CTX_new(SSLv23_server_method());
-
-                    /* MB-12359 - Disable SSLv2 & SSLv3 due to POODLE */
-                    SSL_CTX_set_options(c->ssl.ctx,
-                                        SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-
-                    /* @todo don't read files, but use in-memory-copies */
-                    if (!SSL_CTX_use_certificate_chain_file(c->ssl.ctx, cert) ||
-                        !SSL_CTX_use_PrivateKey_file(c->ssl.ctx, pkey, SSL_FILETYPE_PEM)) {
-                        release_connection(c);
+                    c->ssl.ctx = ssl_sessions_get_ctx(ii);
+                    if (c->ssl.ctx == NULL) {
+                        release_connection(c, NULL);
                         return NULL;
                     }
 
@@ -141,32 +149,56 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
                     c->ssl.error = false;
                     c->ssl.client = NULL;
 
-                    c->ssl.in.buffer = malloc(settings.bio_drain_buffer_sz);
-                    c->ssl.out.buffer = malloc(settings.bio_drain_buffer_sz);
-
-                    if (c->ssl.in.buffer == NULL || c->ssl.out.buffer == NULL) {
-                        release_connection(c);
-                        return NULL;
+#ifdef HAVE_KTLS
+                    /*
+                     * Let OpenSSL read and write the socket itself, so that
+                     * it can hand the record layer to the kernel once the
+                     * handshake is done. If the kernel can't do it, OpenSSL
+                     * keeps doing the encryption (still without the BIO
+                     * pair in between).
+                     */
+                    c->ssl.direct = settings.ktls;
+#endif
+
+                    if (c->ssl.direct) {
+                        c->ssl.client = SSL_new(c->ssl.ctx);
+                        if (c->ssl.client == NULL ||
+                            !SSL_set_fd(c->ssl.client, (int)sfd)) {
+                            release_connection(c, NULL);
+                            return NULL;
+                        }
+#ifdef HAVE_KTLS
+                        SSL_set_options(c->ssl.client, SSL_OP_ENABLE_KTLS);
+                        SSL_set_mode(c->ssl.client,
+                                     SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#endif
+                    } else {
+                        c->ssl.in.buffer = malloc(settings.bio_drain_buffer_sz);
+                        c->ssl.out.buffer = malloc(settings.bio_drain_buffer_sz);
+
+                        if (c->ssl.in.buffer == NULL || c->ssl.out.buffer == NULL) {
+                            release_connection(c, NULL);
+                            return NULL;
+                        }
+
+                        c->ssl.in.buffsz = settings.bio_drain_buffer_sz;
+                        c->ssl.out.buffsz = settings.bio_drain_buffer_sz;
+                        BIO_new_bio_pair(&c->ssl.application,
+                                         settings.bio_drain_buffer_sz,
+                                         &c->ssl.network,
+                                         settings.bio_drain_buffer_sz);
+
+                        c->ssl.client = SSL_new(c->ssl.ctx);
+                        SSL_set_bio(c->ssl.client,
+                                    c->ssl.application,
+                                    c->ssl.application);
                     }
-
-                    c->ssl.in.buffsz = settings.bio_drain_buffer_sz;
-                    c->ssl.out.buffsz = settings.bio_drain_buffer_sz;
-                    BIO_new_bio_pair(&c->ssl.application,
-                                     settings.bio_drain_buffer_sz,
-                                     &c->ssl.network,
-                                     settings.bio_drain_buffer_sz);
-
-                    c->ssl.client = SSL_new(c->ssl.ctx);
-                    SSL_set_bio(c->ssl.client,
-                                c->ssl.application,
-                                c->ssl.application);
                 }
             }
         }
     }
 
-    c->request_addr_size = 0;
-
     if (settings.verbose > 1) {
         if (init_state == conn_listening) {
             settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
@@ -179,6 +211,11 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     c->sfd = sfd;
     c->max_reqs_per_event = settings.default_reqs_per_event;
+    c->slice_weight = SLICE_WEIGHT_MED;
+    c->thread_stats = NULL;
+    memset(&c->slow, 0, sizeof(c->slow));
+    memset(&c->mget, 0, sizeof(c->mget));
+    memset(&c->parked, 0, sizeof(c->parked));
     c->parent_port = parent_port;
     c->state = init_state;
     c->rlbytes = 0;
@@ -187,6 +224,8 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->write.curr = c->write.buf = NULL;
     c->read.curr = c->read.buf = NULL;
     c->read.size = c->write.size = 0;
+    c->read_hint = 0;
+    c->bulk_stats_size = 0;
     c->ritem = 0;
     c->icurr = c->ilist = NULL;
     c->temp_alloc_curr = c->temp_alloc_list;
@@ -197,11 +236,16 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->msgused = 0;
     c->next = NULL;
     c->list_state = 0;
+    c->uring = NULL;
+    c->zerocopy = NULL;
+    c->stream = NULL;
+    c->stream_start = false;
 
     c->write_and_go = init_state;
     c->write_and_free = 0;
     c->item = 0;
     c->supports_datatype = false;
+    c->unordered = false;
     c->noreply = false;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
@@ -210,7 +254,7 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     if (!register_event(c, timeout)) {
         cb_assert(c->thread == NULL);
-        release_connection(c);
+        release_connection(c, NULL);
         return NULL;
     }
 
@@ -220,6 +264,7 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
+    c->aux_done = false;
     c->refcount = 1;
 
     MEMCACHED_CONN_ALLOCATE(c->sfd);
@@ -240,6 +285,24 @@ void conn_cleanup_engine_allocations(conn* c) {
             settings.engine.v1->release(settings.engine.v0, c, *(c->icurr));
         }
     }
+
+    conn_release_mget(c);
+}
+
+void conn_release_mget(conn *c) {
+    uint32_t ii;
+
+    if (c->mget.keys == NULL) {
+        return;
+    }
+    for (ii = 0; ii < c->mget.nkeys; ++ii) {
+        if (c->mget.keys[ii].it != NULL) {
+            settings.engine.v1->release(settings.engine.v0, c,
+                                        c->mget.keys[ii].it);
+        }
+    }
+    free(c->mget.keys);
+    memset(&c->mget, 0, sizeof(c->mget));
 }
 
 static void conn_cleanup(conn *c) {
@@ -257,6 +320,17 @@ static void conn_cleanup(conn *c) {
         c->write_and_free = 0;
     }
 
+    /* The items of the held back responses were released with the others */
+    free(c->coalesce.buf);
+    memset(&c->coalesce, 0, sizeof(c->coalesce));
+    free(c->ilist);
+    c->icurr = c->ilist = NULL;
+    c->isize = 0;
+    free(c->parked.gets);
+    memset(&c->parked, 0, sizeof(c->parked));
+    free(c->slow.cmd);
+    memset(&c->slow, 0, sizeof(c->slow));
+
     if (c->sasl_conn) {
         cbsasl_dispose(&c->sasl_conn);
         c->sasl_conn = NULL;
@@ -274,6 +348,10 @@ static void conn_cleanup(conn *c) {
     c->tap_iterator = NULL;
     c->dcp = 0;
     conn_return_buffers(c);
+    conn_return_lists(c);
+    free(c->temp_alloc_list);
+    c->temp_alloc_list = c->temp_alloc_curr = NULL;
+    c->temp_alloc_size = 0;
 
     c->engine_storage = NULL;
 
@@ -282,6 +360,15 @@ static void conn_cleanup(conn *c) {
     c->sfd = INVALID_SOCKET;
     c->start = 0;
     if (c->ssl.enabled) {
+        if (c->ssl.connected && !c->ssl.error) {
+            /*
+             * We don't do the close_notify exchange, and OpenSSL won't
+             * let anyone resume the session of a connection which wasn't
+             * shut down.
+             */
+            SSL_set_shutdown(c->ssl.client,
+                             SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
         BIO_free_all(c->ssl.network);
         SSL_free(c->ssl.client);
         c->ssl.enabled = false;
@@ -300,11 +387,15 @@ void conn_close(conn *c) {
 
     cb_assert(c->thread);
     /* remove from pending-io list */
-    if (settings.verbose > 1 && list_contains(c->thread->pending_io, c)) {
+    if (settings.verbose > 1 && (c->list_state & LIST_STATE_REQ_PENDING_IO)) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                         "Current connection was in the pending-io list.. Nuking it\n");
     }
-    c->thread->pending_io = list_remove(c->thread->pending_io, c);
+    thread_pending_io_remove(c);
+    uring_conn_detach(c);
+    zerocopy_conn_cleanup(c);
+    stream_compress_cleanup(c);
+    thread_conn_closed(c);
 
     conn_cleanup(c);
 
@@ -315,7 +406,13 @@ void conn_close(conn *c) {
 void conn_shrink(conn *c) {
     cb_assert(c != NULL);
 
-    if (c->read.size > READ_BUFFER_HIGHWAT && c->read.bytes < DATA_BUFFER_SIZE) {
+    /*
+     * Pool-sized read buffers go back to the thread's pool when they're
+     * empty (conn_return_read_buffer); shrinking them here would keep the
+     * larger size classes from ever being reused.
+     */
+    if (c->read.size > READ_BUFFER_HIGHWAT && c->read.bytes < DATA_BUFFER_SIZE &&
+        rbuf_class_of(c->read.size) == -1) {
         void *newbuf;
 
         if (c->read.curr != c->read.buf) {
@@ -419,7 +516,7 @@ bool connection_set_nodelay(conn *c, bool enable)
  */
 static void conn_loan_buffers(conn *c) {
     enum loan_res res;
-    res = conn_loan_single_buffer(c, &c->thread->read, &c->read);
+    res = conn_loan_read_buffer(c);
     if (res == loan_allocated) {
         STATS_NOKEY(c, rbufs_allocated);
     } else if (res == loan_loaned) {
@@ -434,6 +531,18 @@ static void conn_loan_buffers(conn *c) {
     } else if (res == loan_loaned) {
         STATS_NOKEY(c, wbufs_loaned);
     }
+
+    /* The lists are allocated on first use if the thread has none to loan */
+    if (c->iov == NULL && c->thread->iov != NULL) {
+        c->iov = c->thread->iov;
+        c->iovsize = IOV_LIST_INITIAL;
+        c->thread->iov = NULL;
+    }
+    if (c->msglist == NULL && c->thread->msglist != NULL) {
+        c->msglist = c->thread->msglist;
+        c->msgsize = MSG_LIST_INITIAL;
+        c->thread->msglist = NULL;
+    }
 }
 
 /**
@@ -458,71 +567,55 @@ static void conn_return_buffers(conn *c) {
         return;
     }
 
-    conn_return_single_buffer(c, &c->thread->read, &c->read);
+    conn_return_read_buffer(c);
     conn_return_single_buffer(c, &c->thread->write, &c->write);
+
+    /*
+     * An idle connection (waiting for its next request, with everything
+     * sent) doesn't need the lists until then.
+     */
+    if (c->state == conn_read && c->msgcurr >= c->msgused &&
+        !c->coalesce.pending && c->ileft == 0 && c->temp_alloc_left == 0) {
+        conn_return_lists(c);
+        free(c->ilist);
+        c->icurr = c->ilist = NULL;
+        c->isize = 0;
+    }
 }
 
 /**
- * Reset all of the dynamic buffers used by a connection back to their
- * default sizes. The strategy for resizing the buffers is to allocate a
- * new one of the correct size and free the old one if the allocation succeeds
- * instead of using realloc to change the buffer size (because realloc may
- * not shrink the buffers, and will also copy the memory). If the allocation
- * fails the buffer will be unchanged.
- *
- * @param c the connection to resize the buffers for
- * @return true if all allocations succeeded, false if one or more of the
- *         allocations failed.
+ * Give the connection's iov and msghdr lists back to the thread (or free
+ * them if the thread has its own, or they've grown). The connection must
+ * not have anything left to send.
  */
-static bool conn_reset_buffersize(conn *c) {
-    bool ret = true;
-
-    /* itemlist only needed for TAP / DCP connections, so we just free when the
-     * connection is reset.
-     */
-    free(c->ilist);
-    c->ilist = NULL;
-    c->isize = 0;
-
-    if (c->temp_alloc_size != TEMP_ALLOC_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(char *) * TEMP_ALLOC_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->temp_alloc_list);
-            c->temp_alloc_list = ptr;
-            c->temp_alloc_size = TEMP_ALLOC_LIST_INITIAL;
+static void conn_return_lists(conn *c) {
+    if (c->iov != NULL) {
+        if (c->thread->iov == NULL && c->iovsize == IOV_LIST_INITIAL) {
+            c->thread->iov = c->iov;
         } else {
-            ret = false;
-        }
-    }
-
-    if (c->iovsize != IOV_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct iovec) * IOV_LIST_INITIAL);
-        if (ptr != NULL) {
             free(c->iov);
-            c->iov = ptr;
-            c->iovsize = IOV_LIST_INITIAL;
-        } else {
-            ret = false;
         }
+        c->iov = NULL;
+        c->iovsize = 0;
     }
-
-    if (c->msgsize != MSG_LIST_INITIAL) {
-        void *ptr = malloc(sizeof(struct msghdr) * MSG_LIST_INITIAL);
-        if (ptr != NULL) {
-            free(c->msglist);
-            c->msglist = ptr;
-            c->msgsize = MSG_LIST_INITIAL;
+    if (c->msglist != NULL) {
+        if (c->thread->msglist == NULL && c->msgsize == MSG_LIST_INITIAL) {
+            c->thread->msglist = c->msglist;
         } else {
-            ret = false;
+            free(c->msglist);
         }
+        c->msglist = NULL;
+        c->msgsize = 0;
     }
-
-    return ret;
+    c->iovused = 0;
+    c->msgused = 0;
+    c->msgcurr = 0;
 }
 
 /**
- * Constructor for all memory allocations of connection objects. Initialize
- * all members and allocate the transfer buffers.
+ * Constructor for all connection objects (new ones, and the ones reused
+ * from a thread's pool). Initialize all members; the buffers and lists are
+ * allocated (or loaned) when they are first needed.
  *
  * @param buffer The memory allocated by the object cache
  * @return 0 on success, 1 if we failed to allocate memory
@@ -534,37 +627,40 @@ static int conn_constructor(conn *c) {
     c->auth_context = auth_create(NULL);;
     c->state = conn_immediate_close;
     c->sfd = INVALID_SOCKET;
-    if (!conn_reset_buffersize(c)) {
-        free(c->read.buf);
-        free(c->write.buf);
-        free(c->ilist);
-        free(c->temp_alloc_list);
-        free(c->iov);
-        free(c->msglist);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING,
-                                        NULL,
-                                        "Failed to allocate buffers for connection\n");
-        return 1;
-    }
-
-    STATS_LOCK();
-    stats.conn_structs++;
-    STATS_UNLOCK();
 
     return 0;
 }
 
 /**
- * Destructor for all connection objects. Release all allocated resources.
+ * Release everything the connection object has allocated (but not the
+ * object itself).
  */
-static void conn_destructor(conn *c) {
+static void conn_free_resources(conn *c) {
     auth_destroy(c->auth_context);
+    c->auth_context = NULL;
     free(c->read.buf);
+    c->read.buf = NULL;
     free(c->write.buf);
+    c->write.buf = NULL;
     free(c->ilist);
+    c->ilist = NULL;
     free(c->temp_alloc_list);
+    c->temp_alloc_list = NULL;
+    free(c->parked.gets);
+    c->parked.gets = NULL;
+    free(c->slow.cmd);
+    c->slow.cmd = NULL;
     free(c->iov);
+    c->iov = NULL;
     free(c->msglist);
+    c->msglist = NULL;
+}
+
+/**
+ * Destructor for all connection objects. Release all allocated resources.
+ */
+static void conn_destructor(conn *c) {
+    conn_free_resources(c);
     free(c);
 
     STATS_LOCK();
@@ -572,12 +668,38 @@ static void conn_destructor(conn *c) {
     STATS_UNLOCK();
 }
 
-/** Allocate a connection, creating memory and adding it to the conections
- *  list. Returns a pointer to the newly-allocated connection if successful,
- *  else NULL.
+/** Add the connection to the connections list */
+static void link_connection(conn *c) {
+    cb_mutex_enter(&connections.mutex);
+    // First update the new nodes' links ...
+    c->all_next = connections.sentinal.all_next;
+    c->all_prev = &connections.sentinal;
+    // ... then the existing nodes' links.
+    connections.sentinal.all_next->all_prev = c;
+    connections.sentinal.all_next = c;
+    cb_mutex_exit(&connections.mutex);
+}
+
+/** Allocate a connection, reusing one from the thread's pool or creating
+ *  memory, and add it to the conections list. Returns a pointer to the
+ *  newly-allocated connection if successful, else NULL.
  */
-static conn *allocate_connection(void) {
-    conn *ret = malloc(sizeof(conn));
+static conn *allocate_connection(LIBEVENT_THREAD *thread) {
+    conn *ret;
+
+    if (thread != NULL && (ret = thread->conn_pool.head) != NULL) {
+        /*
+         * It was taken off the connections list when it was pooled, so
+         * nobody else looks at it while we set it up again.
+         */
+        thread->conn_pool.head = ret->next;
+        thread->conn_pool.count--;
+        conn_constructor(ret);
+        link_connection(ret);
+        return ret;
+    }
+
+    ret = malloc(sizeof(conn));
     if (ret == NULL) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                         "Failed to allocate memory for connection");
@@ -591,27 +713,34 @@ static conn *allocate_connection(void) {
         return NULL;
     }
 
-    cb_mutex_enter(&connections.mutex);
-    // First update the new nodes' links ...
-    ret->all_next = connections.sentinal.all_next;
-    ret->all_prev = &connections.sentinal;
-    // ... then the existing nodes' links.
-    connections.sentinal.all_next->all_prev = ret;
-    connections.sentinal.all_next = ret;
-    cb_mutex_exit(&connections.mutex);
+    STATS_LOCK();
+    stats.conn_structs++;
+    STATS_UNLOCK();
 
+    link_connection(ret);
     return ret;
 }
 
 /** Release a connection; removing it from the connection list management
- *  and freeing the conn object.
+ *  and putting it in the thread's pool (if there is room for it), or
+ *  freeing the conn object.
  */
-static void release_connection(conn *c) {
+static void release_connection(conn *c, LIBEVENT_THREAD *thread) {
     cb_mutex_enter(&connections.mutex);
     c->all_next->all_prev = c->all_prev;
     c->all_prev->all_next = c->all_next;
     cb_mutex_exit(&connections.mutex);
 
+    if (thread != NULL && thread->conn_pool.count < CONN_POOL_DEPTH) {
+        /* Keep the object, but none of what it had allocated */
+        conn_free_resources(c);
+        c->state = conn_destroyed;
+        c->next = thread->conn_pool.head;
+        thread->conn_pool.head = c;
+        thread->conn_pool.count++;
+        return;
+    }
+
     // Finally free it
     conn_destructor(c);
 }
@@ -658,6 +787,154 @@ static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf
     }
 }
 
+/** The size of the read buffers in the given size class */
+#define RBUF_CLASS_SIZE(cls) ((size_t)DATA_BUFFER_SIZE << (2 * (cls)))
+
+/**
+ * The smallest read buffer size class holding at least wanted bytes
+ * (or the largest class if none of them does)
+ */
+static int rbuf_class_for(size_t wanted) {
+    int cls = 0;
+    while (cls < RBUF_CLASSES - 1 && RBUF_CLASS_SIZE(cls) < wanted) {
+        ++cls;
+    }
+    return cls;
+}
+
+/** The size class of a read buffer, or -1 if it isn't a pool size */
+static int rbuf_class_of(size_t size) {
+    int cls;
+    for (cls = 0; cls < RBUF_CLASSES; ++cls) {
+        if (RBUF_CLASS_SIZE(cls) == size) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Put an empty read buffer into the thread's pool, or free it if it isn't
+ * a pool size or the pool for its size class is full.
+ */
+static void rbuf_pool_put(LIBEVENT_THREAD *thread, char *buf, size_t size) {
+    int cls = rbuf_class_of(size);
+    if (cls != -1 && thread->rbuf_pool[cls].count < RBUF_POOL_DEPTH) {
+        thread->rbuf_pool[cls].bufs[thread->rbuf_pool[cls].count++] = buf;
+    } else {
+        free(buf);
+    }
+}
+
+/**
+ * Get a read buffer of the given size class from the thread's pool, or
+ * allocate one if the pool is empty.
+ */
+static char *rbuf_pool_get(LIBEVENT_THREAD *thread, int cls, bool *pooled) {
+    if (thread->rbuf_pool[cls].count > 0) {
+        *pooled = true;
+        return thread->rbuf_pool[cls].bufs[--thread->rbuf_pool[cls].count];
+    }
+    *pooled = false;
+    return malloc(RBUF_CLASS_SIZE(cls));
+}
+
+/**
+ * Loan the connection a read buffer sized after the amount of data it
+ * usually sends us in one go.
+ */
+static enum loan_res conn_loan_read_buffer(conn *c) {
+    bool pooled;
+    int cls;
+
+    if (c->read.buf != NULL) {
+        return loan_existing;
+    }
+
+    cls = rbuf_class_for(c->read_hint);
+    c->read.buf = rbuf_pool_get(c->thread, cls, &pooled);
+    if (c->read.buf == NULL) {
+        if (settings.verbose) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to allocate new read buffer.. closing connection\n",
+                c->sfd);
+        }
+        conn_set_state(c, conn_closing);
+        return loan_existing;
+    }
+    c->read.size = (uint32_t)RBUF_CLASS_SIZE(cls);
+    c->read.curr = c->read.buf;
+    c->read.bytes = 0;
+    return pooled ? loan_loaned : loan_allocated;
+}
+
+/**
+ * Give the connection's read buffer back to the thread's pool if it is
+ * empty.
+ */
+static void conn_return_read_buffer(conn *c) {
+    /* A blocked command is run again from the packet in the buffer */
+    if (c->read.buf == NULL || c->read.bytes != 0 || c->ewouldblock) {
+        return;
+    }
+
+    rbuf_pool_put(c->thread, c->read.buf, c->read.size);
+    c->read.buf = c->read.curr = NULL;
+    c->read.size = 0;
+}
+
+bool conn_grow_read_buffer(conn *c, size_t needed) {
+    size_t wanted = (size_t)c->read.bytes + needed;
+    int cls = rbuf_class_for(wanted);
+    size_t size = RBUF_CLASS_SIZE(cls);
+    bool pooled;
+    char *buf;
+
+    if (size < wanted) {
+        /* Bigger than the largest class; double until it fits */
+        size = c->read.size;
+        while (size < wanted) {
+            size *= 2;
+        }
+        buf = malloc(size);
+    } else {
+        buf = rbuf_pool_get(c->thread, cls, &pooled);
+    }
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    memcpy(buf, c->read.curr, c->read.bytes);
+    rbuf_pool_put(c->thread, c->read.buf, c->read.size);
+    c->read.buf = c->read.curr = buf;
+    c->read.size = (uint32_t)size;
+    STATS_NOKEY(c, rbufs_grown);
+    return true;
+}
+
+void conn_pools_cleanup(LIBEVENT_THREAD *thread) {
+    int cls;
+
+    /* (they aren't on the connections list) */
+    while (thread->conn_pool.head != NULL) {
+        conn *c = thread->conn_pool.head;
+        thread->conn_pool.head = c->next;
+        conn_destructor(c);
+    }
+    thread->conn_pool.count = 0;
+
+    for (cls = 0; cls < RBUF_CLASSES; ++cls) {
+        while (thread->rbuf_pool[cls].count > 0) {
+            free(thread->rbuf_pool[cls].bufs[--thread->rbuf_pool[cls].count]);
+        }
+    }
+    free(thread->iov);
+    thread->iov = NULL;
+    free(thread->msglist);
+    thread->msglist = NULL;
+}
+
 /**
  * Return an empty read buffer back to the owning worker thread.
  */
@@ -716,6 +993,24 @@ static void json_add_bool_to_object(cJSON *obj, const char *name, bool value) {
     }
 }
 
+size_t conn_memory_usage(const conn *c) {
+    size_t total = sizeof(*c);
+
+    total += c->read.size + c->write.size;
+    total += c->iovsize * sizeof(struct iovec);
+    total += c->msgsize * sizeof(struct msghdr);
+    total += c->isize * sizeof(item *);
+    total += c->temp_alloc_size * sizeof(char *);
+    total += c->dynamic_buffer.size;
+    if (c->coalesce.buf != NULL) {
+        total += COALESCE_BUFFER_SIZE;
+    }
+    if (c->ssl.enabled) {
+        total += c->ssl.in.buffsz + c->ssl.out.buffsz;
+    }
+    return total;
+}
+
 /* Returns a JSON object with stat for the given connection.
  * Caller is responsible for freeing the result with cJSON_Delete().
  */
@@ -727,6 +1022,10 @@ static cJSON* get_connection_stats(const conn *c) {
     } else {
         cJSON_AddNumberToObject(obj, "socket", c->sfd);
         cJSON_AddNumberToObject(obj, "nevents", c->nevents);
+        cJSON_AddNumberToObject(obj, "memory", (double)conn_memory_usage(c));
+        cJSON_AddNumberToObject(obj, "busy_usec",
+                                (double)(c->busy_time / 1000));
+        cJSON_AddNumberToObject(obj, "time_yields", (double)c->time_yields);
         if (c->sasl_conn != NULL) {
             json_add_uintptr_to_object(obj, "sasl_conn",
                                        (uintptr_t)c->sasl_conn);
@@ -810,6 +1109,7 @@ static cJSON* get_connection_stats(const conn *c) {
         }
         json_add_bool_to_object(obj, "noreply", c->noreply);
         json_add_bool_to_object(obj, "nodelay", c->nodelay);
+        stream_compress_stats(c, obj);
         cJSON_AddNumberToObject(obj, "refcount", c->refcount);
         {
             cJSON* dy_buf = cJSON_CreateObject();
@@ -36,12 +36,13 @@ void destroy_connections(void);
 void run_event_loop(conn* c);
 
 /* Creates a new connection. Returns a pointer to the allocated connection if
- * successful, else NULL.
+ * successful, else NULL. The connection object is taken from the pool of the
+ * worker thread it is created for (if not NULL, the caller being that thread).
  */
 conn *conn_new(const SOCKET sfd, in_port_t parent_port,
                STATE_FUNC init_state, int event_flags,
                unsigned int read_buffer_size, struct event_base *base,
-               struct timeval *timeout);
+               struct timeval *timeout, LIBEVENT_THREAD *thread);
 
 /*
  * Closes a connection. Afterwards the connection is invalid (can no longer
@@ -60,6 +61,20 @@ void conn_close(conn *c);
  */
 void conn_shrink(conn *c);
 
+/*
+ * Replace the connection's read buffer with one that has room for (at
+ * least) another needed bytes, keeping the unread data. The new buffer
+ * comes from the thread's pool when it is of a pool size.
+ * Returns false if we failed to allocate the buffer.
+ */
+bool conn_grow_read_buffer(conn *c, size_t needed);
+
+/* Free the connections, empty read buffers and lists pooled by the thread */
+void conn_pools_cleanup(LIBEVENT_THREAD *thread);
+
+/* Memory used by the connection (the object and what it has allocated) */
+size_t conn_memory_usage(const conn *c);
+
 /**
  * Return the TCP or domain socket listening_port structure that
  * has a given port number
@@ -79,4 +94,7 @@ bool connection_set_nodelay(conn *c, bool enable);
  */
 void conn_cleanup_engine_allocations(conn* c);
 
+/* Release the items of the multi-get being run (if any) */
+void conn_release_mget(conn *c);
+
 #endif /* CONNECTIONS_H */
@@ -24,6 +24,13 @@
 #include "cmdline.h"
 #include "connections.h"
 #include "mc_time.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "stream_compress.h"
+#include "ssl_pool.h"
+#include "aux_pool.h"
+#include "slow_log.h"
+#include "ssl_sessions.h"
 #include "cJSON.h"
 #include "utilities/protocol2text.h"
 
@@ -41,6 +48,10 @@
 #include <snappy-c.h>
 #include <JSON_checker.h>
 
+#ifndef WIN32
+#include <sys/ioctl.h>
+#endif
+
 static bool grow_dynamic_buffer(conn *c, size_t needed);
 static void cookie_set_admin(const void *cookie);
 static bool cookie_is_admin(const void *cookie);
@@ -248,6 +259,17 @@ static void settings_init(void) {
     settings.admin = NULL;
     settings.disable_admin = false;
     settings.datatype = false;
+    settings.reuseport = false;
+    settings.placement = PLACEMENT_ROUND_ROBIN;
+    settings.migration_threshold = 0;
+    settings.io_backend = IO_BACKEND_LIBEVENT;
+    settings.zerocopy_threshold = 0;
+    settings.ktls = false;
+    settings.ssl_handshake_threads = 0;
+    settings.aux_threads = 2;
+    settings.time_slice_usec = 0;
+    settings.slow_cmd_usec = 0;
+    settings.slow_cmd_keys = false;
     /* We "need" a rbac profile file and audit config file
      * .... let's try to autodetect the default
      */
@@ -296,12 +318,16 @@ static int add_msghdr(conn *c)
     cb_assert(c != NULL);
 
     if (c->msgsize == c->msgused) {
-        cb_assert(c->msgsize > 0);
-        msg = realloc(c->msglist, c->msgsize * 2 * sizeof(struct msghdr));
+        int size = c->msgsize == 0 ? MSG_LIST_INITIAL : c->msgsize * 2;
+        msg = realloc(c->msglist, size * sizeof(struct msghdr));
         if (! msg)
             return -1;
         c->msglist = msg;
-        c->msgsize *= 2;
+        c->msgsize = size;
+    }
+
+    if (c->iov == NULL && ensure_iov_space(c) != 0) {
+        return -1;
     }
 
     msg = c->msglist + c->msgused;
@@ -312,11 +338,6 @@ static int add_msghdr(conn *c)
 
     msg->msg_iov = &c->iov[c->iovused];
 
-    if (c->request_addr_size > 0) {
-        msg->msg_name = &c->request_addr;
-        msg->msg_namelen = c->request_addr_size;
-    }
-
     c->msgbytes = 0;
     c->msgused++;
     STATS_MAX(c, msgused_high_watermark, c->msgused);
@@ -331,7 +352,7 @@ struct {
     uint64_t num_disable;
 } listen_state;
 
-static bool is_listen_disabled(void) {
+bool is_listen_disabled(void) {
     bool ret;
     cb_mutex_enter(&listen_state.mutex);
     ret = listen_state.disabled;
@@ -347,13 +368,17 @@ static uint64_t get_listen_disabled_num(void) {
     return ret;
 }
 
-static void disable_listen(void) {
-    conn *next;
+static void set_listen_disabled(void) {
     cb_mutex_enter(&listen_state.mutex);
     listen_state.disabled = true;
     listen_state.count = 10;
     ++listen_state.num_disable;
     cb_mutex_exit(&listen_state.mutex);
+}
+
+static void disable_listen(void) {
+    conn *next;
+    set_listen_disabled();
 
     for (next = listen_conn; next; next = next->next) {
         update_event(next, 0);
@@ -364,6 +389,47 @@ static void disable_listen(void) {
     }
 }
 
+static int get_listen_backlog(in_port_t port) {
+    int ii;
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        if (port == settings.interfaces[ii].port) {
+            return settings.interfaces[ii].backlog;
+        }
+    }
+    return 1024;
+}
+
+/*
+ * A worker ran out of file descriptors; stop accepting clients on the
+ * listeners it owns until the dispatcher tells us that connections
+ * have been closed.
+ */
+static void disable_thread_listen(LIBEVENT_THREAD *me) {
+    conn *next;
+    set_listen_disabled();
+
+    for (next = me->listen_conns; next; next = next->next) {
+        update_event(next, 0);
+        if (listen(next->sfd, 1) != 0) {
+            log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                             "listen() failed: %s");
+        }
+    }
+    me->listen_paused = true;
+}
+
+void resume_thread_listen(LIBEVENT_THREAD *me) {
+    conn *next;
+    for (next = me->listen_conns; next; next = next->next) {
+        update_event(next, EV_READ | EV_PERSIST);
+        if (listen(next->sfd, get_listen_backlog(next->parent_port)) != 0) {
+            log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                             "listen() failed: %s");
+        }
+    }
+    me->listen_paused = false;
+}
+
 void safe_close(SOCKET sfd) {
     if (sfd != INVALID_SOCKET) {
         int rval;
@@ -415,6 +481,12 @@ const char *state_text(STATE_FUNC state) {
         return "conn_mwrite";
     } else if (state == conn_ship_log) {
         return "conn_ship_log";
+    } else if (state == conn_migrate) {
+        return "conn_migrate";
+    } else if (state == conn_zerocopy_wait) {
+        return "conn_zerocopy_wait";
+    } else if (state == conn_ssl_handshake) {
+        return "conn_ssl_handshake";
     } else if (state == conn_setup_tap_stream) {
         return "conn_setup_tap_stream";
     } else if (state == conn_pending_close) {
@@ -430,6 +502,113 @@ const char *state_text(STATE_FUNC state) {
     }
 }
 
+/*
+ * Track the phases of a command for the slow command log (see slow_log.h).
+ * A command is tracked from when its header is parsed (if the log is
+ * enabled at that point) until its response is sent.
+ */
+static void slow_cmd_done(conn *c, hrtime_t now) {
+    struct slow_cmd *cmd = c->slow.cmd;
+
+    cmd->transmit = now - c->slow.responded;
+    cmd->total += cmd->wait + cmd->transmit;
+    c->slow.responded = 0;
+    c->slow.started = false;
+
+    if (settings.slow_cmd_usec != 0 &&
+        cmd->total >= (hrtime_t)settings.slow_cmd_usec * 1000) {
+        cmd->time = mc_time_convert_to_abs_time(mc_time_get_current_time());
+        slow_log_add(c->thread->index, cmd);
+    }
+}
+
+static void slow_cmd_begin(conn *c) {
+    if (c->slow.responded != 0) {
+        /* The response of the previous one was held back */
+        slow_cmd_done(c, c->start);
+    }
+
+    c->slow.started = false;
+    if (settings.slow_cmd_usec == 0) {
+        return;
+    }
+    if (c->slow.cmd == NULL) {
+        c->slow.cmd = malloc(sizeof(*c->slow.cmd));
+        if (c->slow.cmd == NULL) {
+            return;
+        }
+    }
+    c->slow.started = true;
+    c->slow.keyed = false;
+    c->slow.run_at = c->slow.blocked_at = 0;
+    c->slow.cmd->conn = (int64_t)c->sfd;
+    c->slow.cmd->opcode = c->binary_header.request.opcode;
+    c->slow.cmd->vbucket = c->binary_header.request.vbucket;
+    c->slow.cmd->keylen = c->binary_header.request.keylen;
+    c->slow.cmd->key_hash = 0;
+    c->slow.cmd->nkey = 0;
+    c->slow.cmd->engine = c->slow.cmd->blocked = 0;
+    if (c->slow.read_at != 0 && c->slow.read_at < c->start) {
+        c->slow.cmd->wait = c->start - c->slow.read_at;
+    } else {
+        c->slow.cmd->wait = 0;
+    }
+}
+
+/* The worker is about to run (or resume) the command */
+static void slow_cmd_run(conn *c) {
+    hrtime_t now = gethrtime();
+
+    if (!c->slow.keyed) {
+        const char *key;
+        uint16_t nkey = c->slow.cmd->keylen;
+
+        /* The whole packet or (for the updates) up to the key is read */
+        if (c->substate == bin_reading_packet) {
+            key = c->read.curr - c->binary_header.request.bodylen +
+                c->binary_header.request.extlen;
+        } else {
+            key = c->read.curr - nkey;
+        }
+        c->slow.cmd->key_hash = hash(key, nkey, 0);
+        if (settings.slow_cmd_keys) {
+            if (nkey > SLOW_LOG_KEY_MAX) {
+                nkey = SLOW_LOG_KEY_MAX;
+            }
+            memcpy(c->slow.cmd->key, key, nkey);
+            c->slow.cmd->nkey = (uint8_t)nkey;
+        }
+        c->slow.keyed = true;
+    }
+
+    if (c->slow.blocked_at != 0) {
+        c->slow.cmd->blocked += now - c->slow.blocked_at;
+        c->slow.blocked_at = 0;
+    }
+    c->slow.run_at = now;
+}
+
+/* The worker is done running the command (for now) */
+static void slow_cmd_stop(conn *c, hrtime_t now) {
+    c->slow.cmd->engine += now - c->slow.run_at;
+    c->slow.run_at = 0;
+    if (c->ewouldblock) {
+        c->slow.blocked_at = now;
+    }
+}
+
+/* The response to the command is ready to be sent */
+static void slow_cmd_respond(conn *c, hrtime_t now) {
+    if (!c->slow.started) {
+        return;
+    }
+    if (c->slow.run_at != 0) {
+        slow_cmd_stop(c, now);
+    }
+    c->slow.cmd->total = now - c->start;
+    c->slow.responded = now;
+}
+
 /*
  * Sets a connection's current state in the state machine. Any special
  * processing that needs to happen on certain state transitions can
@@ -462,7 +641,9 @@ void conn_set_state(conn *c, STATE_FUNC state) {
 
         if (state == conn_write || state == conn_mwrite) {
             if (c->start != 0) {
-                collect_timing(c->cmd, gethrtime() - c->start);
+                hrtime_t now = gethrtime();
+                collect_timing(c->thread->index, c->cmd, now - c->start);
+                slow_cmd_respond(c, now);
                 c->start = 0;
             }
             MEMCACHED_PROCESS_COMMAND_END(c->sfd, c->write.buf, c->write.bytes);
@@ -482,18 +663,24 @@ static int ensure_iov_space(conn *c) {
     cb_assert(c != NULL);
 
     if (c->iovused >= c->iovsize) {
-        int i, iovnum;
+        int i;
+        int size = c->iovsize == 0 ? IOV_LIST_INITIAL : c->iovsize * 2;
+        uintptr_t old_iov = (uintptr_t)c->iov;
         struct iovec *new_iov = (struct iovec *)realloc(c->iov,
-                                (c->iovsize * 2) * sizeof(struct iovec));
+                                size * sizeof(struct iovec));
         if (! new_iov)
             return -1;
         c->iov = new_iov;
-        c->iovsize *= 2;
+        c->iovsize = size;
 
-        /* Point all the msghdr structures at the new list. */
-        for (i = 0, iovnum = 0; i < c->msgused; i++) {
-            c->msglist[i].msg_iov = &c->iov[iovnum];
-            iovnum += c->msglist[i].msg_iovlen;
+        /*
+         * Point all the msghdr structures at the new list. Keep their
+         * offsets, as the ones of responses held back for coalescing may
+         * already have been (partially) sent.
+         */
+        for (i = 0; i < c->msgused; i++) {
+            uintptr_t offset = (uintptr_t)c->msglist[i].msg_iov - old_iov;
+            c->msglist[i].msg_iov = c->iov + offset / sizeof(struct iovec);
         }
     }
 
@@ -684,11 +871,14 @@ static int add_bin_header(conn *c,
 
     cb_assert(c);
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        return -1;
+    /* Append to the responses held back for coalescing (if any) */
+    if (!c->coalesce.pending) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            return -1;
+        }
     }
 
     header = (protocol_binary_response_header *)c->write.buf;
@@ -855,7 +1045,13 @@ static void write_bin_response(conn *c, const void *d, int hlen, int keylen, int
         c->write_and_go = conn_new_cmd;
     } else {
         if (c->start != 0) {
-            collect_timing(c->cmd, gethrtime() - c->start);
+            hrtime_t now = gethrtime();
+            collect_timing(c->thread->index, c->cmd, now - c->start);
+            slow_cmd_respond(c, now);
+            if (c->slow.responded != 0) {
+                /* (nothing to transmit) */
+                slow_cmd_done(c, now);
+            }
             c->start = 0;
         }
         conn_set_state(c, conn_new_cmd);
@@ -1025,11 +1221,87 @@ static void complete_update_bin(conn *c) {
     }
 }
 
-static void process_bin_get(conn *c) {
+/*
+ * Park the get the engine would block on (with unordered execution), so
+ * the connection moves on to the next request meanwhile. Returns false
+ * if the connection has to block as usual.
+ */
+static bool park_get(conn *c, const char *key, size_t nkey) {
+    struct parked_get *get;
+
+    if (c->parked.count == UNORDERED_MAX_PARKED) {
+        return false;
+    }
+    if (c->parked.gets == NULL) {
+        c->parked.gets = malloc(UNORDERED_MAX_PARKED * sizeof(*get));
+        if (c->parked.gets == NULL) {
+            return false;
+        }
+    }
+
+    get = &c->parked.gets[c->parked.count++];
+    get->start = c->start;
+    get->opaque = c->opaque;
+    get->vbucket = c->binary_header.request.vbucket;
+    get->nkey = (uint16_t)nkey;
+    get->opcode = c->binary_header.request.opcode;
+    get->cmd = (uint8_t)c->cmd;
+    get->noreply = c->noreply;
+    memcpy(get->key, key, nkey);
+
+    /* (the slow command log doesn't track it any further) */
+    c->slow.started = false;
+    c->slow.run_at = 0;
+    return true;
+}
+
+static void process_bin_get(conn *c, char *key, size_t nkey);
+
+/* Run the first parked get again (it is parked again if it still blocks) */
+static void unpark_get(conn *c) {
+    struct parked_get get = c->parked.gets[0];
+
+    --c->parked.count;
+    memmove(c->parked.gets, c->parked.gets + 1,
+            c->parked.count * sizeof(get));
+
+    c->start = get.start;
+    c->opaque = get.opaque;
+    c->cmd = get.cmd;
+    c->noreply = get.noreply;
+    c->binary_header.request.opcode = get.opcode;
+    c->binary_header.request.opaque = get.opaque;
+    c->binary_header.request.vbucket = get.vbucket;
+    c->binary_header.request.keylen = get.nkey;
+    c->binary_header.request.extlen = 0;
+    c->binary_header.request.bodylen = get.nkey;
+    c->aiostat = ENGINE_SUCCESS;
+    process_bin_get(c, get.key, get.nkey);
+}
+
+/* May the next request run while gets are parked? */
+static bool may_pass_parked_gets(conn *c) {
+    protocol_binary_request_header req;
+
+    if (c->read.bytes < sizeof(req.bytes)) {
+        /* (checked again once the header is read) */
+        return true;
+    }
+    memcpy(req.bytes, c->read.curr, sizeof(req.bytes));
+    switch (req.request.opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        return c->parked.count < UNORDERED_MAX_PARKED;
+    default:
+        return false;
+    }
+}
+
+static void process_bin_get(conn *c, char *key, size_t nkey) {
     item *it;
     protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->write.buf;
-    char* key = binary_get_key(c);
-    size_t nkey = c->binary_header.request.keylen;
     uint16_t keylen;
     uint32_t bodylen;
     item_info_holder info;
@@ -1154,7 +1426,11 @@ static void process_bin_get(conn *c) {
         }
         break;
     case ENGINE_EWOULDBLOCK:
-        c->ewouldblock = true;
+        if (c->unordered && park_get(c, key, nkey)) {
+            conn_set_state(c, conn_new_cmd);
+        } else {
+            c->ewouldblock = true;
+        }
         break;
     case ENGINE_DISCONNECT:
         c->state = conn_closing;
@@ -1164,6 +1440,280 @@ static void process_bin_get(conn *c) {
     }
 }
 
+/*
+ * Keep a reference to the item until the responses using it (including
+ * the held back ones) are sent
+ */
+static bool conn_hold_item(conn *c, item *it) {
+    if (c->ileft == 0) {
+        c->icurr = c->ilist;
+    }
+    if (c->ilist == NULL || (c->icurr - c->ilist) + c->ileft == c->isize) {
+        int used = c->ilist == NULL ? 0 : (int)(c->icurr - c->ilist);
+        int size = c->isize == 0 ? ITEM_LIST_INITIAL : c->isize * 2;
+        item **ilist = realloc(c->ilist, size * sizeof(item *));
+        if (ilist == NULL) {
+            return false;
+        }
+        c->ilist = ilist;
+        c->isize = size;
+        c->icurr = ilist + used;
+    }
+    c->icurr[c->ileft++] = it;
+    return true;
+}
+
+/* Free the buffer once the responses using it are sent */
+static bool conn_hold_temp_alloc(conn *c, char *buf) {
+    if (c->temp_alloc_left == 0) {
+        c->temp_alloc_curr = c->temp_alloc_list;
+    }
+    if (c->temp_alloc_list == NULL ||
+        (c->temp_alloc_curr - c->temp_alloc_list) + c->temp_alloc_left ==
+        c->temp_alloc_size) {
+        int used = c->temp_alloc_list == NULL ?
+            0 : (int)(c->temp_alloc_curr - c->temp_alloc_list);
+        int size = c->temp_alloc_size == 0 ?
+            TEMP_ALLOC_LIST_INITIAL : c->temp_alloc_size * 2;
+        char **list = realloc(c->temp_alloc_list, size * sizeof(char *));
+        if (list == NULL) {
+            return false;
+        }
+        c->temp_alloc_list = list;
+        c->temp_alloc_size = size;
+        c->temp_alloc_curr = list + used;
+    }
+    c->temp_alloc_curr[c->temp_alloc_left++] = buf;
+    return true;
+}
+
+/*
+ * Add the value of a multi-get key to the response, inflated if it is
+ * compressed and the client doesn't support the datatype. Returns the
+ * length of the value, or -1 on failure.
+ */
+static int64_t add_mget_value(conn *c, item_info_holder *info,
+                              uint8_t *datatype) {
+    char *buf;
+    size_t len;
+    int ii;
+
+    *datatype = info->info.datatype;
+    if (c->supports_datatype) {
+        /* as is */
+    } else if ((*datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0) {
+        *datatype = PROTOCOL_BINARY_RAW_BYTES;
+    } else {
+        if (info->info.nvalue != 1 ||
+            snappy_uncompressed_length(info->info.value[0].iov_base,
+                                       info->info.value[0].iov_len,
+                                       &len) != SNAPPY_OK ||
+            (buf = malloc(len == 0 ? 1 : len)) == NULL) {
+            return -1;
+        }
+        if (snappy_uncompress(info->info.value[0].iov_base,
+                              info->info.value[0].iov_len,
+                              buf, &len) != SNAPPY_OK ||
+            !conn_hold_temp_alloc(c, buf)) {
+            free(buf);
+            return -1;
+        }
+        *datatype = PROTOCOL_BINARY_RAW_BYTES;
+        return add_iov(c, buf, len) == 0 ? (int64_t)len : -1;
+    }
+
+    for (ii = 0; ii < info->info.nvalue; ++ii) {
+        if (add_iov(c, info->info.value[ii].iov_base,
+                    info->info.value[ii].iov_len) != 0) {
+            return -1;
+        }
+    }
+    return info->info.nbytes;
+}
+
+/*
+ * Send the response to the multi-get once all of the keys are looked up
+ * (see protocol_binary_mget_entry). The items are kept (and the entries
+ * freed) until it is sent.
+ */
+static void mget_respond(conn *c) {
+    protocol_binary_response_header *header = (void*)c->write.buf;
+    protocol_binary_mget_entry entry;
+    struct mget_key *keys = c->mget.keys;
+    uint32_t nkeys = c->mget.nkeys;
+    size_t nbitmap = (nkeys + 7) / 8;
+    size_t nentries = 0;
+    uint64_t bodylen;
+    char *frame, *next;
+    item_info_holder info;
+    uint32_t ii;
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        if (keys[ii].status != PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+            ++nentries;
+        }
+    }
+    frame = calloc(1, nbitmap + nentries * sizeof(entry.bytes));
+    if (frame == NULL || !conn_hold_temp_alloc(c, frame)) {
+        free(frame);
+        conn_release_mget(c);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+        return;
+    }
+    if (add_bin_header(c, 0, 0, 0, 0, PROTOCOL_BINARY_RAW_BYTES) == -1 ||
+        add_iov(c, frame, nbitmap) != 0) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    bodylen = nbitmap;
+    next = frame + nbitmap;
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        item *it = keys[ii].it;
+        int64_t vallen = 0;
+        bool found = false;
+
+        if (keys[ii].status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+            frame[ii / 8] |= (char)(1 << (ii % 8));
+            continue;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.entry.status = htons(keys[ii].status);
+        if (it != NULL) {
+            memset(&info, 0, sizeof(info));
+            info.info.nvalue = IOV_MAX;
+            if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                                   (void*)&info)) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "%d: Failed to get item info",
+                                                c->sfd);
+                entry.entry.status = htons(PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+            } else {
+                STATS_HIT(c, get, info.info.key, info.info.nkey);
+                found = true;
+                entry.entry.cas = htonll(info.info.cas);
+                entry.entry.flags = info.info.flags;
+            }
+        }
+
+        memcpy(next, entry.bytes, sizeof(entry.bytes));
+        if (add_iov(c, next, sizeof(entry.bytes)) != 0) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        if (found) {
+            vallen = add_mget_value(c, &info, &entry.entry.datatype);
+            if (vallen < 0 || vallen > UINT32_MAX) {
+                conn_set_state(c, conn_closing);
+                return;
+            }
+            entry.entry.vallen = htonl((uint32_t)vallen);
+            memcpy(next, entry.bytes, sizeof(entry.bytes));
+        }
+        if (it != NULL) {
+            if (!conn_hold_item(c, it)) {
+                conn_set_state(c, conn_closing);
+                return;
+            }
+            keys[ii].it = NULL;
+        }
+        next += sizeof(entry.bytes);
+        bodylen += sizeof(entry.bytes) + vallen;
+    }
+
+    if (bodylen > UINT32_MAX) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    header->response.bodylen = htonl((uint32_t)bodylen);
+    conn_release_mget(c);
+    conn_set_state(c, conn_mwrite);
+}
+
+/*
+ * Look up the keys of the multi-get, the engine may block on any of them
+ * (and the lookup continues from that key when it completes).
+ */
+static void process_bin_mget(conn *c, const char *body, uint32_t nbody) {
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+
+    if (c->mget.keys == NULL) {
+        uint32_t offset = 0;
+        uint32_t nkeys = 0;
+
+        while (offset < nbody) {
+            protocol_binary_mget_key key;
+            uint16_t keylen;
+
+            if (nbody - offset < sizeof(key.bytes)) {
+                break;
+            }
+            memcpy(key.bytes, body + offset, sizeof(key.bytes));
+            keylen = ntohs(key.key.keylen);
+            if (keylen == 0 || keylen > KEY_MAX_LENGTH ||
+                nbody - offset - sizeof(key.bytes) < keylen) {
+                break;
+            }
+            offset += (uint32_t)sizeof(key.bytes) + keylen;
+            ++nkeys;
+        }
+        if (offset != nbody || nkeys == 0) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+            return;
+        }
+        if ((c->mget.keys = calloc(nkeys, sizeof(struct mget_key))) == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+            return;
+        }
+        c->mget.nkeys = nkeys;
+        c->mget.next = 0;
+        c->mget.offset = 0;
+    }
+
+    while (c->mget.next < c->mget.nkeys) {
+        struct mget_key *mkey = &c->mget.keys[c->mget.next];
+        protocol_binary_mget_key key;
+        const char *k = body + c->mget.offset + sizeof(key.bytes);
+        uint16_t nkey;
+        item *it = NULL;
+
+        memcpy(key.bytes, body + c->mget.offset, sizeof(key.bytes));
+        nkey = ntohs(key.key.keylen);
+        if (ret == ENGINE_SUCCESS) {
+            ret = settings.engine.v1->get(settings.engine.v0, c, &it, k, nkey,
+                                          ntohs(key.key.vbucket));
+        }
+
+        switch (ret) {
+        case ENGINE_SUCCESS:
+            /* (the hit is counted with the item's slab class) */
+            mkey->it = it;
+            mkey->status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+            break;
+        case ENGINE_KEY_ENOENT:
+            STATS_MISS(c, get, k, nkey);
+            mkey->status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+            break;
+        case ENGINE_EWOULDBLOCK:
+            c->ewouldblock = true;
+            return;
+        case ENGINE_DISCONNECT:
+            c->state = conn_closing;
+            return;
+        default:
+            mkey->status = engine_error_2_protocol_error(ret);
+        }
+
+        ret = ENGINE_SUCCESS;
+        c->mget.offset += (uint32_t)sizeof(key.bytes) + nkey;
+        c->mget.next++;
+    }
+
+    mget_respond(c);
+}
+
 static void append_bin_stats(const char *key, const uint16_t klen,
                              const char *val, const uint32_t vlen,
                              conn *c) {
@@ -1244,6 +1794,229 @@ static void append_stats(const char *key, const uint16_t klen,
     cb_assert(c->dynamic_buffer.offset <= c->dynamic_buffer.size);
 }
 
+/*
+ * "stats bulk" (see protocol_binary.h) adds all of the requested groups
+ * to a single stat in c->dynamic_buffer. The buffer is allocated up front
+ * with the size of the connection's previous bulk stats (plus some room
+ * to grow), so it normally isn't reallocated while the stats are added.
+ */
+
+static size_t put_varint(char *dst, uint32_t val) {
+    size_t len = 0;
+    while (val >= 0x80) {
+        dst[len++] = (char)(val | 0x80);
+        val >>= 7;
+    }
+    dst[len++] = (char)val;
+    return len;
+}
+
+static void append_bulk_binary(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie)
+{
+    conn *c = (conn*)cookie;
+    char *dst;
+    size_t len = 0;
+
+    if (klen == 0 || !grow_dynamic_buffer(c, 1 + 5 + klen + 5 + vlen)) {
+        return;
+    }
+    dst = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
+    dst[len++] = PROTOCOL_BINARY_BULK_STATS_STAT;
+    len += put_varint(dst + len, klen);
+    memcpy(dst + len, key, klen);
+    len += klen;
+    len += put_varint(dst + len, vlen);
+    memcpy(dst + len, val, vlen);
+    len += vlen;
+    c->dynamic_buffer.offset += len;
+}
+
+/* Copy the string with the JSON escapes, needs up to 6 bytes per byte */
+static size_t json_escape(char *dst, const char *src, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t ii, out = 0;
+
+    for (ii = 0; ii < len; ++ii) {
+        unsigned char ch = (unsigned char)src[ii];
+        if (ch == '"' || ch == '\\') {
+            dst[out++] = '\\';
+            dst[out++] = (char)ch;
+        } else if (ch < 0x20) {
+            memcpy(dst + out, "\\u00", 4);
+            dst[out + 4] = hex[ch >> 4];
+            dst[out + 5] = hex[ch & 0xf];
+            out += 6;
+        } else {
+            dst[out++] = (char)ch;
+        }
+    }
+    return out;
+}
+
+static void append_bulk_json(const char *key, const uint16_t klen,
+                             const char *val, const uint32_t vlen,
+                             const void *cookie)
+{
+    conn *c = (conn*)cookie;
+    char *dst;
+    size_t len = 0;
+
+    if (klen == 0 || !grow_dynamic_buffer(c, 6 + 6 * ((size_t)klen + vlen))) {
+        return;
+    }
+    dst = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
+    if (dst[-1] != '{') {
+        dst[len++] = ',';
+    }
+    dst[len++] = '"';
+    len += json_escape(dst + len, key, klen);
+    dst[len++] = '"';
+    dst[len++] = ':';
+    dst[len++] = '"';
+    len += json_escape(dst + len, val, vlen);
+    dst[len++] = '"';
+    c->dynamic_buffer.offset += len;
+}
+
+static ENGINE_ERROR_CODE bulk_stats_group(conn *c, bool json,
+                                          const char *group, size_t ngroup) {
+    ADD_STAT add_stats = json ? append_bulk_json : append_bulk_binary;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    char *dst;
+
+    if (!grow_dynamic_buffer(c, 8 + 6 * ngroup)) {
+        return ENGINE_ENOMEM;
+    }
+    dst = c->dynamic_buffer.buffer + c->dynamic_buffer.offset;
+    if (json) {
+        size_t len = 0;
+        if (dst[-1] != '{') {
+            dst[len++] = ',';
+        }
+        dst[len++] = '"';
+        len += json_escape(dst + len, group, ngroup);
+        memcpy(dst + len, "\":{", 3);
+        c->dynamic_buffer.offset += len + 3;
+    } else {
+        dst[0] = PROTOCOL_BINARY_BULK_STATS_GROUP;
+        c->dynamic_buffer.offset += 1 + put_varint(dst + 1, (uint32_t)ngroup);
+        memcpy(c->dynamic_buffer.buffer + c->dynamic_buffer.offset, group,
+               ngroup);
+        c->dynamic_buffer.offset += ngroup;
+    }
+
+    if (ngroup == 7 && memcmp(group, "general", 7) == 0) {
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0,
+                                            add_stats);
+        if (ret == ENGINE_SUCCESS) {
+            server_stats(add_stats, c, false);
+        }
+    } else if (ngroup == 8 && memcmp(group, "settings", 8) == 0) {
+        process_stat_settings(add_stats, c);
+    } else if (ngroup == 9 && memcmp(group, "aggregate", 9) == 0) {
+        server_stats(add_stats, c, true);
+    } else if (ngroup == 7 && memcmp(group, "threads", 7) == 0) {
+        threads_stats(add_stats, c);
+    } else {
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c,
+                                            group, (int)ngroup, add_stats);
+    }
+
+    if (json && ret == ENGINE_SUCCESS) {
+        if (!grow_dynamic_buffer(c, 1)) {
+            return ENGINE_ENOMEM;
+        }
+        c->dynamic_buffer.buffer[c->dynamic_buffer.offset++] = '}';
+    }
+    return ret;
+}
+
+/* args: what follows "bulk" in the stat key */
+static ENGINE_ERROR_CODE bulk_stats(conn *c, const char *args, size_t nargs) {
+    static const char *default_groups = "general slabs items";
+    protocol_binary_response_header header;
+    const char *end = args + nargs;
+    const char *groups;
+    size_t hint = c->bulk_stats_size;
+    size_t doc;
+    bool json = true;
+    ENGINE_ERROR_CODE ret;
+
+    while (args < end && *args == ' ') {
+        ++args;
+    }
+    if (end - args >= 4 && memcmp(args, "json", 4) == 0 &&
+        (end - args == 4 || args[4] == ' ')) {
+        args += 4;
+    } else if (end - args >= 6 && memcmp(args, "binary", 6) == 0 &&
+               (end - args == 6 || args[6] == ' ')) {
+        json = false;
+        args += 6;
+    }
+    while (args < end && *args == ' ') {
+        ++args;
+    }
+    groups = args;
+    if (groups == end) {
+        groups = default_groups;
+        end = groups + strlen(groups);
+    }
+
+    /* (this may be a rerun after the engine blocked) */
+    c->dynamic_buffer.offset = 0;
+    if (!grow_dynamic_buffer(c, sizeof(header.response) + 4 +
+                             (hint ? hint + hint / 4 : 16384))) {
+        return ENGINE_ENOMEM;
+    }
+    c->dynamic_buffer.offset = sizeof(header.response) + 4;
+    doc = c->dynamic_buffer.offset;
+    if (json) {
+        c->dynamic_buffer.buffer[c->dynamic_buffer.offset++] = '{';
+    } else {
+        memcpy(c->dynamic_buffer.buffer + c->dynamic_buffer.offset,
+               PROTOCOL_BINARY_BULK_STATS_MAGIC, 4);
+        c->dynamic_buffer.offset += 4;
+    }
+
+    while (groups < end) {
+        const char *next = memchr(groups, ' ', end - groups);
+        if (next == NULL) {
+            next = end;
+        }
+        if (next > groups) {
+            ret = bulk_stats_group(c, json, groups, next - groups);
+            if (ret != ENGINE_SUCCESS) {
+                c->dynamic_buffer.offset = 0;
+                return ret;
+            }
+        }
+        groups = next + 1;
+    }
+
+    if (json) {
+        if (!grow_dynamic_buffer(c, 1)) {
+            c->dynamic_buffer.offset = 0;
+            return ENGINE_ENOMEM;
+        }
+        c->dynamic_buffer.buffer[c->dynamic_buffer.offset++] = '}';
+    }
+    c->bulk_stats_size = c->dynamic_buffer.offset - doc;
+
+    memset(&header, 0, sizeof(header));
+    header.response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+    header.response.opcode = PROTOCOL_BINARY_CMD_STAT;
+    header.response.keylen = (uint16_t)htons(4);
+    header.response.datatype = (uint8_t)PROTOCOL_BINARY_RAW_BYTES;
+    header.response.bodylen = htonl((uint32_t)(c->dynamic_buffer.offset -
+                                               sizeof(header.response)));
+    header.response.opaque = c->opaque;
+    memcpy(c->dynamic_buffer.buffer, header.bytes, sizeof(header.response));
+    memcpy(c->dynamic_buffer.buffer + sizeof(header.response), "bulk", 4);
+    return ENGINE_SUCCESS;
+}
+
 static void bin_read_chunk(conn *c,
                            enum bin_substates next_substate,
                            uint32_t chunk) {
@@ -1681,7 +2454,15 @@ static void ship_tap_log(conn *c) {
                     void *buf = malloc(inflated_length);
                     void *body = info.info.value[0].iov_base;
                     size_t bodylen = info.info.value[0].iov_len;
-                    if (snappy_uncompress(body, bodylen,
+                    if (c->temp_alloc_list == NULL) {
+                        c->temp_alloc_list = malloc(sizeof(char *) *
+                                                    TEMP_ALLOC_LIST_INITIAL);
+                        c->temp_alloc_curr = c->temp_alloc_list;
+                        c->temp_alloc_size = c->temp_alloc_list == NULL ?
+                            0 : TEMP_ALLOC_LIST_INITIAL;
+                    }
+                    if (buf != NULL && c->temp_alloc_list != NULL &&
+                        snappy_uncompress(body, bodylen,
                                           buf, &inflated_length) == SNAPPY_OK) {
                         c->temp_alloc_list[c->temp_alloc_left++] = buf;
 
@@ -1861,17 +2642,45 @@ static void setup_binary_lookup_cmd(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descri
     request_handlers[cmd].callback = new_handler;
 }
 
-static void process_bin_unknown_packet(conn *c) {
+/* The engine commands which may walk (or rewrite) all of its data */
+static bool aux_commands[0x100];
+
+/*
+ * Run the slow part of a command on the aux pool, away from the other
+ * connections of the worker. Returns ENGINE_EWOULDBLOCK while the job
+ * runs; the executor is then run again with c->aux_done set and the
+ * status of the job in c->aiostat. The job is run right away if there is
+ * no pool.
+ */
+static ENGINE_ERROR_CODE aux_run(conn *c, ENGINE_ERROR_CODE (*job)(conn *c))
+{
+    if (aux_pool_submit(c, job)) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    return job(c);
+}
+
+static ENGINE_ERROR_CODE unknown_command_job(conn *c) {
     void *packet = c->read.curr - (c->binary_header.request.bodylen +
                                sizeof(c->binary_header));
+    struct request_lookup *rq = request_handlers + c->binary_header.request.opcode;
+    return rq->callback(rq->descriptor, settings.engine.v0, c, packet,
+                        binary_response_handler);
+}
+
+static void process_bin_unknown_packet(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
 
-    if (ret == ENGINE_SUCCESS) {
-        struct request_lookup *rq = request_handlers + c->binary_header.request.opcode;
-        ret = rq->callback(rq->descriptor, settings.engine.v0, c, packet,
-                           binary_response_handler);
+    if (c->aux_done) {
+        c->aux_done = false;
+    } else if (ret == ENGINE_SUCCESS) {
+        if (aux_commands[c->binary_header.request.opcode]) {
+            ret = aux_run(c, unknown_command_job);
+        } else {
+            ret = unknown_command_job(c);
+        }
     }
 
     switch (ret) {
@@ -1880,6 +2689,9 @@ static void process_bin_unknown_packet(conn *c) {
             write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
             c->dynamic_buffer.buffer = NULL;
             c->dynamic_buffer.size = 0;
+        } else if (c->item != NULL) {
+            /* The response is sent from the item (send_item_range) */
+            conn_set_state(c, conn_mwrite);
         } else {
             conn_set_state(c, conn_new_cmd);
         }
@@ -1903,9 +2715,9 @@ static void cbsasl_refresh_main(void *c)
 {
     int rv = cbsasl_server_refresh();
     if (rv == CBSASL_OK) {
-        notify_io_complete(c, ENGINE_SUCCESS);
+        notify_job_complete(c, ENGINE_SUCCESS);
     } else {
-        notify_io_complete(c, ENGINE_EINVAL);
+        notify_job_complete(c, ENGINE_EINVAL);
     }
 }
 
@@ -1926,21 +2738,31 @@ static ENGINE_ERROR_CODE refresh_cbsasl(conn *c)
     return ENGINE_EWOULDBLOCK;
 }
 
-#if 0
-static void ssl_certs_refresh_main(void *c)
+/*
+ * Load the certificates and keys of the SSL interfaces into new contexts
+ * for the new connections to use (run off the worker threads, as parsing
+ * them is expensive).
+ */
+static void ssl_certs_refresh_job(conn *c)
 {
-    /* Update the internal certificates */
+    notify_job_complete(c, ssl_sessions_reload() ? ENGINE_SUCCESS :
+                                                   ENGINE_EINVAL);
+}
 
-    notify_io_complete(c, ENGINE_SUCCESS);
+static void ssl_certs_refresh_main(void *c)
+{
+    ssl_certs_refresh_job(c);
 }
-#endif
+
 static ENGINE_ERROR_CODE refresh_ssl_certs(conn *c)
 {
-    (void)c;
-#if 0
     cb_thread_t tid;
     int err;
 
+    if (ssl_pool_submit(c, ssl_certs_refresh_job)) {
+        return ENGINE_EWOULDBLOCK;
+    }
+
     err = cb_create_thread(&tid, ssl_certs_refresh_main, c, 1);
     if (err != 0) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
@@ -1951,8 +2773,29 @@ static ENGINE_ERROR_CODE refresh_ssl_certs(conn *c)
     }
 
     return ENGINE_EWOULDBLOCK;
-#endif
-    return ENGINE_SUCCESS;
+}
+
+/*
+ * Set how many requests (and how much time) the connection may be served
+ * before the worker moves on to the next client.
+ */
+static void conn_set_priority(conn *c, CONN_PRIORITY priority) {
+    switch (priority) {
+    case CONN_PRIORITY_HIGH:
+        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
+        c->slice_weight = SLICE_WEIGHT_HIGH;
+        break;
+    case CONN_PRIORITY_MED:
+        c->max_reqs_per_event = settings.reqs_per_event_med_priority;
+        c->slice_weight = SLICE_WEIGHT_MED;
+        break;
+    case CONN_PRIORITY_LOW:
+        c->max_reqs_per_event = settings.reqs_per_event_low_priority;
+        c->slice_weight = SLICE_WEIGHT_LOW;
+        break;
+    default:
+        abort();
+    }
 }
 
 static void process_bin_tap_connect(conn *c) {
@@ -2009,8 +2852,9 @@ static void process_bin_tap_connect(conn *c) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
         c->write_and_go = conn_closing;
     } else {
+        conn_set_heavy(c);
         c->tap_iterator = iterator;
-        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
+        conn_set_priority(c, CONN_PRIORITY_HIGH);
         c->which = EV_WRITE;
         conn_set_state(c, conn_ship_log);
     }
@@ -3221,6 +4065,22 @@ static int get_validator(void *packet)
     return 0;
 }
 
+static int mget_validator(void *packet)
+{
+    protocol_binary_request_mget *req = packet;
+    uint32_t blen = ntohl(req->message.header.request.bodylen);
+
+    if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
+        req->message.header.request.extlen != 0 ||
+        req->message.header.request.keylen != 0 ||
+        blen < sizeof(protocol_binary_mget_key) ||
+        req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int delete_validator(void *packet)
 {
     protocol_binary_request_no_extras *req = packet;
@@ -3276,7 +4136,7 @@ static int get_cmd_timer_validator(void *packet)
     uint8_t extlen = req->message.header.request.extlen;
 
     if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        extlen != 1 || klen != 0 || (klen + extlen) != blen ||
+        extlen != 1 || (klen + extlen) != blen ||
         req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
         return -1;
     }
@@ -3420,6 +4280,7 @@ static void dcp_add_stream_executor(conn *c, void *packet)
 
         switch (ret) {
         case ENGINE_SUCCESS:
+            conn_set_heavy(c);
             c->dcp = 1;
             conn_set_state(c, conn_ship_log);
             break;
@@ -3582,8 +4443,9 @@ static void dcp_stream_req_executor(conn *c, void *packet)
 
         switch (ret) {
         case ENGINE_SUCCESS:
+            conn_set_heavy(c);
             c->dcp = 1;
-            c->max_reqs_per_event = settings.reqs_per_event_med_priority;
+            conn_set_priority(c, CONN_PRIORITY_MED);
             if (c->dynamic_buffer.buffer != NULL) {
                 write_and_free(c, c->dynamic_buffer.buffer,
                                c->dynamic_buffer.offset);
@@ -4115,6 +4977,7 @@ static void process_hello_packet_executor(conn *c, void *packet) {
     uint16_t out[MEMCACHED_TOTAL_HELLO_FEATURES];
     int jj = 0;
     bool enable_nodelay = false;
+    bool stream = false;
 #if 0
     int added_tls = 0;
 #endif
@@ -4125,6 +4988,7 @@ static void process_hello_packet_executor(conn *c, void *packet) {
      * the client can toggle features on/off during a connection
      */
     c->supports_datatype = false;
+    c->unordered = false;
 
     if (klen) {
         if (klen > 256) {
@@ -4173,6 +5037,35 @@ static void process_hello_packet_executor(conn *c, void *packet) {
                 enable_nodelay = true;
             }
             break;
+
+        case PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION:
+            if (!c->unordered) {
+                offset += snprintf(log_buffer + offset,
+                                   sizeof(log_buffer) - offset,
+                                   "unordered ");
+                out[jj++] = htons(PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION);
+                c->unordered = true;
+            }
+            break;
+
+        case PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION:
+            /*
+             * Once on it stays on. Not for SSL, where compressing what is
+             * encrypted leaks the content (CRIME)
+             */
+            if (!stream && (c->stream != NULL || c->stream_start ||
+                            (stream_compress_available() &&
+                             !c->ssl.enabled && c->uring == NULL))) {
+                offset += snprintf(log_buffer + offset,
+                                   sizeof(log_buffer) - offset,
+                                   "stream-compression ");
+                out[jj++] = htons(PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION);
+                if (c->stream == NULL) {
+                    c->stream_start = true;
+                }
+                stream = true;
+            }
+            break;
         }
     }
 
@@ -4357,15 +5250,10 @@ static void noop_executor(conn *c, void *packet)
     write_bin_response(c, NULL, 0, 0, 0);
 }
 
-static void flush_executor(conn *c, void *packet)
+static ENGINE_ERROR_CODE flush_job(conn *c)
 {
-    ENGINE_ERROR_CODE ret;
+    protocol_binary_request_flush* req = binary_get_request(c);
     time_t exptime = 0;
-    protocol_binary_request_flush* req = packet;
-
-    if (c->cmd == PROTOCOL_BINARY_CMD_FLUSHQ) {
-        c->noreply = true;
-    }
 
     if (c->binary_header.request.extlen == sizeof(req->message.body)) {
         exptime = ntohl(req->message.body.expiration);
@@ -4377,7 +5265,31 @@ static void flush_executor(conn *c, void *packet)
                                         (long)exptime);
     }
 
-    ret = settings.engine.v1->flush(settings.engine.v0, c, exptime);
+    return settings.engine.v1->flush(settings.engine.v0, c, exptime);
+}
+
+static void flush_executor(conn *c, void *packet)
+{
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    (void)packet;
+
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    if (c->cmd == PROTOCOL_BINARY_CMD_FLUSHQ) {
+        c->noreply = true;
+    }
+
+    if (c->aux_done) {
+        c->aux_done = false;
+    } else if (ret == ENGINE_SUCCESS) {
+        ret = aux_run(c, flush_job);
+    }
+
+    if (ret == ENGINE_EWOULDBLOCK) {
+        c->ewouldblock = true;
+        return;
+    }
 
     if (ret == ENGINE_SUCCESS) {
         write_bin_response(c, NULL, 0, 0, 0);
@@ -4412,7 +5324,14 @@ static void get_executor(conn *c, void *packet)
         abort();
     }
 
-    process_bin_get(c);
+    process_bin_get(c, binary_get_key(c), c->binary_header.request.keylen);
+}
+
+static void mget_executor(conn *c, void *packet)
+{
+    protocol_binary_request_mget *req = packet;
+    process_bin_mget(c, (const char*)packet + sizeof(req->bytes),
+                     c->binary_header.request.bodylen);
 }
 
 static void process_bin_delete(conn *c);
@@ -4427,6 +5346,50 @@ static void delete_executor(conn *c, void *packet)
     process_bin_delete(c);
 }
 
+/*
+ * The stats which take the locks of all of the threads or connections,
+ * or are left to the engine (which may have to walk its memory)
+ */
+static ENGINE_ERROR_CODE stat_job(conn *c)
+{
+    char *subcommand = binary_get_key(c);
+    size_t nkey = c->binary_header.request.keylen;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (nkey == 0) {
+        /* request all statistics */
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0, append_stats);
+        if (ret == ENGINE_SUCCESS) {
+            server_stats(&append_stats, c, false);
+        }
+    } else if (strncmp(subcommand, "connections", 11) == 0) {
+        int64_t fd = -1; /* default to all connections */
+        /* Check for specific connection number - allow up to 32 chars for FD */
+        if (nkey > 11 && nkey < (11 + 32)) {
+            int64_t key;
+            char buffer[32];
+            const size_t fd_length = nkey - 11;
+            memcpy(buffer, subcommand + 11, fd_length);
+            buffer[fd_length] = '\0';
+            if (safe_strtoll(buffer, &key)) {
+                fd = key;
+            }
+        }
+        connection_stats(&append_stats, c, fd);
+    } else if (nkey >= 4 && strncmp(subcommand, "bulk", 4) == 0) {
+        if (nkey == 4 || subcommand[4] == ' ') {
+            ret = bulk_stats(c, subcommand + 4, nkey - 4);
+        } else {
+            ret = ENGINE_EINVAL;
+        }
+    } else {
+        ret = settings.engine.v1->get_stats(settings.engine.v0, c,
+                                            subcommand, (int)nkey,
+                                            append_stats);
+    }
+    return ret;
+}
+
 static void stat_executor(conn *c, void *packet)
 {
     char *subcommand = binary_get_key(c);
@@ -4448,13 +5411,11 @@ static void stat_executor(conn *c, void *packet)
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
 
-    if (ret == ENGINE_SUCCESS) {
+    if (c->aux_done) {
+        c->aux_done = false;
+    } else if (ret == ENGINE_SUCCESS) {
         if (nkey == 0) {
-            /* request all statistics */
-            ret = settings.engine.v1->get_stats(settings.engine.v0, c, NULL, 0, append_stats);
-            if (ret == ENGINE_SUCCESS) {
-                server_stats(&append_stats, c, false);
-            }
+            ret = aux_run(c, stat_job);
         } else if (strncmp(subcommand, "reset", 5) == 0) {
             stats_reset(c);
             settings.engine.v1->reset_stats(settings.engine.v0, c);
@@ -4465,24 +5426,13 @@ static void stat_executor(conn *c, void *packet)
             return;
         } else if (strncmp(subcommand, "aggregate", 9) == 0) {
             server_stats(&append_stats, c, true);
-        } else if (strncmp(subcommand, "connections", 11) == 0) {
-            int64_t fd = -1; /* default to all connections */
-            /* Check for specific connection number - allow up to 32 chars for FD */
-            if (nkey > 11 && nkey < (11 + 32)) {
-                int64_t key;
-                char buffer[32];
-                const size_t fd_length = nkey - 11;
-                memcpy(buffer, subcommand + 11, fd_length);
-                buffer[fd_length] = '\0';
-                if (safe_strtoll(buffer, &key)) {
-                    fd = key;
-                }
-            }
-            connection_stats(&append_stats, c, fd);
+        } else if (strncmp(subcommand, "threads", 7) == 0) {
+            threads_stats(&append_stats, c);
+        } else if (strncmp(subcommand, "slow", 4) == 0) {
+            slow_log_stats(&append_stats, c);
         } else {
-            ret = settings.engine.v1->get_stats(settings.engine.v0, c,
-                                                subcommand, (int)nkey,
-                                                append_stats);
+            /* connections and the engine's stats */
+            ret = aux_run(c, stat_job);
         }
     }
 
@@ -4653,8 +5603,22 @@ static void arithmetic_executor(conn *c, void *packet)
 static void get_cmd_timer_executor(conn *c, void *packet)
 {
     protocol_binary_request_get_cmd_timer *req = packet;
+    const char *key = (const char*)(req->bytes + sizeof(req->bytes));
+    uint16_t nkey = ntohs(req->message.header.request.keylen);
+    timings_mode_t mode;
+
+    if (nkey == 0) {
+        mode = TIMINGS_CUMULATIVE;
+    } else if (nkey == 8 && memcmp(key, "interval", 8) == 0) {
+        mode = TIMINGS_INTERVAL;
+    } else if (nkey == 5 && memcmp(key, "reset", 5) == 0) {
+        mode = TIMINGS_RESET;
+    } else {
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+        return;
+    }
 
-    generate_timings(req->message.body.opcode, c);
+    generate_timings(req->message.body.opcode, mode, c);
     write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
     c->dynamic_buffer.buffer = NULL;
     c->dynamic_buffer.size = 0;
@@ -4734,54 +5698,97 @@ static void ioctl_set_executor(conn *c, void *packet)
     }
 }
 
+/*
+ * Validate the proposed config (which parses the files it names). Any
+ * problems are put in the dynamic buffer as the response for the client.
+ */
+static ENGINE_ERROR_CODE config_validate_job(conn *c) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    const char* val_ptr = NULL;
+    char *val_buffer = NULL;
+    cJSON *errors = NULL;
+    protocol_binary_request_ioctl_set *req =
+        (void*)(c->read.curr - (c->binary_header.request.bodylen +
+                                sizeof(c->binary_header)));
+
+    size_t keylen = ntohs(req->message.header.request.keylen);
+    size_t vallen = ntohl(req->message.header.request.bodylen) - keylen;
+
+    val_ptr = (const char*)(req->bytes + sizeof(req->bytes)) + keylen;
+
+    /* null-terminate value, and convert to integer */
+    val_buffer = malloc(vallen + 1); /* +1 for terminating '\0' */
+    if (val_buffer == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    memcpy(val_buffer, val_ptr, vallen);
+    val_buffer[vallen] = '\0';
+
+    errors = cJSON_CreateArray();
+    if (!validate_proposed_config_changes(val_buffer, errors)) {
+        /* problem(s). Send the errors back to the client. */
+        char* error_string = cJSON_PrintUnformatted(errors);
+        if (!binary_response_handler(NULL, 0, NULL, 0, error_string,
+                                     strlen(error_string), 0,
+                                     PROTOCOL_BINARY_RESPONSE_EINVAL, 0,
+                                     c)) {
+            ret = ENGINE_ENOMEM;
+        }
+        free(error_string);
+    }
+    cJSON_Delete(errors);
+    free(val_buffer);
+    return ret;
+}
+
 static void config_validate_executor(conn *c, void *packet) {
-    const char* val_ptr = NULL;
-    char *val_buffer = NULL;
-    cJSON *errors = NULL;
+    ENGINE_ERROR_CODE ret = c->aiostat;
     protocol_binary_request_ioctl_set *req = packet;
 
     size_t keylen = ntohs(req->message.header.request.keylen);
     size_t vallen = ntohl(req->message.header.request.bodylen) - keylen;
 
-    /* Key not yet used, must be zero length. */
-    if (keylen != 0) {
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
-        return;
-    }
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
 
-    /* must have non-zero length config */
-    if (vallen == 0 || vallen > CONFIG_VALIDATE_MAX_LENGTH) {
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
-        return;
-    }
+    if (c->aux_done) {
+        c->aux_done = false;
+    } else if (ret == ENGINE_SUCCESS) {
+        /* Key not yet used, must be zero length. */
+        if (keylen != 0) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+            return;
+        }
 
-    val_ptr = (const char*)(req->bytes + sizeof(req->bytes)) + keylen;
+        /* must have non-zero length config */
+        if (vallen == 0 || vallen > CONFIG_VALIDATE_MAX_LENGTH) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+            return;
+        }
 
-    /* null-terminate value, and convert to integer */
-    val_buffer = malloc(vallen + 1); /* +1 for terminating '\0' */
-    memcpy(val_buffer, val_ptr, vallen);
-    val_buffer[vallen] = '\0';
+        ret = aux_run(c, config_validate_job);
+    }
 
-    errors = cJSON_CreateArray();
-    if (validate_proposed_config_changes(val_buffer, errors)) {
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
-    } else {
-        /* problem(s). Send the errors back to the client. */
-        char* error_string = cJSON_PrintUnformatted(errors);
-        if (binary_response_handler(NULL, 0, NULL, 0, error_string,
-                                    strlen(error_string), 0,
-                                    PROTOCOL_BINARY_RESPONSE_EINVAL, 0,
-                                    c)) {
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        if (c->dynamic_buffer.buffer != NULL) {
             write_and_free(c, c->dynamic_buffer.buffer,
                            c->dynamic_buffer.offset);
             c->dynamic_buffer.buffer = NULL;
+            c->dynamic_buffer.size = 0;
         } else {
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
         }
-        free(error_string);
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    default:
+        free(c->dynamic_buffer.buffer);
+        c->dynamic_buffer.buffer = NULL;
+        c->dynamic_buffer.size = 0;
+        write_bin_packet(c, engine_error_2_protocol_error(ret), 0);
     }
-    cJSON_Delete(errors);
-    free(val_buffer);
 }
 
 static void config_reload_executor(conn *c, void *packet) {
@@ -4901,6 +5908,7 @@ static void setup_bin_packet_handlers(void) {
     validators[PROTOCOL_BINARY_CMD_GETQ] = get_validator;
     validators[PROTOCOL_BINARY_CMD_GETK] = get_validator;
     validators[PROTOCOL_BINARY_CMD_GETKQ] = get_validator;
+    validators[PROTOCOL_BINARY_CMD_MGET] = mget_validator;
     validators[PROTOCOL_BINARY_CMD_DELETE] = delete_validator;
     validators[PROTOCOL_BINARY_CMD_DELETEQ] = delete_validator;
     validators[PROTOCOL_BINARY_CMD_STAT] = stat_validator;
@@ -4956,6 +5964,7 @@ static void setup_bin_packet_handlers(void) {
     executors[PROTOCOL_BINARY_CMD_GETQ] = get_executor;
     executors[PROTOCOL_BINARY_CMD_GETK] = get_executor;
     executors[PROTOCOL_BINARY_CMD_GETKQ] = get_executor;
+    executors[PROTOCOL_BINARY_CMD_MGET] = mget_executor;
     executors[PROTOCOL_BINARY_CMD_DELETE] = delete_executor;
     executors[PROTOCOL_BINARY_CMD_DELETEQ] = delete_executor;
     executors[PROTOCOL_BINARY_CMD_STAT] = stat_executor;
@@ -4973,6 +5982,12 @@ static void setup_bin_packet_handlers(void) {
     executors[PROTOCOL_BINARY_CMD_ASSUME_ROLE] = assume_role_executor;
     executors[PROTOCOL_BINARY_CMD_AUDIT_PUT] = audit_put_executor;
     executors[PROTOCOL_BINARY_CMD_AUDIT_CONFIG_RELOAD] = audit_config_reload_executor;
+
+    aux_commands[PROTOCOL_BINARY_CMD_DEL_VBUCKET] = true;
+    aux_commands[PROTOCOL_BINARY_CMD_CREATE_BUCKET] = true;
+    aux_commands[PROTOCOL_BINARY_CMD_DELETE_BUCKET] = true;
+    aux_commands[PROTOCOL_BINARY_CMD_COMPACT_DB] = true;
+    aux_commands[PROTOCOL_BINARY_CMD_SCRUB] = true;
 }
 
 static void setup_not_supported_handlers(void) {
@@ -5068,6 +6083,10 @@ static void dispatch_bin_command(conn *c) {
 
     if (c->start == 0) {
         c->start = gethrtime();
+        if (settings.slow_cmd_usec != 0 || c->slow.started ||
+            c->slow.responded != 0) {
+            slow_cmd_begin(c);
+        }
     }
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->read.curr, c->read.bytes);
@@ -5445,7 +6464,10 @@ static void reset_cmd_handler(conn *c) {
         c->read.curr = c->read.buf;
     }
 
-    conn_shrink(c);
+    if (!c->coalesce.pending) {
+        /* (the held back responses use the iovecs and msghdrs) */
+        conn_shrink(c);
+    }
     if (c->read.bytes > 0) {
         conn_set_state(c, conn_parse_cmd);
     } else {
@@ -5496,13 +6518,17 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     struct rusage usage;
     long pid = (long)getpid();
 #endif
-    struct slab_stats slab_stats;
     char stat_key[1024];
     struct tap_stats ts;
+    struct ssl_pool_stats ssl_stats;
+    struct aux_pool_stats aux_stats;
+    uint64_t handshakes;
     rel_time_t now = mc_time_get_current_time();
 
     struct thread_stats thread_stats;
     threadlocal_stats_clear(&thread_stats);
+    ssl_pool_get_stats(&ssl_stats);
+    aux_pool_get_stats(&aux_stats);
 
     if (aggregate && settings.engine.v1->aggregate_stats != NULL) {
         settings.engine.v1->aggregate_stats(settings.engine.v0,
@@ -5514,8 +6540,6 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
                                     &thread_stats);
     }
 
-    slab_stats_aggregate(&thread_stats, &slab_stats);
-
 #ifndef WIN32
     getrusage(RUSAGE_SELF, &usage);
 #endif
@@ -5551,8 +6575,9 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     }
     APPEND_STAT("total_connections", "%u", stats.total_conns);
     APPEND_STAT("connection_structures", "%u", stats.conn_structs);
+    APPEND_STAT("connection_structure_size", "%lu", (unsigned long)sizeof(conn));
     APPEND_STAT("cmd_get", "%"PRIu64, thread_stats.cmd_get);
-    APPEND_STAT("cmd_set", "%"PRIu64, slab_stats.cmd_set);
+    APPEND_STAT("cmd_set", "%"PRIu64, thread_stats.slab_totals.cmd_set);
     APPEND_STAT("cmd_flush", "%"PRIu64, thread_stats.cmd_flush);
     APPEND_STAT("cmd_total_sets", "%"PRIu64,
                 get_aggregated_cmd_stats(CMD_TOTAL_MUTATION));
@@ -5562,17 +6587,17 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
                 get_aggregated_cmd_stats(CMD_TOTAL));
     APPEND_STAT("auth_cmds", "%"PRIu64, thread_stats.auth_cmds);
     APPEND_STAT("auth_errors", "%"PRIu64, thread_stats.auth_errors);
-    APPEND_STAT("get_hits", "%"PRIu64, slab_stats.get_hits);
+    APPEND_STAT("get_hits", "%"PRIu64, thread_stats.slab_totals.get_hits);
     APPEND_STAT("get_misses", "%"PRIu64, thread_stats.get_misses);
     APPEND_STAT("delete_misses", "%"PRIu64, thread_stats.delete_misses);
-    APPEND_STAT("delete_hits", "%"PRIu64, slab_stats.delete_hits);
+    APPEND_STAT("delete_hits", "%"PRIu64, thread_stats.slab_totals.delete_hits);
     APPEND_STAT("incr_misses", "%"PRIu64, thread_stats.incr_misses);
     APPEND_STAT("incr_hits", "%"PRIu64, thread_stats.incr_hits);
     APPEND_STAT("decr_misses", "%"PRIu64, thread_stats.decr_misses);
     APPEND_STAT("decr_hits", "%"PRIu64, thread_stats.decr_hits);
     APPEND_STAT("cas_misses", "%"PRIu64, thread_stats.cas_misses);
-    APPEND_STAT("cas_hits", "%"PRIu64, slab_stats.cas_hits);
-    APPEND_STAT("cas_badval", "%"PRIu64, slab_stats.cas_badval);
+    APPEND_STAT("cas_hits", "%"PRIu64, thread_stats.slab_totals.cas_hits);
+    APPEND_STAT("cas_badval", "%"PRIu64, thread_stats.slab_totals.cas_badval);
     APPEND_STAT("bytes_read", "%"PRIu64, thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%"PRIu64, thread_stats.bytes_written);
     APPEND_STAT("accepting_conns", "%u",  is_listen_disabled() ? 0 : 1);
@@ -5580,11 +6605,47 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("rejected_conns", "%" PRIu64, (uint64_t)stats.rejected_conns);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%" PRIu64, (uint64_t)thread_stats.conn_yields);
+    APPEND_STAT("conn_time_yields", "%" PRIu64,
+                (uint64_t)thread_stats.conn_time_yields);
     APPEND_STAT("rbufs_allocated", "%" PRIu64, (uint64_t)thread_stats.rbufs_allocated);
     APPEND_STAT("rbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.rbufs_loaned);
     APPEND_STAT("rbufs_existing", "%" PRIu64, (uint64_t)thread_stats.rbufs_existing);
+    APPEND_STAT("rbufs_grown", "%" PRIu64, (uint64_t)thread_stats.rbufs_grown);
+    APPEND_STAT("read_calls", "%" PRIu64, (uint64_t)thread_stats.read_calls);
+    APPEND_STAT("bytes_per_read", "%" PRIu64,
+                thread_stats.read_calls == 0 ? (uint64_t)0 :
+                (uint64_t)(thread_stats.bytes_read / thread_stats.read_calls));
     APPEND_STAT("wbufs_allocated", "%" PRIu64, (uint64_t)thread_stats.wbufs_allocated);
     APPEND_STAT("wbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.wbufs_loaned);
+    APPEND_STAT("bytes_zerocopy", "%" PRIu64, thread_stats.bytes_zerocopy);
+    APPEND_STAT("bytes_copied", "%" PRIu64,
+                thread_stats.bytes_written - thread_stats.bytes_zerocopy);
+    APPEND_STAT("zerocopy_copied", "%" PRIu64, thread_stats.zerocopy_copied);
+    APPEND_STAT("responses_coalesced", "%" PRIu64, thread_stats.responses_coalesced);
+    APPEND_STAT("ktls_conns", "%" PRIu64, thread_stats.ktls_conns);
+    APPEND_STAT("ssl_handshakes_resumed", "%" PRIu64,
+                thread_stats.ssl_handshakes_resumed);
+    APPEND_STAT("ssl_handshakes_full", "%" PRIu64,
+                thread_stats.ssl_handshakes_full);
+    APPEND_STAT("ssl_session_cache_entries", "%" PRIu64,
+                ssl_sessions_cached());
+    APPEND_STAT("ssl_pool_queue", "%" PRIu64, ssl_stats.queued);
+    APPEND_STAT("ssl_pool_queue_max", "%" PRIu64, ssl_stats.queued_max);
+    handshakes = thread_stats.ssl_handshakes_resumed +
+                 thread_stats.ssl_handshakes_full;
+    APPEND_STAT("ssl_handshakes", "%" PRIu64, handshakes);
+    APPEND_STAT("ssl_handshake_avg_usec", "%" PRIu64,
+                handshakes == 0 ? (uint64_t)0 :
+                thread_stats.ssl_handshake_usec / handshakes);
+    APPEND_STAT("ssl_handshake_max_usec", "%" PRIu64,
+                thread_stats.ssl_handshake_max_usec);
+    APPEND_STAT("aux_pool_queue", "%" PRIu64, aux_stats.queued);
+    APPEND_STAT("aux_pool_queue_max", "%" PRIu64, aux_stats.queued_max);
+    APPEND_STAT("aux_jobs", "%" PRIu64, aux_stats.jobs);
+    APPEND_STAT("aux_job_avg_usec", "%" PRIu64,
+                aux_stats.jobs == 0 ? (uint64_t)0 :
+                aux_stats.job_usec / aux_stats.jobs);
+    APPEND_STAT("aux_job_max_usec", "%" PRIu64, aux_stats.job_max_usec);
     APPEND_STAT("iovused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.iovused_high_watermark);
     APPEND_STAT("msgused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.msgused_high_watermark);
     STATS_UNLOCK();
@@ -5696,6 +6757,18 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("verbosity", "%d", settings.verbose);
     APPEND_STAT("num_threads", "%d", settings.num_threads);
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "true" : "false");
+    APPEND_STAT("connection_placement", "%s",
+                conn_placement_text(settings.placement));
+    APPEND_STAT("connection_migration", "%d", settings.migration_threshold);
+    APPEND_STAT("io_backend", "%s", io_backend_text(settings.io_backend));
+    APPEND_STAT("zerocopy_threshold", "%d", settings.zerocopy_threshold);
+    APPEND_STAT("ktls", "%s", settings.ktls ? "true" : "false");
+    APPEND_STAT("ssl_handshake_threads", "%d", settings.ssl_handshake_threads);
+    APPEND_STAT("aux_threads", "%d", settings.aux_threads);
+    APPEND_STAT("time_slice_usec", "%d", settings.time_slice_usec);
+    APPEND_STAT("slow_cmd_usec", "%d", settings.slow_cmd_usec);
+    APPEND_STAT("slow_cmd_keys", "%s", settings.slow_cmd_keys ? "true" : "false");
     APPEND_STAT("reqs_per_event_high_priority", "%d",
                 settings.reqs_per_event_high_priority);
     APPEND_STAT("reqs_per_event_med_priority", "%d",
@@ -5805,12 +6878,14 @@ static int try_read_command(conn *c) {
             return -1;
         }
 
-        c->msgcurr = 0;
-        c->msgused = 0;
-        c->iovused = 0;
-        if (add_msghdr(c) != 0) {
-            conn_set_state(c, conn_closing);
-            return -1;
+        if (!c->coalesce.pending) {
+            c->msgcurr = 0;
+            c->msgused = 0;
+            c->iovused = 0;
+            if (add_msghdr(c) != 0) {
+                conn_set_state(c, conn_closing);
+                return -1;
+            }
         }
 
         c->cmd = c->binary_header.request.opcode;
@@ -5832,6 +6907,11 @@ static void drain_bio_send_pipe(conn *c) {
     int n;
     bool stop = false;
 
+    if (c->ssl.direct) {
+        /* OpenSSL writes to the socket itself */
+        return;
+    }
+
     do {
         if (c->ssl.out.current < c->ssl.out.total) {
 #ifdef WIN32
@@ -5876,6 +6956,11 @@ static void drain_bio_recv_pipe(conn *c) {
     int n;
     bool stop = false;
 
+    if (c->ssl.direct) {
+        /* OpenSSL reads from the socket itself */
+        return;
+    }
+
     do {
         if (c->ssl.in.current < c->ssl.in.total) {
             n = BIO_write(c->ssl.network, c->ssl.in.buffer + c->ssl.in.current,
@@ -5922,13 +7007,43 @@ static void drain_bio_recv_pipe(conn *c) {
     } while (!stop);
 }
 
+/*
+ * Count the session established by the handshake. Done by the worker
+ * (not on the handshake pool), as only the worker updates its stats.
+ */
+static void ssl_handshake_stats(conn *c) {
+    if (SSL_session_reused(c->ssl.client)) {
+        STATS_NOKEY(c, ssl_handshakes_resumed);
+    } else {
+        STATS_NOKEY(c, ssl_handshakes_full);
+    }
+    if (c->ssl.handshake_start != 0) {
+        uint64_t usec = (gethrtime() - c->ssl.handshake_start) / 1000;
+        STATS_ADD(c, ssl_handshake_usec, usec);
+        STATS_MAX(c, ssl_handshake_max_usec, usec);
+    }
+    if (c->ssl.ktls_send) {
+        STATS_NOKEY(c, ktls_conns);
+    }
+}
+
 static int do_ssl_pre_connection(conn *c) {
-    int r = SSL_accept(c->ssl.client);
+    int r;
+
+    r = SSL_accept(c->ssl.client);
     if (r == 1) {
         drain_bio_send_pipe(c);
         c->ssl.connected = true;
+#ifdef HAVE_KTLS
+        if (c->ssl.direct && BIO_get_ktls_send(SSL_get_wbio(c->ssl.client))) {
+            /* The responses may be sent straight from the items */
+            c->ssl.ktls_send = true;
+        }
+#endif
     } else {
-        if (SSL_get_error(c->ssl.client, r) == SSL_ERROR_WANT_READ) {
+        int error = SSL_get_error(c->ssl.client, r);
+        if (error == SSL_ERROR_WANT_READ ||
+            (c->ssl.direct && error == SSL_ERROR_WANT_WRITE)) {
             drain_bio_send_pipe(c);
             set_ewouldblock();
             return -1;
@@ -5955,6 +7070,31 @@ static int do_ssl_pre_connection(conn *c) {
     return 0;
 }
 
+/*
+ * Run the next step of the SSL handshake for a connection parked in the
+ * conn_ssl_handshake state (on an ssl_pool thread), and hand it back to
+ * its worker.
+ */
+static void ssl_handshake_job(conn *c) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    drain_bio_recv_pipe(c);
+    if (c->ssl.error) {
+        ret = ENGINE_DISCONNECT;
+    } else if (do_ssl_pre_connection(c) == -1) {
+#ifdef WIN32
+        DWORD error = WSAGetLastError();
+#else
+        int error = errno;
+#endif
+        if (!is_blocking(error)) {
+            ret = ENGINE_DISCONNECT;
+        }
+    }
+
+    notify_job_complete(c, ret);
+}
+
 static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
     int ret = 0;
 
@@ -6009,7 +7149,9 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
 
 static int do_data_recv(conn *c, void *dest, size_t nbytes) {
     int res;
-    if (c->ssl.enabled) {
+    if (c->stream != NULL) {
+        res = (int)stream_compress_recv(c, dest, nbytes);
+    } else if (c->ssl.enabled) {
         drain_bio_recv_pipe(c);
 
         if (!c->ssl.connected) {
@@ -6017,12 +7159,17 @@ static int do_data_recv(conn *c, void *dest, size_t nbytes) {
             if (res == -1) {
                 return -1;
             }
+            if (c->ssl.connected) {
+                ssl_handshake_stats(c);
+            }
         }
 
         /* The SSL negotiation might be complete at this time */
         if (c->ssl.connected) {
             res = do_ssl_read(c, dest, nbytes);
         }
+    } else if (c->uring != NULL) {
+        res = uring_conn_recv(c, dest, nbytes);
     } else {
         res = recv(c->sfd, dest, nbytes, 0);
     }
@@ -6087,7 +7234,11 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
 
 static int do_data_sendmsg(conn *c, struct msghdr *m) {
     int res;
-    if (c->ssl.enabled) {
+    if (c->stream != NULL) {
+        res = (int)stream_compress_sendmsg(c, m);
+    } else if (c->ssl.ktls_send) {
+        res = sendmsg(c->sfd, m, 0);
+    } else if (c->ssl.enabled) {
         int ii;
         res = 0;
         for (ii = 0; ii < m->msg_iovlen; ++ii) {
@@ -6106,6 +7257,8 @@ static int do_data_sendmsg(conn *c, struct msghdr *m) {
          */
         drain_bio_send_pipe(c);
         return res;
+    } else if (settings.zerocopy_threshold > 0 && c->state == conn_mwrite) {
+        res = zerocopy_sendmsg(c, m);
     } else {
         res = sendmsg(c->sfd, m, 0);
     }
@@ -6146,14 +7299,24 @@ static enum try_read_result try_read_network(conn *c) {
 #endif
 
         if (c->read.bytes >= c->read.size) {
-            char *new_rbuf;
+            size_t needed = c->read.size;
+#ifndef WIN32
+            int pending;
 
+            /* Size the new buffer after what's waiting in the socket */
+            if (!c->ssl.enabled && c->uring == NULL && c->stream == NULL &&
+                ioctl(c->sfd, FIONREAD, &pending) == 0) {
+                if (pending == 0) {
+                    break;
+                }
+                needed = pending;
+            }
+#endif
             if (num_allocs == 4) {
-                return gotdata;
+                break;
             }
             ++num_allocs;
-            new_rbuf = realloc(c->read.buf, c->read.size * 2);
-            if (!new_rbuf) {
+            if (!conn_grow_read_buffer(c, needed)) {
                 if (settings.verbose > 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                                                     "Couldn't realloc input buffer\n");
@@ -6162,16 +7325,18 @@ static enum try_read_result try_read_network(conn *c) {
                 conn_set_state(c, conn_closing);
                 return READ_MEMORY_ERROR;
             }
-            c->read.curr = c->read.buf = new_rbuf;
-            c->read.size *= 2;
         }
 
         avail = c->read.size - c->read.bytes;
         res = do_data_recv(c, c->read.buf + c->read.bytes, avail);
+        STATS_NOKEY(c, read_calls);
         if (res > 0) {
             STATS_ADD(c, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->read.bytes += res;
+            if (settings.slow_cmd_usec != 0) {
+                c->slow.read_at = gethrtime();
+            }
             if (res == avail) {
                 continue;
             } else {
@@ -6198,6 +7363,19 @@ static enum try_read_result try_read_network(conn *c) {
             return READ_ERROR;
         }
     }
+
+    /*
+     * Remember how much the client sends us in one go, so that we loan it
+     * a buffer of the right size next time. Grow at once, but shrink
+     * slowly so that an odd small batch doesn't undo it.
+     */
+    if (gotdata == READ_DATA_RECEIVED) {
+        if (c->read.bytes > c->read_hint) {
+            c->read_hint = c->read.bytes;
+        } else {
+            c->read_hint -= c->read_hint / 8;
+        }
+    }
     return gotdata;
 }
 
@@ -6253,24 +7431,59 @@ bool update_event(conn *c, const int new_flags) {
         }
     }
 
-    if (c->ev_flags == new_flags) {
+    if ((new_flags & EV_READ) && stream_compress_pending(c)) {
+        /* The decompressor has input the socket won't signal for */
+        event_active(&c->event, EV_READ, 0);
         return true;
     }
 
-    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
-                                    "Updated event for %d to read=%s, write=%s\n",
-                                    c->sfd, (new_flags & EV_READ ? "yes" : "no"),
-                                    (new_flags & EV_WRITE ? "yes" : "no"));
+    if (c->ev_flags != new_flags) {
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
+                                        "Updated event for %d to read=%s, write=%s\n",
+                                        c->sfd, (new_flags & EV_READ ? "yes" : "no"),
+                                        (new_flags & EV_WRITE ? "yes" : "no"));
 
-    if (!unregister_event(c)) {
-        return false;
+        if (!unregister_event(c)) {
+            return false;
+        }
+
+        /* The ring tells us about data to read, not libevent */
+        event_set(&c->event, c->sfd,
+                  c->uring != NULL ? new_flags & ~EV_READ : new_flags,
+                  event_handler, (void *)c);
+        event_base_set(base, &c->event);
+        c->ev_flags = new_flags;
+
+        if (!register_event(c, NULL)) {
+            return false;
+        }
+    }
+
+    if (c->uring != NULL && (new_flags & EV_READ) && uring_conn_has_data(c)) {
+        /* The data is already here; signal a call to the handler */
+        event_active(&c->event, EV_READ, 0);
     }
 
-    event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
-    event_base_set(base, &c->event);
-    c->ev_flags = new_flags;
+    return true;
+}
+
+/*
+ * We've written res bytes of the message. Remove the completed iovec
+ * entries from the list of pending writes.
+ */
+static void consume_iovecs(struct msghdr *m, ssize_t res) {
+    while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
+        res -= (ssize_t)m->msg_iov->iov_len;
+        m->msg_iovlen--;
+        m->msg_iov++;
+    }
 
-    return register_event(c, NULL);
+    /* Might have written just part of the last iovec entry;
+       adjust it so the next write will do the rest. */
+    if (res > 0) {
+        m->msg_iov->iov_base = (void*)((unsigned char*)m->msg_iov->iov_base + res);
+        m->msg_iov->iov_len -= res;
+    }
 }
 
 /*
@@ -6308,21 +7521,7 @@ static enum transmit_result transmit(conn *c) {
 #endif
         if (res > 0) {
             STATS_ADD(c, bytes_written, res);
-
-            /* We've written some of the data. Remove the completed
-               iovec entries from the list of pending writes. */
-            while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
-                res -= (ssize_t)m->msg_iov->iov_len;
-                m->msg_iovlen--;
-                m->msg_iov++;
-            }
-
-            /* Might have written just part of the last iovec entry;
-               adjust it so the next write will do the rest. */
-            if (res > 0) {
-                m->msg_iov->iov_base = (void*)((unsigned char*)m->msg_iov->iov_base + res);
-                m->msg_iov->iov_len -= res;
-            }
+            consume_iovecs(m, res);
             return TRANSMIT_INCOMPLETE;
         }
 
@@ -6379,13 +7578,198 @@ static enum transmit_result transmit(conn *c) {
     }
 }
 
-bool conn_listening(conn *c)
+/*
+ * Has the connection used up its share of the worker's time since it was
+ * picked up? If so, the requests it has left to serve are dropped from the
+ * current timeslice (and served once the other clients have had a go).
+ * Checked between requests, so a single request is never interrupted.
+ */
+static void conn_check_slice(conn *c) {
+    hrtime_t budget;
+
+    if (settings.time_slice_usec == 0 || c->nevents <= 0) {
+        return;
+    }
+    /* time_slice_usec * 1000 ns/usec * slice_weight / 100 */
+    budget = (hrtime_t)settings.time_slice_usec * 10 * c->slice_weight;
+    if (gethrtime() - c->slice_start >= budget) {
+        c->nevents = 0;
+        c->time_yields++;
+        STATS_NOKEY(c, conn_time_yields);
+    }
+}
+
+/*
+ * Response coalescing: a pipelining client sends a batch of requests and
+ * then waits for their responses. Instead of sending the response to each
+ * of them with a system call of its own, the response is held back (left
+ * in the msghdr / iovec lists) while the next request is already complete
+ * in the read buffer, and the responses to the following requests are
+ * appended to it. They all go out together when we run out of complete
+ * requests (or of the number of requests to handle per event), when the
+ * limits of a batch are reached, or when a request would block.
+ *
+ * The parts of a held back response in the connection's write and read
+ * buffers (which are reused by the next request), and the other small
+ * ones, are copied to a buffer on the connection. The item holding the
+ * value of a response is kept on the item list until the batch has been
+ * sent. Other large parts are only referenced by the current request, so
+ * a response with those isn't held back.
+ */
+
+/*
+ * Is the next request complete in the read buffer (and one the held back
+ * responses may wait for)?
+ */
+static bool next_request_complete(conn *c) {
+    protocol_binary_request_header req;
+
+    if (c->read.bytes < sizeof(req.bytes)) {
+        return false;
+    }
+    memcpy(req.bytes, c->read.curr, sizeof(req.bytes));
+    if (req.request.opcode == PROTOCOL_BINARY_CMD_TAP_CONNECT ||
+        req.request.opcode == PROTOCOL_BINARY_CMD_DCP_OPEN) {
+        /* The connection becomes a stream with output lists of its own */
+        return false;
+    }
+    return c->read.bytes - sizeof(req.bytes) >= ntohl(req.request.bodylen);
+}
+
+/*
+ * Hold back the response to the current request (in conn_mwrite) if there
+ * is another request to handle. Returns true if it was held back (and the
+ * connection moved on to the next request), false if the responses are to
+ * be sent now.
+ */
+static bool coalesce_response(conn *c) {
+    uint32_t copy = 0;
+    uint32_t bytes = 0;
+    int ii;
+
+    if (c->coalesce.flushing || c->write_and_go != conn_new_cmd ||
+        c->tap_iterator != NULL || c->dcp || c->nevents <= 0 ||
+        c->iovused > COALESCE_MAX_IOV || !next_request_complete(c)) {
+        c->coalesce.flushing = true;
+        return false;
+    }
+
+    for (ii = c->coalesce.iovused; ii < c->iovused; ++ii) {
+        const char *base = c->iov[ii].iov_base;
+        size_t len = c->iov[ii].iov_len;
+
+        if (len <= COALESCE_COPY_MAX ||
+            (base >= c->write.buf && base < c->write.buf + c->write.size) ||
+            (base >= c->read.buf && base < c->read.buf + c->read.size)) {
+            copy += (uint32_t)len;
+        } else if (c->item == NULL) {
+            c->coalesce.flushing = true;
+            return false;
+        }
+        bytes += (uint32_t)len;
+    }
+
+    if (c->coalesce.used + copy > COALESCE_BUFFER_SIZE ||
+        c->coalesce.bytes + bytes > COALESCE_MAX_BYTES) {
+        c->coalesce.flushing = true;
+        return false;
+    }
+
+    if (c->coalesce.buf == NULL &&
+        (c->coalesce.buf = malloc(COALESCE_BUFFER_SIZE)) == NULL) {
+        c->coalesce.flushing = true;
+        return false;
+    }
+
+    if (c->item != NULL) {
+        if (!conn_hold_item(c, c->item)) {
+            c->coalesce.flushing = true;
+            return false;
+        }
+        c->item = NULL;
+    }
+
+    for (ii = c->coalesce.iovused; ii < c->iovused; ++ii) {
+        const char *base = c->iov[ii].iov_base;
+        size_t len = c->iov[ii].iov_len;
+
+        if (len <= COALESCE_COPY_MAX ||
+            (base >= c->write.buf && base < c->write.buf + c->write.size) ||
+            (base >= c->read.buf && base < c->read.buf + c->read.size)) {
+            char *dest = c->coalesce.buf + c->coalesce.used;
+            memcpy(dest, base, len);
+            c->iov[ii].iov_base = dest;
+            c->coalesce.used += (uint32_t)len;
+        }
+    }
+
+    c->coalesce.iovused = c->iovused;
+    c->coalesce.bytes += bytes;
+    c->coalesce.pending = true;
+    STATS_NOKEY(c, responses_coalesced);
+    conn_set_state(c, conn_new_cmd);
+    return true;
+}
+
+/* The held back responses have been sent (or given up on) */
+static void coalesce_reset(conn *c) {
+    c->coalesce.used = 0;
+    c->coalesce.bytes = 0;
+    c->coalesce.iovused = 0;
+    c->coalesce.pending = false;
+    c->coalesce.flushing = false;
+}
+
+/*
+ * The current request would block; send what the socket takes of the
+ * responses held back so far, so the client can get on with them in the
+ * meantime. The rest goes out with the response to the blocked request.
+ */
+static void coalesce_flush_nowait(conn *c) {
+    if (!c->coalesce.pending || (c->ssl.enabled && !c->ssl.ktls_send)) {
+        return;
+    }
+
+    while (c->msgcurr < c->msgused) {
+        struct msghdr *m = &c->msglist[c->msgcurr];
+        ssize_t res;
+
+        if (m->msg_iovlen == 0) {
+            if (c->msgcurr + 1 == c->msgused) {
+                /* The next response is appended to this msghdr */
+                break;
+            }
+            c->msgcurr++;
+            continue;
+        }
+
+        res = do_data_sendmsg(c, m);
+        if (res <= 0) {
+            /* Would block (or failed); leave it to the regular transmit */
+            break;
+        }
+        STATS_ADD(c, bytes_written, res);
+        consume_iovecs(m, res);
+    }
+}
+
+/* The max number of clients a worker accepts per event on its listener */
+#define MAX_ACCEPT_BATCH 16
+
+/**
+ * Accept a single client on the listening connection.
+ *
+ * @return true if a client was accepted (whether it was allowed to stay
+ *         or not), false if there are no more clients to accept right now
+ */
+static bool accept_new_client(conn *c)
 {
     SOCKET sfd;
     struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
     int curr_conns;
     int port_conns;
+    bool rejected = false;
     struct listening_port *port_instance;
 
     if ((sfd = accept(c->sfd, (struct sockaddr *)&addr, &addrlen)) == -1) {
@@ -6406,7 +7790,11 @@ bool conn_listening(conn *c)
                                             "Too many open files. Current limit: %d\n",
                                             limit.rlim_cur);
 #endif
-            disable_listen();
+            if (c->thread != NULL) {
+                disable_thread_listen(c->thread);
+            } else {
+                disable_listen();
+            }
         } else if (!is_blocking(error)) {
             log_socket_error(EXTENSION_LOG_WARNING, c,
                              "Failed to accept new client: %s");
@@ -6415,19 +7803,24 @@ bool conn_listening(conn *c)
         return false;
     }
 
+    /*
+     * With SO_REUSEPORT multiple threads accept clients for the same
+     * port at the same time, so the limits must be checked in the same
+     * critical section as the counters are bumped.
+     */
     STATS_LOCK();
     curr_conns = ++stats.curr_conns;
     port_instance = get_listening_port_instance(c->parent_port);
     cb_assert(port_instance);
     port_conns = ++port_instance->curr_conns;
-    STATS_UNLOCK();
-
     if (curr_conns >= settings.maxconns || port_conns >= port_instance->maxconns) {
-        STATS_LOCK();
         ++stats.rejected_conns;
         --port_instance->curr_conns;
-        STATS_UNLOCK();
+        rejected = true;
+    }
+    STATS_UNLOCK();
 
+    if (rejected) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
             "Too many open connections. Current/Limit for port %d: %d/%d; "
             "total: %d/%d", port_instance->port,
@@ -6435,7 +7828,7 @@ bool conn_listening(conn *c)
             curr_conns, settings.maxconns);
 
         safe_close(sfd);
-        return false;
+        return true;
     }
 
     if (evutil_make_socket_nonblocking(sfd) == -1) {
@@ -6443,11 +7836,41 @@ bool conn_listening(conn *c)
         --port_instance->curr_conns;
         STATS_UNLOCK();
         safe_close(sfd);
-        return false;
+        return true;
+    }
+
+    if (c->thread == NULL) {
+        dispatch_conn_new(sfd, c->parent_port, conn_new_cmd,
+                          EV_READ | EV_PERSIST, DATA_BUFFER_SIZE);
+    } else {
+        /* We own the listener, so the client stays with us */
+        conn *client = conn_new(sfd, c->parent_port, conn_new_cmd,
+                                EV_READ | EV_PERSIST, DATA_BUFFER_SIZE,
+                                c->thread->base, NULL, c->thread);
+        if (client == NULL) {
+            STATS_LOCK();
+            --port_instance->curr_conns;
+            STATS_UNLOCK();
+            safe_close(sfd);
+        } else {
+            client->thread = c->thread;
+            c->thread->load.accepted++;
+            if (c->thread->uring != NULL && !client->ssl.enabled) {
+                uring_conn_attach(client);
+            }
+        }
     }
 
-    dispatch_conn_new(sfd, c->parent_port, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE);
+    return true;
+}
+
+bool conn_listening(conn *c)
+{
+    /* Only workers owning their listener accept in batches */
+    int batch = (c->thread == NULL) ? 1 : MAX_ACCEPT_BATCH;
+    while (batch-- > 0 && accept_new_client(c)) {
+        /* empty */
+    }
 
     return false;
 }
@@ -6493,6 +7916,7 @@ bool conn_ship_log(conn *c) {
         /* and it will slowly grow.. */
         c->nevents = c->max_reqs_per_event;
     } else if (c->which & EV_WRITE) {
+        conn_check_slice(c);
         --c->nevents;
         if (c->nevents >= 0) {
             c->ewouldblock = false;
@@ -6521,6 +7945,12 @@ bool conn_ship_log(conn *c) {
 }
 
 bool conn_waiting(conn *c) {
+    if (c->parked.count > 0 && (c->parked.notified || c->parked.retry > 0)) {
+        /* Run the parked gets again first */
+        conn_set_state(c, conn_parse_cmd);
+        return true;
+    }
+
     if (!update_event(c, EV_READ | EV_PERSIST)) {
         if (settings.verbose > 0) {
             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -6529,12 +7959,33 @@ bool conn_waiting(conn *c) {
         conn_set_state(c, conn_closing);
         return true;
     }
-    conn_set_state(c, conn_read);
-    return false;
-}
+    conn_set_state(c, conn_read);
+    return false;
+}
+
+bool conn_read(conn *c) {
+    int res;
+
+    if (c->ssl.enabled && !c->ssl.connected && ssl_pool_enabled()) {
+        /* Leave the handshake to the pool, away from the other clients */
+        if (c->ssl.handshake_start == 0) {
+            c->ssl.handshake_start = gethrtime();
+        }
+        if (!unregister_event(c)) {
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        conn_set_state(c, conn_ssl_handshake);
+        if (!ssl_pool_submit(c, ssl_handshake_job)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to queue the SSL handshake\n", c->sfd);
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        return false;
+    }
 
-bool conn_read(conn *c) {
-    int res = try_read_network(c);
+    res = try_read_network(c);
     switch (res) {
     case READ_NO_DATA_RECEIVED:
         conn_set_state(c, conn_waiting);
@@ -6554,11 +8005,45 @@ bool conn_read(conn *c) {
 }
 
 bool conn_parse_cmd(conn *c) {
+    if (c->parked.count > 0) {
+        /*
+         * Once the engine notified us, the parked gets are run again
+         * (one at a time, each may respond) before the next request. A
+         * request which isn't a get waits for all of them to complete.
+         */
+        if (c->parked.notified) {
+            c->parked.notified = false;
+            c->parked.retry = c->parked.count;
+        }
+        if (c->parked.retry > 0) {
+            --c->parked.retry;
+            unpark_get(c);
+            return !c->ewouldblock;
+        }
+        if (!may_pass_parked_gets(c)) {
+            if (c->coalesce.pending) {
+                /* Send the held back responses while we wait */
+                c->coalesce.flushing = true;
+                c->write_and_go = conn_new_cmd;
+                conn_set_state(c, conn_mwrite);
+                return true;
+            }
+            if (!unregister_event(c)) {
+                conn_set_state(c, conn_closing);
+                return true;
+            }
+            return false;
+        }
+    }
+
     if (try_read_command(c) == 0) {
         /* wee need more data! */
         conn_set_state(c, conn_waiting);
     }
 
+    if (c->ewouldblock) {
+        coalesce_flush_nowait(c);
+    }
     return !c->ewouldblock;
 }
 
@@ -6566,9 +8051,36 @@ bool conn_new_cmd(conn *c) {
     /* Only process nreqs at a time to avoid starving other connections */
     int ssl_peek = 0;
     c->start = 0;
+
+    /* ... and only as long as its time budget lasts */
+    conn_check_slice(c);
+
+    if (c->stream_start) {
+        /* The HELLO response went out as is, the rest is compressed */
+        c->stream_start = false;
+        if (!stream_compress_start(c)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to start the stream compression\n", c->sfd);
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+    }
+
+    if (c->coalesce.pending &&
+        (c->nevents <= 0 || !next_request_complete(c))) {
+        /* No more requests to handle now; send the held back responses */
+        c->coalesce.flushing = true;
+        c->write_and_go = conn_new_cmd;
+        conn_set_state(c, conn_mwrite);
+        return true;
+    }
+
     --c->nevents;
     if (c->nevents >= 0) {
         reset_cmd_handler(c);
+        if (thread_should_migrate(c)) {
+            conn_set_state(c, conn_migrate);
+        }
     } else {
         /* check ssl for pending data */
         if (c->ssl.enabled) {
@@ -6576,7 +8088,7 @@ bool conn_new_cmd(conn *c) {
             ssl_peek = SSL_peek(c->ssl.client, &dummy, 1);
         }
         STATS_NOKEY(c, conn_yields);
-        if (c->read.bytes > 0 || ssl_peek > 0) {
+        if (c->read.bytes > 0 || ssl_peek > 0 || stream_compress_pending(c)) {
             /* We have already read in data into the input buffer,
                so libevent will most likely not signal read events
                on the socket (unless more data is available. As a
@@ -6673,9 +8185,16 @@ bool conn_nread(conn *c) {
 
     if (c->rlbytes == 0) {
         bool block = c->ewouldblock = false;
+        if (c->slow.started) {
+            slow_cmd_run(c);
+        }
         complete_nread(c);
+        if (c->slow.run_at != 0) {
+            slow_cmd_stop(c, gethrtime());
+        }
         if (c->ewouldblock) {
             unregister_event(c);
+            coalesce_flush_nowait(c);
             block = true;
         }
         return !block;
@@ -6746,9 +8265,9 @@ bool conn_write(conn *c) {
     /*
      * We want to write out a simple response. If we haven't already,
      * assemble it into a msgbuf list (this will be a single-entry
-     * list for TCP).
+     * list for TCP). It goes out after the held back responses (if any).
      */
-    if (c->iovused == 0) {
+    if (c->iovused == 0 || !c->coalesce.flushing) {
         if (add_iov(c, c->write.curr, c->write.bytes) != 0) {
             if (settings.verbose > 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -6757,30 +8276,48 @@ bool conn_write(conn *c) {
             conn_set_state(c, conn_closing);
             return true;
         }
+        c->coalesce.flushing = true;
     }
 
     return conn_mwrite(c);
 }
 
+/* Release the items and temporary allocations of the sent responses */
+static void release_sent_responses(conn *c) {
+    while (c->ileft > 0) {
+        item *it = *(c->icurr);
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        c->icurr++;
+        c->ileft--;
+    }
+    while (c->temp_alloc_left > 0) {
+        char *temp_alloc_ = *(c->temp_alloc_curr);
+        free(temp_alloc_);
+        c->temp_alloc_curr++;
+        c->temp_alloc_left--;
+    }
+}
+
 bool conn_mwrite(conn *c) {
+    if (c->state == conn_mwrite && coalesce_response(c)) {
+        return true;
+    }
+
     switch (transmit(c)) {
     case TRANSMIT_COMPLETE:
+        coalesce_reset(c);
+        if (c->slow.responded != 0) {
+            slow_cmd_done(c, gethrtime());
+        }
         if (c->state == conn_mwrite) {
-            while (c->ileft > 0) {
-                item *it = *(c->icurr);
-                settings.engine.v1->release(settings.engine.v0, c, it);
-                c->icurr++;
-                c->ileft--;
-            }
-            while (c->temp_alloc_left > 0) {
-                char *temp_alloc_ = *(c->temp_alloc_curr);
-                free(temp_alloc_);
-                c->temp_alloc_curr++;
-                c->temp_alloc_left--;
-            }
+            /* Hold on to what the kernel may still be sending from */
+            zerocopy_pin_response(c);
+            release_sent_responses(c);
             /* XXX:  I don't know why this wasn't the general case */
             conn_set_state(c, c->write_and_go);
         } else if (c->state == conn_write) {
+            /* (held back responses may have been sent with this one) */
+            release_sent_responses(c);
             if (c->write_and_free) {
                 free(c->write_and_free);
                 c->write_and_free = 0;
@@ -6845,6 +8382,13 @@ bool conn_immediate_close(conn *c) {
 }
 
 bool conn_closing(conn *c) {
+    /* The kernel may still be sending the values of our last responses */
+    zerocopy_pin_response(c);
+    if (zerocopy_pending(c)) {
+        conn_set_state(c, conn_zerocopy_wait);
+        return true;
+    }
+
     /* We don't want any network notifications anymore.. */
     unregister_event(c);
     safe_close(c->sfd);
@@ -6853,7 +8397,7 @@ bool conn_closing(conn *c) {
     /* engine::release any allocated state */
     conn_cleanup_engine_allocations(c);
 
-    if (c->refcount > 1 || c->ewouldblock) {
+    if (c->refcount > 1 || c->ewouldblock || c->parked.count > 0) {
         conn_set_state(c, conn_pending_close);
     } else {
         conn_set_state(c, conn_immediate_close);
@@ -6861,6 +8405,65 @@ bool conn_closing(conn *c) {
     return true;
 }
 
+/** A connection being moved to another worker thread parks in this state
+ *  until run_event_loop hands it over. Always returns false.
+ */
+bool conn_migrate(conn *c) {
+    (void)c;
+    return false;
+}
+
+/**
+ * A connection being closed parks in this state until the kernel is done
+ * sending from the items of its zero-copy responses. The socket's error
+ * queue is polled every 10ms (waiting for it to become readable would
+ * spin if the client keeps sending us data, or has hung up).
+ */
+bool conn_zerocopy_wait(conn *c) {
+    struct timeval tv = { 0, 10000 };
+
+    if (!zerocopy_wait(c)) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+    if (!unregister_event(c)) {
+        conn_set_state(c, conn_immediate_close);
+        return true;
+    }
+    event_set(&c->event, c->sfd, 0, event_handler, (void *)c);
+    event_base_set(c->thread->base, &c->event);
+    c->ev_flags = 0;
+    if (!register_event(c, &tv)) {
+        zerocopy_abort(c);
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * A connection parks in this state while an ssl_pool thread runs a step
+ * of its SSL handshake, and is run again (through the pending io list)
+ * when the step is done.
+ */
+bool conn_ssl_handshake(conn *c) {
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+
+    if (ret != ENGINE_SUCCESS) {
+        conn_set_state(c, conn_closing);
+    } else if (c->ssl.connected) {
+        ssl_handshake_stats(c);
+        /* The first requests may already be buffered by OpenSSL */
+        conn_set_state(c, conn_read);
+    } else {
+        /* Wait for the client's next handshake message */
+        conn_set_state(c, conn_waiting);
+    }
+    return true;
+}
+
 /** sentinal state used to represent a 'destroyed' connection which will
  *  actually be freed at the end of the event loop. Always returns false.
  */
@@ -6936,7 +8539,7 @@ void event_handler(evutil_socket_t fd, short which, void *arg) {
          * object was scheduled to run in the dispatcher before the
          * callback for the worker thread is executed.
          */
-        c->thread->pending_io = list_remove(c->thread->pending_io, c);
+        thread_pending_io_remove(c);
     }
 
     c->which = which;
@@ -6944,12 +8547,23 @@ void event_handler(evutil_socket_t fd, short which, void *arg) {
     /* sanity */
     cb_assert(fd == c->sfd);
 
-    c->nevents = c->max_reqs_per_event;
+    /* Release the items of the zero-copy sends the kernel is done with */
+    zerocopy_reap(c);
 
-    run_event_loop(c);
+    c->nevents = c->max_reqs_per_event;
 
     if (thr) {
+        hrtime_t start = gethrtime();
+        run_event_loop(c);
+        /* c may be gone by now */
+        thread_account_busy(thr, gethrtime() - start);
         UNLOCK_THREAD(thr);
+        if (thr->uring != NULL) {
+            /* Submit the receives we re-armed for the connection */
+            uring_flush(thr);
+        }
+    } else {
+        run_event_loop(c);
     }
 }
 
@@ -6972,22 +8586,16 @@ static void dispatch_event_handler(evutil_socket_t fd, short which, void *arg) {
         if (enable) {
             conn *next;
             for (next = listen_conn; next; next = next->next) {
-                int backlog = 1024;
-                int ii;
                 update_event(next, EV_READ | EV_PERSIST);
-                for (ii = 0; ii < settings.num_interfaces; ++ii) {
-                    if (next->parent_port == settings.interfaces[ii].port) {
-                        backlog = settings.interfaces[ii].backlog;
-                        break;
-                    }
-                }
-
-                if (listen(next->sfd, backlog) != 0) {
+                if (listen(next->sfd, get_listen_backlog(next->parent_port)) != 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                                     "listen() failed",
                                                     strerror(errno));
                 }
             }
+            if (settings.reuseport) {
+                notify_listen_threads();
+            }
         }
     }
 }
@@ -7050,6 +8658,158 @@ static SOCKET new_socket(struct addrinfo *ai) {
     return sfd;
 }
 
+/*
+ * Have the kernel pick the listener of the given worker (among the
+ * SO_REUSEPORT listeners of an address) for the connections received on
+ * the CPU the worker is bound to.
+ */
+static void set_listener_cpu(SOCKET sfd, int tid) {
+#ifdef SO_INCOMING_CPU
+    int cpu = thread_cpu(tid);
+    if (cpu != -1 &&
+        setsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, (void *)&cpu,
+                   sizeof(cpu)) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_INCOMING_CPU): %s",
+                                        strerror(errno));
+    }
+#else
+    (void)sfd;
+    (void)tid;
+#endif
+}
+
+/**
+ * Create a socket, bind it to the given address and start listening on it.
+ * @param interf the interface the address belongs to
+ * @param ai the address to bind to
+ * @param reuseport try to set SO_REUSEPORT on the socket (cleared if it
+ *        isn't supported)
+ * @param fatal set to true if the interface should be given up on
+ * @return the new socket, or INVALID_SOCKET if the address can't be used
+ */
+static SOCKET new_server_socket(struct interface *interf, struct addrinfo *ai,
+                                bool *reuseport, bool *fatal) {
+    SOCKET sfd;
+    struct linger ling = {0, 0};
+    int flags =1;
+    int error;
+
+    *fatal = false;
+    if ((sfd = new_socket(ai)) == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(IPV6_V6ONLY): %s",
+                                            strerror(errno));
+            safe_close(sfd);
+            return INVALID_SOCKET;
+        }
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    if (*reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+            *reuseport = false;
+        }
+    }
+#endif
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_KEEPALIVE): %s",
+                                        strerror(errno));
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_LINGER): %s",
+                                        strerror(errno));
+    }
+
+    if (interf->tcp_nodelay) {
+        error = setsockopt(sfd, IPPROTO_TCP,
+                           TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+    if (bind(sfd, ai->ai_addr, (socklen_t)ai->ai_addrlen) == SOCKET_ERROR) {
+#ifdef WIN32
+        DWORD error = WSAGetLastError();
+#else
+        int error = errno;
+#endif
+        if (!is_addrinuse(error)) {
+            log_errcode_error(EXTENSION_LOG_WARNING, NULL,
+                              "bind(): %s", error);
+            *fatal = true;
+        }
+        safe_close(sfd);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(sfd, interf->backlog) == SOCKET_ERROR) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "listen(): %s",
+                                        strerror(errno));
+        safe_close(sfd);
+        *fatal = true;
+        return INVALID_SOCKET;
+    }
+
+    return sfd;
+}
+
+/**
+ * Start accepting clients on a listening socket, either in the dispatcher
+ * or (with SO_REUSEPORT) in the given worker thread.
+ * @param sfd the listening socket
+ * @param port the port number of the interface
+ * @param tid the worker to own the socket, or -1 for the dispatcher
+ */
+static void add_listen_conn(SOCKET sfd, in_port_t port, int tid) {
+    struct listening_port *port_instance;
+
+    if (tid < 0) {
+        conn *listen_conn_add;
+        if (!(listen_conn_add = conn_new(sfd, port, conn_listening,
+                                         EV_READ | EV_PERSIST, 1,
+                                         main_base, NULL, NULL))) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "failed to create listening connection\n");
+            exit(EXIT_FAILURE);
+        }
+        listen_conn_add->next = listen_conn;
+        listen_conn = listen_conn_add;
+    } else {
+        dispatch_listen_conn(sfd, port, tid);
+    }
+
+    STATS_LOCK();
+    ++stats.curr_conns;
+    ++stats.daemon_conns;
+    port_instance = get_listening_port_instance(port);
+    cb_assert(port_instance);
+    ++port_instance->curr_conns;
+    STATS_UNLOCK();
+}
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -7060,14 +8820,12 @@ static SOCKET new_socket(struct addrinfo *ai) {
  */
 static int server_socket(struct interface *interf, FILE *portnumber_file) {
     SOCKET sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints;
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
     const char *host = NULL;
 
     memset(&hints, 0, sizeof(hints));
@@ -7108,114 +8866,72 @@ static int server_socket(struct interface *interf, FILE *portnumber_file) {
     }
 
     for (next= ai; next; next= next->ai_next) {
-        struct listening_port *port_instance;
-        conn *listen_conn_add;
-        if ((sfd = new_socket(next)) == INVALID_SOCKET) {
+        struct sockaddr_storage bound_addr;
+        socklen_t bound_len = sizeof(bound_addr);
+        bool reuseport = settings.reuseport;
+        bool fatal;
+
+        if ((sfd = new_server_socket(interf, next, &reuseport,
+                                     &fatal)) == INVALID_SOCKET) {
+            if (fatal) {
+                freeaddrinfo(ai);
+                return 1;
+            }
             /* getaddrinfo can return "junk" addresses,
              * we make sure at least one works before erroring.
              */
             continue;
         }
+        success++;
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(IPV6_V6ONLY): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                continue;
-            }
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_KEEPALIVE): %s",
-                                            strerror(errno));
-        }
-
-        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_LINGER): %s",
-                                            strerror(errno));
+        if (getsockname(sfd, (struct sockaddr*)&bound_addr, &bound_len) != 0) {
+            bound_len = 0;
         }
 
-        if (interf->tcp_nodelay) {
-            error = setsockopt(sfd, IPPROTO_TCP,
-                               TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(TCP_NODELAY): %s",
-                                                strerror(errno));
+        if (portnumber_file != NULL && bound_len != 0 &&
+            (next->ai_addr->sa_family == AF_INET ||
+             next->ai_addr->sa_family == AF_INET6)) {
+            if (next->ai_addr->sa_family == AF_INET) {
+                fprintf(portnumber_file, "%s INET: %u\n", "TCP",
+                        ntohs(((struct sockaddr_in*)&bound_addr)->sin_port));
+            } else {
+                fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
+                        ntohs(((struct sockaddr_in6*)&bound_addr)->sin6_port));
             }
         }
 
-        if (bind(sfd, next->ai_addr, (socklen_t)next->ai_addrlen) == SOCKET_ERROR) {
-#ifdef WIN32
-            DWORD error = WSAGetLastError();
-#else
-            int error = errno;
-#endif
-            if (!is_addrinuse(error)) {
-                log_errcode_error(EXTENSION_LOG_WARNING, NULL,
-                                  "bind(): %s", error);
-                safe_close(sfd);
-                freeaddrinfo(ai);
-                return 1;
+        if (reuseport && bound_len != 0) {
+            /*
+             * Give each worker its own listener for the address. They
+             * must bind to the port we got (it may be ephemeral).
+             */
+            struct addrinfo bound = *next;
+            int ii;
+
+            bound.ai_addr = (struct sockaddr*)&bound_addr;
+            bound.ai_addrlen = bound_len;
+            set_listener_cpu(sfd, 0);
+            add_listen_conn(sfd, interf->port, 0);
+            for (ii = 1; ii < settings.num_threads; ++ii) {
+                if ((sfd = new_server_socket(interf, &bound, &reuseport,
+                                             &fatal)) == INVALID_SOCKET) {
+                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                    "Failed to create SO_REUSEPORT listener for port %u\n",
+                                                    interf->port);
+                    freeaddrinfo(ai);
+                    return 1;
+                }
+                set_listener_cpu(sfd, ii);
+                add_listen_conn(sfd, interf->port, ii);
             }
-            safe_close(sfd);
-            continue;
         } else {
-            success++;
-            if (listen(sfd, interf->backlog) == SOCKET_ERROR) {
+            if (settings.reuseport) {
                 settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "listen(): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                freeaddrinfo(ai);
-                return 1;
-            }
-            if (portnumber_file != NULL &&
-                (next->ai_addr->sa_family == AF_INET ||
-                 next->ai_addr->sa_family == AF_INET6)) {
-                union {
-                    struct sockaddr_in in;
-                    struct sockaddr_in6 in6;
-                } my_sockaddr;
-                socklen_t len = sizeof(my_sockaddr);
-                if (getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len)==0) {
-                    if (next->ai_addr->sa_family == AF_INET) {
-                        fprintf(portnumber_file, "%s INET: %u\n", "TCP",
-                                ntohs(my_sockaddr.in.sin_port));
-                    } else {
-                        fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
-                                ntohs(my_sockaddr.in6.sin6_port));
-                    }
-                }
+                                                "Not using SO_REUSEPORT for port %u\n",
+                                                interf->port);
             }
+            add_listen_conn(sfd, interf->port, -1);
         }
-
-        if (!(listen_conn_add = conn_new(sfd, interf->port, conn_listening,
-                                         EV_READ | EV_PERSIST, 1,
-                                         main_base, NULL))) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "failed to create listening connection\n");
-            exit(EXIT_FAILURE);
-        }
-        listen_conn_add->next = listen_conn;
-        listen_conn = listen_conn_add;
-        STATS_LOCK();
-        ++stats.curr_conns;
-        ++stats.daemon_conns;
-        port_instance = get_listening_port_instance(interf->port);
-        cb_assert(port_instance);
-        ++port_instance->curr_conns;
-        STATS_UNLOCK();
     }
 
     freeaddrinfo(ai);
@@ -7228,6 +8944,15 @@ static int server_sockets(FILE *portnumber_file) {
     int ret = 0;
     int ii = 0;
 
+#ifndef SO_REUSEPORT
+    if (settings.reuseport) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "SO_REUSEPORT isn't supported on this platform; "
+                                        "all clients are accepted by the dispatcher\n");
+        settings.reuseport = false;
+    }
+#endif
+
     for (ii = 0; ii < settings.num_interfaces; ++ii) {
         stats.listening_ports[ii].port = settings.interfaces[ii].port;
         stats.listening_ports[ii].maxconns = settings.interfaces[ii].maxconn;
@@ -7342,7 +9067,7 @@ static ENGINE_ERROR_CODE reserve_cookie(const void *cookie) {
 
 static ENGINE_ERROR_CODE release_cookie(const void *cookie) {
     conn *c = (conn *)cookie;
-    int notify;
+    LIBEVENT_THREAD *notify;
     LIBEVENT_THREAD *thr;
 
     cb_assert(c);
@@ -7355,14 +9080,16 @@ static ENGINE_ERROR_CODE release_cookie(const void *cookie) {
      * state. (NOTE: the release call shall never be called from the
      * worker threads), so should put the connection in the pool of
      * pending IO and have the system retry the operation for the
-     * connection
+     * connection. It is queued before the thread lock is dropped: the
+     * worker may close the connection as soon as it sees the refcount
+     * drop, and must find it on the pending io list when it does.
      */
     notify = add_conn_to_pending_io_list(c);
     UNLOCK_THREAD(thr);
 
     /* kick the thread in the butt */
-    if (notify) {
-        notify_thread(thr);
+    if (notify != NULL) {
+        notify_thread(notify);
     }
 
     return ENGINE_SUCCESS;
@@ -7382,20 +9109,25 @@ static bool cookie_is_admin(const void *cookie) {
 }
 
 static void cookie_set_priority(const void* cookie, CONN_PRIORITY priority) {
-    conn* c = (conn*)cookie;
-    switch (priority) {
-    case CONN_PRIORITY_HIGH:
-        c->max_reqs_per_event = settings.reqs_per_event_high_priority;
-        break;
-    case CONN_PRIORITY_MED:
-        c->max_reqs_per_event = settings.reqs_per_event_med_priority;
-        break;
-    case CONN_PRIORITY_LOW:
-        c->max_reqs_per_event = settings.reqs_per_event_low_priority;
-        break;
-    default:
-        abort();
+    conn_set_priority((conn*)cookie, priority);
+}
+
+static bool cookie_send_item_range(const void *cookie, item *it,
+                                   const void *value, uint32_t nvalue,
+                                   uint64_t cas) {
+    conn *c = (conn*)cookie;
+    protocol_binary_response_header *header = (void*)c->write.buf;
+
+    cb_assert(c->item == NULL);
+    if (add_bin_header(c, 0, 0, 0, nvalue, PROTOCOL_BINARY_RAW_BYTES) == -1 ||
+        add_iov(c, value, nvalue) != 0) {
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        return false;
     }
+    header->response.cas = htonll(cas);
+    /* Released once the response is sent (see process_bin_unknown_packet) */
+    c->item = it;
+    return true;
 }
 
 static void register_callback(ENGINE_HANDLE *eh,
@@ -7657,6 +9389,7 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         server_cookie_api.set_admin = cookie_set_admin;
         server_cookie_api.is_admin = cookie_is_admin;
         server_cookie_api.set_priority = cookie_set_priority;
+        server_cookie_api.send_item_range = cookie_send_item_range;
 
         server_stat_api.new_stats = new_independent_stats;
         server_stat_api.release_stats = release_independent_stats;
@@ -8049,8 +9782,6 @@ int main (int argc, char **argv) {
 
     initialize_openssl();
 
-    initialize_timings();
-
     /* Initialize global variables */
     cb_mutex_initialize(&listen_state.mutex);
     cb_mutex_initialize(&tap_stats.mutex);
@@ -8168,9 +9899,18 @@ int main (int argc, char **argv) {
     }
 #endif
 
+    initialize_timings(settings.num_threads + 1);
+
     /* start up worker threads if MT mode */
     thread_init(settings.num_threads, main_base, dispatch_event_handler);
 
+    if (!ssl_sessions_init() ||
+        !ssl_pool_init(settings.ssl_handshake_threads) ||
+        !aux_pool_init(settings.aux_threads) ||
+        !slow_log_init(settings.num_threads + 1)) {
+        exit(EX_OSERR);
+    }
+
     /* Initialise memcached time keeping */
     mc_time_init(main_base);
 
@@ -8209,6 +9949,9 @@ int main (int argc, char **argv) {
     /* Optional parent monitor */
     setup_parent_monitor();
 
+    /* All of the other threads are started; they keep their own CPUs */
+    thread_bind_dispatcher();
+
     if (!memcached_shutdown) {
         /* enter the event loop */
         event_base_loop(main_base, 0);
@@ -8222,11 +9965,14 @@ int main (int argc, char **argv) {
     /* Close down the audit daemon cleanly */
     shutdown_auditdaemon();
 
+    ssl_pool_shutdown();
+    aux_pool_shutdown();
     threads_shutdown();
 
     settings.engine.v1->destroy(settings.engine.v0, false);
 
     threads_cleanup();
+    slow_log_shutdown();
 
     /* Free the memory used by listening_port structure */
     if (stats.listening_ports) {
@@ -8236,6 +9982,7 @@ int main (int argc, char **argv) {
     event_base_free(main_base);
     release_independent_stats(default_independent_stats);
     destroy_connections();
+    ssl_sessions_shutdown();
 
     if (get_alloc_hooks_type() == none) {
         unload_engine();
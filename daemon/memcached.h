@@ -42,11 +42,50 @@
 /** Initial number of sendmsg() argument structures to allocate. */
 #define MSG_LIST_INITIAL 5
 
+/**
+ * Read buffers come in size classes of DATA_BUFFER_SIZE << (2 * class)
+ * (2k, 8k, 32k and 128k), and each worker thread keeps a pool of empty
+ * buffers of each class to loan to its connections.
+ */
+#define RBUF_CLASSES 4
+#define RBUF_POOL_DEPTH 8
+
+/**
+ * Max # of closed connection objects each worker thread keeps for reuse
+ * by its new connections.
+ */
+#define CONN_POOL_DEPTH 256
+
+/**
+ * Share of the time_slice_usec budget (in %) a connection of the given
+ * priority may use before the next client is served.
+ */
+#define SLICE_WEIGHT_HIGH 200
+#define SLICE_WEIGHT_MED 100
+#define SLICE_WEIGHT_LOW 50
+
 /** High water marks for buffer shrinking */
 #define READ_BUFFER_HIGHWAT 8192
 #define IOV_LIST_HIGHWAT 50
 #define MSG_LIST_HIGHWAT 20
 
+/**
+ * Limits for holding back the responses to pipelined requests so they can
+ * be sent together: the total size of the held back responses, the number
+ * of iovecs they may use, and the size of the per connection buffer the
+ * small parts of them (such as the headers) are copied into.
+ */
+#define COALESCE_MAX_BYTES (64 * 1024)
+#define COALESCE_MAX_IOV 256
+#define COALESCE_BUFFER_SIZE (16 * 1024)
+/** iovecs up to this size are copied instead of referenced */
+#define COALESCE_COPY_MAX 512
+
+/** Can OpenSSL hand the record layer of a socket to the kernel (kTLS)? */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS 1
+#endif
+
 /* Slab sizing definitions. */
 #define POWER_SMALLEST 1
 #define POWER_LARGEST  200
@@ -93,11 +132,27 @@ struct slab_stats {
     uint64_t  cas_badval;
 };
 
+/*
+ * The slab stats are kept in blocks of this many classes, which are only
+ * allocated once a class of the block is used (an engine only uses a few
+ * dozen of the MAX_NUMBER_OF_SLAB_CLASSES classes).
+ */
+#define SLAB_STATS_BLOCK 16
+#define SLAB_STATS_BLOCKS ((MAX_NUMBER_OF_SLAB_CLASSES + SLAB_STATS_BLOCK - 1) / \
+                           SLAB_STATS_BLOCK)
+
 /**
  * Stats stored per-thread.
+ *
+ * Only the worker thread a record belongs to updates it (see stats.h), so
+ * there is no lock; the aggregation reads the counters while the workers
+ * keep counting. A reset is only requested from other threads (by bumping
+ * reset_gen), and carried out by the worker the next time it counts
+ * something.
  */
 struct thread_stats {
-    cb_mutex_t   mutex;
+    volatile uint64_t reset_gen;   /* # of resets requested */
+    volatile uint64_t cleared_gen; /* # of those carried out */
     uint64_t          cmd_get;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -110,6 +165,8 @@ struct thread_stats {
     uint64_t          bytes_written;
     uint64_t          cmd_flush;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
+    /* # of those yields because the connection used up its time budget */
+    uint64_t          conn_time_yields;
     uint64_t          auth_cmds;
     uint64_t          auth_errors;
     /* # of read buffers allocated. */
@@ -119,15 +176,37 @@ struct thread_stats {
     /* # of read buffers which already existed (with partial data) on the connection
        (and hence didn't need to be allocated). */
     uint64_t          rbufs_existing;
+    /* # of times a read buffer was replaced with a bigger one */
+    uint64_t          rbufs_grown;
+    /* # of read calls done on the connections */
+    uint64_t          read_calls;
     /* # of write buffers allocated. */
     uint64_t          wbufs_allocated;
     /* # of write buffers which could be loaned (and hence didn't need to be allocated). */
     uint64_t          wbufs_loaned;
+    /* # of bytes sent with MSG_ZEROCOPY */
+    uint64_t          bytes_zerocopy;
+    /* # of zero-copy sends the kernel ended up copying anyway */
+    uint64_t          zerocopy_copied;
+    /* # of responses held back to be sent with the ones that followed */
+    uint64_t          responses_coalesced;
+    /* # of SSL connections whose sends are encrypted by the kernel */
+    uint64_t          ktls_conns;
+    /* # of SSL handshakes which resumed an earlier session, and the rest */
+    uint64_t          ssl_handshakes_resumed;
+    uint64_t          ssl_handshakes_full;
+    /* Total and longest time from the first step of a handshake run on the
+       pool to the worker getting the established session back */
+    uint64_t          ssl_handshake_usec;
+    uint64_t          ssl_handshake_max_usec;
     /* Highest value iovsize has got to */
     uint64_t          iovused_high_watermark;
     /* High value conn->msgused has got to */
     uint64_t          msgused_high_watermark;
-    struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
+    /* The stats of the slab classes counted so far (see SLAB_STATS_BLOCK) */
+    struct slab_stats *volatile slab_stats[SLAB_STATS_BLOCKS];
+    /* The sum over all of the slab classes (only set in aggregated stats) */
+    struct slab_stats slab_totals;
 };
 
 /**
@@ -160,6 +239,12 @@ struct interface {
     struct {
         const char *key;
         const char *cert;
+        /* Max # of sessions cached for resumption (0 = no cache) */
+        int session_cache;
+        /* # of seconds a session may be resumed for */
+        int session_timeout;
+        /* # of seconds between ticket key changes (0 = no tickets) */
+        int ticket_key_rotation;
     } ssl;
     int maxconn;
     int backlog;
@@ -169,6 +254,22 @@ struct interface {
     bool tcp_nodelay;
 };
 
+/* How the dispatcher picks the worker thread for a new connection */
+enum conn_placement {
+    PLACEMENT_ROUND_ROBIN,
+    PLACEMENT_LEAST_CONNECTIONS, /* fewest active connections */
+    PLACEMENT_LEAST_CPU,         /* least time spent serving recently */
+    PLACEMENT_WEIGHTED,          /* connections, where DCP/TAP count more */
+    PLACEMENT_INCOMING_CPU       /* the worker bound to the CPU the
+                                    connection was received on */
+};
+
+/* How the worker threads receive data from their connections */
+enum io_backend {
+    IO_BACKEND_LIBEVENT, /* readiness notification followed by recv() */
+    IO_BACKEND_IO_URING  /* multishot receive through io_uring (Linux) */
+};
+
 /* pair of shared object name and config for an extension to be loaded. */
 struct extension_settings {
     const char* soname;
@@ -204,6 +305,28 @@ struct settings {
     int verbose;            /* level of versosity to log at. */
     int bio_drain_buffer_sz; /* size of the SSL bio buffers */
     bool datatype;          /* is datatype support enabled? */
+    bool reuseport;         /* per-worker SO_REUSEPORT listeners */
+    enum conn_placement placement; /* worker selection for new clients */
+    int migration_threshold; /* % of time a worker must be busy before
+                                connections are moved away from it (0 =
+                                never move connections) */
+    enum io_backend io_backend; /* how the workers receive data */
+    int zerocopy_threshold; /* send values of at least this many bytes
+                               with MSG_ZEROCOPY (0 = never) */
+    bool ktls;              /* hand SSL connections to kernel TLS */
+    int ssl_handshake_threads; /* # of threads running the SSL handshakes
+                                  (0 = the worker threads run them) */
+    int aux_threads;        /* # of threads running the slow admin commands
+                               (0 = the worker threads run them) */
+    int time_slice_usec;    /* time a client may be served before serving
+                               the next client (0 = only count requests) */
+    int slow_cmd_usec;      /* log the commands taking at least this long
+                               (0 = don't log) */
+    bool slow_cmd_keys;     /* include the keys in the slow command log */
+    int *worker_cpus;       /* CPUs to bind the worker threads to (one */
+    int num_worker_cpus;    /* each, round robin; none = any CPU) */
+    int *dispatcher_cpus;   /* CPUs to bind the dispatcher thread to */
+    int num_dispatcher_cpus;
 
     /* Maximum number of io events to process based on the priority of the
        connection */
@@ -230,6 +353,18 @@ struct settings {
         bool verbose;
         bool bio_drain_buffer_sz;
         bool datatype;
+        bool reuseport;
+        bool placement;
+        bool migration_threshold;
+        bool io_backend;
+        bool zerocopy_threshold;
+        bool ktls;
+        bool ssl_handshake_threads;
+        bool aux_threads;
+        bool time_slice_usec;
+        bool slow_cmd_usec;
+        bool slow_cmd_keys;
+        bool cpu_affinity;
     } has;
     /*************************************************************************
      * These settings are not exposed to the user, and are either derived from
@@ -285,18 +420,66 @@ typedef struct {
     cb_thread_t thread_id;      /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify[2];           /* notification pipes */
+    SOCKET notify[2];           /* notification pipes (or the same eventfd) */
+    volatile int notified;      /* Set while a wakeup is on its way */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
-    cb_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
+    cb_mutex_t mutex;      /* Held while running a connection (see release_cookie) */
     bool is_locked;
-    struct conn *pending_io;    /* List of connection with pending async io ops */
+    /* Connections with pending async io ops, pushed without locking */
+    struct conn *volatile pending_io;
+    /* Connections taken off pending_io, only used by the thread itself */
+    struct conn *pending_local;
+    /* Connections other threads moved to us */
+    struct conn *volatile migrated;
     int index;                  /* index of this thread in the threads array */
     enum thread_type type;      /* Type of IO this thread processes */
 
     rel_time_t last_checked;
 
-    struct net_buf read; /** Shared read buffer for all connections serviced by this thread. */
+    /** Empty read buffers for the connections serviced by this thread. */
+    struct {
+        char *bufs[RBUF_POOL_DEPTH];
+        int count;
+    } rbuf_pool[RBUF_CLASSES];
     struct net_buf write; /** Shared write buffer for all connections serviced by this thread. */
+    /** Empty iov and msghdr lists (of the initial sizes) to loan to the
+        connections serviced by this thread */
+    struct iovec *iov;
+    struct msghdr *msglist;
+    /** Closed connection objects kept for reuse (linked through next) */
+    struct {
+        struct conn *head;
+        volatile int count;
+    } conn_pool;
+
+    struct conn *listen_conns; /** SO_REUSEPORT listeners owned by this thread */
+    struct uring *uring;       /** io_uring used for receiving (or NULL) */
+    bool listen_paused;        /** Are the listeners disabled (out of fds) */
+
+    /*
+     * Load counters used for connection placement. Each of them has a
+     * single writer (the dispatcher for "dispatched", the worker itself
+     * for the rest) so they may be read without locking.
+     */
+    struct {
+        volatile uint64_t dispatched; /** conns handed to us by the dispatcher */
+        volatile uint64_t accepted;   /** conns we accepted ourselves */
+        volatile uint64_t closed;     /** conns closed */
+        volatile uint64_t migrated_in;  /** conns moved to us */
+        volatile uint64_t migrated_out; /** conns moved away from us */
+        volatile int heavy;           /** current # of DCP/TAP conns */
+        volatile hrtime_t busy;       /** total ns spent serving events */
+        volatile rel_time_t window;   /** the second cur_busy belongs to */
+        volatile hrtime_t cur_busy;   /** ns spent serving during window */
+        volatile hrtime_t prev_busy;  /** ns spent the second before */
+        int overloaded;               /** seconds in a row we've been
+                                          overloaded (dispatcher only) */
+    } load;
+    /** Move a connection to this worker at the next request boundary
+     * (-1 if we shouldn't) */
+    volatile int migrate_to;
+    /** The CPU the thread is bound to (-1 if it may run on any) */
+    int cpu;
 
 } LIBEVENT_THREAD;
 
@@ -318,6 +501,54 @@ typedef struct conn conn;
 typedef bool (*STATE_FUNC)(conn *);
 
 
+/* # of bytes of the key kept in the slow command log */
+#define SLOW_LOG_KEY_MAX 64
+
+/* A record of the slow command log (see slow_log.h), times in ns */
+struct slow_cmd {
+    time_t time;        /* when the command completed */
+    int64_t conn;       /* the socket of the connection */
+    uint32_t key_hash;
+    uint16_t keylen;
+    uint16_t vbucket;
+    uint8_t opcode;
+    uint8_t nkey;       /* # of bytes of the key kept (0 without
+                           slow_cmd_keys) */
+    char key[SLOW_LOG_KEY_MAX];
+    hrtime_t total;
+    hrtime_t wait;
+    hrtime_t engine;
+    hrtime_t blocked;
+    hrtime_t transmit;
+};
+
+/*
+ * # of gets a connection with unordered execution may have waiting for
+ * the engine (any request behind those waits for them to complete).
+ * The engine only knows the connection (cookie), not which of them it
+ * notifies about, so every notification runs all of them again; the ones
+ * still blocked are parked again.
+ */
+#define UNORDERED_MAX_PARKED 16
+
+/* A get waiting for the engine while the connection moves on */
+struct parked_get {
+    hrtime_t start;     /* when the get started */
+    uint32_t opaque;
+    uint16_t vbucket;
+    uint16_t nkey;
+    uint8_t opcode;     /* as requested (for the response) */
+    uint8_t cmd;        /* GET or GETK */
+    bool noreply;
+    char key[KEY_MAX_LENGTH];
+};
+
+/* A key of a multi-get (PROTOCOL_BINARY_CMD_MGET) */
+struct mget_key {
+    item *it;           /* the item found (or NULL) */
+    uint16_t status;    /* the status of the lookup */
+};
+
 /**
  * The structure representing a connection into memcached.
  */
@@ -330,6 +561,11 @@ struct conn {
                                 thread timeslice */
     int nevents; /** number of events this connection can process in a single
                      worker thread timeslice */
+    int slice_weight; /** % of time_slice_usec this connection may use in a
+                          worker thread timeslice (set by its priority) */
+    hrtime_t slice_start; /** When the current timeslice started */
+    hrtime_t busy_time; /** Total time spent serving this connection */
+    uint64_t time_yields; /** # of timeslices cut short by the time budget */
     bool admin;
     cbsasl_conn_t *sasl_conn;
     STATE_FUNC   state;
@@ -340,6 +576,9 @@ struct conn {
     short  which;   /** which events were just triggered */
     struct net_buf read; /** Read buffer */
     struct net_buf write; /* Write buffer */
+    /** The amount of data the client typically has us read at once (used
+        to pick the size of the read buffer loaned to it) */
+    uint32_t read_hint;
 
     /** which state to go into after finishing current write */
     STATE_FUNC   write_and_go;
@@ -363,7 +602,9 @@ struct conn {
     /* data for the swallow state */
     uint32_t sbytes;    /* how many bytes to swallow */
 
-    /* data for the mwrite state */
+    /* data for the mwrite state. The lists are allocated (or loaned from
+       the thread) when first used, and given back when the connection goes
+       idle */
     struct iovec *iov;
     int    iovsize;   /* number of elements allocated in iov[] */
     int    iovused;   /* number of elements used in iov[] */
@@ -384,9 +625,15 @@ struct conn {
     char   **temp_alloc_curr;
     int    temp_alloc_left;
 
-    struct sockaddr_storage request_addr; /* Who sent the most recent request */
-    socklen_t request_addr_size;
-    int    hdrsize;   /* number of headers' worth of space is allocated */
+    /* Responses held back to be sent together with the following ones */
+    struct {
+        char *buf;      /* copies of the small parts of the responses */
+        uint32_t used;  /* # of bytes used in buf */
+        uint32_t bytes; /* total size of the responses */
+        int iovused;    /* # of iovecs in the responses */
+        bool pending;   /* are there responses held back? */
+        bool flushing;  /* the responses are being sent */
+    } coalesce;
 
     bool   noreply;   /* True if the reply should not be sent. */
     bool nodelay; /* Is tcp nodelay enabled? */
@@ -395,15 +642,44 @@ struct conn {
 
     uint8_t refcount; /* number of references to the object */
     bool   supports_datatype;
+    bool   unordered; /* the responses may be sent out of order (HELLO) */
 
     struct {
         char *buffer;
         size_t size;
         size_t offset;
     } dynamic_buffer;
+    size_t bulk_stats_size; /* of the previous "stats bulk" */
 
     void *engine_storage;
     hrtime_t start;
+    /* The phases of the current command, for the slow command log (only
+       tracked while it is enabled) */
+    struct {
+        hrtime_t read_at;    /* when data last arrived from the socket */
+        hrtime_t run_at;     /* when the worker started running it (or 0) */
+        hrtime_t blocked_at; /* when the command last would block (or 0) */
+        hrtime_t responded;  /* when its response was ready (0 if there is
+                                no command to log) */
+        bool started;        /* the command is being tracked */
+        bool keyed;          /* its key has been recorded */
+        struct slow_cmd *cmd; /* allocated when the first one is tracked */
+    } slow;
+    /* The gets waiting for the engine with unordered execution */
+    struct {
+        struct parked_get *gets;  /* in the order they were parked */
+        int count;
+        int retry;                /* # of them to run again this round */
+        volatile bool notified;   /* the engine has completed (some of)
+                                     them since the last round */
+    } parked;
+    /* The multi-get being run (kept while the engine blocks) */
+    struct {
+        struct mget_key *keys;
+        uint32_t nkeys;
+        uint32_t next;      /* the next key to look up */
+        uint32_t offset;    /* of the next key in the request body */
+    } mget;
 
     /* Binary protocol stuff */
     /* This is where the binary header goes */
@@ -413,13 +689,22 @@ struct conn {
     int opaque;
     int keylen;
 
-    int list_state; /* bitmask of list state data for this connection */
+    volatile int list_state; /* bitmask of list state data for this connection */
     conn   *next;     /* Used for generating a list of conn structures */
     LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
+    /* The record of the thread in the stats of the connection's bucket
+       (looked up on the first count of each event, see stats.h) */
+    struct thread_stats *thread_stats;
 
     ENGINE_ERROR_CODE aiostat;
     bool ewouldblock;
+    bool aux_done;  /* an aux_pool job has run the command (its status is
+                       in aiostat) */
     TAP_ITERATOR tap_iterator;
+    struct uring_conn *uring; /* io_uring receive state (or NULL) */
+    struct zerocopy_conn *zerocopy; /* MSG_ZEROCOPY send state (or NULL) */
+    struct stream_compress *stream; /* stream compression state (or NULL) */
+    bool stream_start; /* start compressing once the HELLO response is sent */
     in_port_t parent_port; /* Listening port that creates this connection instance */
 
     int dcp;
@@ -441,6 +726,13 @@ struct conn {
         bool connected;
         BIO *application;
         BIO *network;
+        /* OpenSSL does the socket I/O itself (so it may set up kTLS) */
+        bool direct;
+        /* The kernel encrypts what we send (plain sendmsg() will do) */
+        bool ktls_send;
+        /* When the first step of the handshake was queued for the pool
+           (0 if the worker runs the handshake) */
+        hrtime_t handshake_start;
     } ssl;
 
     auth_context_t *auth_context;
@@ -451,6 +743,7 @@ extern conn *listen_conn;
 
 /* States for the connection list_state */
 #define LIST_STATE_PROCESSING 1
+/* Set while the connection is queued on its thread's pending_io */
 #define LIST_STATE_REQ_PENDING_IO 2
 #define LIST_STATE_REQ_PENDING_CLOSE 4
 
@@ -485,6 +778,19 @@ int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size);
+void dispatch_listen_conn(SOCKET sfd, int parent_port, int tid);
+void thread_account_busy(LIBEVENT_THREAD *me, hrtime_t busy);
+bool thread_should_migrate(conn *c);
+void thread_migrate_conn(conn *c);
+void thread_conn_closed(conn *c);
+void conn_set_heavy(conn *c);
+void threads_stats(ADD_STAT add_stats, conn *c);
+int thread_cpu(int tid);
+void thread_bind_dispatcher(void);
+const char *conn_placement_text(enum conn_placement placement);
+void notify_listen_threads(void);
+void resume_thread_listen(LIBEVENT_THREAD *me);
+bool is_listen_disabled(void);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -497,26 +803,27 @@ void STATS_UNLOCK(void);
 void threadlocal_stats_clear(struct thread_stats *stats);
 void threadlocal_stats_reset(struct thread_stats *thread_stats);
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats);
-void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
 
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status);
+/*
+ * Hand a connection blocked on one of our own jobs (aux pool, SSL pool,
+ * ...) back to its worker with the status of the job
+ */
+void notify_job_complete(conn *c, ENGINE_ERROR_CODE status);
 void conn_set_state(conn *c, STATE_FUNC state);
 const char *state_text(STATE_FUNC state);
 void safe_close(SOCKET sfd);
 
 
 /* Number of times this connection is in the given pending list */
-int number_of_pending(conn *c, conn *pending);
 bool has_cycle(conn *c);
 bool list_contains(conn *h, conn *n);
 conn *list_remove(conn *h, conn *n);
-size_t list_to_array(conn **dest, size_t max_items, conn **l);
-void enlist_conn(conn *c, conn **list);
-void finalize_list(conn **list, size_t items);
+void thread_pending_io_remove(conn *c);
 bool set_socket_nonblocking(SOCKET sfd);
 
 /* Aggregate the maximum number of connections */
@@ -524,7 +831,7 @@ void calculate_maxconns(void);
 
 bool load_extension(const char *soname, const char *config);
 
-int add_conn_to_pending_io_list(conn *c);
+LIBEVENT_THREAD *add_conn_to_pending_io_list(conn *c);
 
 extern void drop_privileges(void);
 
@@ -543,6 +850,9 @@ bool conn_closing(conn *c);
 bool conn_destroyed(conn *c);
 bool conn_mwrite(conn *c);
 bool conn_ship_log(conn *c);
+bool conn_migrate(conn *c);
+bool conn_zerocopy_wait(conn *c);
+bool conn_ssl_handshake(conn *c);
 bool conn_setup_tap_stream(conn *c);
 bool conn_refresh_cbsasl(conn *c);
 bool conn_refresh_ssl_certs(conn *c);
@@ -0,0 +1,137 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The slow command log (see slow_log.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "slow_log.h"
+#include "utilities/protocol2text.h"
+
+#include <cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct slow_log_slot {
+    /* Odd while the record is being written */
+    volatile uint64_t seq;
+    struct slow_cmd cmd;
+};
+
+struct slow_log_ring {
+    /* # of records ever written to the ring */
+    volatile uint64_t head;
+    struct slow_log_slot slots[SLOW_LOG_SIZE];
+};
+
+static struct slow_log_ring *rings;
+static int num_rings;
+
+bool slow_log_init(int nthreads) {
+    rings = calloc(nthreads, sizeof(*rings));
+    if (rings == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to allocate memory for the slow command log");
+        return false;
+    }
+    num_rings = nthreads;
+    return true;
+}
+
+void slow_log_shutdown(void) {
+    free(rings);
+    rings = NULL;
+    num_rings = 0;
+}
+
+void slow_log_add(int thread, const struct slow_cmd *cmd) {
+    struct slow_log_ring *ring;
+    struct slow_log_slot *slot;
+    uint64_t seq;
+
+    if (thread < 0 || thread >= num_rings) {
+        return;
+    }
+    ring = &rings[thread];
+    slot = &ring->slots[ring->head % SLOW_LOG_SIZE];
+
+    seq = slot->seq;
+    slot->seq = seq + 1;
+    STATS_BARRIER();
+    slot->cmd = *cmd;
+    STATS_BARRIER();
+    slot->seq = seq + 2;
+    ring->head = ring->head + 1;
+}
+
+/* Copy the slot, returns false if it was being (re)written meanwhile */
+static bool slow_log_read(struct slow_log_slot *slot, struct slow_cmd *cmd) {
+    uint64_t seq = slot->seq;
+
+    if (seq & 1) {
+        return false;
+    }
+    STATS_BARRIER();
+    memcpy(cmd, &slot->cmd, sizeof(*cmd));
+    STATS_BARRIER();
+    return slot->seq == seq;
+}
+
+static void slow_log_add_stat(ADD_STAT add_stats, const void *cookie,
+                              int thread, const struct slow_cmd *cmd) {
+    char key[SLOW_LOG_KEY_MAX + 1];
+    char hash[16];
+    const char *opcode = memcached_opcode_2_text(cmd->opcode);
+    cJSON *obj = cJSON_CreateObject();
+    char *str;
+
+    cJSON_AddNumberToObject(obj, "time", (double)cmd->time);
+    cJSON_AddNumberToObject(obj, "thread", thread);
+    cJSON_AddNumberToObject(obj, "conn", (double)cmd->conn);
+    if (opcode != NULL) {
+        cJSON_AddStringToObject(obj, "opcode", opcode);
+    } else {
+        snprintf(hash, sizeof(hash), "0x%02x", cmd->opcode);
+        cJSON_AddStringToObject(obj, "opcode", hash);
+    }
+    cJSON_AddNumberToObject(obj, "vbucket", cmd->vbucket);
+    snprintf(hash, sizeof(hash), "%08x", cmd->key_hash);
+    cJSON_AddStringToObject(obj, "key_hash", hash);
+    cJSON_AddNumberToObject(obj, "keylen", cmd->keylen);
+    if (cmd->nkey > 0) {
+        memcpy(key, cmd->key, cmd->nkey);
+        key[cmd->nkey] = '\0';
+        cJSON_AddStringToObject(obj, "key", key);
+    }
+    cJSON_AddNumberToObject(obj, "total_usec", (double)(cmd->total / 1000));
+    cJSON_AddNumberToObject(obj, "wait_usec", (double)(cmd->wait / 1000));
+    cJSON_AddNumberToObject(obj, "engine_usec", (double)(cmd->engine / 1000));
+    cJSON_AddNumberToObject(obj, "blocked_usec", (double)(cmd->blocked / 1000));
+    cJSON_AddNumberToObject(obj, "transmit_usec",
+                            (double)(cmd->transmit / 1000));
+
+    str = cJSON_PrintUnformatted(obj);
+    if (str != NULL) {
+        add_stats(" ", 1, str, (uint32_t)strlen(str), cookie);
+        cJSON_Free(str);
+    }
+    cJSON_Delete(obj);
+}
+
+void slow_log_stats(ADD_STAT add_stats, const void *cookie) {
+    int ii;
+
+    for (ii = 0; ii < num_rings; ++ii) {
+        struct slow_log_ring *ring = &rings[ii];
+        uint64_t head = ring->head;
+        uint64_t seq = head > SLOW_LOG_SIZE ? head - SLOW_LOG_SIZE : 0;
+
+        STATS_BARRIER();
+        for (; seq < head; ++seq) {
+            struct slow_cmd cmd;
+            if (slow_log_read(&ring->slots[seq % SLOW_LOG_SIZE], &cmd)) {
+                slow_log_add_stat(add_stats, cookie, ii, &cmd);
+            }
+        }
+    }
+}
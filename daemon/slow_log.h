@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The slow command log.
+ *
+ * With "slow_cmd_usec" set, every command which takes at least that long
+ * (from when its header arrived in the read buffer until its response was
+ * sent) is recorded with the time it spent in each phase:
+ *
+ *  - wait:     in the read buffer, before the worker got to it
+ *  - engine:   being run by the worker (the engine calls)
+ *  - blocked:  waiting for the engine to complete it (EWOULDBLOCK)
+ *  - transmit: from the response being ready until it was sent (or, for
+ *              a response held back to go with the next ones, until the
+ *              next command started)
+ *
+ * Each worker thread keeps the last SLOW_LOG_SIZE records in a ring which
+ * only it writes to. The slots carry a sequence number (odd while being
+ * written) so the readers ("stats slow") copy them without taking a lock,
+ * and skip a slot which was rewritten while they copied it.
+ */
+
+#ifndef SLOW_LOG_H
+#define SLOW_LOG_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* # of records kept per worker thread */
+#define SLOW_LOG_SIZE 256
+
+/* Allocate the rings of the worker threads */
+bool slow_log_init(int nthreads);
+
+void slow_log_shutdown(void);
+
+/* Record a slow command (only called by the worker thread itself) */
+void slow_log_add(int thread, const struct slow_cmd *cmd);
+
+/* Add the records (oldest first per thread) as JSON stats with a blank key */
+void slow_log_stats(ADD_STAT add_stats, const void *cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
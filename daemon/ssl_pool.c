@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Pool of threads for the CPU heavy SSL work (see ssl_pool.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "ssl_pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ssl_job {
+    struct ssl_job *next;
+    conn *c;
+    void (*run)(conn *c);
+};
+
+static struct {
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    bool initialized;
+    bool shutdown;
+    int nthreads;
+    cb_thread_t *tids;
+    /* The jobs waiting for a thread (oldest first) */
+    struct ssl_job *head;
+    struct ssl_job *tail;
+    struct ssl_pool_stats stats;
+} pool;
+
+static void ssl_pool_thread(void *arg) {
+    (void)arg;
+
+    cb_mutex_enter(&pool.mutex);
+    while (!pool.shutdown) {
+        struct ssl_job *job = pool.head;
+        if (job == NULL) {
+            cb_cond_wait(&pool.cond, &pool.mutex);
+            continue;
+        }
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        --pool.stats.queued;
+        cb_mutex_exit(&pool.mutex);
+
+        job->run(job->c);
+        free(job);
+
+        cb_mutex_enter(&pool.mutex);
+    }
+    cb_mutex_exit(&pool.mutex);
+}
+
+bool ssl_pool_init(int nthreads) {
+    int ii;
+
+    cb_mutex_initialize(&pool.mutex);
+    cb_cond_initialize(&pool.cond);
+    pool.initialized = true;
+
+    if (nthreads == 0) {
+        return true;
+    }
+
+    pool.tids = calloc(nthreads, sizeof(cb_thread_t));
+    if (pool.tids == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to allocate memory for the SSL handshake threads");
+        return false;
+    }
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        if (cb_create_thread(&pool.tids[ii], ssl_pool_thread, NULL, 0) != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to create SSL handshake thread: %s", strerror(errno));
+            ssl_pool_shutdown();
+            return false;
+        }
+        pool.nthreads++;
+    }
+
+    return true;
+}
+
+void ssl_pool_shutdown(void) {
+    int ii;
+
+    if (!pool.initialized) {
+        return;
+    }
+
+    cb_mutex_enter(&pool.mutex);
+    pool.shutdown = true;
+    cb_cond_broadcast(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+
+    for (ii = 0; ii < pool.nthreads; ++ii) {
+        cb_join_thread(pool.tids[ii]);
+    }
+    free(pool.tids);
+    pool.tids = NULL;
+    pool.nthreads = 0;
+
+    while (pool.head != NULL) {
+        struct ssl_job *job = pool.head;
+        pool.head = job->next;
+        free(job);
+    }
+    pool.tail = NULL;
+}
+
+bool ssl_pool_enabled(void) {
+    return pool.nthreads > 0;
+}
+
+bool ssl_pool_submit(conn *c, void (*run)(conn *c)) {
+    struct ssl_job *job;
+
+    if (!ssl_pool_enabled() || (job = malloc(sizeof(*job))) == NULL) {
+        return false;
+    }
+    job->next = NULL;
+    job->c = c;
+    job->run = run;
+
+    cb_mutex_enter(&pool.mutex);
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    if (++pool.stats.queued > pool.stats.queued_max) {
+        pool.stats.queued_max = pool.stats.queued;
+    }
+    cb_cond_signal(&pool.cond);
+    cb_mutex_exit(&pool.mutex);
+    return true;
+}
+
+void ssl_pool_get_stats(struct ssl_pool_stats *stats) {
+    if (!pool.initialized) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    cb_mutex_enter(&pool.mutex);
+    *stats = pool.stats;
+    cb_mutex_exit(&pool.mutex);
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Pool of threads for the CPU heavy SSL work.
+ *
+ * With "ssl_handshake_threads" set, the worker threads don't run the SSL
+ * handshakes of new connections themselves. When data arrives for a
+ * connection which isn't through its handshake yet, the worker parks it
+ * in the conn_ssl_handshake state (with its event unregistered) and
+ * queues it for the pool. A pool thread runs the next step of the
+ * handshake (SSL_accept() on what the client has sent so far) and hands
+ * the connection back to its worker through the pending io list, where
+ * it either waits for more data from the client or, once the session is
+ * established, moves on to reading requests. The certificate refresh
+ * (SSL_CERTS_REFRESH) runs on the pool as well.
+ */
+
+#ifndef SSL_POOL_H
+#define SSL_POOL_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ssl_pool_stats {
+    /* # of jobs waiting for a pool thread right now */
+    uint64_t queued;
+    /* The most jobs that have been waiting at the same time */
+    uint64_t queued_max;
+};
+
+/*
+ * Start the pool threads (none if nthreads is 0).
+ * Returns false (and logs why) if they couldn't be started.
+ */
+bool ssl_pool_init(int nthreads);
+
+/* Stop the pool threads; queued jobs are dropped */
+void ssl_pool_shutdown(void);
+
+/* Are there pool threads to submit jobs to? */
+bool ssl_pool_enabled(void);
+
+/*
+ * Run job(c) on a pool thread. The connection must not be touched by its
+ * worker until the job hands it back with notify_job_complete().
+ * Returns false if the job couldn't be queued.
+ */
+bool ssl_pool_submit(conn *c, void (*job)(conn *c));
+
+void ssl_pool_get_stats(struct ssl_pool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,597 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The SSL contexts of the interfaces, with session resumption (see
+ * ssl_sessions.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "ssl_sessions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/* # of locks the session cache of an interface is striped over */
+#define SESSION_STRIPES 16
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSL_CTX_up_ref(ctx) CRYPTO_add(&(ctx)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#define SSL_SESSION_up_ref(s) CRYPTO_add(&(s)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+typedef unsigned char session_id_t;
+#else
+typedef const unsigned char session_id_t;
+#endif
+
+struct session_entry {
+    /* Next entry in the hash bucket */
+    struct session_entry *next;
+    /* Neighbours in the stripe's LRU list */
+    struct session_entry *lru_prev;
+    struct session_entry *lru_next;
+    SSL_SESSION *session;
+    unsigned int idlen;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+};
+
+struct session_stripe {
+    cb_mutex_t mutex;
+    struct session_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t capacity;
+    /* Most recently used first */
+    struct session_entry *lru_head;
+    struct session_entry *lru_tail;
+};
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+};
+
+/* The resumption state of a context (kept in its ex_data) */
+struct session_ctx {
+    int ticket_key_rotation;
+    cb_mutex_t key_mutex;
+    /* The current key, and the previous one if has_previous */
+    struct ticket_key keys[2];
+    bool has_previous;
+    struct session_stripe stripes[SESSION_STRIPES];
+};
+
+static struct {
+    cb_mutex_t mutex;
+    int ex_index;
+    int nctx;
+    /* The context of each interface (NULL until first used) */
+    SSL_CTX **ctx;
+} shared;
+
+static struct session_ctx *get_session_ctx(SSL_CTX *ctx) {
+    return SSL_CTX_get_ex_data(ctx, shared.ex_index);
+}
+
+/* session cache *************************************************************/
+
+static uint32_t hash_session_id(const unsigned char *id, unsigned int len) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261U;
+    unsigned int ii;
+    for (ii = 0; ii < len; ++ii) {
+        hash = (hash ^ id[ii]) * 16777619U;
+    }
+    return hash;
+}
+
+static void lru_unlink(struct session_stripe *stripe,
+                       struct session_entry *entry) {
+    if (entry->lru_prev == NULL) {
+        stripe->lru_head = entry->lru_next;
+    } else {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    if (entry->lru_next == NULL) {
+        stripe->lru_tail = entry->lru_prev;
+    } else {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct session_stripe *stripe,
+                           struct session_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = stripe->lru_head;
+    if (stripe->lru_head == NULL) {
+        stripe->lru_tail = entry;
+    } else {
+        stripe->lru_head->lru_prev = entry;
+    }
+    stripe->lru_head = entry;
+}
+
+static struct session_stripe *find_stripe(struct session_ctx *sctx,
+                                          const unsigned char *id,
+                                          unsigned int len) {
+    return &sctx->stripes[hash_session_id(id, len) % SESSION_STRIPES];
+}
+
+/*
+ * Find the link pointing at the entry for the session id (or at the end of
+ * its bucket). The caller holds the stripe's mutex.
+ */
+static struct session_entry **find_entry(struct session_stripe *stripe,
+                                         const unsigned char *id,
+                                         unsigned int len) {
+    uint32_t hash = hash_session_id(id, len);
+    struct session_entry **link;
+
+    link = &stripe->buckets[(hash / SESSION_STRIPES) % stripe->nbuckets];
+    while (*link != NULL &&
+           ((*link)->idlen != len || memcmp((*link)->id, id, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/* Remove the entry *link points at and release its session */
+static void remove_entry(struct session_stripe *stripe,
+                         struct session_entry **link) {
+    struct session_entry *entry = *link;
+    *link = entry->next;
+    lru_unlink(stripe, entry);
+    --stripe->count;
+    SSL_SESSION_free(entry->session);
+    free(entry);
+}
+
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+    struct session_ctx *sctx = get_session_ctx(SSL_get_SSL_CTX(ssl));
+    struct session_stripe *stripe;
+    struct session_entry *entry;
+    struct session_entry **link;
+    const unsigned char *id;
+    unsigned int len;
+
+#ifdef TLS1_3_VERSION
+    if (SSL_version(ssl) >= TLS1_3_VERSION &&
+        (SSL_get_options(ssl) & SSL_OP_NO_TICKET) == 0) {
+        /* A stateless ticket; it is never looked up in the cache */
+        return 0;
+    }
+#endif
+
+    id = SSL_SESSION_get_id(session, &len);
+    if (sctx == NULL || len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+        (entry = calloc(1, sizeof(*entry))) == NULL) {
+        return 0;
+    }
+    memcpy(entry->id, id, len);
+    entry->idlen = len;
+    /* We keep the reference OpenSSL passed us (we return 1) */
+    entry->session = session;
+
+    stripe = find_stripe(sctx, id, len);
+    cb_mutex_enter(&stripe->mutex);
+    link = find_entry(stripe, id, len);
+    if (*link != NULL) {
+        remove_entry(stripe, link);
+        link = find_entry(stripe, id, len);
+    }
+    *link = entry;
+    lru_push_front(stripe, entry);
+    if (++stripe->count > stripe->capacity) {
+        struct session_entry *oldest = stripe->lru_tail;
+        remove_entry(stripe, find_entry(stripe, oldest->id, oldest->idlen));
+    }
+    cb_mutex_exit(&stripe->mutex);
+
+    return 1;
+}
+
+static SSL_SESSION *get_session_cb(SSL *ssl, session_id_t *id, int len,
+                                   int *copy) {
+    struct session_ctx *sctx = get_session_ctx(SSL_get_SSL_CTX(ssl));
+    struct session_stripe *stripe;
+    struct session_entry **link;
+    SSL_SESSION *session = NULL;
+
+    /* We give OpenSSL a reference of its own below */
+    *copy = 0;
+    if (sctx == NULL || len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return NULL;
+    }
+
+    stripe = find_stripe(sctx, id, (unsigned int)len);
+    cb_mutex_enter(&stripe->mutex);
+    link = find_entry(stripe, id, (unsigned int)len);
+    if (*link != NULL) {
+        SSL_SESSION *s = (*link)->session;
+        if ((time_t)(SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s)) <
+            time(NULL)) {
+            remove_entry(stripe, link);
+        } else {
+            lru_unlink(stripe, *link);
+            lru_push_front(stripe, *link);
+            SSL_SESSION_up_ref(s);
+            session = s;
+        }
+    }
+    cb_mutex_exit(&stripe->mutex);
+
+    return session;
+}
+
+static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session) {
+    struct session_ctx *sctx = get_session_ctx(ctx);
+    struct session_stripe *stripe;
+    struct session_entry **link;
+    const unsigned char *id;
+    unsigned int len;
+
+    id = SSL_SESSION_get_id(session, &len);
+    if (sctx == NULL || len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return;
+    }
+
+    stripe = find_stripe(sctx, id, len);
+    cb_mutex_enter(&stripe->mutex);
+    link = find_entry(stripe, id, len);
+    if (*link != NULL) {
+        remove_entry(stripe, link);
+    }
+    cb_mutex_exit(&stripe->mutex);
+}
+
+/* session tickets ***********************************************************/
+
+static bool new_ticket_key(struct ticket_key *key, time_t now) {
+    key->created = now;
+    return RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1 &&
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1;
+}
+
+/* Replace the keys which are due; the caller holds key_mutex */
+static bool rotate_ticket_keys(struct session_ctx *sctx) {
+    time_t now = time(NULL);
+    time_t age = now - sctx->keys[0].created;
+
+    if (age < sctx->ticket_key_rotation) {
+        return true;
+    }
+
+    if (age < 2 * (time_t)sctx->ticket_key_rotation) {
+        sctx->keys[1] = sctx->keys[0];
+        sctx->has_previous = true;
+    } else {
+        /* Nothing has used the keys for a while; both are past it */
+        sctx->has_previous = false;
+    }
+    return new_ticket_key(&sctx->keys[0], now);
+}
+
+static int init_ticket_hmac(void *hctx, const struct ticket_key *key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *)"SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init(hctx, key->hmac_key, sizeof(key->hmac_key), params);
+#else
+    return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+                        EVP_sha256(), NULL);
+#endif
+}
+
+/*
+ * Set up the encryption of a new ticket with the current key, or the
+ * decryption of a ticket the client sent us (with the key it names).
+ * Returns 2 for the tickets issued with the previous key so that OpenSSL
+ * issues the client a new one.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+    struct session_ctx *sctx = get_session_ctx(SSL_get_SSL_CTX(ssl));
+    struct ticket_key key;
+    int ret = -1;
+
+    if (sctx == NULL) {
+        return -1;
+    }
+
+    cb_mutex_enter(&sctx->key_mutex);
+    if (rotate_ticket_keys(sctx)) {
+        if (enc) {
+            key = sctx->keys[0];
+            ret = 1;
+        } else if (memcmp(name, sctx->keys[0].name, sizeof(key.name)) == 0) {
+            key = sctx->keys[0];
+            ret = 1;
+        } else if (sctx->has_previous &&
+                   memcmp(name, sctx->keys[1].name, sizeof(key.name)) == 0) {
+            key = sctx->keys[1];
+            ret = 2;
+        } else {
+            /* Unknown (or retired) key; do a full handshake */
+            ret = 0;
+        }
+    }
+    cb_mutex_exit(&sctx->key_mutex);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (enc) {
+        memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+            ret = -1;
+        }
+    }
+    if (ret > 0 &&
+        (!EVP_CipherInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv,
+                            enc) ||
+         !init_ticket_hmac(hctx, &key))) {
+        ret = -1;
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    return ret;
+}
+
+/* contexts ******************************************************************/
+
+static void free_session_ctx(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                             int idx, long argl, void *argp) {
+    struct session_ctx *sctx = ptr;
+    int ii;
+
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+    if (sctx == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < SESSION_STRIPES; ++ii) {
+        struct session_stripe *stripe = &sctx->stripes[ii];
+        while (stripe->lru_head != NULL) {
+            struct session_entry *entry = stripe->lru_head;
+            remove_entry(stripe, find_entry(stripe, entry->id, entry->idlen));
+        }
+        free(stripe->buckets);
+        cb_mutex_destroy(&stripe->mutex);
+    }
+    cb_mutex_destroy(&sctx->key_mutex);
+    OPENSSL_cleanse(sctx->keys, sizeof(sctx->keys));
+    free(sctx);
+}
+
+static struct session_ctx *create_session_ctx(const struct interface *iface) {
+    struct session_ctx *sctx = calloc(1, sizeof(*sctx));
+    size_t capacity;
+    int ii;
+
+    if (sctx == NULL) {
+        return NULL;
+    }
+
+    cb_mutex_initialize(&sctx->key_mutex);
+    for (ii = 0; ii < SESSION_STRIPES; ++ii) {
+        cb_mutex_initialize(&sctx->stripes[ii].mutex);
+    }
+
+    capacity = iface->ssl.session_cache / SESSION_STRIPES;
+    if (capacity == 0) {
+        capacity = 1;
+    }
+    for (ii = 0; ii < SESSION_STRIPES; ++ii) {
+        struct session_stripe *stripe = &sctx->stripes[ii];
+        stripe->capacity = capacity;
+        stripe->nbuckets = capacity;
+        stripe->buckets = calloc(capacity, sizeof(*stripe->buckets));
+        if (stripe->buckets == NULL) {
+            free_session_ctx(NULL, sctx, NULL, 0, 0, NULL);
+            return NULL;
+        }
+    }
+
+    sctx->ticket_key_rotation = iface->ssl.ticket_key_rotation;
+    if (sctx->ticket_key_rotation > 0 &&
+        !new_ticket_key(&sctx->keys[0], time(NULL))) {
+        free_session_ctx(NULL, sctx, NULL, 0, 0, NULL);
+        return NULL;
+    }
+
+    return sctx;
+}
+
+static SSL_CTX *create_ctx(const struct interface *iface) {
+    const char *cert = iface->ssl.cert;
+    const char *pkey = iface->ssl.key;
+    struct session_ctx *sctx;
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* MB-12359 - Disable SSLv2 & SSLv3 due to POODLE */
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    /* @todo don't read files, but use in-memory-copies */
+    if (!SSL_CTX_use_certificate_chain_file(ctx, cert) ||
+        !SSL_CTX_use_PrivateKey_file(ctx, pkey, SSL_FILETYPE_PEM) ||
+        !SSL_CTX_check_private_key(ctx)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to load SSL certificate "
+                                        "%s / key %s", cert, pkey);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    sctx = create_session_ctx(iface);
+    if (sctx == NULL || !SSL_CTX_set_ex_data(ctx, shared.ex_index, sctx)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to set up the SSL session cache for interface %s:%hu",
+            iface->host ? iface->host : "*", iface->port);
+        free_session_ctx(NULL, sctx, NULL, 0, 0, NULL);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)&iface->port,
+                                   sizeof(iface->port));
+    if (iface->ssl.session_timeout > 0) {
+        SSL_CTX_set_timeout(ctx, iface->ssl.session_timeout);
+    }
+
+    if (iface->ssl.session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                       SSL_SESS_CACHE_NO_INTERNAL |
+                                       SSL_SESS_CACHE_NO_AUTO_CLEAR);
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+        SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (iface->ssl.ticket_key_rotation > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+
+    return ctx;
+}
+
+bool ssl_sessions_init(void) {
+    cb_mutex_initialize(&shared.mutex);
+    shared.ex_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                               free_session_ctx);
+    shared.nctx = settings.num_interfaces;
+    shared.ctx = calloc(shared.nctx + 1, sizeof(SSL_CTX *));
+    if (shared.ex_index < 0 || shared.ctx == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+            "Failed to set up the SSL contexts of the interfaces");
+        return false;
+    }
+    return true;
+}
+
+void ssl_sessions_shutdown(void) {
+    int ii;
+
+    for (ii = 0; ii < shared.nctx; ++ii) {
+        ssl_sessions_invalidate(ii);
+    }
+    free(shared.ctx);
+    shared.ctx = NULL;
+    shared.nctx = 0;
+}
+
+SSL_CTX *ssl_sessions_get_ctx(int iface) {
+    SSL_CTX *ctx;
+
+    if (iface < 0 || iface >= shared.nctx) {
+        return NULL;
+    }
+
+    cb_mutex_enter(&shared.mutex);
+    if (shared.ctx[iface] == NULL) {
+        shared.ctx[iface] = create_ctx(&settings.interfaces[iface]);
+    }
+    ctx = shared.ctx[iface];
+    if (ctx != NULL) {
+        SSL_CTX_up_ref(ctx);
+    }
+    cb_mutex_exit(&shared.mutex);
+
+    return ctx;
+}
+
+void ssl_sessions_invalidate(int iface) {
+    SSL_CTX *ctx = NULL;
+
+    if (iface < 0 || iface >= shared.nctx) {
+        return;
+    }
+
+    cb_mutex_enter(&shared.mutex);
+    ctx = shared.ctx[iface];
+    shared.ctx[iface] = NULL;
+    cb_mutex_exit(&shared.mutex);
+
+    /* The last connection using it frees it (and its sessions) */
+    SSL_CTX_free(ctx);
+}
+
+bool ssl_sessions_reload(void) {
+    bool ret = true;
+    int ii;
+
+    for (ii = 0; ii < shared.nctx; ++ii) {
+        SSL_CTX *ctx;
+        SSL_CTX *old;
+
+        if (settings.interfaces[ii].ssl.cert == NULL) {
+            continue;
+        }
+
+        /* Load the files without holding the lock */
+        ctx = create_ctx(&settings.interfaces[ii]);
+        if (ctx == NULL) {
+            ret = false;
+            continue;
+        }
+
+        cb_mutex_enter(&shared.mutex);
+        old = shared.ctx[ii];
+        shared.ctx[ii] = ctx;
+        cb_mutex_exit(&shared.mutex);
+        SSL_CTX_free(old);
+    }
+
+    return ret;
+}
+
+uint64_t ssl_sessions_cached(void) {
+    uint64_t count = 0;
+    int ii, jj;
+
+    cb_mutex_enter(&shared.mutex);
+    for (ii = 0; ii < shared.nctx; ++ii) {
+        struct session_ctx *sctx;
+        if (shared.ctx[ii] == NULL ||
+            (sctx = get_session_ctx(shared.ctx[ii])) == NULL) {
+            continue;
+        }
+        for (jj = 0; jj < SESSION_STRIPES; ++jj) {
+            cb_mutex_enter(&sctx->stripes[jj].mutex);
+            count += sctx->stripes[jj].count;
+            cb_mutex_exit(&sctx->stripes[jj].mutex);
+        }
+    }
+    cb_mutex_exit(&shared.mutex);
+
+    return count;
+}
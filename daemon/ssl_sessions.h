@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The SSL contexts of the interfaces, with session resumption.
+ *
+ * All of the connections to an SSL interface share one SSL_CTX (so the
+ * certificate and key are only loaded once, not for every connection),
+ * and with it the server side state needed to resume sessions:
+ *
+ *  - A session cache (interface setting "session_cache", the max number
+ *    of sessions), which is striped over a number of locks so that the
+ *    workers (and the handshake threads) don't serialize on it. It is
+ *    used by the clients which resume with a session id (TLS 1.2) or
+ *    which don't accept tickets.
+ *  - Session ticket keys, which are replaced by a new random key every
+ *    "ticket_key_rotation" seconds. The tickets issued with the previous
+ *    key are still accepted (and replaced by a new one), so a ticket is
+ *    good for between one and two rotation periods. 0 disables tickets.
+ *
+ * A session can be resumed for "session_timeout" seconds. The context of
+ * an interface is rebuilt (and its sessions and ticket keys are dropped)
+ * when its certificate is refreshed or its SSL settings change.
+ */
+
+#ifndef SSL_SESSIONS_H
+#define SSL_SESSIONS_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set up the (empty) contexts for the configured interfaces */
+bool ssl_sessions_init(void);
+
+/* Release the contexts and the sessions cached for them */
+void ssl_sessions_shutdown(void);
+
+/*
+ * Get (a reference to) the context of the interface, creating it if
+ * needed. The caller releases it with SSL_CTX_free(). Returns NULL (and
+ * logs why) if the certificate or key couldn't be loaded.
+ */
+SSL_CTX *ssl_sessions_get_ctx(int iface);
+
+/*
+ * Drop the context of the interface; the next connection gets a new one
+ * (with the current settings). The connections using the old one keep it.
+ */
+void ssl_sessions_invalidate(int iface);
+
+/*
+ * Build new contexts for all of the SSL interfaces from their certificate
+ * and key files. Returns false if any of them couldn't be loaded (those
+ * interfaces keep their current context).
+ */
+bool ssl_sessions_reload(void);
+
+/* # of sessions in the caches of the current contexts */
+uint64_t ssl_sessions_cached(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,22 +12,22 @@ static int num_independent_stats(void) {
     return settings.num_threads + 1;
 }
 
+/* Where the slab stats go if a block can't be allocated */
+static struct slab_stats slab_stats_sink[SLAB_STATS_BLOCK];
+
 void *new_independent_stats(void) {
     int nrecords = num_independent_stats();
-    struct thread_stats *ts = calloc(nrecords, sizeof(struct thread_stats));
-    int ii;
-    for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_initialize(&ts[ii].mutex);
-    }
-    return ts;
+    return calloc(nrecords, sizeof(struct thread_stats));
 }
 
 void release_independent_stats(void *stats) {
     int nrecords = num_independent_stats();
     struct thread_stats *ts = stats;
-    int ii;
+    int ii, jj;
     for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_destroy(&ts[ii].mutex);
+        for (jj = 0; jj < SLAB_STATS_BLOCKS; jj++) {
+            free(ts[ii].slab_stats[jj]);
+        }
     }
     free(ts);
 }
@@ -45,9 +45,26 @@ struct thread_stats* get_independent_stats(conn *c) {
     return independent_stats;
 }
 
-struct thread_stats *get_thread_stats(conn *c) {
+struct thread_stats *lookup_thread_stats(conn *c) {
     struct thread_stats *independent_stats;
     cb_assert(c->thread->index < num_independent_stats());
     independent_stats = get_independent_stats(c);
     return &independent_stats[c->thread->index];
 }
+
+/*
+ * Allocate the block of the class (on the thread owning the record). If
+ * that fails the class isn't counted until a block can be allocated.
+ */
+struct slab_stats *slab_stats_block_new(struct thread_stats *thread_stats,
+                                        int clsid) {
+    struct slab_stats *block = calloc(SLAB_STATS_BLOCK,
+                                      sizeof(struct slab_stats));
+    if (block == NULL) {
+        return slab_stats_sink;
+    }
+    /* The aggregation must not see the block before its zeros */
+    STATS_BARRIER();
+    thread_stats->slab_stats[clsid / SLAB_STATS_BLOCK] = block;
+    return block;
+}
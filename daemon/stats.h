@@ -10,22 +10,70 @@ void *new_independent_stats(void);
 void release_independent_stats(void *stats);
 
 struct thread_stats* get_independent_stats(conn *c);
-struct thread_stats *get_thread_stats(conn *c);
+struct thread_stats *lookup_thread_stats(conn *c);
+void thread_stats_apply_reset(struct thread_stats *thread_stats);
+struct slab_stats *slab_stats_block_new(struct thread_stats *thread_stats,
+                                        int clsid);
+
+/*
+ * The counters have a single writer (the worker thread owning the record)
+ * and are read by the aggregation without a lock. The loads and stores
+ * are volatile so that they are single (untorn, on 64 bit platforms)
+ * accesses which the compiler keeps in order; the few places publishing
+ * more than one counter (a reset, a new slab stats block) use a barrier.
+ */
+#define STATS_LOAD(var) (*(volatile uint64_t *)&(var))
+#define STATS_STORE(var, val) (*(volatile uint64_t *)&(var) = (val))
+#define STATS_BUMP(var, amt) STATS_STORE(var, (var) + (amt))
+
+#ifdef WIN32
+#define STATS_BARRIER() MemoryBarrier()
+#else
+#define STATS_BARRIER() __sync_synchronize()
+#endif
+
+/*
+ * The stats record of the connection's thread (in the stats of its
+ * bucket), with any reset requested since the last count carried out.
+ * Must only be called on the connection's worker thread.
+ */
+static inline struct thread_stats *get_thread_stats(conn *c) {
+    struct thread_stats *thread_stats = c->thread_stats;
+    if (thread_stats == NULL) {
+        thread_stats = c->thread_stats = lookup_thread_stats(c);
+    }
+    if (thread_stats->reset_gen != thread_stats->cleared_gen) {
+        thread_stats_apply_reset(thread_stats);
+    }
+    return thread_stats;
+}
+
+static inline struct slab_stats *get_slab_stats(struct thread_stats *thread_stats,
+                                                int clsid) {
+    struct slab_stats *block = thread_stats->slab_stats[clsid / SLAB_STATS_BLOCK];
+    if (block == NULL) {
+        block = slab_stats_block_new(thread_stats, clsid);
+    }
+    return block + clsid % SLAB_STATS_BLOCK;
+}
 
 /*
  *  Macros for managing statistics inside memcached
  */
 
 /* The item must always be called "it" */
-#define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_stats[info.info.clsid].slab_op++;
+#define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) { \
+    struct slab_stats *slab_stats = \
+        get_slab_stats(thread_stats, info.info.clsid); \
+    STATS_BUMP(slab_stats->slab_op, 1); \
+}
 
 #define THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->thread_op++;
+    STATS_BUMP(thread_stats->thread_op, 1);
 
 #define THREAD_GUTS2(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_op++; \
-    thread_stats->thread_op++;
+    STATS_BUMP(thread_stats->slab_op, 1); \
+    STATS_BUMP(thread_stats->thread_op, 1);
 
 #define SLAB_THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
     SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
@@ -33,9 +81,7 @@ struct thread_stats *get_thread_stats(conn *c);
 
 #define STATS_INCR1(GUTS, conn, slab_op, thread_op, key, nkey) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     GUTS(conn, thread_stats, slab_op, thread_op); \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 #define STATS_INCR(conn, op, key, nkey) \
@@ -59,26 +105,20 @@ struct thread_stats *get_thread_stats(conn *c);
 #define STATS_NOKEY(conn, op) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op++; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op, 1); \
 }
 
 #define STATS_NOKEY2(conn, op1, op2) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op1++; \
-    thread_stats->op2++; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op1, 1); \
+    STATS_BUMP(thread_stats->op2, 1); \
 }
 
 #define STATS_ADD(conn, op, amt) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
-    thread_stats->op += amt; \
-    cb_mutex_exit(&thread_stats->mutex); \
+    STATS_BUMP(thread_stats->op, amt); \
 }
 
 /* Set the statistic to the maximum of the current value, and the specified
@@ -87,9 +127,7 @@ struct thread_stats *get_thread_stats(conn *c);
 #define STATS_MAX(conn, op, value) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
     if (value > thread_stats->op) { \
-        cb_mutex_enter(&thread_stats->mutex); \
-        thread_stats->op = value; \
-        cb_mutex_exit(&thread_stats->mutex); \
+        STATS_STORE(thread_stats->op, value); \
     } \
 }
 
@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Whole-connection stream compression (see stream_compress.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "stream_compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_LZ4FRAME_H) && !defined(WIN32)
+#include <lz4frame.h>
+
+/* Most plain bytes compressed per send (one LZ4 block) */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+/* Size of the frame header written by LZ4F_compressBegin */
+#define STREAM_HEADER_MAX 19
+
+struct stream_compress {
+    LZ4F_compressionContext_t cctx;
+    LZ4F_decompressionContext_t dctx;
+    LZ4F_preferences_t prefs;
+
+    /* Received bytes not yet decompressed */
+    char *in;
+    size_t in_size;
+    size_t in_offset;
+    size_t in_used;
+
+    /* Compressed bytes not yet sent */
+    char *out;
+    size_t out_size;
+    size_t out_offset;
+    size_t out_used;
+
+    /* The last decompress filled the buffer; it may have more for us */
+    bool more;
+    /*
+     * We reported one byte less than we compressed as sent, because the
+     * kernel didn't take all of the compressed bytes. It is reported once
+     * they're sent, so that the response isn't complete before that.
+     */
+    bool owed;
+
+    struct {
+        uint64_t plain_in;
+        uint64_t wire_in;
+        uint64_t plain_out;
+        uint64_t wire_out;
+        hrtime_t compress;
+        hrtime_t decompress;
+    } stats;
+};
+
+bool stream_compress_available(void) {
+    return true;
+}
+
+bool stream_compress_start(conn *c) {
+    struct stream_compress *s = calloc(1, sizeof(*s));
+    size_t n;
+
+    if (s == NULL) {
+        return false;
+    }
+    c->stream = s;
+
+    s->prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    s->prefs.frameInfo.blockMode = LZ4F_blockLinked;
+    s->prefs.autoFlush = 1;
+
+    if (LZ4F_isError(LZ4F_createCompressionContext(&s->cctx, LZ4F_VERSION)) ||
+        LZ4F_isError(LZ4F_createDecompressionContext(&s->dctx, LZ4F_VERSION))) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+            "%d: Failed to create the LZ4 contexts\n", c->sfd);
+        stream_compress_cleanup(c);
+        return false;
+    }
+
+    s->in_size = c->read.bytes > STREAM_CHUNK_SIZE ?
+                 c->read.bytes : STREAM_CHUNK_SIZE;
+    s->out_size = LZ4F_compressBound(STREAM_CHUNK_SIZE, &s->prefs) +
+                  STREAM_HEADER_MAX;
+    s->in = malloc(s->in_size);
+    s->out = malloc(s->out_size);
+    if (s->in == NULL || s->out == NULL) {
+        stream_compress_cleanup(c);
+        return false;
+    }
+
+    n = LZ4F_compressBegin(s->cctx, s->out, s->out_size, &s->prefs);
+    if (LZ4F_isError(n)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+            "%d: Failed to start the LZ4 frame: %s\n", c->sfd,
+            LZ4F_getErrorName(n));
+        stream_compress_cleanup(c);
+        return false;
+    }
+    s->out_used = n;
+
+    /* What the client sent after the HELLO is compressed */
+    memcpy(s->in, c->read.curr, c->read.bytes);
+    s->in_used = c->read.bytes;
+    s->stats.wire_in += c->read.bytes;
+    c->read.curr = c->read.buf;
+    c->read.bytes = 0;
+    return true;
+}
+
+ssize_t stream_compress_recv(conn *c, void *dest, size_t nbytes) {
+    struct stream_compress *s = c->stream;
+    size_t done = 0;
+
+    while (done < nbytes) {
+        size_t dst = nbytes - done;
+        size_t src = s->in_used - s->in_offset;
+        hrtime_t start;
+        size_t n;
+
+        if (src == 0 && !s->more) {
+            ssize_t nr = recv(c->sfd, s->in, s->in_size, 0);
+            if (nr <= 0) {
+                /* The error (or EOF) is seen by the next call */
+                return done > 0 ? (ssize_t)done : nr;
+            }
+            s->in_offset = 0;
+            s->in_used = nr;
+            s->stats.wire_in += nr;
+            src = nr;
+        }
+
+        start = gethrtime();
+        n = LZ4F_decompress(s->dctx, (char*)dest + done, &dst,
+                            s->in + s->in_offset, &src, NULL);
+        s->stats.decompress += gethrtime() - start;
+        if (LZ4F_isError(n)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to decompress the input: %s\n", c->sfd,
+                LZ4F_getErrorName(n));
+            errno = ECONNRESET;
+            return -1;
+        }
+        s->in_offset += src;
+        s->stats.plain_in += dst;
+        done += dst;
+        s->more = done == nbytes;
+    }
+
+    return done;
+}
+
+/* Send the compressed bytes. Returns false (errno set) if some are left */
+static bool stream_flush(conn *c, struct stream_compress *s) {
+    while (s->out_offset < s->out_used) {
+        ssize_t nw = send(c->sfd, s->out + s->out_offset,
+                          s->out_used - s->out_offset, 0);
+        if (nw <= 0) {
+            if (nw == 0) {
+                errno = EWOULDBLOCK;
+            }
+            return false;
+        }
+        s->out_offset += nw;
+        s->stats.wire_out += nw;
+    }
+    s->out_offset = s->out_used = 0;
+    return true;
+}
+
+ssize_t stream_compress_sendmsg(conn *c, struct msghdr *m) {
+    struct stream_compress *s = c->stream;
+    size_t consumed = 0;
+    hrtime_t start;
+    size_t ii;
+
+    if (s->out_offset < s->out_used) {
+        if (!stream_flush(c, s)) {
+            return -1;
+        }
+        if (s->owed) {
+            s->owed = false;
+            return 1;
+        }
+    }
+
+    start = gethrtime();
+    for (ii = 0; ii < (size_t)m->msg_iovlen && consumed < STREAM_CHUNK_SIZE; ++ii) {
+        size_t len = m->msg_iov[ii].iov_len;
+        size_t n;
+
+        if (len > STREAM_CHUNK_SIZE - consumed) {
+            len = STREAM_CHUNK_SIZE - consumed;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (LZ4F_compressBound(len, &s->prefs) > s->out_size - s->out_used) {
+            break;
+        }
+        n = LZ4F_compressUpdate(s->cctx, s->out + s->out_used,
+                                s->out_size - s->out_used,
+                                m->msg_iov[ii].iov_base, len, NULL);
+        if (LZ4F_isError(n)) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to compress the output: %s\n", c->sfd,
+                LZ4F_getErrorName(n));
+            errno = ECONNRESET;
+            return -1;
+        }
+        s->out_used += n;
+        consumed += len;
+    }
+    s->stats.compress += gethrtime() - start;
+    s->stats.plain_out += consumed;
+
+    if (consumed == 0) {
+        return 0;
+    }
+    if (!stream_flush(c, s) && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+    }
+    if (s->out_offset == s->out_used) {
+        return consumed;
+    }
+
+    s->owed = true;
+    if (consumed == 1) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    return consumed - 1;
+}
+
+bool stream_compress_pending(const conn *c) {
+    const struct stream_compress *s = c->stream;
+    return s != NULL && (s->in_offset < s->in_used || s->more);
+}
+
+void stream_compress_stats(const conn *c, cJSON *obj) {
+    const struct stream_compress *s = c->stream;
+    cJSON *stream;
+
+    if (s == NULL) {
+        return;
+    }
+
+    stream = cJSON_CreateObject();
+    cJSON_AddNumberToObject(stream, "plain_in", (double)s->stats.plain_in);
+    cJSON_AddNumberToObject(stream, "wire_in", (double)s->stats.wire_in);
+    cJSON_AddNumberToObject(stream, "plain_out", (double)s->stats.plain_out);
+    cJSON_AddNumberToObject(stream, "wire_out", (double)s->stats.wire_out);
+    if (s->stats.wire_in > 0) {
+        cJSON_AddNumberToObject(stream, "ratio_in",
+                                (double)s->stats.plain_in / s->stats.wire_in);
+    }
+    if (s->stats.wire_out > 0) {
+        cJSON_AddNumberToObject(stream, "ratio_out",
+                                (double)s->stats.plain_out / s->stats.wire_out);
+    }
+    cJSON_AddNumberToObject(stream, "compress_usec",
+                            (double)(s->stats.compress / 1000));
+    cJSON_AddNumberToObject(stream, "decompress_usec",
+                            (double)(s->stats.decompress / 1000));
+    cJSON_AddItemToObject(obj, "stream_compression", stream);
+}
+
+void stream_compress_cleanup(conn *c) {
+    struct stream_compress *s = c->stream;
+
+    if (s == NULL) {
+        return;
+    }
+    if (s->cctx != NULL) {
+        LZ4F_freeCompressionContext(s->cctx);
+    }
+    if (s->dctx != NULL) {
+        LZ4F_freeDecompressionContext(s->dctx);
+    }
+    free(s->in);
+    free(s->out);
+    free(s);
+    c->stream = NULL;
+}
+
+#else
+
+bool stream_compress_available(void) {
+    return false;
+}
+
+bool stream_compress_start(conn *c) {
+    (void)c;
+    return false;
+}
+
+ssize_t stream_compress_recv(conn *c, void *dest, size_t nbytes) {
+    return recv(c->sfd, dest, nbytes, 0);
+}
+
+ssize_t stream_compress_sendmsg(conn *c, struct msghdr *m) {
+    return sendmsg(c->sfd, m, 0);
+}
+
+bool stream_compress_pending(const conn *c) {
+    (void)c;
+    return false;
+}
+
+void stream_compress_stats(const conn *c, cJSON *obj) {
+    (void)c;
+    (void)obj;
+}
+
+void stream_compress_cleanup(conn *c) {
+    (void)c;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Whole-connection stream compression (LZ4 frame).
+ *
+ * A client which negotiates PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION
+ * with HELLO gets the HELLO response as is; from then on everything on
+ * the connection, both ways, is a single LZ4 frame stream. The frame
+ * blocks are flushed for every send so that each response can be
+ * decompressed as soon as it arrives. The client must not send anything
+ * after the HELLO before it has the response (whatever follows the HELLO
+ * in the read buffer is taken to be compressed), and it can't be turned
+ * off again.
+ *
+ * It sits below do_data_recv/do_data_sendmsg, so the rest of the server
+ * deals in plain bytes. Only plain TCP connections (not SSL, where
+ * compressing before encrypting leaks the content, nor io_uring) use it,
+ * and only if the server was built with LZ4.
+ */
+
+#ifndef STREAM_COMPRESS_H
+#define STREAM_COMPRESS_H
+
+#include "config.h"
+#include "memcached.h"
+
+#include <cJSON.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Was the server built with stream compression? */
+bool stream_compress_available(void);
+
+/*
+ * Start compressing the connection (its HELLO response has been sent).
+ * The unread bytes in the read buffer are taken as compressed input.
+ */
+bool stream_compress_start(conn *c);
+
+/* Read (and decompress) up to nbytes. Returns like recv() */
+ssize_t stream_compress_recv(conn *c, void *dest, size_t nbytes);
+
+/*
+ * Compress and send (the start of) the message. Returns like sendmsg();
+ * the caller deals with partial writes. The bytes reported as sent have
+ * all been handed to the kernel.
+ */
+ssize_t stream_compress_sendmsg(conn *c, struct msghdr *m);
+
+/* Is there input to read without waiting for the socket? */
+bool stream_compress_pending(const conn *c);
+
+/* Add the compression stats of the connection to its JSON description */
+void stream_compress_stats(const conn *c, cJSON *obj);
+
+/* Release the compression state of the connection */
+void stream_compress_cleanup(conn *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,8 @@
 #include "config.h"
 #include "memcached.h"
 #include "connections.h"
+#include "mc_time.h"
+#include "uring.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -16,8 +18,26 @@
 #include <fcntl.h>
 #include <platform/platform.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #define ITEMS_PER_ALLOC 64
 
+#ifdef WIN32
+#define ATOMIC_CAS_PTR(ptr, prev, next) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(ptr), (PVOID)(next), \
+                                       (PVOID)(prev)) == (PVOID)(prev))
+#define ATOMIC_CAS_INT(ptr, prev, next) \
+    (InterlockedCompareExchange((LONG volatile*)(ptr), (LONG)(next), \
+                                (LONG)(prev)) == (LONG)(prev))
+#else
+#define ATOMIC_CAS_PTR(ptr, prev, next) \
+            __sync_bool_compare_and_swap(ptr, prev, next)
+#define ATOMIC_CAS_INT(ptr, prev, next) \
+            __sync_bool_compare_and_swap(ptr, prev, next)
+#endif
+
 static char devnull[8192];
 extern volatile sig_atomic_t memcached_shutdown;
 
@@ -32,21 +52,27 @@ struct conn_queue_item {
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread may push items onto the stack without
+ * locking, and the owning worker takes all of them at once (so there is
+ * no ABA problem to worry about).
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    cb_mutex_t lock;
-    cb_cond_t  cond;
+    CQ_ITEM *volatile head; /* most recently pushed item first */
 };
 
 /* Connection lock around accepting new connections */
 cb_mutex_t conn_lock;
 
-/* Free list of CQ_ITEM structs */
+/*
+ * Free list of CQ_ITEM structs. Items are only allocated by the
+ * dispatcher (which owns cqi_freelist), but they are released by the
+ * workers onto cqi_returned, which the dispatcher takes over when its
+ * own list runs dry.
+ */
 static CQ_ITEM *cqi_freelist;
-static cb_mutex_t cqi_freelist_lock;
+static CQ_ITEM *volatile cqi_returned;
 
 static LIBEVENT_THREAD dispatcher_thread;
 
@@ -66,66 +92,67 @@ static cb_mutex_t init_lock;
 static cb_cond_t init_cond;
 
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
+static void clear_pending_io_flag(conn *c);
 
 /*
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    cb_mutex_initialize(&cq->lock);
-    cb_cond_initialize(&cq->cond);
     cq->head = NULL;
-    cq->tail = NULL;
 }
 
 /*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Adds an item to a connection queue (may be called from any thread).
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    cb_mutex_enter(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    cb_mutex_exit(&cq->lock);
-
-    return item;
+static void cq_push(CQ *cq, CQ_ITEM *item) {
+    CQ_ITEM *head;
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!ATOMIC_CAS_PTR(&cq->head, head, item));
 }
 
 /*
- * Adds an item to a connection queue.
+ * Takes all of the items off a connection queue (only to be called by
+ * the owner of the queue).
+ * Returns the items in the order they were pushed, or NULL if the queue
+ * is empty
  */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+static CQ_ITEM *cq_take(CQ *cq) {
+    CQ_ITEM *head;
+    CQ_ITEM *fifo = NULL;
+
+    do {
+        head = cq->head;
+    } while (head != NULL && !ATOMIC_CAS_PTR(&cq->head, head, NULL));
+
+    while (head != NULL) {
+        CQ_ITEM *next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+    }
 
-    cb_mutex_enter(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    cb_cond_signal(&cq->cond);
-    cb_mutex_exit(&cq->lock);
+    return fifo;
 }
 
 /*
- * Returns a fresh connection queue item.
+ * Returns a fresh connection queue item (dispatcher only).
  */
 static CQ_ITEM *cqi_new(void) {
-    CQ_ITEM *item = NULL;
-    cb_mutex_enter(&cqi_freelist_lock);
-    if (cqi_freelist) {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
+    CQ_ITEM *item;
+
+    if (cqi_freelist == NULL) {
+        do {
+            item = cqi_returned;
+        } while (item != NULL && !ATOMIC_CAS_PTR(&cqi_returned, item, NULL));
+        cqi_freelist = item;
     }
-    cb_mutex_exit(&cqi_freelist_lock);
 
-    if (NULL == item) {
+    item = cqi_freelist;
+    if (item != NULL) {
+        cqi_freelist = item->next;
+    } else {
         int i;
 
         /* Allocate a bunch of items at once to reduce fragmentation */
@@ -141,10 +168,8 @@ static CQ_ITEM *cqi_new(void) {
         for (i = 2; i < ITEMS_PER_ALLOC; i++)
             item[i - 1].next = &item[i];
 
-        cb_mutex_enter(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
+        item[ITEMS_PER_ALLOC - 1].next = NULL;
         cqi_freelist = &item[1];
-        cb_mutex_exit(&cqi_freelist_lock);
     }
 
     return item;
@@ -155,12 +180,46 @@ static CQ_ITEM *cqi_new(void) {
  * Frees a connection queue item (adds it to the freelist.)
  */
 static void cqi_free(CQ_ITEM *item) {
-    cb_mutex_enter(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    cb_mutex_exit(&cqi_freelist_lock);
+    CQ_ITEM *head;
+    do {
+        head = cqi_returned;
+        item->next = head;
+    } while (!ATOMIC_CAS_PTR(&cqi_returned, head, item));
+}
+
+/*
+ * Lock-free stack of connections linked through c->next, used for the
+ * connections with completed IO and those moved to us by other workers.
+ */
+static void conn_stack_push(struct conn *volatile *stack, conn *c) {
+    conn *head;
+    do {
+        head = *stack;
+        c->next = head;
+    } while (!ATOMIC_CAS_PTR(stack, head, c));
 }
 
+/*
+ * Take all of the connections off the stack
+ * Returns them in the order they were pushed
+ */
+static conn *conn_stack_take(struct conn *volatile *stack) {
+    conn *head;
+    conn *fifo = NULL;
+
+    do {
+        head = *stack;
+    } while (head != NULL && !ATOMIC_CAS_PTR(stack, head, NULL));
+
+    while (head != NULL) {
+        conn *next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+    }
+
+    return fifo;
+}
 
 /*
  * Creates a worker thread.
@@ -204,6 +263,25 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
     return true;
 }
 
+/*
+ * The workers are woken up through an eventfd where we have one (the
+ * dispatcher counts the bytes written to its pipe, so it keeps using
+ * the socketpair). Both ends of the channel are set to the eventfd.
+ */
+static bool create_worker_notification(LIBEVENT_THREAD *me)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd != -1) {
+        me->notify[0] = me->notify[1] = fd;
+        return true;
+    }
+    log_system_error(EXTENSION_LOG_WARNING, NULL,
+                     "Can't create eventfd, falling back to a pipe: %s");
+#endif
+    return create_notification_pipe(me);
+}
+
 static void setup_dispatcher(struct event_base *main_base,
                              void (*dispatcher_callback)(evutil_socket_t, short, void *))
 {
@@ -231,6 +309,7 @@ static void setup_dispatcher(struct event_base *main_base,
  */
 static void setup_thread(LIBEVENT_THREAD *me) {
     me->type = GENERAL;
+    me->migrate_to = -1;
     me->base = event_base_new();
     if (! me->base) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -250,6 +329,12 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
+    if (settings.io_backend == IO_BACKEND_IO_URING && !uring_thread_init(me)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Falling back to the libevent io backend\n");
+        settings.io_backend = IO_BACKEND_LIBEVENT;
+    }
+
     me->new_conn_queue = malloc(sizeof(struct conn_queue));
     if (me->new_conn_queue == NULL) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -261,15 +346,41 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     cb_mutex_initialize(&me->mutex);
 }
 
+/*
+ * Bind the worker to its CPU from the cpu_affinity.workers list.
+ */
+static void bind_worker(LIBEVENT_THREAD *me) {
+    int cpu;
+
+    me->cpu = -1;
+    if (settings.num_worker_cpus == 0) {
+        return;
+    }
+
+    cpu = settings.worker_cpus[me->index % settings.num_worker_cpus];
+    if (bind_thread_to_cpus(&cpu, 1)) {
+        me->cpu = cpu;
+    } else {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to bind worker thread %d to CPU %d: %s\n",
+                                        me->index, cpu, strerror(errno));
+    }
+}
+
 /*
  * Worker thread: main event loop
  */
 static void worker_libevent(void *arg) {
     LIBEVENT_THREAD *me = arg;
 
-    /* Any per-thread setup can happen here; thread_init() will block until
-     * all threads have finished initializing.
+    /*
+     * Any per-thread setup can happen here; thread_init() will block until
+     * we have finished initializing. Bind to our CPU first, so that what
+     * we allocate (the event base, and later the buffers and connections
+     * of our clients) is placed in the memory local to it.
      */
+    bind_worker(me);
+    setup_thread(me);
 
     cb_mutex_enter(&init_lock);
     init_count++;
@@ -279,19 +390,23 @@ static void worker_libevent(void *arg) {
     event_base_loop(me->base, 0);
 }
 
-int number_of_pending(conn *c, conn *list) {
-    int rv = 0;
-    for (; list; list = list->next) {
-        if (list == c) {
-            rv ++;
+static void drain_notification_channel(LIBEVENT_THREAD *me)
+{
+    evutil_socket_t fd = me->notify[0];
+    int nread;
+
+#ifdef HAVE_SYS_EVENTFD_H
+    if (me->notify[0] == me->notify[1]) {
+        uint64_t count;
+        /* Reading an eventfd resets its counter */
+        if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Can't read from eventfd: %s");
         }
+        return;
     }
-    return rv;
-}
+#endif
 
-static void drain_notification_channel(evutil_socket_t fd)
-{
-    int nread;
     while ((nread = recv(fd, devnull, sizeof(devnull), 0)) == (int)sizeof(devnull)) {
         /* empty */
     }
@@ -303,48 +418,139 @@ static void drain_notification_channel(evutil_socket_t fd)
 }
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Take over a connection another worker moved to us (see
+ * thread_migrate_conn()) and resume serving it at the request boundary
+ * where it left the other thread.
+ */
+static void adopt_conn(LIBEVENT_THREAD *me, conn *c) {
+    cb_assert(c->thread == me);
+    me->load.migrated_in++;
+
+    event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+    event_base_set(me->base, &c->event);
+    if (register_event(c, NULL)) {
+        conn_set_state(c, conn_new_cmd);
+    } else {
+        safe_close(c->sfd);
+        c->sfd = INVALID_SOCKET;
+        conn_set_state(c, conn_immediate_close);
+    }
+
+    /*
+     * From now on it may be queued for us. Whatever the notifications
+     * dropped during the handoff were for is looked at below.
+     */
+    clear_pending_io_flag(c);
+
+    LOCK_THREAD(me);
+    c->nevents = c->max_reqs_per_event;
+    run_event_loop(c);
+    UNLOCK_THREAD(me);
+}
+
+/*
+ * Move the connections pushed onto the shared pending_io stack over to
+ * the list only the worker itself looks at (keeping them in order).
+ */
+static void collect_pending_io(LIBEVENT_THREAD *me) {
+    conn *fifo = conn_stack_take(&me->pending_io);
+    if (fifo != NULL) {
+        conn **tail = &me->pending_local;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        *tail = fifo;
+    }
+}
+
+static void clear_pending_io_flag(conn *c) {
+    int state;
+    do {
+        state = c->list_state;
+    } while (!ATOMIC_CAS_INT(&c->list_state, state,
+                             state & ~LIST_STATE_REQ_PENDING_IO));
+}
+
+/*
+ * Processes the incoming connections and notifications. This is called
+ * when input arrives on the libevent wakeup channel.
  */
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     CQ_ITEM *item;
-    conn* pending;
+    conn *c;
 
     cb_assert(me->type == GENERAL);
-    drain_notification_channel(fd);
+    (void)fd;
+    (void)which;
+    drain_notification_channel(me);
+
+    /*
+     * Anyone queueing work after this point must wake us up again, and
+     * everything queued before it is picked up below.
+     */
+    ATOMIC_CAS_INT(&me->notified, 1, 0);
 
     if (memcached_shutdown) {
          event_base_loopbreak(me->base);
          return ;
     }
 
-    while ((item = cq_pop(me->new_conn_queue)) != NULL) {
-        conn *c = conn_new(item->sfd, item->parent_port, item->init_state,
+    c = conn_stack_take(&me->migrated);
+    while (c != NULL) {
+        conn *next = c->next;
+        c->next = NULL;
+        adopt_conn(me, c);
+        c = next;
+    }
+
+    item = cq_take(me->new_conn_queue);
+    while (item != NULL) {
+        CQ_ITEM *next = item->next;
+
+        c = conn_new(item->sfd, item->parent_port, item->init_state,
                            item->event_flags, item->read_buffer_size,
-                           me->base, NULL);
+                           me->base, NULL, me);
         if (c == NULL) {
-            if (settings.verbose > 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
-                                                "Can't listen for events on fd %d\n",
-                                                item->sfd);
+            if (item->init_state == conn_listening) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to create listening connection for port %d\n",
+                                                item->parent_port);
+            } else {
+                me->load.closed++;
+                if (settings.verbose > 0) {
+                    settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                                    "Can't listen for events on fd %d\n",
+                                                    item->sfd);
+                }
             }
             closesocket(item->sfd);
         } else {
             cb_assert(c->thread == NULL);
             c->thread = me;
+            if (item->init_state == conn_listening) {
+                c->next = me->listen_conns;
+                me->listen_conns = c;
+            } else if (me->uring != NULL && !c->ssl.enabled) {
+                uring_conn_attach(c);
+            }
         }
         cqi_free(item);
+        item = next;
     }
 
+    if (me->listen_paused && !is_listen_disabled()) {
+        resume_thread_listen(me);
+    }
+
+    collect_pending_io(me);
     LOCK_THREAD(me);
-    pending = me->pending_io;
-    me->pending_io = NULL;
-    while (pending != NULL) {
-        conn *c = pending;
+    while ((c = me->pending_local) != NULL) {
         cb_assert(me == c->thread);
-        pending = pending->next;
+        me->pending_local = c->next;
         c->next = NULL;
+        /* From now on the connection may be queued again */
+        clear_pending_io_flag(c);
 
         if (c->sfd != INVALID_SOCKET && !c->registered_in_libevent) {
             /* The socket may have been shut down while we're looping */
@@ -360,6 +566,10 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
         run_event_loop(c);
     }
     UNLOCK_THREAD(me);
+
+    if (me->uring != NULL) {
+        uring_flush(me);
+    }
 }
 
 extern volatile rel_time_t current_time;
@@ -406,75 +616,276 @@ conn* list_remove(conn *haystack, conn *needle) {
     return haystack;
 }
 
-size_t list_to_array(conn **dest, size_t max_items, conn **l) {
-    size_t n_items = 0;
-    for (; *l && n_items < max_items - 1; ++n_items) {
-        dest[n_items] = *l;
-        *l = dest[n_items]->next;
-        dest[n_items]->next = NULL;
-        dest[n_items]->list_state |= LIST_STATE_PROCESSING;
+/*
+ * Remove the connection from the list of connections with pending io
+ * (called by the thread owning the connection).
+ */
+void thread_pending_io_remove(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if ((c->list_state & LIST_STATE_REQ_PENDING_IO) == 0) {
+        return;
     }
-    return n_items;
-}
 
-void enlist_conn(conn *c, conn **list) {
-    LIBEVENT_THREAD *thr = c->thread;
-    cb_assert(list == &thr->pending_io);
-    if ((c->list_state & LIST_STATE_PROCESSING) == 0) {
-        cb_assert(!list_contains(thr->pending_io, c));
-        cb_assert(c->next == NULL);
-        c->next = *list;
-        *list = c;
-        cb_assert(list_contains(*list, c));
-        cb_assert(!has_cycle(*list));
-    } else {
-        c->list_state |= LIST_STATE_REQ_PENDING_IO;
+    /*
+     * The flag is set before the connection is pushed, so if it isn't
+     * there yet the notifier is about to push it. Wait for it to land;
+     * once we're done with the connection it may be freed or reused.
+     */
+    collect_pending_io(me);
+    while (!list_contains(me->pending_local, c)) {
+#ifdef WIN32
+        Sleep(0);
+#else
+        usleep(1);
+#endif
+        collect_pending_io(me);
     }
+    me->pending_local = list_remove(me->pending_local, c);
+    clear_pending_io_flag(c);
 }
 
-void finalize_list(conn **list, size_t items) {
-    size_t i;
-    for (i = 0; i < items; i++) {
-        if (list[i] != NULL) {
-            list[i]->list_state &= ~LIST_STATE_PROCESSING;
-            if (list[i]->sfd != INVALID_SOCKET) {
-                if (list[i]->list_state & LIST_STATE_REQ_PENDING_IO) {
-                    enlist_conn(list[i], &list[i]->thread->pending_io);
-                }
-            }
-            list[i]->list_state = 0;
+/*
+ * Take the connection off the pending IO list and keep the flag set, so
+ * that nobody can queue it (called by the thread owning the connection).
+ */
+static void thread_pending_io_claim(conn *c) {
+    for (;;) {
+        int state;
+
+        thread_pending_io_remove(c);
+        state = c->list_state;
+        if ((state & LIST_STATE_REQ_PENDING_IO) == 0 &&
+            ATOMIC_CAS_INT(&c->list_state, state,
+                           state | LIST_STATE_REQ_PENDING_IO)) {
+            return;
         }
     }
 }
 
+/* Queue the connection for its worker (and wake the worker if needed) */
+static void conn_notify_worker(conn *conn) {
+    LIBEVENT_THREAD *thr = add_conn_to_pending_io_list(conn);
+    if (thr != NULL) {
+        /* kick the thread in the butt */
+        notify_thread(thr);
+    }
+}
+
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
 {
     struct conn *conn = (struct conn *)cookie;
-    LIBEVENT_THREAD *thr;
-    int notify;
 
     cb_assert(conn);
-    thr = conn->thread;
-    cb_assert(thr);
 
     settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
                                     "Got notify from %d, status %x\n",
                                     conn->sfd, status);
 
-    LOCK_THREAD(thr);
-    conn->aiostat = status;
-    notify = add_conn_to_pending_io_list(conn);
-    UNLOCK_THREAD(thr);
-
-    /* kick the thread in the butt */
-    if (notify) {
-        notify_thread(thr);
+    /*
+     * Published to the worker by the atomic push. With unordered
+     * execution we can't tell which get the notification is for: it may
+     * be for one being parked right now, or for one which was run again
+     * (and completed) before its notification arrived. So the status is
+     * dropped, and the blocked command or all of the parked gets are
+     * simply run again to get their own status from the engine.
+     */
+    if (conn->unordered) {
+        conn->parked.notified = true;
+    } else {
+        conn->aiostat = status;
     }
+    conn_notify_worker(conn);
+}
+
+void notify_job_complete(conn *c, ENGINE_ERROR_CODE status)
+{
+    cb_assert(c);
+
+    /* Only the command the connection is blocked on can run a job */
+    c->aiostat = status;
+    conn_notify_worker(c);
 }
 
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
+/* A DCP/TAP connection counts as this many normal ones when weighted */
+#define HEAVY_CONN_WEIGHT 10
+
+static const char *placement_text[] = {
+    "round_robin",
+    "least_connections",
+    "least_cpu",
+    "weighted",
+    "incoming_cpu"
+};
+
+const char *conn_placement_text(enum conn_placement placement) {
+    return placement_text[placement];
+}
+
+static uint64_t thread_active_conns(const LIBEVENT_THREAD *thr) {
+    return thr->load.dispatched + thr->load.accepted + thr->load.migrated_in -
+        thr->load.closed - thr->load.migrated_out;
+}
+
+/*
+ * The time the thread spent serving events the last second or so. The
+ * counters are only rolled over when the thread is busy, so stale
+ * windows are treated as idle.
+ */
+static hrtime_t thread_recent_busy(const LIBEVENT_THREAD *thr) {
+    rel_time_t window = thr->load.window;
+    rel_time_t now = mc_time_get_current_time();
+    if (window == now) {
+        return thr->load.cur_busy + thr->load.prev_busy;
+    } else if (window + 1 == now) {
+        return thr->load.cur_busy;
+    }
+    return 0;
+}
+
+static uint64_t thread_load(const LIBEVENT_THREAD *thr) {
+    switch (settings.placement) {
+    case PLACEMENT_LEAST_CONNECTIONS:
+        return thread_active_conns(thr);
+    case PLACEMENT_LEAST_CPU:
+        return thread_recent_busy(thr);
+    case PLACEMENT_WEIGHTED:
+        return thread_active_conns(thr) +
+            (uint64_t)thr->load.heavy * (HEAVY_CONN_WEIGHT - 1);
+    default:
+        return 0;
+    }
+}
+
+/* Seconds a worker must stay overloaded before we move a connection */
+#define MIGRATE_AFTER 3
+
+static struct event rebalance_event;
+
+/* The time the thread spent serving events the previous second */
+static hrtime_t thread_last_second_busy(const LIBEVENT_THREAD *thr) {
+    rel_time_t window = thr->load.window;
+    rel_time_t now = mc_time_get_current_time();
+    if (window == now) {
+        return thr->load.prev_busy;
+    } else if (window + 1 == now) {
+        return thr->load.cur_busy;
+    }
+    return 0;
+}
+
+/*
+ * Runs in the dispatcher once a second. If the busiest worker has been
+ * busy more than migration_threshold percent of the time for
+ * MIGRATE_AFTER seconds in a row while another worker does less than
+ * half the work, ask it to move one of its connections to the least
+ * busy worker.
+ */
+static void rebalance_threads(evutil_socket_t fd, short which, void *arg) {
+    struct timeval tv = { 1, 0 };
+    hrtime_t hot_busy, cold_busy;
+    int hot = 0;
+    int cold = 0;
+    int ii;
+
+    (void)fd;
+    (void)which;
+    (void)arg;
+
+    if (memcached_shutdown) {
+        return;
+    }
+    evtimer_add(&rebalance_event, &tv);
+
+    if (settings.migration_threshold == 0 || settings.num_threads < 2) {
+        return;
+    }
+
+    hot_busy = cold_busy = thread_last_second_busy(threads);
+    for (ii = 1; ii < settings.num_threads; ++ii) {
+        hrtime_t busy = thread_last_second_busy(threads + ii);
+        if (busy > hot_busy) {
+            hot = ii;
+            hot_busy = busy;
+        }
+        if (busy < cold_busy) {
+            cold = ii;
+            cold_busy = busy;
+        }
+    }
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (ii != hot) {
+            threads[ii].load.overloaded = 0;
+        }
+    }
+
+    if (hot_busy * 100 >= (hrtime_t)settings.migration_threshold * 1000000000 &&
+        cold_busy < hot_busy / 2 && thread_active_conns(threads + hot) > 1) {
+        /* The worker only clears migrate_to, and we only set it if clear */
+        if (++threads[hot].load.overloaded >= MIGRATE_AFTER &&
+            threads[hot].migrate_to == -1) {
+            threads[hot].migrate_to = cold;
+            threads[hot].load.overloaded = 0;
+        }
+    } else {
+        threads[hot].load.overloaded = 0;
+    }
+}
+
+/*
+ * The worker bound to the CPU which received the connection's packets
+ * (and so runs the network stack for it), or -1 if there is none.
+ */
+static int incoming_cpu_thread(SOCKET sfd) {
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    int ii;
+
+    if (getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, (void *)&cpu,
+                   &len) == 0) {
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            if (threads[ii].cpu == cpu) {
+                return ii;
+            }
+        }
+    }
+#else
+    (void)sfd;
+#endif
+    return -1;
+}
+
+/*
+ * Pick the worker to serve a new connection. Ties are broken round
+ * robin so that an idle server still spreads the connections.
+ */
+static int select_thread(SOCKET sfd) {
+    int tid = (last_thread + 1) % settings.num_threads;
+    if (settings.placement == PLACEMENT_INCOMING_CPU) {
+        int local = incoming_cpu_thread(sfd);
+        if (local != -1) {
+            tid = local;
+        }
+    } else if (settings.placement != PLACEMENT_ROUND_ROBIN) {
+        uint64_t min = thread_load(threads + tid);
+        int ii;
+        for (ii = 1; ii < settings.num_threads && min > 0; ++ii) {
+            int candidate = (last_thread + 1 + ii) % settings.num_threads;
+            uint64_t load = thread_load(threads + candidate);
+            if (load < min) {
+                min = load;
+                tid = candidate;
+            }
+        }
+    }
+    return tid;
+}
+
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, or because of an incoming connection.
@@ -483,11 +894,12 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size) {
     CQ_ITEM *item = cqi_new();
-    int tid = (last_thread + 1) % settings.num_threads;
+    int tid = select_thread(sfd);
 
     LIBEVENT_THREAD *thread = threads + tid;
 
     last_thread = tid;
+    thread->load.dispatched++;
 
     item->sfd = sfd;
     item->parent_port = parent_port;
@@ -501,6 +913,169 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
     notify_thread(thread);
 }
 
+/*
+ * Hands a listening socket over to the given worker thread, which will
+ * accept the clients connecting to it itself (SO_REUSEPORT).
+ */
+void dispatch_listen_conn(SOCKET sfd, int parent_port, int tid) {
+    CQ_ITEM *item = cqi_new();
+    LIBEVENT_THREAD *thread = threads + tid;
+
+    cb_assert(tid < settings.num_threads);
+    item->sfd = sfd;
+    item->parent_port = parent_port;
+    item->init_state = conn_listening;
+    item->event_flags = EV_READ | EV_PERSIST;
+    item->read_buffer_size = 1;
+
+    cq_push(thread->new_conn_queue, item);
+    notify_thread(thread);
+}
+
+/*
+ * Wakes up all of the worker threads owning listening sockets so that
+ * they may resume accepting clients.
+ */
+void notify_listen_threads(void) {
+    int ii;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (threads[ii].listen_conns != NULL) {
+            notify_thread(&threads[ii]);
+        }
+    }
+}
+
+/*
+ * Account time spent serving events on the given worker (called by the
+ * worker itself).
+ */
+void thread_account_busy(LIBEVENT_THREAD *me, hrtime_t busy) {
+    rel_time_t now = mc_time_get_current_time();
+    if (me->load.window != now) {
+        me->load.prev_busy = (me->load.window + 1 == now) ?
+            me->load.cur_busy : 0;
+        me->load.cur_busy = 0;
+        me->load.window = now;
+    }
+    me->load.cur_busy += busy;
+    me->load.busy += busy;
+}
+
+/*
+ * Called at a request boundary to check if the worker was asked to move
+ * a connection away, and if this connection may be moved. Connections
+ * the engine holds a reference to (or DCP/TAP streams) stay put.
+ */
+bool thread_should_migrate(conn *c) {
+    int target = c->thread->migrate_to;
+    return target >= 0 && target != c->thread->index &&
+        c->refcount == 1 && !c->ewouldblock && c->parked.count == 0 &&
+        !c->dcp && c->tap_iterator == NULL &&
+        c->uring == NULL; /* the receive is bound to our ring */
+}
+
+/*
+ * Hand the connection over to the worker picked by the rebalancer. This
+ * is called by run_event_loop() once the connection is parked in the
+ * conn_migrate state and any empty buffers it borrowed from us are
+ * returned (a buffer with pipelined data stays with the connection).
+ * The connection must not be touched by us after this.
+ */
+void thread_migrate_conn(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    LIBEVENT_THREAD *to = threads + me->migrate_to;
+
+    me->migrate_to = -1;
+    if (!unregister_event(c)) {
+        /* Keep it; make sure we'll look at the data we may have read */
+        conn_set_state(c, conn_new_cmd);
+        update_event(c, EV_WRITE | EV_PERSIST);
+        return;
+    }
+
+    /*
+     * Hold on to the pending IO flag until the new worker has adopted the
+     * connection. A (spurious; nothing may be waiting for the engine)
+     * notification meanwhile is dropped instead of linking the connection
+     * into a pending stack through c->next, which the migrated stack
+     * uses, or queueing it for a thread which is about to lose it.
+     */
+    thread_pending_io_claim(c);
+    me->load.migrated_out++;
+    c->thread = to;
+
+    conn_stack_push(&to->migrated, c);
+    notify_thread(to);
+}
+
+/*
+ * Called by the worker when a connection it serves is closed.
+ */
+void thread_conn_closed(conn *c) {
+    c->thread->load.closed++;
+    if (c->dcp || c->tap_iterator != NULL) {
+        c->thread->load.heavy--;
+    }
+}
+
+/*
+ * Called before a connection is turned into a DCP or TAP connection.
+ */
+void conn_set_heavy(conn *c) {
+    if (!c->dcp && c->tap_iterator == NULL) {
+        c->thread->load.heavy++;
+    }
+}
+
+void threads_stats(ADD_STAT add_stats, conn *c) {
+    int ii;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        const LIBEVENT_THREAD *thr = threads + ii;
+        char key[64];
+
+        snprintf(key, sizeof(key), "thread_%d_curr_conns", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, thread_active_conns(thr));
+        snprintf(key, sizeof(key), "thread_%d_dcp_tap_conns", ii);
+        append_stat(key, add_stats, c, "%d", thr->load.heavy);
+        snprintf(key, sizeof(key), "thread_%d_busy_usec", ii);
+        append_stat(key, add_stats, c, "%"PRIu64,
+                    (uint64_t)(thr->load.busy / 1000));
+        snprintf(key, sizeof(key), "thread_%d_recent_busy_usec", ii);
+        append_stat(key, add_stats, c, "%"PRIu64,
+                    (uint64_t)(thread_recent_busy(thr) / 1000));
+        snprintf(key, sizeof(key), "thread_%d_migrated_in", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, thr->load.migrated_in);
+        snprintf(key, sizeof(key), "thread_%d_migrated_out", ii);
+        append_stat(key, add_stats, c, "%"PRIu64, thr->load.migrated_out);
+        snprintf(key, sizeof(key), "thread_%d_pooled_conns", ii);
+        append_stat(key, add_stats, c, "%d", thr->conn_pool.count);
+        snprintf(key, sizeof(key), "thread_%d_cpu", ii);
+        append_stat(key, add_stats, c, "%d", thr->cpu);
+    }
+}
+
+/*
+ * The CPU the given worker is bound to (-1 if it may run on any).
+ */
+int thread_cpu(int tid) {
+    return threads[tid].cpu;
+}
+
+/*
+ * Bind the calling (dispatcher) thread to the cpu_affinity.dispatcher
+ * CPUs. This is done once all of the other threads are started, as they
+ * would inherit it.
+ */
+void thread_bind_dispatcher(void) {
+    if (settings.num_dispatcher_cpus > 0 &&
+        !bind_thread_to_cpus(settings.dispatcher_cpus,
+                             settings.num_dispatcher_cpus)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to bind the dispatcher thread: %s\n",
+                                        strerror(errno));
+    }
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -514,7 +1089,13 @@ void notify_dispatcher(void) {
 
 /******************************* GLOBAL STATS ******************************/
 
-void threadlocal_stats_clear(struct thread_stats *stats) {
+/*
+ * Zero the counters of a record (on the thread owning it, see stats.h),
+ * keeping its slab stats blocks.
+ */
+static void threadlocal_stats_zero(struct thread_stats *stats) {
+    int ii;
+
     stats->cmd_get = 0;
     stats->get_misses = 0;
     stats->delete_misses = 0;
@@ -527,93 +1108,139 @@ void threadlocal_stats_clear(struct thread_stats *stats) {
     stats->bytes_read = 0;
     stats->cmd_flush = 0;
     stats->conn_yields = 0;
+    stats->conn_time_yields = 0;
     stats->auth_cmds = 0;
     stats->auth_errors = 0;
     stats->rbufs_allocated = 0;
     stats->rbufs_loaned = 0;
     stats->rbufs_existing = 0;
+    stats->rbufs_grown = 0;
+    stats->read_calls = 0;
     stats->wbufs_allocated = 0;
     stats->wbufs_loaned = 0;
+    stats->bytes_zerocopy = 0;
+    stats->zerocopy_copied = 0;
+    stats->responses_coalesced = 0;
+    stats->ktls_conns = 0;
+    stats->ssl_handshakes_resumed = 0;
+    stats->ssl_handshakes_full = 0;
+    stats->ssl_handshake_usec = 0;
+    stats->ssl_handshake_max_usec = 0;
     stats->iovused_high_watermark = 0;
     stats->msgused_high_watermark = 0;
 
-    memset(stats->slab_stats, 0,
-           sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
+    for (ii = 0; ii < SLAB_STATS_BLOCKS; ii++) {
+        if (stats->slab_stats[ii] != NULL) {
+            memset(stats->slab_stats[ii], 0,
+                   sizeof(struct slab_stats) * SLAB_STATS_BLOCK);
+        }
+    }
+}
+
+/* Carry out the reset requested (on the thread owning the record) */
+void thread_stats_apply_reset(struct thread_stats *stats) {
+    uint64_t gen = stats->reset_gen;
+    threadlocal_stats_zero(stats);
+    /* The aggregation must not see the new generation before the zeros */
+    STATS_BARRIER();
+    stats->cleared_gen = gen;
+}
+
+/* Set up an empty struct to aggregate the records into */
+void threadlocal_stats_clear(struct thread_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
 }
 
+/*
+ * Ask the workers to reset their records. Until they do (the next time
+ * they count something) the records are aggregated as zeros.
+ */
 void threadlocal_stats_reset(struct thread_stats *thread_stats) {
     int ii;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
-        threadlocal_stats_clear(&thread_stats[ii]);
-        cb_mutex_exit(&thread_stats[ii].mutex);
+#ifdef WIN32
+        InterlockedIncrement64((LONG64 volatile *)&thread_stats[ii].reset_gen);
+#else
+        __sync_add_and_fetch(&thread_stats[ii].reset_gen, 1);
+#endif
+    }
+}
+
+static void slab_stats_add(struct slab_stats *out,
+                           const struct slab_stats *block) {
+    int sid;
+    for (sid = 0; sid < SLAB_STATS_BLOCK; sid++) {
+        out->cmd_set += STATS_LOAD(block[sid].cmd_set);
+        out->get_hits += STATS_LOAD(block[sid].get_hits);
+        out->delete_hits += STATS_LOAD(block[sid].delete_hits);
+        out->cas_hits += STATS_LOAD(block[sid].cas_hits);
+        out->cas_badval += STATS_LOAD(block[sid].cas_badval);
     }
 }
 
+/*
+ * Add up the records of the threads, while the workers keep counting (so
+ * the counters of a record may not be from the same instant).
+ */
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
-    int ii, sid;
+    int ii, jj;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
-
-        stats->cmd_get += thread_stats[ii].cmd_get;
-        stats->get_misses += thread_stats[ii].get_misses;
-        stats->delete_misses += thread_stats[ii].delete_misses;
-        stats->decr_misses += thread_stats[ii].decr_misses;
-        stats->incr_misses += thread_stats[ii].incr_misses;
-        stats->decr_hits += thread_stats[ii].decr_hits;
-        stats->incr_hits += thread_stats[ii].incr_hits;
-        stats->cas_misses += thread_stats[ii].cas_misses;
-        stats->bytes_read += thread_stats[ii].bytes_read;
-        stats->bytes_written += thread_stats[ii].bytes_written;
-        stats->cmd_flush += thread_stats[ii].cmd_flush;
-        stats->conn_yields += thread_stats[ii].conn_yields;
-        stats->auth_cmds += thread_stats[ii].auth_cmds;
-        stats->auth_errors += thread_stats[ii].auth_errors;
-        stats->rbufs_allocated += thread_stats[ii].rbufs_allocated;
-        stats->rbufs_loaned += thread_stats[ii].rbufs_loaned;
-        stats->rbufs_existing += thread_stats[ii].rbufs_existing;
-        stats->wbufs_allocated += thread_stats[ii].wbufs_allocated;
-        stats->wbufs_loaned += thread_stats[ii].wbufs_loaned;
-
-        if (thread_stats[ii].iovused_high_watermark > stats->iovused_high_watermark) {
-            stats->iovused_high_watermark = thread_stats[ii].iovused_high_watermark;
+        const struct thread_stats *ts = &thread_stats[ii];
+        uint64_t reset_gen = ts->reset_gen;
+
+        if (reset_gen != ts->cleared_gen) {
+            /* Reset, as far as anyone can tell */
+            continue;
         }
-        if (thread_stats[ii].msgused_high_watermark > stats->msgused_high_watermark) {
-            stats->msgused_high_watermark = thread_stats[ii].msgused_high_watermark;
+        STATS_BARRIER();
+
+        stats->cmd_get += STATS_LOAD(ts->cmd_get);
+        stats->get_misses += STATS_LOAD(ts->get_misses);
+        stats->delete_misses += STATS_LOAD(ts->delete_misses);
+        stats->decr_misses += STATS_LOAD(ts->decr_misses);
+        stats->incr_misses += STATS_LOAD(ts->incr_misses);
+        stats->decr_hits += STATS_LOAD(ts->decr_hits);
+        stats->incr_hits += STATS_LOAD(ts->incr_hits);
+        stats->cas_misses += STATS_LOAD(ts->cas_misses);
+        stats->bytes_read += STATS_LOAD(ts->bytes_read);
+        stats->bytes_written += STATS_LOAD(ts->bytes_written);
+        stats->cmd_flush += STATS_LOAD(ts->cmd_flush);
+        stats->conn_yields += STATS_LOAD(ts->conn_yields);
+        stats->conn_time_yields += STATS_LOAD(ts->conn_time_yields);
+        stats->auth_cmds += STATS_LOAD(ts->auth_cmds);
+        stats->auth_errors += STATS_LOAD(ts->auth_errors);
+        stats->rbufs_allocated += STATS_LOAD(ts->rbufs_allocated);
+        stats->rbufs_loaned += STATS_LOAD(ts->rbufs_loaned);
+        stats->rbufs_existing += STATS_LOAD(ts->rbufs_existing);
+        stats->rbufs_grown += STATS_LOAD(ts->rbufs_grown);
+        stats->read_calls += STATS_LOAD(ts->read_calls);
+        stats->wbufs_allocated += STATS_LOAD(ts->wbufs_allocated);
+        stats->wbufs_loaned += STATS_LOAD(ts->wbufs_loaned);
+        stats->bytes_zerocopy += STATS_LOAD(ts->bytes_zerocopy);
+        stats->zerocopy_copied += STATS_LOAD(ts->zerocopy_copied);
+        stats->responses_coalesced += STATS_LOAD(ts->responses_coalesced);
+        stats->ktls_conns += STATS_LOAD(ts->ktls_conns);
+        stats->ssl_handshakes_resumed += STATS_LOAD(ts->ssl_handshakes_resumed);
+        stats->ssl_handshakes_full += STATS_LOAD(ts->ssl_handshakes_full);
+        stats->ssl_handshake_usec += STATS_LOAD(ts->ssl_handshake_usec);
+        if (STATS_LOAD(ts->ssl_handshake_max_usec) > stats->ssl_handshake_max_usec) {
+            stats->ssl_handshake_max_usec = STATS_LOAD(ts->ssl_handshake_max_usec);
         }
 
-        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            stats->slab_stats[sid].cmd_set +=
-                thread_stats[ii].slab_stats[sid].cmd_set;
-            stats->slab_stats[sid].get_hits +=
-                thread_stats[ii].slab_stats[sid].get_hits;
-            stats->slab_stats[sid].delete_hits +=
-                thread_stats[ii].slab_stats[sid].delete_hits;
-            stats->slab_stats[sid].cas_hits +=
-                thread_stats[ii].slab_stats[sid].cas_hits;
-            stats->slab_stats[sid].cas_badval +=
-                thread_stats[ii].slab_stats[sid].cas_badval;
+        if (STATS_LOAD(ts->iovused_high_watermark) > stats->iovused_high_watermark) {
+            stats->iovused_high_watermark = STATS_LOAD(ts->iovused_high_watermark);
+        }
+        if (STATS_LOAD(ts->msgused_high_watermark) > stats->msgused_high_watermark) {
+            stats->msgused_high_watermark = STATS_LOAD(ts->msgused_high_watermark);
         }
 
-        cb_mutex_exit(&thread_stats[ii].mutex);
-    }
-}
-
-void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
-    int sid;
-
-    out->cmd_set = 0;
-    out->get_hits = 0;
-    out->delete_hits = 0;
-    out->cas_hits = 0;
-    out->cas_badval = 0;
-
-    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-        out->cmd_set += stats->slab_stats[sid].cmd_set;
-        out->get_hits += stats->slab_stats[sid].get_hits;
-        out->delete_hits += stats->slab_stats[sid].delete_hits;
-        out->cas_hits += stats->slab_stats[sid].cas_hits;
-        out->cas_badval += stats->slab_stats[sid].cas_badval;
+        for (jj = 0; jj < SLAB_STATS_BLOCKS; jj++) {
+            const struct slab_stats *block = ts->slab_stats[jj];
+            if (block != NULL) {
+                STATS_BARRIER();
+                slab_stats_add(&stats->slab_totals, block);
+            }
+        }
     }
 }
 
@@ -629,9 +1256,9 @@ void thread_init(int nthr, struct event_base *main_base,
     nthreads = nthr + 1;
 
     cqi_freelist = NULL;
+    cqi_returned = NULL;
 
     cb_mutex_initialize(&conn_lock);
-    cb_mutex_initialize(&cqi_freelist_lock);
     cb_mutex_initialize(&init_lock);
     cb_cond_initialize(&init_cond);
 
@@ -652,27 +1279,29 @@ void thread_init(int nthr, struct event_base *main_base,
 
     setup_dispatcher(main_base, dispatcher_callback);
 
+    /*
+     * The threads set themselves up (see worker_libevent); one at a time,
+     * as they may fall back to another io backend.
+     */
     for (i = 0; i < nthreads; i++) {
-        if (!create_notification_pipe(&threads[i])) {
+        if (!create_worker_notification(&threads[i])) {
             exit(1);
         }
         threads[i].index = i;
 
-        setup_thread(&threads[i]);
-    }
-
-    /* Create threads after we've done all the libevent setup. */
-    for (i = 0; i < nthreads; i++) {
         create_worker(worker_libevent, &threads[i], &thread_ids[i]);
         threads[i].thread_id = thread_ids[i];
-    }
 
-    /* Wait for all the threads to set themselves up before returning. */
-    cb_mutex_enter(&init_lock);
-    while (init_count < nthreads) {
-        cb_cond_wait(&init_cond, &init_lock);
+        cb_mutex_enter(&init_lock);
+        while (init_count <= i) {
+            cb_cond_wait(&init_cond, &init_lock);
+        }
+        cb_mutex_exit(&init_lock);
     }
-    cb_mutex_exit(&init_lock);
+
+    evtimer_set(&rebalance_event, rebalance_threads, NULL);
+    event_base_set(main_base, &rebalance_event);
+    rebalance_threads(0, 0, NULL);
 }
 
 void threads_shutdown(void)
@@ -691,14 +1320,20 @@ void threads_cleanup(void)
         CQ_ITEM *it;
 
         safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        if (threads[ii].notify[1] != threads[ii].notify[0]) {
+            safe_close(threads[ii].notify[1]);
+        }
+        uring_thread_cleanup(&threads[ii]);
         event_base_free(threads[ii].base);
 
-        while ((it = cq_pop(threads[ii].new_conn_queue)) != NULL) {
+        it = cq_take(threads[ii].new_conn_queue);
+        while (it != NULL) {
+            CQ_ITEM *next = it->next;
             cqi_free(it);
+            it = next;
         }
         free(threads[ii].new_conn_queue);
-        free(threads[ii].read.buf);
+        conn_pools_cleanup(&threads[ii]);
         free(threads[ii].write.buf);
     }
 
@@ -707,20 +1342,52 @@ void threads_cleanup(void)
 }
 
 void notify_thread(LIBEVENT_THREAD *thread) {
+    /*
+     * Workers only need a single wakeup until they get around to look at
+     * their queues (the dispatcher counts the bytes, so always send).
+     */
+    if (thread->type == GENERAL &&
+        !ATOMIC_CAS_INT(&thread->notified, 0, 1)) {
+        return;
+    }
+
+#ifdef HAVE_SYS_EVENTFD_H
+    if (thread->notify[0] == thread->notify[1]) {
+        uint64_t one = 1;
+        if (write(thread->notify[1], &one, sizeof(one)) != sizeof(one)) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to notify thread: %s");
+        }
+        return;
+    }
+#endif
+
     if (send(thread->notify[1], "", 1, 0) != 1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Failed to notify thread: %s");
     }
 }
 
-int add_conn_to_pending_io_list(conn *c) {
-    int notify = 0;
-    if (number_of_pending(c, c->thread->pending_io) == 0) {
-        if (c->thread->pending_io == NULL) {
-            notify = 1;
+/*
+ * Queue the connection for the thread serving it to look at (may be
+ * called from any thread, without locking).
+ * Returns the thread it was queued for (which should be notified), or
+ * NULL if it was already waiting (or being moved to another thread)
+ */
+LIBEVENT_THREAD *add_conn_to_pending_io_list(conn *c) {
+    LIBEVENT_THREAD *thr;
+    int state;
+    do {
+        state = c->list_state;
+        if (state & LIST_STATE_REQ_PENDING_IO) {
+            return NULL;
         }
-        enlist_conn(c, &c->thread->pending_io);
-    }
-
-    return notify;
+    } while (!ATOMIC_CAS_INT(&c->list_state, state,
+                             state | LIST_STATE_REQ_PENDING_IO));
+
+    /* With the flag ours the connection can't be moved (see
+     * thread_migrate_conn) */
+    thr = c->thread;
+    conn_stack_push(&thr->pending_io, c);
+    return thr;
 }
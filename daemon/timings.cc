@@ -1,10 +1,34 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Command timings (see timings.h).
+ *
+ * Every worker thread records the time of the commands it runs in its own
+ * histograms (one per opcode, allocated the first time the thread runs the
+ * opcode), so the workers never write to the same cache lines. A histogram
+ * is only ever written by the thread owning it; the counters are updated
+ * with relaxed loads and stores rather than atomic increments. The readers
+ * merge the histograms of all of the threads.
+ *
+ * The histograms are log-linear (like HdrHistogram): the times below
+ * SUB_BUCKETS ns have a bucket each, and every power of two above that is
+ * split into SUB_BUCKETS / 2 buckets of equal width, so a bucket is never
+ * wider than 1/128th (< 1%) of the times it holds. Times of 2^MAX_MAGNITUDE
+ * ns (~68 seconds) or more are counted in the last bucket.
+ *
+ * A reset (requested by any thread) bumps the reset generation of the
+ * opcode. The owner of a histogram zeroes it the next time it records a
+ * time for the opcode, and until then the readers ignore it.
+ */
 #include "config.h"
 #include "timings.h"
 #include <memcached/protocol_binary.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <new>
 #include <sstream>
+#include <vector>
 
 #ifdef HAVE_ATOMIC
 #include <atomic>
@@ -12,86 +36,261 @@
 #include <cstdatomic>
 #endif
 
+#define SUB_BUCKET_BITS 8
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_MAGNITUDE 36
+#define NUM_BUCKETS ((MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * (SUB_BUCKETS / 2))
 
+typedef struct histogram_st {
+    /* The reset generation of the opcode the histogram was last zeroed for */
+    std::atomic<uint64_t> cleared_gen;
 
-typedef struct timings_st {
-    /* We collect timings for <=1 us */
-    std::atomic<uint32_t> ns;
+    /* # of commands since the histogram was started (not zeroed by reset) */
+    std::atomic<uint64_t> total;
 
-    /* We collect timings per 10usec */
-    std::atomic<uint32_t> usec[100];
+    /* The total time (ns) of the commands since the last reset */
+    std::atomic<uint64_t> sum;
 
-    /* we collect timings from 0-49 ms (entry 0 is never used!) */
-    std::atomic<uint32_t> msec[50];
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+} histogram_t;
 
-    std::atomic<uint32_t> halfsec[10];
+typedef struct thread_timings_st {
+    std::atomic<histogram_t *> histograms[0x100];
+} thread_timings_t;
 
-    std::atomic<uint32_t> wayout;
+/* A (merged) copy of the histograms of an opcode */
+typedef struct {
+    uint64_t sum;
+    std::vector<uint64_t> buckets;
+} snapshot_t;
 
-    std::atomic<uint64_t> total;
-} timings_t;
+static thread_timings_t *thread_timings;
+static int num_threads;
+static std::atomic<uint64_t> reset_gen[0x100];
 
-timings_t timings[0x100];
+/* Where the last interval of each opcode ended (empty: at the last reset) */
+static cb_mutex_t interval_mutex;
+static snapshot_t intervals[0x100];
+
+static inline void relaxed_add(std::atomic<uint64_t> &counter, uint64_t val)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + val,
+                  std::memory_order_relaxed);
+}
+
+static int bucket_index(uint64_t nsec)
+{
+    int magnitude = SUB_BUCKET_BITS - 1;
+    int shift;
+
+    if (nsec < SUB_BUCKETS) {
+        return (int)nsec;
+    }
+    if (nsec >> MAX_MAGNITUDE) {
+        nsec = (((uint64_t)1) << MAX_MAGNITUDE) - 1;
+    }
+    while (nsec >> (magnitude + 1)) {
+        ++magnitude;
+    }
+    shift = magnitude - (SUB_BUCKET_BITS - 1);
+
+    return shift * (SUB_BUCKETS / 2) + (int)(nsec >> shift);
+}
 
-void collect_timing(uint8_t cmd, hrtime_t nsec)
+/* The lowest and highest time counted in the bucket */
+static void bucket_range(int idx, uint64_t *low, uint64_t *high)
 {
-    timings_t *t = &timings[cmd];
-    hrtime_t usec = nsec / 1000;
-    hrtime_t msec = usec / 1000;
-    hrtime_t hsec = msec / 500;
-
-    if (usec == 0) {
-        t->ns++;
-    } else if (usec < 1000) {
-        t->usec[usec / 10]++;
-    } else if (msec < 50) {
-        t->msec[msec]++;
-    } else if (hsec < 10) {
-        t->halfsec[hsec]++;
+    if (idx < SUB_BUCKETS) {
+        *low = *high = idx;
     } else {
-        t->wayout++;
+        int shift = idx / (SUB_BUCKETS / 2) - 1;
+        uint64_t sub = idx % (SUB_BUCKETS / 2) + (SUB_BUCKETS / 2);
+        *low = sub << shift;
+        *high = ((sub + 1) << shift) - 1;
+    }
+}
+
+static void histogram_zero(histogram_t *h)
+{
+    h->sum.store(0, std::memory_order_relaxed);
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii) {
+        h->buckets[ii].store(0, std::memory_order_relaxed);
+    }
+}
+
+void collect_timing(int thread, uint8_t cmd, hrtime_t nsec)
+{
+    histogram_t *h;
+    uint64_t gen;
+
+    if (thread < 0 || thread >= num_threads) {
+        return;
+    }
+
+    gen = reset_gen[cmd].load(std::memory_order_acquire);
+    h = thread_timings[thread].histograms[cmd].load(std::memory_order_relaxed);
+    if (h == NULL) {
+        h = new (std::nothrow) histogram_t;
+        if (h == NULL) {
+            return;
+        }
+        histogram_zero(h);
+        h->total.store(0, std::memory_order_relaxed);
+        h->cleared_gen.store(gen, std::memory_order_relaxed);
+        thread_timings[thread].histograms[cmd].store(h, std::memory_order_release);
+    } else if (h->cleared_gen.load(std::memory_order_relaxed) != gen) {
+        histogram_zero(h);
+        h->cleared_gen.store(gen, std::memory_order_release);
+    }
+
+    relaxed_add(h->buckets[bucket_index(nsec)], 1);
+    relaxed_add(h->sum, nsec);
+    relaxed_add(h->total, 1);
+}
+
+void initialize_timings(int nthreads)
+{
+    cb_mutex_initialize(&interval_mutex);
+    for (int ii = 0; ii < 0x100; ++ii) {
+        reset_gen[ii].store(0);
     }
 
-    t->total++;
+    thread_timings = new thread_timings_t[nthreads];
+    for (int ii = 0; ii < nthreads; ++ii) {
+        for (int jj = 0; jj < 0x100; ++jj) {
+            thread_timings[ii].histograms[jj].store(NULL);
+        }
+    }
+    num_threads = nthreads;
 }
 
-void initialize_timings(void)
+/* Merge the histograms of all of the threads for the opcode */
+static void merge_histograms(uint8_t opcode, snapshot_t *snap)
 {
-    int ii, jj;
-    for (ii = 0; ii < 0x100; ++ii) {
-        timings[ii].ns.store(0);
-        for (jj = 0; jj < 100; ++jj) {
-            timings[ii].usec[jj].store(0);
+    snap->sum = 0;
+    snap->buckets.assign(NUM_BUCKETS, 0);
+
+    for (int ii = 0; ii < num_threads; ++ii) {
+        histogram_t *h;
+        h = thread_timings[ii].histograms[opcode].load(std::memory_order_acquire);
+        if (h == NULL ||
+            h->cleared_gen.load(std::memory_order_acquire) !=
+            reset_gen[opcode].load(std::memory_order_acquire)) {
+            continue;
         }
-        for (jj = 0; jj < 50; ++jj) {
-            timings[ii].msec[jj].store(0);
+
+        snap->sum += h->sum.load(std::memory_order_relaxed);
+        for (int jj = 0; jj < NUM_BUCKETS; ++jj) {
+            snap->buckets[jj] += h->buckets[jj].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * The time (the highest one of its bucket) within which the given percent
+ * of the commands completed
+ */
+static uint64_t percentile(const snapshot_t &snap, uint64_t count,
+                           double percent)
+{
+    uint64_t target = (uint64_t)ceil(percent * count / 100.0);
+    uint64_t seen = 0;
+    uint64_t low, high = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii) {
+        if (snap.buckets[ii] == 0) {
+            continue;
         }
-        for (jj = 0; jj < 10; ++jj) {
-            timings[ii].halfsec[jj].store(0);
+        bucket_range(ii, &low, &high);
+        seen += snap.buckets[ii];
+        if (seen >= target) {
+            break;
         }
-        timings[ii].wayout.store(0);
-        timings[ii].total.store(0);
     }
+
+    return high;
 }
 
-void generate_timings(uint8_t opcode, const void *cookie)
+void generate_timings(uint8_t opcode, timings_mode_t mode, const void *cookie)
 {
     std::stringstream ss;
-    timings_t *t = &timings[opcode];
+    snapshot_t snap;
+    uint64_t ns = 0, usec[100], msec[50], halfsec[10], wayout = 0;
+    uint64_t count = 0;
+
+    merge_histograms(opcode, &snap);
+
+    if (mode == TIMINGS_INTERVAL) {
+        snapshot_t now = snap;
+        cb_mutex_enter(&interval_mutex);
+        snapshot_t &last = intervals[opcode];
+        if (!last.buckets.empty()) {
+            snap.sum -= std::min(snap.sum, last.sum);
+            for (int ii = 0; ii < NUM_BUCKETS; ++ii) {
+                snap.buckets[ii] -= std::min(snap.buckets[ii], last.buckets[ii]);
+            }
+        }
+        last = now;
+        cb_mutex_exit(&interval_mutex);
+    } else if (mode == TIMINGS_RESET) {
+        reset_gen[opcode].fetch_add(1);
+        cb_mutex_enter(&interval_mutex);
+        intervals[opcode].sum = 0;
+        intervals[opcode].buckets.clear();
+        cb_mutex_exit(&interval_mutex);
+    }
 
-    ss << "{\"ns\":" << t->ns.load() << ",\"us\":[";
+    /* The coarse layout the older clients read */
+    memset(usec, 0, sizeof(usec));
+    memset(msec, 0, sizeof(msec));
+    memset(halfsec, 0, sizeof(halfsec));
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii) {
+        uint64_t low, high, us, ms;
+        if (snap.buckets[ii] == 0) {
+            continue;
+        }
+        count += snap.buckets[ii];
+        bucket_range(ii, &low, &high);
+        us = (low + (high - low) / 2) / 1000;
+        ms = us / 1000;
+        if (us == 0) {
+            ns += snap.buckets[ii];
+        } else if (us < 1000) {
+            usec[us / 10] += snap.buckets[ii];
+        } else if (ms < 50) {
+            msec[ms] += snap.buckets[ii];
+        } else if (ms / 500 < 10) {
+            halfsec[ms / 500] += snap.buckets[ii];
+        } else {
+            wayout += snap.buckets[ii];
+        }
+    }
+
+    ss << "{\"ns\":" << ns << ",\"us\":[";
     for (int ii = 0; ii < 99; ++ii) {
-        ss << t->usec[ii].load() << ",";
+        ss << usec[ii] << ",";
     }
-    ss << t->usec[99].load() << "],\"ms\":[";
+    ss << usec[99] << "],\"ms\":[";
     for (int ii = 1; ii < 49; ++ii) {
-        ss << t->msec[ii].load() << ",";
+        ss << msec[ii] << ",";
     }
-    ss << t->msec[49].load() << "],\"500ms\":[";
+    ss << msec[49] << "],\"500ms\":[";
     for (int ii = 0; ii < 9; ++ii) {
-        ss << t->halfsec[ii].load() << ",";
+        ss << halfsec[ii] << ",";
     }
-    ss << t->halfsec[9].load() << "],\"wayout\":" << t->wayout.load() << "}";
+    ss << halfsec[9] << "],\"wayout\":" << wayout;
+
+    /* The percentiles (and mean) in ns */
+    ss << ",\"count\":" << count
+       << ",\"mean\":" << (count == 0 ? 0 : snap.sum / count)
+       << ",\"p50\":" << percentile(snap, count, 50.0)
+       << ",\"p90\":" << percentile(snap, count, 90.0)
+       << ",\"p99\":" << percentile(snap, count, 99.0)
+       << ",\"p99.9\":" << percentile(snap, count, 99.9)
+       << ",\"max\":" << percentile(snap, count, 100.0) << "}";
     std::string str = ss.str();
 
     binary_response_handler(NULL, 0, NULL, 0, str.data(), str.length(),
@@ -183,7 +382,13 @@ uint64_t get_aggregated_cmd_stats(cmd_stat_t type)
     }
 
     while (*ids != PROTOCOL_BINARY_CMD_INVALID) {
-        ret += timings[*ids].total.load();
+        for (int ii = 0; ii < num_threads; ++ii) {
+            histogram_t *h;
+            h = thread_timings[ii].histograms[*ids].load(std::memory_order_acquire);
+            if (h != NULL) {
+                ret += h->total.load(std::memory_order_relaxed);
+            }
+        }
         ++ids;
     }
 
@@ -8,9 +8,28 @@
 extern "C" {
 #endif
 
-    void collect_timing(uint8_t cmd, hrtime_t delay);
-    void initialize_timings(void);
-    void generate_timings(uint8_t opcode, const void *cookie);
+    /*
+     * The commands are timed per worker thread (0 - nthreads-1) and opcode,
+     * in log-linear histograms with a relative precision of about 1%.
+     */
+    void collect_timing(int thread, uint8_t cmd, hrtime_t delay);
+    void initialize_timings(int nthreads);
+
+    typedef enum {
+        /* Everything since the last reset */
+        TIMINGS_CUMULATIVE,
+        /* Since the previous TIMINGS_INTERVAL request (or the last reset) */
+        TIMINGS_INTERVAL,
+        /* Everything since the last reset, and start over */
+        TIMINGS_RESET
+    } timings_mode_t;
+
+    /*
+     * Send the (JSON) timings of the opcode, merged over all of the threads,
+     * with the count, mean, p50, p90, p99, p99.9 and max (in ns).
+     */
+    void generate_timings(uint8_t opcode, timings_mode_t mode,
+                          const void *cookie);
 
     bool binary_response_handler(const void *key, uint16_t keylen,
                                  const void *ext, uint8_t extlen,
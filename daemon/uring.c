@@ -0,0 +1,635 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring receive backend for the worker threads (see uring.h).
+ *
+ * We talk to the kernel through the raw system calls rather than
+ * liburing so that we don't pick up another dependency. Every ring is
+ * only ever touched by the worker thread owning it.
+ */
+#include "config.h"
+#include "memcached.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot receive and provided buffer rings arrived in Linux 6.0 */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT) && \
+    defined(HAVE_SYS_EVENTFD_H)
+#define HAVE_URING 1
+#endif
+
+static const char *backend_text[] = {
+    "libevent",
+    "io_uring"
+};
+
+const char *io_backend_text(enum io_backend backend) {
+    return backend_text[backend];
+}
+
+#ifdef HAVE_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Number of submission queue entries */
+#define URING_ENTRIES 256
+/* Number of receive buffers per thread (must be a power of 2) */
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 16384
+#define URING_BGID 0
+/*
+ * Stop receiving for a connection holding on to this many buffers (it
+ * isn't reading what it got, and we don't want it to starve the others)
+ */
+#define URING_MAX_CHUNKS 8
+
+/* A completed receive waiting for the connection to read it */
+struct uring_chunk {
+    unsigned short bid;
+    unsigned int offset;
+    unsigned int len;
+};
+
+struct uring_conn {
+    conn *c;                /* NULL once the connection is closed */
+    struct uring *ring;
+    bool armed;             /* a multishot receive is outstanding */
+    bool cancelling;        /* and we've asked the kernel to stop it */
+    bool starved;           /* waiting for buffers to be returned */
+    bool eof;
+    int error;
+    struct uring_conn *next_starved;
+
+    /* circular buffer of chunks */
+    struct uring_chunk *chunks;
+    int head;
+    int count;
+    int size;
+};
+
+struct uring {
+    int fd;
+    int eventfd;
+    struct event event;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; /* includes entries not submitted yet */
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned short br_tail;
+    char *buffers;
+    bool recycled;          /* buffers returned since the last flush */
+
+    struct uring_conn *starved;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_buffer_add(struct uring *ring, unsigned short bid) {
+    struct io_uring_buf *buf;
+    buf = &ring->br->bufs[ring->br_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    /* The kernel must see the buffer before the new tail */
+    __sync_synchronize();
+    ring->br->tail = ring->br_tail;
+    ring->recycled = true;
+}
+
+static void uring_submit(struct uring *ring) {
+    unsigned submit = ring->sq_local_tail - *ring->sq_tail;
+    if (submit == 0) {
+        return;
+    }
+
+    __sync_synchronize();
+    *ring->sq_tail = ring->sq_local_tail;
+    __sync_synchronize();
+
+    while (sys_io_uring_enter(ring->fd, submit, 0, 0) == -1) {
+        if (errno != EINTR) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to submit to io_uring: %s");
+            return;
+        }
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    if (ring->sq_local_tail - *ring->sq_head >= ring->sq_entries) {
+        uring_submit(ring);
+        __sync_synchronize();
+        if (ring->sq_local_tail - *ring->sq_head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static bool uring_arm(struct uring_conn *uc) {
+    struct io_uring_sqe *sqe = uring_get_sqe(uc->ring);
+    if (sqe == NULL) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->c->sfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)uc;
+    uc->armed = true;
+    return true;
+}
+
+static void uring_cancel(struct uring_conn *uc) {
+    struct io_uring_sqe *sqe;
+
+    if (!uc->armed || uc->cancelling) {
+        return;
+    }
+
+    if ((sqe = uring_get_sqe(uc->ring)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)uc;
+        /* We don't care about the result of the cancel itself */
+        sqe->user_data = 0;
+        uc->cancelling = true;
+    }
+}
+
+static void uring_starve(struct uring_conn *uc) {
+    if (!uc->starved) {
+        uc->starved = true;
+        uc->next_starved = uc->ring->starved;
+        uc->ring->starved = uc;
+    }
+}
+
+static void uring_conn_free(struct uring_conn *uc) {
+    free(uc->chunks);
+    free(uc);
+}
+
+static bool uring_chunk_push(struct uring_conn *uc, unsigned short bid,
+                             unsigned int len) {
+    struct uring_chunk *chunk;
+
+    if (uc->count == uc->size) {
+        int size = uc->size * 2;
+        struct uring_chunk *chunks = malloc(size * sizeof(*chunks));
+        int ii;
+
+        if (chunks == NULL) {
+            return false;
+        }
+        for (ii = 0; ii < uc->count; ++ii) {
+            chunks[ii] = uc->chunks[(uc->head + ii) % uc->size];
+        }
+        free(uc->chunks);
+        uc->chunks = chunks;
+        uc->head = 0;
+        uc->size = size;
+    }
+
+    chunk = &uc->chunks[(uc->head + uc->count) % uc->size];
+    chunk->bid = bid;
+    chunk->offset = 0;
+    chunk->len = len;
+    uc->count++;
+    return true;
+}
+
+static void uring_complete(struct uring *ring, const struct io_uring_cqe *cqe) {
+    struct uring_conn *uc = (void *)(uintptr_t)cqe->user_data;
+    conn *c;
+
+    if (uc == NULL) {
+        return;
+    }
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+        uc->armed = false;
+        uc->cancelling = false;
+    }
+
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (uc->c == NULL || !uring_chunk_push(uc, bid, cqe->res)) {
+            uring_buffer_add(ring, bid);
+            if (uc->c != NULL) {
+                uc->error = ENOMEM;
+            }
+        } else if (uc->count >= URING_MAX_CHUNKS) {
+            uring_cancel(uc);
+        }
+    } else if (cqe->res == 0) {
+        uc->eof = true;
+    } else if (cqe->res == -ENOBUFS) {
+        if (uc->c != NULL) {
+            uring_starve(uc);
+        }
+    } else if (cqe->res != -ECANCELED) {
+        uc->error = -cqe->res;
+    }
+
+    if ((c = uc->c) == NULL) {
+        if (!uc->armed && !uc->starved) {
+            uring_conn_free(uc);
+        }
+        return;
+    }
+
+    if (c->registered_in_libevent && (c->ev_flags & EV_READ) &&
+        uring_conn_has_data(c)) {
+        event_active(&c->event, EV_READ, 0);
+    }
+}
+
+static void uring_reap(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail;
+
+    do {
+        __sync_synchronize();
+        tail = *ring->cq_tail;
+        __sync_synchronize();
+        while (head != tail) {
+            uring_complete(ring, &ring->cqes[head & ring->cq_mask]);
+            ++head;
+        }
+        *ring->cq_head = head;
+        __sync_synchronize();
+    } while (head != *ring->cq_tail);
+}
+
+static void uring_event_handler(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    uint64_t count;
+
+    (void)which;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Can't read from io_uring eventfd: %s");
+    }
+
+    uring_reap(me->uring);
+    uring_flush(me);
+}
+
+void uring_flush(LIBEVENT_THREAD *me) {
+    struct uring *ring = me->uring;
+
+    if (ring->recycled && ring->starved != NULL) {
+        struct uring_conn *uc = ring->starved;
+        ring->starved = NULL;
+        while (uc != NULL) {
+            struct uring_conn *next = uc->next_starved;
+            uc->starved = false;
+            uc->next_starved = NULL;
+            if (uc->c == NULL) {
+                if (!uc->armed) {
+                    uring_conn_free(uc);
+                }
+            } else if (!uc->armed && !uc->eof && uc->error == 0 &&
+                       !uring_arm(uc)) {
+                uring_starve(uc);
+            }
+            uc = next;
+        }
+    }
+    ring->recycled = false;
+
+    uring_submit(ring);
+}
+
+static void uring_destroy(struct uring *ring) {
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    if (ring->eventfd != -1) {
+        close(ring->eventfd);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != NULL && (void*)ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->br != NULL && (void*)ring->br != MAP_FAILED) {
+        munmap(ring->br, ring->br_size);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+bool uring_thread_init(LIBEVENT_THREAD *me) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct uring *ring;
+    unsigned *array;
+    unsigned ii;
+
+    if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to allocate io_uring\n");
+        return false;
+    }
+    ring->fd = ring->eventfd = -1;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring->fd = sys_io_uring_setup(URING_ENTRIES, &p)) == -1) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to set up io_uring: %s");
+        uring_destroy(ring);
+        return false;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        (void*)ring->sqes == MAP_FAILED) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to map io_uring: %s");
+        uring_destroy(ring);
+        return false;
+    }
+
+    ring->sq_head = (void*)((char*)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (void*)((char*)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = *(unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    /* We always use the submission queue entries in order */
+    array = (void*)((char*)ring->sq_ring + p.sq_off.array);
+    for (ii = 0; ii < p.sq_entries; ++ii) {
+        array[ii] = ii;
+    }
+
+    ring->cq_head = (void*)((char*)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (void*)((char*)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = *(unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (void*)((char*)ring->cq_ring + p.cq_off.cqes);
+
+    /* The receive buffers */
+    ring->br_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if ((void*)ring->br == MAP_FAILED || ring->buffers == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to allocate io_uring buffers\n");
+        uring_destroy(ring);
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) == -1) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to register io_uring buffers: %s");
+        uring_destroy(ring);
+        return false;
+    }
+    for (ii = 0; ii < URING_BUFFERS; ++ii) {
+        uring_buffer_add(ring, (unsigned short)ii);
+    }
+    ring->recycled = false;
+
+    /* Completions are signalled through libevent */
+    ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->eventfd == -1 ||
+        sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+                              &ring->eventfd, 1) == -1) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to register io_uring eventfd: %s");
+        uring_destroy(ring);
+        return false;
+    }
+
+    event_set(&ring->event, ring->eventfd, EV_READ | EV_PERSIST,
+              uring_event_handler, me);
+    event_base_set(me->base, &ring->event);
+    if (event_add(&ring->event, 0) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't monitor io_uring eventfd\n");
+        uring_destroy(ring);
+        return false;
+    }
+
+    me->uring = ring;
+    return true;
+}
+
+void uring_thread_cleanup(LIBEVENT_THREAD *me) {
+    if (me->uring != NULL) {
+        event_del(&me->uring->event);
+        uring_destroy(me->uring);
+        me->uring = NULL;
+    }
+}
+
+bool uring_conn_attach(conn *c) {
+    struct uring_conn *uc = calloc(1, sizeof(*uc));
+    struct event_base *base = c->event.ev_base;
+
+    if (uc == NULL || (uc->chunks = malloc(4 * sizeof(*uc->chunks))) == NULL) {
+        free(uc);
+        return false;
+    }
+    uc->size = 4;
+    uc->c = c;
+    uc->ring = c->thread->uring;
+
+    if (!uring_arm(uc)) {
+        uring_conn_free(uc);
+        return false;
+    }
+    c->uring = uc;
+
+    /*
+     * Let libevent stop polling the socket for reads (if this fails we
+     * just keep on getting the extra wakeups)
+     */
+    if (unregister_event(c)) {
+        event_set(&c->event, c->sfd, c->ev_flags & ~EV_READ, event_handler,
+                  (void *)c);
+        event_base_set(base, &c->event);
+        register_event(c, NULL);
+    }
+    return true;
+}
+
+void uring_conn_detach(conn *c) {
+    struct uring_conn *uc = c->uring;
+    if (uc == NULL) {
+        return;
+    }
+
+    c->uring = NULL;
+    uc->c = NULL;
+    while (uc->count > 0) {
+        uring_buffer_add(uc->ring, uc->chunks[uc->head].bid);
+        uc->head = (uc->head + 1) % uc->size;
+        uc->count--;
+    }
+
+    if (uc->armed) {
+        /* freed when the final completion arrives */
+        uring_cancel(uc);
+        uring_submit(uc->ring);
+    } else if (!uc->starved) {
+        uring_conn_free(uc);
+    }
+}
+
+int uring_conn_recv(conn *c, void *dest, size_t nbytes) {
+    struct uring_conn *uc = c->uring;
+    size_t copied = 0;
+
+    while (copied < nbytes && uc->count > 0) {
+        struct uring_chunk *chunk = &uc->chunks[uc->head];
+        size_t n = chunk->len;
+        if (n > nbytes - copied) {
+            n = nbytes - copied;
+        }
+        memcpy((char*)dest + copied,
+               uc->ring->buffers + (size_t)chunk->bid * URING_BUFFER_SIZE +
+               chunk->offset, n);
+        chunk->offset += n;
+        chunk->len -= n;
+        copied += n;
+        if (chunk->len == 0) {
+            uring_buffer_add(uc->ring, chunk->bid);
+            uc->head = (uc->head + 1) % uc->size;
+            uc->count--;
+        }
+    }
+
+    /* We stopped receiving because it was full; start again */
+    if (uc->count == 0 && !uc->armed && !uc->starved && !uc->eof &&
+        uc->error == 0 && !uring_arm(uc)) {
+        uring_starve(uc);
+    }
+
+    if (copied > 0) {
+        return (int)copied;
+    }
+    if (uc->error != 0) {
+        errno = uc->error;
+        return -1;
+    }
+    if (uc->eof) {
+        return 0;
+    }
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+bool uring_conn_has_data(const conn *c) {
+    const struct uring_conn *uc = c->uring;
+    return uc->count > 0 || uc->eof || uc->error != 0;
+}
+
+#else
+
+bool uring_thread_init(LIBEVENT_THREAD *me) {
+    (void)me;
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "io_uring is not supported on this platform\n");
+    return false;
+}
+
+void uring_thread_cleanup(LIBEVENT_THREAD *me) {
+    (void)me;
+}
+
+bool uring_conn_attach(conn *c) {
+    (void)c;
+    return false;
+}
+
+void uring_conn_detach(conn *c) {
+    (void)c;
+}
+
+int uring_conn_recv(conn *c, void *dest, size_t nbytes) {
+    (void)c;
+    (void)dest;
+    (void)nbytes;
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool uring_conn_has_data(const conn *c) {
+    (void)c;
+    return false;
+}
+
+void uring_flush(LIBEVENT_THREAD *me) {
+    (void)me;
+}
+
+#endif
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring receive backend for the worker threads.
+ *
+ * With "io_backend": "io_uring" each worker thread owns a ring with a
+ * ring of provided receive buffers. Every plain (non-SSL) client
+ * connection gets a multishot receive, so the kernel fills the buffers
+ * as data arrives and the worker picks up the completions for all of
+ * its connections in one go, instead of doing an epoll wakeup and a
+ * recv() per connection. The connection state machine is unchanged:
+ * do_data_recv() copies out of the completed buffers, and libevent is
+ * still used for write readiness, timers and everything else.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set up the ring for a worker thread (called before the thread starts).
+ * Returns false (and logs why) if io_uring can't be used.
+ */
+bool uring_thread_init(LIBEVENT_THREAD *me);
+
+void uring_thread_cleanup(LIBEVENT_THREAD *me);
+
+/*
+ * Start receiving data for the connection through the thread's ring.
+ * The connection must be registered in libevent; read readiness is
+ * signalled through event_active() from now on.
+ */
+bool uring_conn_attach(conn *c);
+
+/* Stop receiving data for the connection (it is being closed) */
+void uring_conn_detach(conn *c);
+
+/*
+ * Copy received data for the connection into dest.
+ * Returns the number of bytes copied, 0 on EOF or -1 with errno set
+ * (EWOULDBLOCK if no data is available yet)
+ */
+int uring_conn_recv(conn *c, void *dest, size_t nbytes);
+
+/* Is there anything (data, EOF or an error) for the connection to read? */
+bool uring_conn_has_data(const conn *c);
+
+/* Submit the queued requests for the thread */
+void uring_flush(LIBEVENT_THREAD *me);
+
+const char *io_backend_text(enum io_backend backend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
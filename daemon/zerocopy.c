@@ -0,0 +1,345 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Zero-copy transmit of large values (see zerocopy.h).
+ */
+#include "config.h"
+#include "memcached.h"
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#endif
+
+#ifdef HAVE_ZEROCOPY
+#include <netinet/in.h>
+
+/* Number of times a closing connection polls for the completions */
+#define ZEROCOPY_WAIT_POLLS 200
+
+/* The items and temporary allocations of a response sent with zero-copy */
+struct zerocopy_pin {
+    struct zerocopy_pin *next;
+    /* id of the first zero-copy send of the response */
+    uint32_t first;
+    /* # of zero-copy sends done for the response */
+    uint32_t sends;
+    /* # of those the kernel hasn't told us it is done with */
+    uint32_t remaining;
+    int nitems;
+    int nallocs;
+    /* The items followed by the temporary allocations */
+    void *ptrs[1];
+};
+
+struct zerocopy_conn {
+    /* Is SO_ZEROCOPY set on the socket (and worth using)? */
+    bool enabled;
+    /* Stop waiting for completions, we're resetting the connection */
+    bool aborted;
+    /* id the kernel will give the next zero-copy send */
+    uint32_t next;
+    /* The zero-copy sends done for the response being sent */
+    uint32_t first;
+    uint32_t sends;
+    /* # of times we've polled for completions while closing */
+    int polls;
+    /* The responses the kernel may still be sending from */
+    struct zerocopy_pin *head;
+    struct zerocopy_pin *tail;
+};
+
+static struct zerocopy_conn *get_zerocopy_conn(conn *c) {
+    int enable = 1;
+
+    if (c->zerocopy != NULL) {
+        return c->zerocopy;
+    }
+
+    c->zerocopy = calloc(1, sizeof(*c->zerocopy));
+    if (c->zerocopy != NULL) {
+        /* Fails for unix domain sockets and old kernels */
+        c->zerocopy->enabled = setsockopt(c->sfd, SOL_SOCKET, SO_ZEROCOPY,
+                                          &enable, sizeof(enable)) == 0;
+    }
+    return c->zerocopy;
+}
+
+ssize_t zerocopy_sendmsg(conn *c, struct msghdr *m) {
+    size_t threshold = (size_t)settings.zerocopy_threshold;
+    struct zerocopy_conn *zc;
+    struct msghdr part;
+    bool large;
+    ssize_t res;
+
+    if (c->uring != NULL || c->tap_iterator != NULL || c->dcp ||
+        m->msg_iovlen == 0 || (zc = get_zerocopy_conn(c)) == NULL ||
+        !zc->enabled) {
+        return sendmsg(c->sfd, m, 0);
+    }
+
+    /*
+     * Send the run of iovecs at the start of the message which are all
+     * big or all small; only the big ones may go out with zero-copy.
+     */
+    part = *m;
+    large = m->msg_iov[0].iov_len >= threshold;
+    part.msg_iovlen = 1;
+    while (part.msg_iovlen < m->msg_iovlen &&
+           (m->msg_iov[part.msg_iovlen].iov_len >= threshold) == large) {
+        ++part.msg_iovlen;
+    }
+
+    if (!large) {
+        return sendmsg(c->sfd, &part, 0);
+    }
+
+    res = sendmsg(c->sfd, &part, MSG_ZEROCOPY);
+    if (res > 0) {
+        if (zc->sends == 0) {
+            zc->first = zc->next;
+        }
+        ++zc->next;
+        ++zc->sends;
+        STATS_ADD(c, bytes_zerocopy, res);
+    } else if (res == -1 && errno == ENOBUFS) {
+        /* Too many completions outstanding (optmem_max); copy this one */
+        res = sendmsg(c->sfd, &part, 0);
+    }
+    return res;
+}
+
+void zerocopy_pin_response(conn *c) {
+    struct zerocopy_conn *zc = c->zerocopy;
+    struct zerocopy_pin *pin;
+    int ii;
+
+    if (zc == NULL || zc->sends == 0) {
+        return;
+    }
+
+    pin = malloc(sizeof(*pin) +
+                 (c->ileft + c->temp_alloc_left) * sizeof(void*));
+    if (pin == NULL) {
+        /*
+         * We can't release the items while the kernel may still be
+         * sending from them, so all we can do is to leak them.
+         */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+            "%d: Failed to allocate memory to track a zero-copy response, "
+            "leaking %d items\n", c->sfd, c->ileft);
+    } else {
+        pin->next = NULL;
+        pin->first = zc->first;
+        pin->sends = pin->remaining = zc->sends;
+        pin->nitems = c->ileft;
+        pin->nallocs = c->temp_alloc_left;
+        for (ii = 0; ii < c->ileft; ++ii) {
+            pin->ptrs[ii] = c->icurr[ii];
+        }
+        for (ii = 0; ii < c->temp_alloc_left; ++ii) {
+            pin->ptrs[c->ileft + ii] = c->temp_alloc_curr[ii];
+        }
+        if (zc->tail == NULL) {
+            zc->head = pin;
+        } else {
+            zc->tail->next = pin;
+        }
+        zc->tail = pin;
+    }
+
+    c->icurr += c->ileft;
+    c->ileft = 0;
+    c->temp_alloc_curr += c->temp_alloc_left;
+    c->temp_alloc_left = 0;
+    zc->sends = 0;
+}
+
+static void release_pin(conn *c, struct zerocopy_pin *pin) {
+    int ii;
+    for (ii = 0; ii < pin->nitems; ++ii) {
+        settings.engine.v1->release(settings.engine.v0, c, pin->ptrs[ii]);
+    }
+    for (ii = 0; ii < pin->nallocs; ++ii) {
+        free(pin->ptrs[pin->nitems + ii]);
+    }
+    free(pin);
+}
+
+/* # of the ids in [lo, hi] which belong to the pin */
+static uint32_t pin_overlap(const struct zerocopy_pin *pin,
+                            uint32_t lo, uint32_t hi) {
+    /* Use offsets from the pin's first id so that wrapping doesn't matter */
+    int64_t start = (int32_t)(lo - pin->first);
+    int64_t end = (int32_t)(hi - pin->first);
+
+    if (start < 0) {
+        start = 0;
+    }
+    if (end > (int64_t)pin->sends - 1) {
+        end = (int64_t)pin->sends - 1;
+    }
+    return end < start ? 0 : (uint32_t)(end - start + 1);
+}
+
+/* The kernel is done with the zero-copy sends lo to hi */
+static void complete_sends(conn *c, uint32_t lo, uint32_t hi) {
+    struct zerocopy_conn *zc = c->zerocopy;
+    struct zerocopy_pin *prev = NULL;
+    struct zerocopy_pin *pin = zc->head;
+
+    while (pin != NULL) {
+        struct zerocopy_pin *next = pin->next;
+        pin->remaining -= pin_overlap(pin, lo, hi);
+        if (pin->remaining == 0) {
+            if (prev == NULL) {
+                zc->head = next;
+            } else {
+                prev->next = next;
+            }
+            if (zc->tail == pin) {
+                zc->tail = prev;
+            }
+            release_pin(c, pin);
+        } else {
+            prev = pin;
+        }
+        pin = next;
+    }
+}
+
+void zerocopy_reap(conn *c) {
+    struct zerocopy_conn *zc = c->zerocopy;
+
+    if (zc == NULL || zc->head == NULL || c->sfd == INVALID_SOCKET) {
+        return;
+    }
+
+    while (zc->head != NULL) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1) {
+            /* EAGAIN; nothing more right now */
+            return;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err;
+
+            if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /*
+                 * The kernel had to copy the data anyway (loopback, or a
+                 * device without scatter-gather); don't bother with
+                 * zero-copy for this connection from now on.
+                 */
+                STATS_NOKEY(c, zerocopy_copied);
+                zc->enabled = false;
+            }
+            complete_sends(c, err->ee_info, err->ee_data);
+        }
+    }
+}
+
+bool zerocopy_pending(const conn *c) {
+    return c->zerocopy != NULL && c->zerocopy->head != NULL &&
+        !c->zerocopy->aborted;
+}
+
+bool zerocopy_wait(conn *c) {
+    zerocopy_reap(c);
+    if (!zerocopy_pending(c)) {
+        return false;
+    }
+    if (++c->zerocopy->polls > ZEROCOPY_WAIT_POLLS) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+            "%d: Gave up waiting for zero-copy sends to complete\n", c->sfd);
+        zerocopy_abort(c);
+        return false;
+    }
+    return true;
+}
+
+void zerocopy_abort(conn *c) {
+    struct linger linger;
+
+    if (c->zerocopy == NULL) {
+        return;
+    }
+
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(c->sfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    c->zerocopy->aborted = true;
+}
+
+void zerocopy_conn_cleanup(conn *c) {
+    struct zerocopy_conn *zc = c->zerocopy;
+
+    if (zc == NULL) {
+        return;
+    }
+
+    zerocopy_pin_response(c);
+    while (zc->head != NULL) {
+        struct zerocopy_pin *pin = zc->head;
+        zc->head = pin->next;
+        release_pin(c, pin);
+    }
+    free(zc);
+    c->zerocopy = NULL;
+}
+
+#else
+
+ssize_t zerocopy_sendmsg(conn *c, struct msghdr *m) {
+    return sendmsg(c->sfd, m, 0);
+}
+
+void zerocopy_pin_response(conn *c) {
+    (void)c;
+}
+
+void zerocopy_reap(conn *c) {
+    (void)c;
+}
+
+bool zerocopy_pending(const conn *c) {
+    (void)c;
+    return false;
+}
+
+bool zerocopy_wait(conn *c) {
+    (void)c;
+    return false;
+}
+
+void zerocopy_abort(conn *c) {
+    (void)c;
+}
+
+void zerocopy_conn_cleanup(conn *c) {
+    (void)c;
+}
+
+#endif
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Zero-copy transmit of large values (Linux MSG_ZEROCOPY).
+ *
+ * With "zerocopy_threshold" set, the iovecs of a response that are at
+ * least that big (the item values) are sent with MSG_ZEROCOPY, so the
+ * kernel sends straight from the item memory instead of copying it into
+ * the socket buffer. The kernel tells us through the socket's error queue
+ * when it is done with the memory, so until then the items (and the
+ * temporary allocations) of the response are kept in a list on the
+ * connection instead of being released. The completions are picked up
+ * whenever the worker services the connection, and a connection being
+ * closed waits for them (for a while) in the conn_zerocopy_wait state.
+ *
+ * The small iovecs (the response headers, which live in the connection's
+ * write buffer and are reused for the next response) are always copied.
+ * SSL, io_uring, TAP and DCP connections don't use zero-copy.
+ */
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "config.h"
+#include "memcached.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Send (the start of) the message for a connection in conn_mwrite.
+ * Returns like sendmsg(); the caller deals with partial writes.
+ */
+ssize_t zerocopy_sendmsg(conn *c, struct msghdr *m);
+
+/*
+ * The response has been sent; if (parts of) it went out with zero-copy,
+ * take the items and temporary allocations of the response from the
+ * connection and hold on to them until the kernel is done with them.
+ */
+void zerocopy_pin_response(conn *c);
+
+/* Process the completions for the connection and release what we can */
+void zerocopy_reap(conn *c);
+
+/* Is the kernel still using memory from any of our responses? */
+bool zerocopy_pending(const conn *c);
+
+/*
+ * Called by a closing connection waiting for its zero-copy sends to
+ * complete. Returns true if it should poll again in a while, false if
+ * they are done or we've waited long enough (see zerocopy_abort).
+ */
+bool zerocopy_wait(conn *c);
+
+/*
+ * Stop waiting for the completions (the connection is closing and the
+ * client isn't reading). The socket is set up to be reset on close so
+ * that the kernel drops what it still had to send.
+ */
+void zerocopy_abort(conn *c);
+
+/* Release everything held for the connection (the socket is closed) */
+void zerocopy_conn_cleanup(conn *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 
 #include <memcached/engine.h>
+#include <memcached/util.h>
 #include <platform/platform.h>
 #include "genhash.h"
 #include "topkeys.h"
@@ -141,6 +142,15 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
                                            uint8_t datatype,
                                            uint64_t *result,
                                            uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_write_range(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const void* key,
+                                            const int nkey,
+                                            uint64_t offset,
+                                            const void* data,
+                                            uint64_t ndata,
+                                            uint64_t *cas,
+                                            uint16_t vbucket);
 static ENGINE_ERROR_CODE bucket_flush(ENGINE_HANDLE* handle,
                                       const void* cookie, time_t when);
 static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
@@ -325,6 +335,8 @@ static void free_engine_handle(proxied_engine_handle_t *);
 static bool list_buckets(struct bucket_engine *e, struct bucket_list **blist);
 static void bucket_list_free(struct bucket_list *blist);
 static void maybe_start_engine_shutdown(proxied_engine_handle_t *e);
+static void init_bucket_memory(proxied_engine_handle_t *peh);
+static void memory_arbitrator_thread(void *arg);
 
 
 /**
@@ -580,6 +592,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.engine.get = bucket_get;
     bucket_engine.engine.store = bucket_store;
     bucket_engine.engine.arithmetic = bucket_arithmetic;
+    bucket_engine.engine.write_range = bucket_write_range;
     bucket_engine.engine.flush = bucket_flush;
     bucket_engine.engine.get_stats = bucket_get_stats;
     bucket_engine.engine.reset_stats = bucket_reset_stats;
@@ -615,6 +628,8 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     cb_mutex_initialize(&bucket_engine.shutdown.mutex);
     cb_cond_initialize(&bucket_engine.shutdown.cond);
     cb_cond_initialize(&bucket_engine.shutdown.refcount_cond);
+    cb_mutex_initialize(&bucket_engine.memory.mutex);
+    cb_cond_initialize(&bucket_engine.memory.cond);
     bucket_engine.info.engine_info.description = "Bucket engine v0.2";
     bucket_engine.info.engine_info.num_features = 1;
     bucket_engine.info.engine_info.features[0].feature = ENGINE_FEATURE_MULTI_TENANCY;
@@ -858,6 +873,8 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
                          "Failed to initialize instance. Error code: %d\n", rv);
             }
             rv = ENGINE_FAILED;
+        } else {
+            init_bucket_memory(peh);
         }
     } else {
         if (msg) {
@@ -1431,6 +1448,17 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
     se->upstream_server->callback->register_callback(handle, ON_DISCONNECT,
                                                      handle_disconnect, se);
 
+    if (se->memory.interval != 0) {
+        se->memory.running = true;
+        if (cb_create_thread(&se->memory.tid, memory_arbitrator_thread,
+                             se, 0) != 0) {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to start the memory arbitrator\n");
+            se->memory.running = false;
+            se->memory.interval = 0;
+        }
+    }
+
     /* Initialization is useful to know if we *can* start up an */
     /* engine, but we check flags here to see if we should have and */
     /* shut it down if not. */
@@ -1489,6 +1517,14 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
         return;
     }
 
+    if (se->memory.running) {
+        cb_mutex_enter(&se->memory.mutex);
+        se->memory.running = false;
+        cb_cond_signal(&se->memory.cond);
+        cb_mutex_exit(&se->memory.mutex);
+        cb_join_thread(se->memory.tid);
+    }
+
     cb_mutex_enter(&bucket_engine.shutdown.mutex);
     bucket_engine.shutdown.in_progress = true;
     /* kick bucket deletion threads in butt broadcasting in_progress = true condition */
@@ -1752,6 +1788,9 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
 
         if (ret == ENGINE_SUCCESS) {
             TK(peh->topkeys, get_hits, key, nkey, get_current_time());
+            if (peh->mem.base != 0) {
+                ATOMIC_INCR(&peh->mem.hits);
+            }
         } else if (ret == ENGINE_KEY_ENOENT) {
             TK(peh->topkeys, get_misses, key, nkey, get_current_time());
         }
@@ -1804,6 +1843,232 @@ static void bucket_list_free(struct bucket_list *blist) {
     }
 }
 
+/***********************************************************
+ **            Memory arbitration between buckets          **
+ **********************************************************/
+
+/**
+ * Call into the engine on behalf of bucket_engine itself (there is no
+ * connection involved). Release with release_engine_handle.
+ * @return false if the engine isn't running
+ */
+static bool enter_engine(proxied_engine_handle_t *peh) {
+    int count = ATOMIC_INCR(&peh->clients);
+    cb_assert(count > 0);
+    if (peh->state != STATE_RUNNING) {
+        release_engine_handle(peh);
+        return false;
+    }
+    return true;
+}
+
+struct memory_stats {
+    uint64_t maxbytes;
+    uint64_t evictions;
+    uint64_t allocated;
+};
+
+static void memory_stats_collector(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    struct memory_stats *ms = (struct memory_stats *)cookie;
+    char buffer[32];
+    uint64_t *dest = NULL;
+
+    if (klen == sizeof("engine_maxbytes") - 1 &&
+        memcmp(key, "engine_maxbytes", klen) == 0) {
+        dest = &ms->maxbytes;
+    } else if (klen == sizeof("evictions") - 1 &&
+               memcmp(key, "evictions", klen) == 0) {
+        dest = &ms->evictions;
+    } else if (klen == sizeof("mem_allocated") - 1 &&
+               memcmp(key, "mem_allocated", klen) == 0) {
+        dest = &ms->allocated;
+    }
+
+    if (dest != NULL && vlen < sizeof(buffer)) {
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        safe_strtoull(buffer, dest);
+    }
+}
+
+/**
+ * Pick up the memory limit, eviction count and the memory the engine
+ * holds (0 if it doesn't tell) from the engine's stats.
+ * The engine only gets our own struct as the cookie, which it is
+ * supposed to pass through to add_stat untouched.
+ */
+static bool get_memory_stats(proxied_engine_handle_t *peh,
+                             struct memory_stats *ms) {
+    memset(ms, 0, sizeof(*ms));
+    return peh->pe.v1->get_stats(peh->pe.v0, ms, NULL, 0,
+                                 memory_stats_collector) == ENGINE_SUCCESS;
+}
+
+/**
+ * Enroll a newly created bucket in the memory arbitration if it's
+ * enabled and the engine supports changing its limit.
+ */
+static void init_bucket_memory(proxied_engine_handle_t *peh) {
+    struct memory_stats ms;
+
+    if (bucket_engine.memory.interval == 0 ||
+        peh->pe.v1->set_memory_limit == NULL ||
+        !get_memory_stats(peh, &ms) || ms.maxbytes == 0) {
+        return;
+    }
+
+    peh->mem.limit = (size_t)ms.maxbytes;
+    peh->mem.guarantee = peh->mem.limit / 100 * bucket_engine.memory.guarantee;
+    peh->mem.burst = peh->mem.limit / 100 * bucket_engine.memory.burst;
+    peh->mem.last_evictions = ms.evictions;
+    peh->mem.base = peh->mem.limit;
+}
+
+static void add_bucket_memory_stats(proxied_engine_handle_t *peh,
+                                    const void *cookie,
+                                    ADD_STAT add_stat) {
+    char statval[32];
+
+    snprintf(statval, sizeof(statval), "%"PRIu64, (uint64_t)peh->mem.limit);
+    add_stat("bucket_mem_limit", sizeof("bucket_mem_limit") - 1,
+             statval, (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%"PRIu64, (uint64_t)peh->mem.guarantee);
+    add_stat("bucket_mem_guarantee", sizeof("bucket_mem_guarantee") - 1,
+             statval, (uint32_t)strlen(statval), cookie);
+    snprintf(statval, sizeof(statval), "%"PRIu64, (uint64_t)peh->mem.burst);
+    add_stat("bucket_mem_burst", sizeof("bucket_mem_burst") - 1,
+             statval, (uint32_t)strlen(statval), cookie);
+}
+
+static bool set_bucket_memory_limit(proxied_engine_handle_t *peh,
+                                    size_t limit) {
+    ENGINE_ERROR_CODE ret;
+    if (!enter_engine(peh)) {
+        return false;
+    }
+    ret = peh->pe.v1->set_memory_limit(peh->pe.v0, limit);
+    release_engine_handle(peh);
+    if (ret != ENGINE_SUCCESS) {
+        return false;
+    }
+    peh->mem.limit = limit;
+    return true;
+}
+
+/**
+ * Move memory from the bucket that gets the least hits per byte (and
+ * doesn't have to evict anything) to the bucket with the most evictions
+ * since the last time we looked. We move a small step at a time so
+ * that a change in the workload doesn't cause big swings, and the total
+ * amount of memory handed out never changes. Engines don't give memory
+ * back when their limit is lowered, so we only move what the donor
+ * hasn't allocated yet; otherwise the memory in use could grow towards
+ * the sum of the bursts.
+ */
+static void rebalance_memory(struct bucket_engine *e) {
+    struct bucket_list *blist = NULL;
+    struct bucket_list *p;
+    proxied_engine_handle_t *donor = NULL;
+    proxied_engine_handle_t *receiver = NULL;
+    double donor_value = 0;
+    uint64_t donor_allocated = 0;
+    uint64_t receiver_pressure = 0;
+
+    if (!list_buckets(e, &blist)) {
+        return;
+    }
+
+    for (p = blist; p != NULL; p = p->next) {
+        proxied_engine_handle_t *peh = p->peh;
+        struct memory_stats ms;
+        uint64_t evicted;
+        double value;
+        int hits;
+
+        if (peh->mem.base == 0 || !enter_engine(peh)) {
+            continue;
+        }
+        if (!get_memory_stats(peh, &ms)) {
+            release_engine_handle(peh);
+            continue;
+        }
+        release_engine_handle(peh);
+
+        /* The counter wraps, and the engine may reset its stats */
+        hits = peh->mem.hits;
+        value = (double)(unsigned int)(hits - peh->mem.last_hits) /
+            (double)peh->mem.limit;
+        peh->mem.last_hits = hits;
+        if (ms.evictions >= peh->mem.last_evictions) {
+            evicted = ms.evictions - peh->mem.last_evictions;
+        } else {
+            evicted = ms.evictions;
+        }
+        peh->mem.last_evictions = ms.evictions;
+
+        if (evicted == 0) {
+            if (peh->mem.limit > peh->mem.guarantee &&
+                ms.allocated < peh->mem.limit &&
+                (donor == NULL || value < donor_value)) {
+                donor = peh;
+                donor_value = value;
+                donor_allocated = ms.allocated;
+            }
+        } else if (peh->mem.limit < peh->mem.burst &&
+                   evicted > receiver_pressure) {
+            receiver = peh;
+            receiver_pressure = evicted;
+        }
+    }
+
+    if (donor != NULL && receiver != NULL) {
+        size_t amount = donor->mem.base / 20;
+        if (amount > donor->mem.limit - donor->mem.guarantee) {
+            amount = donor->mem.limit - donor->mem.guarantee;
+        }
+        if (amount > donor->mem.limit - donor_allocated) {
+            amount = (size_t)(donor->mem.limit - donor_allocated);
+        }
+        if (amount > receiver->mem.burst - receiver->mem.limit) {
+            amount = receiver->mem.burst - receiver->mem.limit;
+        }
+
+        /* Shrink first so we never hand out more than we have */
+        if (amount > 0 &&
+            set_bucket_memory_limit(donor, donor->mem.limit - amount)) {
+            if (set_bucket_memory_limit(receiver,
+                                        receiver->mem.limit + amount)) {
+                logger->log(EXTENSION_LOG_INFO, NULL,
+                            "Moved %lu bytes from \"%s\" to \"%s\"\n",
+                            (unsigned long)amount, donor->name,
+                            receiver->name);
+            } else {
+                set_bucket_memory_limit(donor, donor->mem.limit + amount);
+            }
+        }
+    }
+
+    bucket_list_free(blist);
+}
+
+static void memory_arbitrator_thread(void *arg) {
+    struct bucket_engine *e = arg;
+
+    cb_mutex_enter(&e->memory.mutex);
+    while (e->memory.running) {
+        cb_cond_timedwait(&e->memory.cond, &e->memory.mutex,
+                          (unsigned int)(e->memory.interval * 1000));
+        if (e->memory.running) {
+            cb_mutex_exit(&e->memory.mutex);
+            rebalance_memory(e);
+            cb_mutex_enter(&e->memory.mutex);
+        }
+    }
+    cb_mutex_exit(&e->memory.mutex);
+}
+
 /**
  * Implementation of the "aggregate_stats" function in the engine
  * specification. Look up the correct engine and call into the
@@ -1917,6 +2182,9 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                 snprintf(statval, sizeof(statval), "%d", peh->clients);
                 add_stat("bucket_active_conns", sizeof("bucket_active_conns") -1,
                          statval, (uint32_t)strlen(statval), cookie);
+                if (peh->mem.base != 0) {
+                    add_bucket_memory_stats(peh, cookie, add_stat);
+                }
             }
         }
         release_engine_handle(peh);
@@ -2038,6 +2306,35 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
     }
 }
 
+/**
+ * Implementation of the (optional) "write_range" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running" and implements
+ * it; the caller stores a modified copy of the item otherwise.
+ */
+static ENGINE_ERROR_CODE bucket_write_range(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const void* key,
+                                            const int nkey,
+                                            uint64_t offset,
+                                            const void* data,
+                                            uint64_t ndata,
+                                            uint64_t *cas,
+                                            uint16_t vbucket) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_NOT_STORED;
+        if (peh->pe.v1->write_range != NULL) {
+            ret = peh->pe.v1->write_range(peh->pe.v0, cookie, key, nkey,
+                                          offset, data, ndata, cas, vbucket);
+        }
+        release_engine_handle(peh);
+        return ret;
+    } else {
+        return ENGINE_NO_BUCKET;
+    }
+}
+
 /**
  * Implementation of the "flush" function in the engine
  * specification. Look up the correct engine and call into the
@@ -2678,11 +2975,13 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
     me->auto_create = true;
+    me->memory.guarantee = 50;
+    me->memory.burst = 200;
 
     if (cfg_str != NULL) {
         int r;
         int ii = 0;
-#define CONFIG_SIZE 8
+#define CONFIG_SIZE 11
         struct config_item items[CONFIG_SIZE];
         memset(&items, 0, sizeof(items));
 
@@ -2716,6 +3015,21 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
         items[ii].value.dt_bool = &me->auto_create;
         ++ii;
 
+        items[ii].key = "mem_interval";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->memory.interval;
+        ++ii;
+
+        items[ii].key = "mem_guarantee";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->memory.guarantee;
+        ++ii;
+
+        items[ii].key = "mem_burst";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->memory.burst;
+        ++ii;
+
         items[ii].key = "config_file";
         items[ii].datatype = DT_CONFIGFILE;
         ++ii;
@@ -2739,6 +3053,11 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
             if (!items[4].found) {
                 me->default_bucket_config = strdup("");
             }
+            if (me->memory.guarantee > 100 || me->memory.burst < 100) {
+                logger->log(EXTENSION_LOG_WARNING, NULL,
+                            "mem_guarantee must be <= 100 and mem_burst >= 100\n");
+                ret = ENGINE_FAILED;
+            }
         } else {
             ret = ENGINE_FAILED;
         }
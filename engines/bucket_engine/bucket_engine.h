@@ -19,6 +19,26 @@ typedef enum {
     STATE_STOPPED
 } bucket_state_t;
 
+/**
+ * The memory arbitrator state for a bucket. Only buckets whose engine
+ * implements set_memory_limit take part in the arbitration.
+ */
+typedef struct bucket_memory {
+    /* The limit the engine was configured with (0 if not arbitrated) */
+    size_t base;
+    /* The bucket may never shrink below this */
+    size_t guarantee;
+    /* nor grow above this */
+    size_t burst;
+    /* The limit currently set in the engine */
+    volatile size_t limit;
+    /* # of successful gets (counted by bucket_get) */
+    volatile int hits;
+    /* Counters as seen by the previous rebalance */
+    int last_hits;
+    uint64_t last_evictions;
+} bucket_memory_t;
+
 typedef struct proxied_engine_handle {
     const char          *name;
     size_t               name_len;
@@ -53,6 +73,7 @@ typedef struct proxied_engine_handle {
     const void *cookie;
     void *dlhandle;
     volatile bucket_state_t state;
+    bucket_memory_t mem;
 } proxied_engine_handle_t;
 
 #define ES_CONNECTED_FLAG 0x1000
@@ -114,6 +135,17 @@ struct bucket_engine {
         cb_cond_t refcount_cond;
     } shutdown;
 
+    /* The memory arbitrator moving memory between the buckets */
+    struct {
+        size_t interval; /* Seconds between each rebalance, 0 = disabled */
+        size_t guarantee; /* % of the configured limit a bucket keeps */
+        size_t burst; /* % of the configured limit a bucket may grow to */
+        bool running;
+        cb_thread_t tid;
+        cb_mutex_t mutex;
+        cb_cond_t cond;
+    } memory;
+
     union {
       engine_info engine_info;
       char buffer[sizeof(engine_info) +
@@ -28,6 +28,11 @@ struct mock_engine {
     genhash_t *hashtbl;
     struct mock_stats stats;
     int disconnects;
+    /* The mock counts items rather than bytes (0 = no limit) */
+    size_t mem_limit;
+    /* Like a slab allocator, the mock never gives memory back */
+    size_t mem_allocated;
+    uint64_t evictions;
     uint64_t magic2;
 
     union {
@@ -112,6 +117,8 @@ static ENGINE_ERROR_CODE mock_unknown_command(ENGINE_HANDLE* handle,
                                               const void* cookie,
                                               protocol_binary_request_header *request,
                                               ADD_RESPONSE response);
+static ENGINE_ERROR_CODE mock_set_memory_limit(ENGINE_HANDLE* handle,
+                                               size_t limit);
 static char* item_get_data(const item* item);
 static const char* item_get_key(const item* item);
 static void item_set_cas(ENGINE_HANDLE* handle, const void *cookie,
@@ -238,6 +245,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     h->engine.get_item_info = get_item_info;
     h->engine.get_tap_iterator = mock_get_tap_iterator;
     h->engine.tap_notify = mock_tap_notify;
+    h->engine.set_memory_limit = mock_set_memory_limit;
 
     h->server = gsapi();
 
@@ -301,6 +309,10 @@ static ENGINE_ERROR_CODE mock_initialize(ENGINE_HANDLE* handle,
 
     cb_assert(my_hash_ops.dupKey);
 
+    if (strncmp(config_str, "mem_limit=", 10) == 0) {
+        se->mem_limit = (size_t)strtoull(config_str + 10, NULL, 10);
+    }
+
     if (strcmp(config_str, "no_alloc") != 0) {
         se->hashtbl = genhash_init(1, my_hash_ops);
         cb_assert(se->hashtbl);
@@ -403,12 +415,24 @@ static ENGINE_ERROR_CODE mock_get_stats(ENGINE_HANDLE* handle,
                                         int nkey,
                                         ADD_STAT add_stat)
 {
-    (void)handle;
-    (void)cookie;
-    (void)stat_key;
+    struct mock_engine* e = get_handle(handle);
     (void)nkey;
-    (void)add_stat;
-    /* TODO:  Implement */
+
+    if (stat_key == NULL && e->mem_limit != 0) {
+        char val[32];
+        int len = snprintf(val, sizeof(val), "%"PRIu64, (uint64_t)e->mem_limit);
+        add_stat("engine_maxbytes", 15, val, len, cookie);
+        len = snprintf(val, sizeof(val), "%"PRIu64, e->evictions);
+        add_stat("evictions", 9, val, len, cookie);
+        len = snprintf(val, sizeof(val), "%"PRIu64, (uint64_t)e->mem_allocated);
+        add_stat("mem_allocated", 13, val, len, cookie);
+    }
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE mock_set_memory_limit(ENGINE_HANDLE* handle,
+                                               size_t limit) {
+    get_handle(handle)->mem_limit = limit;
     return ENGINE_SUCCESS;
 }
 
@@ -418,12 +442,23 @@ static ENGINE_ERROR_CODE mock_store(ENGINE_HANDLE* handle,
                                     uint64_t *cas,
                                     ENGINE_STORE_OPERATION operation,
                                     uint16_t vbucket) {
+    struct mock_engine* e = get_handle(handle);
     mock_item* it = (mock_item*)itm;
+    size_t size;
     (void)cookie;
     (void)cas;
     (void)vbucket;
     (void)operation;
     genhash_update(get_ht(handle), item_get_key(itm), it->nkey, itm, 0);
+    size = (size_t)genhash_size(get_ht(handle));
+    if (e->mem_limit != 0 && size > e->mem_limit) {
+        /* Pretend we had to throw something out */
+        e->evictions++;
+        size = e->mem_limit;
+    }
+    if (size > e->mem_allocated) {
+        e->mem_allocated = size;
+    }
     return ENGINE_SUCCESS;
 }
 
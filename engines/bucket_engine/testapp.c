@@ -1456,6 +1456,147 @@ static enum test_result test_stats_bucket(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static size_t get_bucket_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const void *cookie, const char *name) {
+    const char *val;
+    cb_assert(h1->get_stats(h, cookie, NULL, 0, add_stats) == ENGINE_SUCCESS);
+    val = genhash_find(stats_hash, name, strlen(name));
+    cb_assert(val != NULL);
+    return (size_t)strtoul(val, NULL, 10);
+}
+
+static size_t get_bucket_mem_limit(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   const void *cookie) {
+    return get_bucket_stat(h, h1, cookie, "bucket_mem_limit");
+}
+
+static enum test_result test_memory_arbitration(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const void *busy_cookie;
+    const void *idle_cookie;
+    ENGINE_ERROR_CODE rv;
+    size_t busy_limit;
+    size_t idle_limit;
+    void *pkt;
+    int ii;
+
+    /* The mock engine counts items instead of bytes */
+    pkt = create_create_bucket_pkt("busy", ENGINE_PATH, "mem_limit=1000");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    pkt = create_create_bucket_pkt("idle", ENGINE_PATH, "mem_limit=1000");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    busy_cookie = mk_conn("busy", NULL);
+    idle_cookie = mk_conn("idle", NULL);
+
+    cb_assert(get_bucket_mem_limit(h, h1, busy_cookie) == 1000);
+    cb_assert(memcmp("500", genhash_find(stats_hash, "bucket_mem_guarantee",
+                                         strlen("bucket_mem_guarantee")),
+                     3) == 0);
+    cb_assert(memcmp("2000", genhash_find(stats_hash, "bucket_mem_burst",
+                                          strlen("bucket_mem_burst")),
+                     4) == 0);
+
+    /* Overflow the busy bucket so that it starts to evict */
+    for (ii = 0; ii < 1100; ++ii) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%d", ii);
+        store(h, h1, busy_cookie, key, "value", NULL);
+    }
+
+    /* Memory should move over from the idle bucket */
+    for (ii = 0; ii < 100; ++ii) {
+        if (get_bucket_mem_limit(h, h1, busy_cookie) > 1000) {
+            break;
+        }
+#ifdef WIN32
+        Sleep(100);
+#else
+        usleep(100000);
+#endif
+    }
+
+    busy_limit = get_bucket_mem_limit(h, h1, busy_cookie);
+    idle_limit = get_bucket_mem_limit(h, h1, idle_cookie);
+    cb_assert(busy_limit > 1000);
+    cb_assert(idle_limit >= 500);
+    cb_assert(busy_limit + idle_limit == 2000);
+
+    return SUCCESS;
+}
+
+/*
+ * The idle bucket holds on to most of its memory, so only the part it
+ * never allocated may move over; the memory allocated by the two
+ * buckets together must stay within what they were given.
+ */
+static enum test_result test_memory_arbitration_bounded(ENGINE_HANDLE *h,
+                                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const void *busy_cookie;
+    const void *idle_cookie;
+    ENGINE_ERROR_CODE rv;
+    size_t busy_limit;
+    size_t idle_limit;
+    size_t allocated;
+    void *pkt;
+    int ii;
+
+    pkt = create_create_bucket_pkt("busy", ENGINE_PATH, "mem_limit=1000");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    pkt = create_create_bucket_pkt("idle", ENGINE_PATH, "mem_limit=1000");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(last_status == 0);
+
+    busy_cookie = mk_conn("busy", NULL);
+    idle_cookie = mk_conn("idle", NULL);
+
+    for (ii = 0; ii < 900; ++ii) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%d", ii);
+        store(h, h1, idle_cookie, key, "value", NULL);
+    }
+
+    /* Keep the busy bucket evicting for a few rounds of arbitration */
+    for (ii = 0; ii < 4000; ++ii) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%d", ii);
+        store(h, h1, busy_cookie, key, "value", NULL);
+        if (ii % 1000 == 999) {
+#ifdef WIN32
+            Sleep(1500);
+#else
+            usleep(1500000);
+#endif
+        }
+    }
+
+    busy_limit = get_bucket_mem_limit(h, h1, busy_cookie);
+    idle_limit = get_bucket_mem_limit(h, h1, idle_cookie);
+    cb_assert(busy_limit == 1100);
+    cb_assert(idle_limit == 900);
+
+    allocated = get_bucket_stat(h, h1, busy_cookie, "mem_allocated") +
+        get_bucket_stat(h, h1, idle_cookie, "mem_allocated");
+    cb_assert(allocated <= 2000);
+
+    return SUCCESS;
+}
+
 static enum test_result test_unknown_call_no_bucket(ENGINE_HANDLE *h,
                                                     ENGINE_HANDLE_V1 *h1) {
 
@@ -1904,6 +2045,11 @@ int main(int argc, char **argv) {
          test_select_no_bucket, NULL},
         {"stats call", test_stats, NULL},
         {"stats bucket call", test_stats_bucket, NULL},
+        {"memory arbitration", test_memory_arbitration,
+         DEFAULT_CONFIG_NO_DEF ";mem_interval=1"},
+        {"memory arbitration (allocated memory)",
+         test_memory_arbitration_bounded,
+         DEFAULT_CONFIG_NO_DEF ";mem_interval=1"},
         {"release call", test_release, NULL},
         {"unknown call delegation", test_unknown_call, NULL},
         {"unknown call delegation (no bucket)", test_unknown_call_no_bucket,
@@ -59,6 +59,47 @@ hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *
     return ret;
 }
 
+/*
+ * Walk the hash table without the cache_lock. The caller must be inside
+ * an epoch so that the items (and tables) we look at can't be released
+ * while we're using them. Items being moved by the expansion thread may
+ * be skipped, so a miss is only conclusive if no expansion overlapped
+ * with the lookup.
+ */
+hash_item *assoc_find_lockless(struct default_engine *engine, uint32_t hash,
+                               const char *key, const size_t nkey,
+                               bool *conclusive) {
+    hash_item *it;
+    unsigned int oldbucket;
+    unsigned int hashpower;
+    unsigned int seq = engine->assoc.expand_seq;
+
+    MEMORY_BARRIER();
+    /* Read hashpower before the tables; the tables are published first */
+    hashpower = engine->assoc.hashpower;
+    MEMORY_BARRIER();
+
+    if (engine->assoc.expanding &&
+        (oldbucket = (hash & hashmask(hashpower - 1))) >= engine->assoc.expand_bucket)
+    {
+        it = engine->assoc.old_hashtable[oldbucket];
+    } else {
+        it = engine->assoc.primary_hashtable[hash & hashmask(hashpower)];
+    }
+
+    while (it) {
+        if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+            break;
+        }
+        it = it->h_next;
+    }
+
+    MEMORY_BARRIER();
+    *conclusive = (it != NULL) ||
+        ((seq & 1) == 0 && seq == engine->assoc.expand_seq);
+    return it;
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
@@ -84,20 +125,30 @@ static hash_item** _hashitem_before(struct default_engine *engine,
 }
 
 static void assoc_maintenance_thread(void *arg);
+static bool assoc_move_bucket(struct default_engine *engine);
+static void assoc_expand_done(struct default_engine *engine);
 
 /* grows the hashtable to the next power of 2. */
 static void assoc_expand(struct default_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
-
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1),
-                                             sizeof(hash_item *));
-    if (engine->assoc.primary_hashtable) {
+    hash_item **new_hashtable = calloc(hashsize(engine->assoc.hashpower + 1),
+                                       sizeof(hash_item *));
+    if (new_hashtable) {
         int ret = 0;
         cb_thread_t tid;
 
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
+        /*
+         * Lock-free readers may look at the tables at any time, so
+         * publish them before bumping hashpower (readers read hashpower
+         * first and never index past the end of a table).
+         */
+        engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
         engine->assoc.expand_bucket = 0;
+        engine->assoc.expand_seq++;
+        MEMORY_BARRIER();
+        engine->assoc.expanding = true;
+        engine->assoc.primary_hashtable = new_hashtable;
+        MEMORY_BARRIER();
+        engine->assoc.hashpower++;
 
         /* start a thread to do the expansion */
         if ((ret = cb_create_thread(&tid, assoc_maintenance_thread, engine, 1)) != 0)
@@ -106,15 +157,18 @@ static void assoc_expand(struct default_engine *engine) {
             logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
             logger->log(EXTENSION_LOG_WARNING, NULL,
                         "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
+            /*
+             * Readers may already use the new table so we can't back
+             * out; move everything over while we hold the lock instead.
+             */
+            while (assoc_move_bucket(engine)) {
+                /* empty */
+            }
+            epoch_synchronize(&engine->epoch);
+            assoc_expand_done(engine);
         }
-    } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
-        /* Bad news, but we can keep running. */
     }
+    /* else: Bad news, but we can keep running. */
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
@@ -127,9 +181,11 @@ int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
         (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
     {
         it->h_next = engine->assoc.old_hashtable[oldbucket];
+        MEMORY_BARRIER();
         engine->assoc.old_hashtable[oldbucket] = it;
     } else {
         it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        MEMORY_BARRIER();
         engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
     }
 
@@ -153,7 +209,8 @@ void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key,
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
         nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
+        /* Leave h_next alone; a lock-free reader may be standing on the
+         * item and still needs to reach the rest of the chain. */
         *before = nxt;
         return;
     }
@@ -164,46 +221,92 @@ void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key,
 
 
 
+/*
+ * Put new_it in the place of it (same key) in its hash chain. A lock-free
+ * reader walking the chain finds one or the other, never neither.
+ */
+void assoc_replace(struct default_engine *engine, uint32_t hash,
+                   hash_item *it, hash_item *new_it) {
+    hash_item **before = _hashitem_before(engine, hash, item_get_key(it),
+                                          it->nkey);
+
+    cb_assert(*before == it);
+    new_it->h_next = it->h_next;
+    MEMORY_BARRIER();
+    /* Leave it->h_next alone, as in assoc_delete */
+    *before = new_it;
+    MEMCACHED_ASSOC_DELETE(item_get_key(it), it->nkey,
+                           engine->assoc.hash_items);
+    MEMCACHED_ASSOC_INSERT(item_get_key(new_it), new_it->nkey,
+                           engine->assoc.hash_items);
+}
+
 #define DEFAULT_HASH_BULK_MOVE 1
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
+/*
+ * Move the next bucket from the old table to the primary table (caller
+ * must hold the cache_lock).
+ * @return false when there are no more buckets to move
+ */
+static bool assoc_move_bucket(struct default_engine *engine) {
+    hash_item *it, *next;
+    int bucket;
+
+    for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
+         NULL != it; it = next) {
+        next = it->h_next;
+
+        bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
+            & hashmask(engine->assoc.hashpower);
+        it->h_next = engine->assoc.primary_hashtable[bucket];
+        MEMORY_BARRIER();
+        engine->assoc.primary_hashtable[bucket] = it;
+    }
+
+    engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
+    engine->assoc.expand_bucket++;
+    return engine->assoc.expand_bucket != hashsize(engine->assoc.hashpower - 1);
+}
+
+/*
+ * Release the old table (caller must hold the cache_lock, and no
+ * lock-free reader may still be walking the old table).
+ */
+static void assoc_expand_done(struct default_engine *engine) {
+    engine->assoc.expanding = false;
+    MEMORY_BARRIER();
+    engine->assoc.expand_seq++;
+    free(engine->assoc.old_hashtable);
+    engine->assoc.old_hashtable = NULL;
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table expansion done\n");
+    }
+}
+
 static void assoc_maintenance_thread(void *arg) {
     struct default_engine *engine = arg;
-    bool done = false;
+    bool more = true;
     do {
         int ii;
         cb_mutex_enter(&engine->cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
-
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
-            }
-
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
-            }
-        }
-        if (!engine->assoc.expanding) {
-            done = true;
+        for (ii = 0; ii < hash_bulk_move && more; ++ii) {
+            more = assoc_move_bucket(engine);
         }
         cb_mutex_exit(&engine->cache_lock);
-    } while (!done);
+    } while (more);
+
+    /*
+     * All buckets are moved so nobody picks the old table any more, but
+     * a lock-free reader may still be walking it. expanding stays set
+     * until it is released so that assoc_destroy waits for us.
+     */
+    epoch_synchronize(&engine->epoch);
+
+    cb_mutex_enter(&engine->cache_lock);
+    assoc_expand_done(engine);
+    cb_mutex_exit(&engine->cache_lock);
 }
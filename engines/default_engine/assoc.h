@@ -26,6 +26,12 @@ struct assoc {
     * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
     */
    unsigned int expand_bucket;
+
+   /*
+    * Bumped when an expansion starts and when it completes (odd while
+    * expanding), so lock-free readers can tell if a miss is conclusive.
+    */
+   volatile unsigned int expand_seq;
 };
 
 /* associative array */
@@ -33,10 +39,15 @@ ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
 void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
+hash_item *assoc_find_lockless(struct default_engine *engine, uint32_t hash,
+                               const char *key, const size_t nkey,
+                               bool *conclusive);
 int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
+void assoc_replace(struct default_engine *engine, uint32_t hash,
+                   hash_item *it, hash_item *new_it);
 int start_assoc_maintenance_thread(struct default_engine *engine);
 void stop_assoc_maintenance_thread(struct default_engine *engine);
 
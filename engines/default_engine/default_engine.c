@@ -77,6 +77,17 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
                                                  const void* cookie,
                                                  protocol_binary_request_header *request,
                                                  ADD_RESPONSE response);
+static ENGINE_ERROR_CODE default_set_memory_limit(ENGINE_HANDLE* handle,
+                                                  size_t limit);
+static ENGINE_ERROR_CODE default_write_range(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const void* key,
+                                             const int nkey,
+                                             uint64_t offset,
+                                             const void* data,
+                                             uint64_t ndata,
+                                             uint64_t *cas,
+                                             uint16_t vbucket);
 
 
 union vbucket_info_adapter {
@@ -131,6 +142,7 @@ ENGINE_ERROR_CODE create_default_engine_instance(uint64_t interface,
    cb_mutex_initialize(&engine->cache_lock);
    cb_mutex_initialize(&engine->stats.lock);
    cb_mutex_initialize(&engine->scrubber.lock);
+   epoch_init(&engine->epoch);
 
    engine->engine.interface.interface = 1;
    engine->engine.get_info = default_get_info;
@@ -149,6 +161,8 @@ ENGINE_ERROR_CODE create_default_engine_instance(uint64_t interface,
    engine->engine.item_set_cas = item_set_cas;
    engine->engine.get_item_info = get_item_info;
    engine->engine.set_item_info = set_item_info;
+   engine->engine.set_memory_limit = default_set_memory_limit;
+   engine->engine.write_range = default_write_range;
    engine->server = *api;
    engine->get_server_api = get_server_api;
    engine->initialized = true;
@@ -328,6 +342,8 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       char val[128];
       int len;
 
+      len = sprintf(val, "%"PRIu64, (uint64_t)slabs_allocated(engine));
+      add_stat("mem_allocated", 13, val, len, cookie);
       cb_mutex_enter(&engine->stats.lock);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.evictions);
       add_stat("evictions", 9, val, len, cookie);
@@ -437,6 +453,35 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    cb_mutex_exit(&engine->stats.lock);
 }
 
+static ENGINE_ERROR_CODE default_set_memory_limit(ENGINE_HANDLE* handle,
+                                                  size_t limit) {
+   struct default_engine *engine = get_handle(handle);
+   ENGINE_ERROR_CODE ret = slabs_set_limit(engine, limit);
+
+   if (ret == ENGINE_SUCCESS) {
+      cb_mutex_enter(&engine->stats.lock);
+      engine->config.maxbytes = limit;
+      cb_mutex_exit(&engine->stats.lock);
+   }
+   return ret;
+}
+
+static ENGINE_ERROR_CODE default_write_range(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const void* key,
+                                             const int nkey,
+                                             uint64_t offset,
+                                             const void* data,
+                                             uint64_t ndata,
+                                             uint64_t *cas,
+                                             uint16_t vbucket) {
+   struct default_engine *engine = get_handle(handle);
+   (void)cookie;
+   VBUCKET_GUARD(engine, vbucket);
+
+   return item_write_range(engine, key, nkey, offset, data, ndata, cas);
+}
+
 static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
                                                  const char *cfg_str) {
    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
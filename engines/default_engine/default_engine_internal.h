@@ -33,6 +33,7 @@
 struct default_engine;
 
 #include "trace.h"
+#include "epoch.h"
 #include "items.h"
 #include "assoc.h"
 #include "slabs.h"
@@ -117,9 +118,11 @@ struct default_engine {
 
    /**
     * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
+    * this single mutex. Lookups may bypass it (see item_get), so
+    * memory unlinked under the lock is reclaimed through the epoch.
     */
    cb_mutex_t cache_lock;
+   struct epoch epoch;
 
    struct config config;
    struct engine_stats stats;
@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+
+#include "default_engine_internal.h"
+
+void epoch_init(struct epoch *epoch) {
+    memset(epoch, 0, sizeof(*epoch));
+    /* 0 is used to mark a free reader slot */
+    epoch->global = 1;
+}
+
+int epoch_enter(struct epoch *epoch) {
+    /* Spread the threads over the slots to avoid false sharing */
+    uint64_t self = (uint64_t)(unsigned long)cb_thread_self();
+    int slot = (int)((self * 0x9E3779B97F4A7C15ULL) >> 58) % EPOCH_READER_SLOTS;
+
+    for (;;) {
+        uint64_t current = epoch->global;
+        if (epoch->readers[slot].epoch == 0 &&
+            ATOMIC_CAS_64(&epoch->readers[slot].epoch, 0, current)) {
+            return slot;
+        }
+        slot = (slot + 1) % EPOCH_READER_SLOTS;
+    }
+}
+
+void epoch_exit(struct epoch *epoch, int slot) {
+    MEMORY_BARRIER();
+    epoch->readers[slot].epoch = 0;
+}
+
+bool epoch_try_advance(struct epoch *epoch) {
+    uint64_t current = epoch->global;
+    int ii;
+
+    MEMORY_BARRIER();
+    for (ii = 0; ii < EPOCH_READER_SLOTS; ++ii) {
+        uint64_t announced = epoch->readers[ii].epoch;
+        if (announced != 0 && announced != current) {
+            return false;
+        }
+    }
+
+    return ATOMIC_CAS_64(&epoch->global, current, current + 1);
+}
+
+void epoch_synchronize(struct epoch *epoch) {
+    int advanced = 0;
+    while (advanced < 2) {
+        if (epoch_try_advance(epoch)) {
+            ++advanced;
+        } else {
+#ifdef WIN32
+            Sleep(0);
+#else
+            usleep(1);
+#endif
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch based reclamation used by the lock-free read path.
+ *
+ * A reader announces the current global epoch in one of the reader slots
+ * before it walks the hash table without holding the cache_lock, and
+ * clears the slot when it is done. Memory unlinked by a writer is parked
+ * until every announced reader has moved past the epoch it was unlinked
+ * in, so a reader never touches memory returned to the slab allocator.
+ *
+ * Readers must never block (or wait for the cache_lock) while they hold a
+ * slot, otherwise a writer waiting in epoch_synchronize would deadlock.
+ */
+
+#ifdef WIN32
+#define ATOMIC_CAS_16(ptr, prev, next) \
+    (InterlockedCompareExchange16((SHORT volatile*)(ptr), (SHORT)(next), \
+                                  (SHORT)(prev)) == (SHORT)(prev))
+#define ATOMIC_CAS_64(ptr, prev, next) \
+    (InterlockedCompareExchange64((LONGLONG volatile*)(ptr), (LONGLONG)(next), \
+                                  (LONGLONG)(prev)) == (LONGLONG)(prev))
+#define MEMORY_BARRIER() MemoryBarrier()
+#else
+#define ATOMIC_CAS_16(ptr, prev, next) \
+            __sync_bool_compare_and_swap(ptr, prev, next)
+#define ATOMIC_CAS_64(ptr, prev, next) \
+            __sync_bool_compare_and_swap(ptr, prev, next)
+#define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+#define EPOCH_READER_SLOTS 64
+
+struct epoch_reader {
+    /* The epoch the reader entered in, or 0 if the slot is free */
+    volatile uint64_t epoch;
+    /* Keep the slots on separate cache lines */
+    char pad[64 - sizeof(uint64_t)];
+};
+
+struct epoch {
+    volatile uint64_t global;
+    struct epoch_reader readers[EPOCH_READER_SLOTS];
+};
+
+void epoch_init(struct epoch *epoch);
+
+/**
+ * Announce a reader in the current epoch
+ * @return the slot to pass to epoch_exit
+ */
+int epoch_enter(struct epoch *epoch);
+
+void epoch_exit(struct epoch *epoch, int slot);
+
+/**
+ * Move the global epoch forward if all active readers have observed
+ * the current one.
+ * @return true if the epoch was advanced
+ */
+bool epoch_try_advance(struct epoch *epoch);
+
+/**
+ * Wait until all readers active at the time of the call have left
+ * (the epoch has been advanced twice).
+ */
+void epoch_synchronize(struct epoch *epoch);
+
+#endif
@@ -28,6 +28,8 @@ static void do_item_update(struct default_engine *engine, hash_item *it);
 static int do_item_replace(struct default_engine *engine,
                             hash_item *it, hash_item *new_it);
 static void item_free(struct default_engine *engine, hash_item *it);
+static void do_item_collect(struct default_engine *engine);
+static bool item_collect_wait(struct default_engine *engine);
 
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
@@ -76,6 +78,61 @@ static uint64_t get_cas_id(void) {
 # define DEBUG_REFCNT(it,op) while(0)
 #endif
 
+/*
+ * The refcount is parked at this value once the last reference to an
+ * unlinked item is gone (and while an item is updated in place), which
+ * prevents lock-free readers from taking new references to it.
+ */
+#define ITEM_REFCOUNT_DEAD ((unsigned short)0xffff)
+
+/* Retired items are collected every this many retirements */
+#define ITEM_COLLECT_INTERVAL 32
+
+/*
+ * Take a reference to an item. Safe to call without the cache_lock as
+ * long as the item can't be reclaimed under our feet (we're in an epoch).
+ * @return false if the item is dead
+ */
+static bool item_refcount_incr(hash_item *it) {
+    unsigned short count;
+    do {
+        count = it->refcount;
+        if (count == ITEM_REFCOUNT_DEAD) {
+            return false;
+        }
+    } while (!ATOMIC_CAS_16(&it->refcount, count, count + 1));
+    DEBUG_REFCNT(it, '+');
+    return true;
+}
+
+/*
+ * Mark an unlinked item without references as dead. Only one caller
+ * succeeds, and that caller is responsible for freeing the item.
+ */
+static bool item_try_kill(hash_item *it) {
+    MEMORY_BARRIER();
+    return (it->iflag & ITEM_LINKED) == 0 &&
+        ATOMIC_CAS_16(&it->refcount, 0, ITEM_REFCOUNT_DEAD);
+}
+
+/*
+ * Drop a reference to an item (doesn't need the cache_lock).
+ * @return true if the caller dropped the last reference to an unlinked
+ *         item and must free it
+ */
+static bool item_refcount_decr(hash_item *it) {
+    unsigned short count;
+    do {
+        count = it->refcount;
+        if (count == 0 || count == ITEM_REFCOUNT_DEAD) {
+            /* The reference was stolen by the tail repair */
+            return false;
+        }
+    } while (!ATOMIC_CAS_16(&it->refcount, count, count - 1));
+    DEBUG_REFCNT(it, '-');
+    return count == 1 && item_try_kill(it);
+}
+
 
 /*@null@*/
 hash_item *do_item_alloc(struct default_engine *engine,
@@ -113,20 +170,18 @@ hash_item *do_item_alloc(struct default_engine *engine,
         if (search->refcount == 0 &&
             ((search->time < oldest_live) || /* dead by flush */
              (search->exptime != 0 && search->exptime < current_time))) {
-            it = search;
-            /* I don't want to actually free the object, just steal
-             * the item to avoid to grab the slab mutex twice ;-)
+            /* We can't steal the memory directly as a lock-free reader
+             * may still be looking at it, so unlink it and collect what
+             * the readers have left if the slab class is full.
              */
             cb_mutex_enter(&engine->stats.lock);
             engine->stats.reclaimed++;
             cb_mutex_exit(&engine->stats.lock);
             engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-            it->refcount = 0;
+            do_item_unlink(engine, search);
+            if ((it = slabs_alloc(engine, ntotal, id)) == NULL) {
+                do_item_collect(engine);
+            }
             break;
         }
     }
@@ -180,6 +235,7 @@ hash_item *do_item_alloc(struct default_engine *engine,
                     cb_mutex_exit(&engine->stats.lock);
                 }
                 do_item_unlink(engine, search);
+                do_item_collect(engine);
                 break;
             }
         }
@@ -196,9 +252,13 @@ hash_item *do_item_alloc(struct default_engine *engine,
             tries = search_items;
             for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
                 if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    unsigned short count;
                     engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
+                    do {
+                        count = search->refcount;
+                    } while (!ATOMIC_CAS_16(&search->refcount, count, 0));
                     do_item_unlink(engine, search);
+                    do_item_collect(engine);
                     break;
                 }
             }
@@ -228,22 +288,97 @@ hash_item *do_item_alloc(struct default_engine *engine,
     return it;
 }
 
+/*
+ * Retire an item we hold the last reference to. Lock-free readers may
+ * still be looking at it, so it isn't returned to the slab allocator
+ * until they have left the current epoch.
+ */
 static void item_free(struct default_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
-    unsigned int clsid;
+    int idx = (int)(engine->epoch.global % 3);
     cb_assert((it->iflag & ITEM_LINKED) == 0);
     cb_assert(it != engine->items.heads[it->slabs_clsid]);
     cb_assert(it != engine->items.tails[it->slabs_clsid]);
-    cb_assert(it->refcount == 0);
+    cb_assert(it->refcount == ITEM_REFCOUNT_DEAD);
+
+    it->next = engine->items.retired[idx];
+    engine->items.retired[idx] = it;
+    if (++engine->items.nretired % ITEM_COLLECT_INTERVAL == 0) {
+        do_item_collect(engine);
+    }
+}
+
+static void item_reclaim(struct default_engine *engine, hash_item *it) {
+    size_t ntotal = ITEM_ntotal(engine, it);
+    unsigned int clsid;
 
     /* so slab size changer can tell later if item is already free or not */
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
     it->iflag |= ITEM_SLABBED;
+    it->refcount = 0;
     DEBUG_REFCNT(it, 'F');
     slabs_free(engine, it, ntotal, clsid);
 }
 
+static void item_reclaim_chain(struct default_engine *engine, hash_item *it) {
+    while (it != NULL) {
+        hash_item *next = it->next;
+        item_reclaim(engine, it);
+        it = next;
+    }
+}
+
+/*
+ * Return the retired items nobody can reference any more to the slab
+ * allocator, without waiting for the readers. The epoch is advanced up to
+ * twice, so that with no reader in the way the items retired just now are
+ * released too.
+ */
+static void do_item_collect(struct default_engine *engine) {
+    int ii;
+    for (ii = 0; ii < 2 && epoch_try_advance(&engine->epoch); ++ii) {
+        /* Items retired two epochs ago are unreachable */
+        int idx = (int)((engine->epoch.global + 1) % 3);
+        hash_item *it = engine->items.retired[idx];
+        engine->items.retired[idx] = NULL;
+        item_reclaim_chain(engine, it);
+    }
+}
+
+/*
+ * Wait for the lock-free readers to leave and release everything that was
+ * retired before we started. The caller must not hold the cache_lock; we
+ * only take it to detach the retired items and to release them, so other
+ * writers don't wait for the readers with us.
+ * @return true if there was anything to release
+ */
+static bool item_collect_wait(struct default_engine *engine) {
+    hash_item *retired[3];
+    bool found = false;
+    int ii;
+
+    cb_mutex_enter(&engine->cache_lock);
+    for (ii = 0; ii < 3; ++ii) {
+        retired[ii] = engine->items.retired[ii];
+        engine->items.retired[ii] = NULL;
+        found |= retired[ii] != NULL;
+    }
+    cb_mutex_exit(&engine->cache_lock);
+
+    if (!found) {
+        return false;
+    }
+
+    epoch_synchronize(&engine->epoch);
+
+    cb_mutex_enter(&engine->cache_lock);
+    for (ii = 0; ii < 3; ++ii) {
+        item_reclaim_chain(engine, retired[ii]);
+    }
+    cb_mutex_exit(&engine->cache_lock);
+    return true;
+}
+
 static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
     hash_item **head, **tail;
     cb_assert(it->slabs_clsid < POWER_LARGEST);
@@ -321,7 +456,7 @@ void do_item_unlink(struct default_engine *engine, hash_item *it) {
                                                             it->nkey, 0),
                      item_get_key(it), it->nkey);
         item_unlink_q(engine, it);
-        if (it->refcount == 0) {
+        if (item_try_kill(it)) {
             item_free(engine, it);
         }
     }
@@ -329,11 +464,7 @@ void do_item_unlink(struct default_engine *engine, hash_item *it) {
 
 void do_item_release(struct default_engine *engine, hash_item *it) {
     MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
-    }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+    if (item_refcount_decr(it)) {
         item_free(engine, it);
     }
 }
@@ -358,8 +489,44 @@ int do_item_replace(struct default_engine *engine,
                            item_get_key(new_it), new_it->nkey, new_it->nbytes);
     cb_assert((it->iflag & ITEM_SLABBED) == 0);
 
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    if ((it->iflag & ITEM_LINKED) == 0) {
+        return do_item_link(engine, new_it);
+    }
+
+    if (it == new_it || (new_it->iflag & ITEM_LINKED) != 0) {
+        /* The item is stored again; nothing to swap */
+        do_item_unlink(engine, it);
+        return do_item_link(engine, new_it);
+    }
+
+    /*
+     * Swap the items in the hash chain rather than unlinking the old one
+     * first; a lock-free get in between would take the miss as final.
+     */
+    cb_assert((new_it->iflag & ITEM_SLABBED) == 0);
+    cb_assert(new_it->nbytes < (1024 * 1024));  /* 1MB max size */
+    new_it->iflag |= ITEM_LINKED;
+    new_it->time = engine->server.core->get_current_time();
+    assoc_replace(engine, engine->server.core->hash(item_get_key(it),
+                                                    it->nkey, 0),
+                  it, new_it);
+    it->iflag &= ~ITEM_LINKED;
+
+    cb_mutex_enter(&engine->stats.lock);
+    engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
+    engine->stats.curr_bytes += ITEM_ntotal(engine, new_it);
+    engine->stats.total_items += 1;
+    cb_mutex_exit(&engine->stats.lock);
+
+    /* Allocate a new CAS ID on link. */
+    item_set_cas(NULL, NULL, new_it, get_cas_id());
+
+    item_unlink_q(engine, it);
+    item_link_q(engine, new_it);
+    if (item_try_kill(it)) {
+        item_free(engine, it);
+    }
+    return 1;
 }
 
 /*@null@*/
@@ -553,14 +720,64 @@ hash_item *do_item_get(struct default_engine *engine,
     }
 
     if (it != NULL) {
-        it->refcount++;
-        DEBUG_REFCNT(it, '+');
-        do_item_update(engine, it);
+        if (item_refcount_incr(it)) {
+            do_item_update(engine, it);
+        } else {
+            /* Being updated in place by someone else */
+            it = NULL;
+        }
     }
 
     return it;
 }
 
+/*
+ * Look up an item without the cache_lock.
+ * @return true if the result in *ret is final, false if the caller
+ *         must repeat the lookup under the cache_lock
+ */
+static bool item_get_lockless(struct default_engine *engine,
+                              const char *key, const size_t nkey,
+                              hash_item **ret) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    uint32_t hash = engine->server.core->hash(key, nkey, 0);
+    bool conclusive;
+    hash_item *it;
+    int slot;
+
+    slot = epoch_enter(&engine->epoch);
+    it = assoc_find_lockless(engine, hash, key, nkey, &conclusive);
+    if (it != NULL && !item_refcount_incr(it)) {
+        it = NULL;
+        conclusive = false;
+    }
+    epoch_exit(&engine->epoch, slot);
+
+    *ret = NULL;
+    if (it == NULL) {
+        return conclusive;
+    }
+
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        (engine->config.oldest_live != 0 &&
+         engine->config.oldest_live <= current_time &&
+         it->time <= engine->config.oldest_live) ||
+        (it->exptime != 0 && it->exptime <= current_time)) {
+        /* Let the locked path deal with the lazy expiry */
+        item_release(engine, it);
+        return false;
+    }
+
+    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+        cb_mutex_enter(&engine->cache_lock);
+        do_item_update(engine, it);
+        cb_mutex_exit(&engine->cache_lock);
+    }
+
+    *ret = it;
+    return true;
+}
+
 /*
  * Stores an item in the cache according to the semantics of one of the set
  * commands. In threaded mode, this is protected by the cache lock.
@@ -734,12 +951,17 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
         return ENGINE_EINVAL;
     }
 
-    if (it->refcount == 1 && res <= (int)it->nbytes) {
-        /* we can do inline replacement */
+    if (res <= (int)it->nbytes &&
+        ATOMIC_CAS_16(&it->refcount, 1, ITEM_REFCOUNT_DEAD)) {
+        /* we can do inline replacement. Parking the refcount stops
+         * lock-free readers from picking up a half written value; they
+         * will retry under the cache_lock instead. */
         memcpy(item_get_data(it), buf, res);
         memset(item_get_data(it) + res, ' ', it->nbytes - res);
         item_set_cas(NULL, NULL, it, get_cas_id());
         *rcas = item_get_cas(it);
+        MEMORY_BARRIER();
+        it->refcount = 1;
     } else {
         hash_item *new_it = do_item_alloc(engine, item_get_key(it),
                                           it->nkey, it->flags,
@@ -772,6 +994,17 @@ hash_item *item_alloc(struct default_engine *engine,
     it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
                        datatype);
     cb_mutex_exit(&engine->cache_lock);
+
+    /*
+     * The memory we evicted may still be held up by lock-free readers;
+     * wait for them (without the cache_lock) and try once more.
+     */
+    if (it == NULL && item_collect_wait(engine)) {
+        cb_mutex_enter(&engine->cache_lock);
+        it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
+                           datatype);
+        cb_mutex_exit(&engine->cache_lock);
+    }
     return it;
 }
 
@@ -782,6 +1015,12 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
+    /* The locked path does the verbose logging */
+    if (engine->config.verbose <= 2 &&
+        item_get_lockless(engine, key, nkey, &it)) {
+        return it;
+    }
+
     cb_mutex_enter(&engine->cache_lock);
     it = do_item_get(engine, key, nkey);
     cb_mutex_exit(&engine->cache_lock);
@@ -790,12 +1029,15 @@ hash_item *item_get(struct default_engine *engine,
 
 /*
  * Decrements the reference count on an item and adds it to the freelist if
- * needed.
+ * needed. The cache_lock is only needed to retire the item.
  */
 void item_release(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_release(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
+    MEMCACHED_ITEM_REMOVE(item_get_key(item), item->nkey, item->nbytes);
+    if (item_refcount_decr(item)) {
+        cb_mutex_enter(&engine->cache_lock);
+        item_free(engine, item);
+        cb_mutex_exit(&engine->cache_lock);
+    }
 }
 
 /*
@@ -875,6 +1117,62 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
     return ret;
 }
 
+/*
+ * Overwrite part of the value of an item in place. Only done while nobody
+ * else has a reference to the item (a connection may be sending it); the
+ * caller stores a modified copy otherwise.
+ */
+static ENGINE_ERROR_CODE do_item_write_range(struct default_engine *engine,
+                                             const void *key,
+                                             const int nkey,
+                                             uint64_t offset,
+                                             const void *data,
+                                             uint64_t ndata,
+                                             uint64_t *cas)
+{
+    hash_item *it = do_item_get(engine, key, nkey);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (it == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+
+    if (*cas != 0 && *cas != item_get_cas(it)) {
+        ret = ENGINE_KEY_EEXISTS;
+    } else if (offset + ndata > (uint64_t)it->nbytes) {
+        ret = ENGINE_ERANGE;
+    } else if ((it->datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) ||
+               !ATOMIC_CAS_16(&it->refcount, 1, ITEM_REFCOUNT_DEAD)) {
+        ret = ENGINE_NOT_STORED;
+    } else {
+        /* Parked like in do_add_delta while the value is half written */
+        memcpy(item_get_data(it) + offset, data, ndata);
+        item_set_cas(NULL, NULL, it, get_cas_id());
+        *cas = item_get_cas(it);
+        MEMORY_BARRIER();
+        it->refcount = 1;
+    }
+
+    do_item_release(engine, it);
+    return ret;
+}
+
+ENGINE_ERROR_CODE item_write_range(struct default_engine *engine,
+                                   const void *key,
+                                   const int nkey,
+                                   uint64_t offset,
+                                   const void *data,
+                                   uint64_t ndata,
+                                   uint64_t *cas)
+{
+    ENGINE_ERROR_CODE ret;
+
+    cb_mutex_enter(&engine->cache_lock);
+    ret = do_item_write_range(engine, key, nkey, offset, data, ndata, cas);
+    cb_mutex_exit(&engine->cache_lock);
+    return ret;
+}
+
 /*
  * Stores an item in the cache (high level, obeys set/add/replace semantics)
  */
@@ -1141,7 +1439,7 @@ static ENGINE_ERROR_CODE item_tap_iterfunc(struct default_engine *engine,
                                     void *cookie) {
     struct tap_client *client = cookie;
     client->it = item;
-    ++client->it->refcount;
+    item_refcount_incr(client->it);
     return ENGINE_SUCCESS;
 }
 
@@ -1252,7 +1550,7 @@ static ENGINE_ERROR_CODE item_dcp_iterfunc(struct default_engine *engine,
                                            void *cookie) {
     struct dcp_connection *connection = cookie;
     connection->it = item;
-    ++connection->it->refcount;
+    item_refcount_incr(connection->it);
     return ENGINE_SUCCESS;
 }
 
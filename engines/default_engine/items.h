@@ -18,7 +18,7 @@ typedef struct _hash_item {
     uint16_t iflag; /**< Intermal flags. lower 8 bit is reserved for the core
                      * server, the upper 8 bits is reserved for engine
                      * implementation. */
-    unsigned short refcount;
+    volatile unsigned short refcount; /**< Only modified through CAS */
     uint8_t slabs_clsid;/* which slab class we're in */
     uint8_t datatype;/* to identify the type of the data */
 } hash_item;
@@ -37,6 +37,10 @@ struct items {
    hash_item *tails[POWER_LARGEST];
    itemstats_t itemstats[POWER_LARGEST];
    unsigned int sizes[POWER_LARGEST];
+   /* Unlinked items waiting for the readers to leave the epoch they
+    * were retired in (indexed by epoch % 3, chained through next) */
+   hash_item *retired[3];
+   unsigned int nretired;
 };
 
 
@@ -56,7 +60,10 @@ hash_item *item_alloc(struct default_engine *engine,
                       uint8_t datatype);
 
 /**
- * Get an item from the cache
+ * Get an item from the cache. The lookup is performed without the
+ * cache_lock and only falls back to the locked path on a miss which
+ * may have raced with a hash table expansion, or for items which need
+ * to be lazily expired.
  *
  * @param engine handle to the storage engine
  * @param key the key for the item to get
@@ -116,7 +123,8 @@ char *item_cachedump(struct default_engine *engine,
 void  item_flush_expired(struct default_engine *engine, time_t when);
 
 /**
- * Release our reference to the current item
+ * Release our reference to the current item. The cache_lock is only
+ * acquired if this was the last reference to an unlinked item.
  * @param engine handle to the storage engine
  * @param it the item to release
  */
@@ -172,6 +180,25 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              uint8_t datatype,
                              uint64_t *result);
 
+/**
+ * Overwrite part of the value of an item in place
+ * @param engine handle to the storage engine
+ * @param key the key of the item
+ * @param nkey the length of the key
+ * @param offset where in the value to write
+ * @param data the bytes to write
+ * @param ndata the number of bytes to write
+ * @param cas the CAS the item must have (if not 0), set to the new CAS
+ * @return ENGINE_NOT_STORED if the item is in use (see engine.h)
+ */
+ENGINE_ERROR_CODE item_write_range(struct default_engine *engine,
+                                   const void *key,
+                                   const int nkey,
+                                   uint64_t offset,
+                                   const void *data,
+                                   uint64_t ndata,
+                                   uint64_t *cas);
+
 
 /**
  * Start the item scrubber
@@ -419,6 +419,29 @@ void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned
     cb_mutex_exit(&engine->slabs.lock);
 }
 
+ENGINE_ERROR_CODE slabs_set_limit(struct default_engine *engine, size_t limit) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    cb_mutex_enter(&engine->slabs.lock);
+    if (engine->slabs.mem_base != NULL) {
+        /* We can't grow (or give back) the preallocated chunk */
+        ret = ENGINE_ENOTSUP;
+    } else {
+        engine->slabs.mem_limit = limit;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret;
+}
+
+size_t slabs_allocated(struct default_engine *engine) {
+    size_t ret;
+
+    cb_mutex_enter(&engine->slabs.lock);
+    ret = engine->slabs.mem_malloced;
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret;
+}
+
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c) {
     cb_mutex_enter(&engine->slabs.lock);
     do_slabs_stats(engine, add_stats, c);
@@ -80,6 +80,17 @@ void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal);
 
+/**
+ * Change the memory limit. Memory already handed out to the slab classes
+ * isn't released when the limit is lowered, it just stops them from
+ * growing any further.
+ * @return ENGINE_ENOTSUP if the memory is preallocated
+ */
+ENGINE_ERROR_CODE slabs_set_limit(struct default_engine *engine, size_t limit);
+
+/** The number of bytes handed out to the slab classes so far */
+size_t slabs_allocated(struct default_engine *engine);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c);
 
@@ -28,6 +28,7 @@
 #include <memcached/extension.h>
 #include <memcached/engine.h>
 #include <memcached/syslog.h>
+#include <memcached/util.h>
 
 #include "extensions/protocol_extension.h"
 
@@ -80,6 +81,14 @@ static size_t buffersz = 2048 * 1024;
 /* The sleeptime between each forced flush of the buffer */
 static size_t sleeptime = 60;
 
+/* The CPUs to run the thread performing the disk IO on (the "cpus"
+ * configuration parameter, in the "0-3,8" format). By default it may run
+ * on any CPU.
+ */
+#define MAX_LOGGER_CPUS 1024
+static int logger_cpus[MAX_LOGGER_CPUS];
+static int num_logger_cpus;
+
 /* To avoid race condition we're protecting our shared resources with a
  * single mutex. */
 static cb_mutex_t mutex;
@@ -452,9 +461,17 @@ static cb_thread_t tid;
 static void logger_thead_main(void* arg)
 {
     size_t currsize = 0;
-    HANDLE fp = open_logfile(arg);
+    HANDLE fp;
 
     struct timeval tp;
+
+    if (num_logger_cpus > 0 &&
+        !bind_thread_to_cpus(logger_cpus, num_logger_cpus)) {
+        fprintf(stderr, "Failed to bind the logger thread: %s\n",
+                strerror(errno));
+    }
+    fp = open_logfile(arg);
+
     cb_get_timeofday(&tp);
     time_t next = (time_t)tp.tv_sec;
 
@@ -584,7 +601,8 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
 
     if (config != NULL) {
         char *loglevel = NULL;
-        struct config_item items[8];
+        char *cpus = NULL;
+        struct config_item items[9];
         int ii = 0;
         memset(&items, 0, sizeof(items));
 
@@ -623,9 +641,14 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
         items[ii].value.dt_bool = &unit_test;
         ++ii;
 
+        items[ii].key = "cpus";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &cpus;
+        ++ii;
+
         items[ii].key = NULL;
         ++ii;
-        cb_assert(ii == 8);
+        cb_assert(ii == 9);
 
         if (sapi->core->parse_config(config, items, stderr) != ENGINE_SUCCESS) {
             return EXTENSION_FATAL;
@@ -647,6 +670,17 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
             }
         }
         free(loglevel);
+
+        if (cpus != NULL) {
+            num_logger_cpus = parse_cpu_list(cpus, logger_cpus,
+                                             MAX_LOGGER_CPUS);
+            if (num_logger_cpus <= 0) {
+                fprintf(stderr, "Invalid list of CPUs: %s\n", cpus);
+                free(cpus);
+                return EXTENSION_FATAL;
+            }
+            free(cpus);
+        }
     }
 
     if (fname == NULL) {
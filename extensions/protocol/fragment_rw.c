@@ -114,6 +114,29 @@ static ENGINE_ERROR_CODE handle_fragment_rw(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR
     item = NULL;
     data = key + nkey;
 
+    if (request->request.opcode == write_command &&
+        ntohl(request->request.bodylen) != 8 + nkey + len) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if (request->request.opcode == write_command && v1->write_range != NULL) {
+        r = v1->write_range(handle, cookie, key, nkey, offset, data, len,
+                            &cas, vbucket);
+        if (r == ENGINE_SUCCESS) {
+            if (!response(NULL, 0, NULL, 0, NULL, 0,
+                          PROTOCOL_BINARY_RAW_BYTES,
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                          cas, cookie)) {
+                return ENGINE_DISCONNECT;
+            }
+        }
+        if (r != ENGINE_NOT_STORED) {
+            return r;
+        }
+        /* Someone else is using the item; store a modified copy */
+    }
+
     r = v1->get(handle, cookie, &item, key, nkey, vbucket);
     if (r == ENGINE_SUCCESS) {
         item_info item_info;
@@ -131,12 +154,13 @@ static ENGINE_ERROR_CODE handle_fragment_rw(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR
             if (request->request.opcode == read_command) {
                 uint8_t *ptr;
                 ptr =  ((uint8_t*)item_info.value[0].iov_base) + offset;
-                if (!response(NULL, 0, NULL, 0, ptr,
-                              (uint32_t)len, PROTOCOL_BINARY_RAW_BYTES,
-                              PROTOCOL_BINARY_RESPONSE_SUCCESS,
-                              item_info.cas, cookie)) {
+                /* Sent straight from the item, which the core releases */
+                if (!server_api()->cookie->send_item_range(cookie, item, ptr,
+                                                           (uint32_t)len,
+                                                           item_info.cas)) {
                     return ENGINE_DISCONNECT;
                 }
+                return ENGINE_SUCCESS;
             } else {
                 r = create_object(v1, handle, cookie, &item_info,
                                   vbucket, data, offset, len, &cas,
@@ -556,6 +556,55 @@ extern "C" {
                                                engine_get_vb_map_cb callback);
 
         struct dcp_interface dcp;
+
+        /**
+         * Change the amount of memory the engine may use for its data.
+         * This is optional (may be NULL), and is used by bucket_engine
+         * to move memory between buckets.
+         *
+         * The engine should report its current limit in the
+         * "engine_maxbytes" stat and the number of items evicted to
+         * make room for new ones in the "evictions" stat.
+         *
+         * @param handle the engine handle
+         * @param limit the new limit in bytes
+         * @return ENGINE_SUCCESS if the limit was changed
+         */
+        ENGINE_ERROR_CODE (*set_memory_limit)(ENGINE_HANDLE* handle,
+                                              size_t limit);
+
+        /**
+         * Overwrite part of the value of an item in place. This is
+         * optional (may be NULL), and is used for the ranged writes of
+         * the fragment_rw extension, which otherwise store a modified
+         * copy of the whole item.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param key the key of the item
+         * @param nkey the length of the key
+         * @param offset where in the value to write
+         * @param data the bytes to write
+         * @param ndata the number of bytes to write
+         * @param cas if not 0, the CAS the item must have. Set to the
+         *            new CAS of the item on success
+         * @param vbucket the virtual bucket id
+         * @return ENGINE_SUCCESS if the item was updated,
+         *         ENGINE_KEY_EEXISTS if the CAS didn't match, ENGINE_ERANGE
+         *         if the range is beyond the end of the value, or
+         *         ENGINE_NOT_STORED if the item can't be updated in place
+         *         right now (someone else is using it); the caller should
+         *         then store a modified copy
+         */
+        ENGINE_ERROR_CODE (*write_range)(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         const void* key,
+                                         const int nkey,
+                                         uint64_t offset,
+                                         const void* data,
+                                         uint64_t ndata,
+                                         uint64_t *cas,
+                                         uint16_t vbucket);
     } ENGINE_HANDLE_V1;
 
     /**
@@ -186,6 +186,9 @@ extern "C"
         PROTOCOL_BINARY_CMD_AUDIT_PUT = 0x27,
         PROTOCOL_BINARY_CMD_AUDIT_CONFIG_RELOAD = 0x28,
 
+        /* Get many keys with one request (see protocol_binary_mget_key) */
+        PROTOCOL_BINARY_CMD_MGET = 0x29,
+
         /* These commands are used for range operations and exist within
          * this header for use in other projects.  Range operations are
          * not expected to be implemented in the memcached server itself.
@@ -463,6 +466,47 @@ extern "C"
     typedef protocol_binary_response_get protocol_binary_response_getk;
     typedef protocol_binary_response_get protocol_binary_response_getkq;
 
+    /**
+     * Definition of the packet used by the multi-get command. It has no
+     * extras and no key, the body is a list of keys, each with the
+     * vbucket it belongs to:
+     *
+     *   <vbucket (2 bytes)> <key length (2 bytes)> <key>
+     *
+     * (see protocol_binary_mget_key, in network byte order).
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_mget;
+
+    typedef union {
+        struct {
+            uint16_t vbucket;
+            uint16_t keylen;
+        } key;
+        uint8_t bytes[4];
+    } protocol_binary_mget_key;
+
+    /**
+     * The response to the multi-get command is a single packet (status
+     * success unless the request itself is invalid), whose body starts
+     * with a bitmap of the keys which don't exist (bit n % 8 of byte n / 8
+     * set for the n-th key, the bitmap is (# keys + 7) / 8 bytes). Then
+     * each of the other keys has, in the order they were requested, an
+     * entry (the first 20 bytes of protocol_binary_mget_entry, the fields
+     * in network byte order) followed by its value. The status of a key
+     * may be an error (like not my vbucket), with no value.
+     */
+    typedef union {
+        struct {
+            uint64_t cas;
+            uint32_t flags;
+            uint32_t vallen;
+            uint16_t status;
+            uint8_t datatype;
+            uint8_t reserved;
+        } entry;
+        uint8_t bytes[20];
+    } protocol_binary_mget_entry;
+
     /**
      * Definition of the packet used by the delete command
      * See section 4
@@ -619,6 +663,25 @@ extern "C"
      */
     typedef protocol_binary_response_no_extras protocol_binary_response_stats;
 
+    /**
+     * "stats bulk [json|binary] [group ...]" returns the groups (by default
+     * "general" (the plain stats), "slabs" and "items") as a single stat
+     * named "bulk" (followed by the usual empty stat), whose value is
+     * either a JSON object with an object per group
+     * ({"general": {...}, "slabs": {...}}), or the binary form:
+     *
+     *   PROTOCOL_BINARY_BULK_STATS_MAGIC (4 bytes), followed by
+     *   GROUP <name length> <name>         starts a group
+     *   STAT <key length> <key> <value length> <value>
+     *
+     * where GROUP and STAT are a byte each, and the lengths are unsigned
+     * LEB128 varints (7 bits per byte, least significant first, the top
+     * bit set on all but the last byte).
+     */
+#define PROTOCOL_BINARY_BULK_STATS_MAGIC "MCS\x01"
+#define PROTOCOL_BINARY_BULK_STATS_GROUP 0x00
+#define PROTOCOL_BINARY_BULK_STATS_STAT 0x01
+
     /**
      * Definition of the packet used by the verbosity command
      */
@@ -945,16 +1008,32 @@ extern "C"
     typedef enum {
         PROTOCOL_BINARY_FEATURE_DATATYPE = 0x01,
         PROTOCOL_BINARY_FEATURE_TLS = 0x2,
-        PROTOCOL_BINARY_FEATURE_TCPNODELAY = 0x03
+        PROTOCOL_BINARY_FEATURE_TCPNODELAY = 0x03,
+        /*
+         * The server may send the responses out of order (the client
+         * matches them by their opaque): a get the engine has to fetch
+         * the item for no longer holds up the requests behind it.
+         */
+        PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION = 0x04,
+        /*
+         * Everything after the HELLO response, both ways, is one LZ4
+         * frame stream (flushed for every send). The client must wait
+         * for the HELLO response before it sends anything else, and
+         * can't turn it off again. Not available over SSL.
+         */
+        PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION = 0x05
     } protocol_binary_hello_features;
 
     #define MEMCACHED_FIRST_HELLO_FEATURE 0x01
-    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x03
+    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x05
 
 #define protocol_feature_2_text(a) \
     (a == PROTOCOL_BINARY_FEATURE_DATATYPE) ? "Datatype" : \
     (a == PROTOCOL_BINARY_FEATURE_TLS) ? "TLS" : \
-    (a == PROTOCOL_BINARY_FEATURE_TCPNODELAY) ? "TCP NODELAY" : "Unknown"
+    (a == PROTOCOL_BINARY_FEATURE_TCPNODELAY) ? "TCP NODELAY" : \
+    (a == PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION) ? "Unordered execution" : \
+    (a == PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION) ? "Stream compression" : \
+    "Unknown"
 
     /**
      * The HELLO command is used by the client and the server to agree
@@ -1229,6 +1308,11 @@ extern "C"
     typedef protocol_binary_request_no_extras protocol_binary_request_ssl_refresh;
     typedef protocol_binary_response_no_extras protocol_binary_response_ssl_refresh;
 
+    /**
+     * GET_CMD_TIMER returns the timings of the opcode in the extras. The
+     * key is optional: "interval" returns the timings since the previous
+     * "interval" request, and "reset" returns the timings and clears them.
+     */
     typedef union {
         struct {
             protocol_binary_request_header header;
@@ -205,6 +205,26 @@ extern "C" {
          */
         void (*set_priority)(const void *cookie, CONN_PRIORITY priority);
 
+        /**
+         * Respond to the current command (of a protocol extension) with
+         * part of the value of an item. The bytes are sent straight from
+         * the item instead of being copied into the response, so the core
+         * takes over the caller's reference to the item and releases it
+         * once the response is sent. Call it instead of the ADD_RESPONSE
+         * callback.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @param it the item (the caller's reference)
+         * @param value the first byte to send (within the item's value)
+         * @param nvalue the number of bytes to send
+         * @param cas the CAS to put in the response
+         * @return false if the response couldn't be built (the item is
+         *         released, and the caller should return ENGINE_DISCONNECT)
+         */
+        bool (*send_item_range)(const void *cookie, item *it,
+                                const void *value, uint32_t nvalue,
+                                uint64_t cas);
+
     } SERVER_COOKIE_API;
 
 #ifdef WIN32
@@ -24,6 +24,26 @@ MEMCACHED_PUBLIC_API bool safe_strtof(const char *str, float *out);
 MEMCACHED_PUBLIC_API
 const char *memcached_protocol_errcode_2_text(protocol_binary_response_status err);
 
+/**
+ * Parse a list of CPUs in the format used by the kernel ("0-3,8,10-11").
+ *
+ * @param list the list to parse
+ * @param cpus where to store the CPU numbers (in the order listed)
+ * @param max the size of cpus
+ * @return the number of CPUs in the list, or -1 if it's malformed (or
+ *         holds more than max CPUs)
+ */
+MEMCACHED_PUBLIC_API int parse_cpu_list(const char *list, int *cpus, int max);
+
+/**
+ * Restrict the calling thread to run on the given CPUs (threads it starts
+ * later inherit this).
+ *
+ * @return false (with errno set) if it couldn't be done, or isn't
+ *         supported on this platform
+ */
+MEMCACHED_PUBLIC_API bool bind_thread_to_cpus(const int *cpus, int count);
+
 #ifdef __GCC
 # define __gcc_attribute__ __attribute__
 #else
@@ -373,6 +373,30 @@ static void *mock_get_stats_struct(ENGINE_HANDLE* handle, const void* cookie)
     return me->the_engine->get_stats_struct((ENGINE_HANDLE*)me->the_engine, cookie);
 }
 
+static ENGINE_ERROR_CODE mock_set_memory_limit(ENGINE_HANDLE* handle,
+                                               size_t limit)
+{
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->set_memory_limit((ENGINE_HANDLE*)me->the_engine,
+                                            limit);
+}
+
+static ENGINE_ERROR_CODE mock_write_range(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const void* key,
+                                          const int nkey,
+                                          uint64_t offset,
+                                          const void* data,
+                                          uint64_t ndata,
+                                          uint64_t *cas,
+                                          uint16_t vbucket)
+{
+    struct mock_engine *me = get_handle(handle);
+    return me->the_engine->write_range((ENGINE_HANDLE*)me->the_engine,
+                                       cookie, key, nkey, offset,
+                                       data, ndata, cas, vbucket);
+}
+
 static ENGINE_ERROR_CODE mock_aggregate_stats(ENGINE_HANDLE* handle,
                                               const void* cookie,
                                               void (*callback)(void*, void*),
@@ -938,6 +962,8 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     mock_engine.me.get_tap_iterator = mock_get_tap_iterator;
     mock_engine.me.item_set_cas = mock_item_set_cas;
     mock_engine.me.get_item_info = mock_get_item_info;
+    mock_engine.me.set_memory_limit = mock_set_memory_limit;
+    mock_engine.me.write_range = mock_write_range;
     mock_engine.me.dcp.step = mock_dcp_step;
     mock_engine.me.dcp.open = mock_dcp_open;
     mock_engine.me.dcp.add_stream = mock_dcp_add_stream;
@@ -967,6 +993,12 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     if (mock_engine.the_engine->get_stats_struct == NULL) {
         mock_engine.me.get_stats_struct = NULL;
     }
+    if (mock_engine.the_engine->set_memory_limit == NULL) {
+        mock_engine.me.set_memory_limit = NULL;
+    }
+    if (mock_engine.the_engine->write_range == NULL) {
+        mock_engine.me.write_range = NULL;
+    }
     if (mock_engine.the_engine->aggregate_stats == NULL) {
         mock_engine.me.aggregate_stats = NULL;
     }
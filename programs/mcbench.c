@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * mcbench runs small requests against a memcached server over a number of
+ * connections (one thread each) for a while, and reports the throughput
+ * and the round trip latency distribution. It is used to compare server
+ * configurations (such as the io backend) with each other.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <memcached/openssl.h>
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utilities.h"
+
+struct bench_conn {
+    BIO *bio;
+    SSL_CTX *ctx;
+    cb_thread_t tid;
+    char key[32];
+    /* One request per pipeline slot */
+    char *requests;
+    size_t request_size;
+    /* Round trip time of each batch in usec */
+    uint64_t *samples;
+    size_t nsamples;
+    size_t maxsamples;
+    uint64_t ops;
+};
+
+static int depth = 1;
+static bool use_get = false;
+static uint32_t valsize = 32;
+static hrtime_t deadline;
+
+static void build_request(char *dest, uint8_t opcode, const char *key,
+                          uint32_t extlen, uint32_t bodylen) {
+    protocol_binary_request_header *req = (void*)dest;
+    uint16_t keylen = (uint16_t)strlen(key);
+
+    memset(req, 0, sizeof(*req));
+    req->request.magic = PROTOCOL_BINARY_REQ;
+    req->request.opcode = opcode;
+    req->request.keylen = htons(keylen);
+    req->request.extlen = (uint8_t)extlen;
+    req->request.bodylen = htonl(extlen + keylen + bodylen);
+    memset(dest + sizeof(*req), 0, extlen);
+    memcpy(dest + sizeof(*req) + extlen, key, keylen);
+}
+
+/* Read a response and return its status */
+static uint16_t read_response(BIO *bio) {
+    protocol_binary_response_header res;
+    char buffer[4096];
+    uint32_t bodylen;
+
+    ensure_recv(bio, &res, sizeof(res.bytes));
+    bodylen = ntohl(res.response.bodylen);
+    while (bodylen > 0) {
+        uint32_t chunk = bodylen > sizeof(buffer) ? sizeof(buffer) : bodylen;
+        ensure_recv(bio, buffer, chunk);
+        bodylen -= chunk;
+    }
+    return ntohs(res.response.status);
+}
+
+static void store_key(struct bench_conn *conn) {
+    size_t size = sizeof(protocol_binary_request_header) + 8 +
+        strlen(conn->key) + valsize;
+    char *req = calloc(1, size);
+
+    if (req == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    build_request(req, PROTOCOL_BINARY_CMD_SET, conn->key, 8, valsize);
+    memset(req + size - valsize, 'x', valsize);
+    ensure_send(conn->bio, req, (int)size);
+    if (read_response(conn->bio) != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        fprintf(stderr, "Failed to store %s\n", conn->key);
+        exit(EXIT_FAILURE);
+    }
+    free(req);
+}
+
+static void add_sample(struct bench_conn *conn, uint64_t usec) {
+    if (conn->nsamples == conn->maxsamples) {
+        size_t max = conn->maxsamples ? conn->maxsamples * 2 : 65536;
+        uint64_t *samples = realloc(conn->samples, max * sizeof(uint64_t));
+        if (samples == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        conn->samples = samples;
+        conn->maxsamples = max;
+    }
+    conn->samples[conn->nsamples++] = usec;
+}
+
+static void bench_thread(void *arg) {
+    struct bench_conn *conn = arg;
+
+    while (gethrtime() < deadline) {
+        hrtime_t start = gethrtime();
+        int ii;
+
+        ensure_send(conn->bio, conn->requests,
+                    (int)(conn->request_size * depth));
+        for (ii = 0; ii < depth; ++ii) {
+            read_response(conn->bio);
+        }
+        add_sample(conn, (uint64_t)((gethrtime() - start) / 1000));
+        conn->ops += depth;
+    }
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static uint64_t percentile(const uint64_t *samples, size_t n, double pct) {
+    size_t idx = (size_t)(pct / 100.0 * (double)n);
+    if (idx >= n) {
+        idx = n - 1;
+    }
+    return samples[idx];
+}
+
+int main(int argc, char** argv) {
+    int cmd;
+    const char *port = "11210";
+    const char *host = "localhost";
+    const char *user = NULL;
+    const char *pass = NULL;
+    int secure = 0;
+    int nconns = 4;
+    int duration = 10;
+    char *ptr;
+    struct bench_conn *conns;
+    uint64_t *samples;
+    size_t nsamples = 0;
+    uint64_t ops = 0;
+    int ii;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:u:P:sc:t:d:gv:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            host = optarg;
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                port = ptr + 1;
+            }
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'u' :
+            user = optarg;
+            break;
+        case 'P':
+            pass = optarg;
+            break;
+        case 's':
+            secure = 1;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'g':
+            use_get = true;
+            break;
+        case 'v':
+            valsize = (uint32_t)atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage mcbench [-h host[:port]] [-p port] [-u user] [-P pass] [-s]\n"
+                    "              [-c connections] [-t seconds] [-d pipeline depth]\n"
+                    "              [-g (get instead of noop)] [-v value size]\n");
+            return 1;
+        }
+    }
+
+    if (nconns < 1 || duration < 1 || depth < 1) {
+        fprintf(stderr, "Connections, duration and depth must be positive\n");
+        return 1;
+    }
+
+    if ((conns = calloc(nconns, sizeof(*conns))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (ii = 0; ii < nconns; ++ii) {
+        struct bench_conn *conn = conns + ii;
+        int jj;
+
+        if (create_ssl_connection(&conn->ctx, &conn->bio, host, port,
+                                  user, pass, secure) != 0) {
+            return 1;
+        }
+        snprintf(conn->key, sizeof(conn->key), "mcbench_%d", ii);
+        conn->request_size = sizeof(protocol_binary_request_header);
+        if (use_get) {
+            conn->request_size += strlen(conn->key);
+            store_key(conn);
+        }
+        conn->requests = malloc(conn->request_size * depth);
+        if (conn->requests == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return 1;
+        }
+        for (jj = 0; jj < depth; ++jj) {
+            build_request(conn->requests + jj * conn->request_size,
+                          use_get ? PROTOCOL_BINARY_CMD_GET :
+                          PROTOCOL_BINARY_CMD_NOOP,
+                          use_get ? conn->key : "", 0, 0);
+        }
+    }
+
+    deadline = gethrtime() + (hrtime_t)duration * 1000000000;
+    for (ii = 0; ii < nconns; ++ii) {
+        if (cb_create_thread(&conns[ii].tid, bench_thread, conns + ii, 0) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            return 1;
+        }
+    }
+
+    for (ii = 0; ii < nconns; ++ii) {
+        cb_join_thread(conns[ii].tid);
+        ops += conns[ii].ops;
+        nsamples += conns[ii].nsamples;
+    }
+
+    if (nsamples == 0) {
+        fprintf(stderr, "No requests completed\n");
+        return 1;
+    }
+
+    if ((samples = malloc(nsamples * sizeof(uint64_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    nsamples = 0;
+    for (ii = 0; ii < nconns; ++ii) {
+        memcpy(samples + nsamples, conns[ii].samples,
+               conns[ii].nsamples * sizeof(uint64_t));
+        nsamples += conns[ii].nsamples;
+        free(conns[ii].samples);
+        free(conns[ii].requests);
+        BIO_free_all(conns[ii].bio);
+        if (secure) {
+            SSL_CTX_free(conns[ii].ctx);
+        }
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), compare_samples);
+
+    printf("%s x %d, %d connections, %d seconds\n",
+           use_get ? "get" : "noop", depth, nconns, duration);
+    printf("ops: %"PRIu64" (%"PRIu64" ops/s)\n", ops, ops / duration);
+    printf("round trip (usec): min %"PRIu64" p50 %"PRIu64" p99 %"PRIu64
+           " p99.9 %"PRIu64" max %"PRIu64"\n",
+           samples[0],
+           percentile(samples, nsamples, 50),
+           percentile(samples, nsamples, 99),
+           percentile(samples, nsamples, 99.9),
+           samples[nsamples - 1]);
+
+    free(samples);
+    free(conns);
+    return EXIT_SUCCESS;
+}
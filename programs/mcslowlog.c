@@ -0,0 +1,253 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Print the slow command log of the server ("stats slow"), oldest first,
+ * or the slowest commands first with -t.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <memcached/openssl.h>
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <cJSON.h>
+
+#include "utilities.h"
+
+typedef struct {
+    time_t time;
+    int thread;
+    int64_t conn;
+    char opcode[32];
+    int vbucket;
+    char key[256];
+    uint64_t total;
+    uint64_t wait;
+    uint64_t engine;
+    uint64_t blocked;
+    uint64_t transmit;
+} slow_cmd_t;
+
+static slow_cmd_t *cmds;
+static size_t num_cmds;
+static size_t cmds_size;
+
+static double json_number(cJSON *obj, const char *name)
+{
+    cJSON *i = cJSON_GetObjectItem(obj, name);
+    return i != NULL ? i->valuedouble : 0;
+}
+
+static const char *json_string(cJSON *obj, const char *name)
+{
+    cJSON *i = cJSON_GetObjectItem(obj, name);
+    return i != NULL && i->type == cJSON_String ? i->valuestring : NULL;
+}
+
+static void add_cmd(const char *val, uint32_t vallen)
+{
+    char *str = malloc(vallen + 1);
+    cJSON *json;
+    slow_cmd_t *cmd;
+    const char *s;
+
+    if (str == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(str, val, vallen);
+    str[vallen] = '\0';
+    json = cJSON_Parse(str);
+    if (json == NULL) {
+        fprintf(stderr, "Failed to parse json: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+    free(str);
+
+    if (num_cmds == cmds_size) {
+        cmds_size = cmds_size ? cmds_size * 2 : 256;
+        cmds = realloc(cmds, cmds_size * sizeof(*cmds));
+        if (cmds == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    cmd = &cmds[num_cmds++];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->time = (time_t)json_number(json, "time");
+    cmd->thread = (int)json_number(json, "thread");
+    cmd->conn = (int64_t)json_number(json, "conn");
+    if ((s = json_string(json, "opcode")) != NULL) {
+        snprintf(cmd->opcode, sizeof(cmd->opcode), "%s", s);
+    }
+    cmd->vbucket = (int)json_number(json, "vbucket");
+    if ((s = json_string(json, "key")) != NULL) {
+        snprintf(cmd->key, sizeof(cmd->key), "%s", s);
+    } else if ((s = json_string(json, "key_hash")) != NULL) {
+        snprintf(cmd->key, sizeof(cmd->key), "#%s", s);
+    }
+    cmd->total = (uint64_t)json_number(json, "total_usec");
+    cmd->wait = (uint64_t)json_number(json, "wait_usec");
+    cmd->engine = (uint64_t)json_number(json, "engine_usec");
+    cmd->blocked = (uint64_t)json_number(json, "blocked_usec");
+    cmd->transmit = (uint64_t)json_number(json, "transmit_usec");
+    cJSON_Delete(json);
+}
+
+static void request_slow_log(BIO *bio)
+{
+    uint32_t buffsize = 0;
+    char *buffer = NULL;
+    const char *key = "slow";
+    uint16_t keylen = (uint16_t)strlen(key);
+    protocol_binary_request_stats request;
+    protocol_binary_response_no_extras response;
+
+    memset(&request, 0, sizeof(request));
+    request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    request.message.header.request.opcode = PROTOCOL_BINARY_CMD_STAT;
+    request.message.header.request.keylen = htons(keylen);
+    request.message.header.request.bodylen = htonl(keylen);
+
+    ensure_send(bio, &request, sizeof(request));
+    ensure_send(bio, key, keylen);
+
+    do {
+        ensure_recv(bio, &response, sizeof(response.bytes));
+        if (response.message.header.response.status != 0) {
+            fprintf(stderr, "Command failed: %u\n",
+                    ntohs(response.message.header.response.status));
+            exit(EXIT_FAILURE);
+        }
+        if (response.message.header.response.keylen != 0) {
+            uint16_t keylen = ntohs(response.message.header.response.keylen);
+            uint32_t vallen = ntohl(response.message.header.response.bodylen);
+            if (vallen > buffsize) {
+                if ((buffer = realloc(buffer, vallen)) == NULL) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                buffsize = vallen;
+            }
+            ensure_recv(bio, buffer, vallen);
+            add_cmd(buffer + keylen, vallen - keylen);
+        }
+    } while (response.message.header.response.keylen != 0);
+    free(buffer);
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const slow_cmd_t *x = a;
+    const slow_cmd_t *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return 0;
+}
+
+static int by_total(const void *a, const void *b)
+{
+    const slow_cmd_t *x = a;
+    const slow_cmd_t *y = b;
+    if (x->total != y->total) {
+        return x->total > y->total ? -1 : 1;
+    }
+    return 0;
+}
+
+static void dump_slow_log(size_t limit)
+{
+    size_t ii;
+
+    fprintf(stdout, "%-8s %3s %6s %-16s %5s %10s %10s %10s %10s %10s  %s\n",
+            "time", "thr", "conn", "opcode", "vb", "total_us", "wait_us",
+            "engine_us", "blocked_us", "xmit_us", "key");
+    for (ii = 0; ii < num_cmds && ii < limit; ++ii) {
+        const slow_cmd_t *cmd = &cmds[ii];
+        char when[16];
+        struct tm *tm = localtime(&cmd->time);
+
+        if (tm == NULL || strftime(when, sizeof(when), "%H:%M:%S", tm) == 0) {
+            snprintf(when, sizeof(when), "?");
+        }
+        fprintf(stdout, "%-8s %3d %6"PRId64" %-16s %5d %10"PRIu64" %10"PRIu64
+                " %10"PRIu64" %10"PRIu64" %10"PRIu64"  %s\n",
+                when, cmd->thread, cmd->conn, cmd->opcode, cmd->vbucket,
+                cmd->total, cmd->wait, cmd->engine, cmd->blocked,
+                cmd->transmit, cmd->key);
+    }
+}
+
+int main(int argc, char** argv) {
+    int cmd;
+    const char *port = "11210";
+    const char *host = "localhost";
+    const char *user = NULL;
+    const char *pass = NULL;
+    int secure = 0;
+    int top = 0;
+    size_t limit = (size_t)-1;
+    char *ptr;
+    SSL_CTX* ctx;
+    BIO* bio;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:u:P:stn:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            host = optarg;
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                port = ptr + 1;
+            }
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'u' :
+            user = optarg;
+            break;
+        case 'P':
+            pass = optarg;
+            break;
+        case 's':
+            secure = 1;
+            break;
+        case 't':
+            top = 1;
+            break;
+        case 'n':
+            limit = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage mcslowlog [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [-t] [-n count]\n"
+                    "    -t        the slowest commands first\n"
+                    "    -n count  only print the first count commands\n");
+            return 1;
+        }
+    }
+
+    if (create_ssl_connection(&ctx, &bio, host, port, user, pass, secure) != 0) {
+        return 1;
+    }
+
+    request_slow_log(bio);
+    qsort(cmds, num_cmds, sizeof(*cmds), top ? by_total : by_time);
+    dump_slow_log(limit);
+    free(cmds);
+
+    BIO_free_all(bio);
+    if (secure) {
+        SSL_CTX_free(ctx);
+    }
+
+    return EXIT_SUCCESS;
+}
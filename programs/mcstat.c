@@ -26,12 +26,105 @@ static void print(const char *key, int keylen, const char *val, int vallen) {
     fflush(stdout);
 }
 
+typedef void (*print_stat)(const char *key, int keylen,
+                           const char *val, int vallen);
+
+/**
+ * Print the JSON document of "stats bulk json"
+ */
+static void print_bulk_json(const char *key, int keylen,
+                            const char *val, int vallen) {
+    (void)key;
+    (void)keylen;
+    (void)fwrite(val, vallen, 1, stdout);
+    fputs("\n", stdout);
+    fflush(stdout);
+}
+
+/**
+ * Read an unsigned LEB128 varint
+ * @return the # of bytes read, 0 if it is truncated
+ */
+static int get_varint(const unsigned char *ptr, const unsigned char *end,
+                      uint32_t *val) {
+    const unsigned char *start = ptr;
+    int shift = 0;
+
+    *val = 0;
+    while (ptr < end && shift < 32) {
+        *val |= (uint32_t)(*ptr & 0x7f) << shift;
+        if ((*ptr++ & 0x80) == 0) {
+            return (int)(ptr - start);
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/**
+ * Decode the document of "stats bulk binary" (see protocol_binary.h) and
+ * print the stats as "group:key value"
+ */
+static void print_bulk_binary(const char *key, int keylen,
+                              const char *val, int vallen) {
+    const unsigned char *ptr = (const unsigned char*)val;
+    const unsigned char *end = ptr + vallen;
+    const char *group = "";
+    uint32_t grouplen = 0;
+    char name[512];
+
+    (void)key;
+    (void)keylen;
+    if (vallen < 4 || memcmp(ptr, PROTOCOL_BINARY_BULK_STATS_MAGIC, 4) != 0) {
+        fprintf(stderr, "Invalid bulk stats document\n");
+        exit(1);
+    }
+    ptr += 4;
+
+    while (ptr < end) {
+        unsigned char tag = *ptr++;
+        uint32_t len;
+        int nb = get_varint(ptr, end, &len);
+        if (nb == 0 || len > (uint32_t)(end - ptr - nb)) {
+            break;
+        }
+        ptr += nb;
+
+        if (tag == PROTOCOL_BINARY_BULK_STATS_GROUP) {
+            group = (const char*)ptr;
+            grouplen = len;
+            ptr += len;
+        } else if (tag == PROTOCOL_BINARY_BULK_STATS_STAT) {
+            const char *stat = (const char*)ptr;
+            uint32_t statlen = len;
+            ptr += len;
+            nb = get_varint(ptr, end, &len);
+            if (nb == 0 || len > (uint32_t)(end - ptr - nb)) {
+                break;
+            }
+            ptr += nb;
+            snprintf(name, sizeof(name), "%.*s:%.*s", (int)grouplen, group,
+                     (int)statlen, stat);
+            print(name, (int)strlen(name), (const char*)ptr, (int)len);
+            ptr += len;
+        } else {
+            break;
+        }
+    }
+
+    if (ptr != end) {
+        fprintf(stderr, "Invalid bulk stats document\n");
+        exit(1);
+    }
+}
+
 /**
  * Request a stat from the server
  * @param sock socket connected to the server
  * @param key the name of the stat to receive (NULL == ALL)
+ * @param printer how to print the stats received
  */
-static void request_stat(BIO *bio, const char *key)
+static void request_stat(BIO *bio, const char *key, print_stat printer)
 {
     uint32_t buffsize = 0;
     char *buffer = NULL;
@@ -67,9 +160,37 @@ static void request_stat(BIO *bio, const char *key)
                 buffsize = vallen;
             }
             ensure_recv(bio, buffer, vallen);
-            print(buffer, keylen, buffer + keylen, vallen - keylen);
+            printer(buffer, keylen, buffer + keylen, vallen - keylen);
         }
     } while (response.message.header.response.keylen != 0);
+    free(buffer);
+}
+
+/**
+ * Request the groups ("stats bulk") in a single document
+ * @param format "json" or "binary"
+ */
+static void request_bulk_stats(BIO *bio, const char *format,
+                               int ngroups, char **groups)
+{
+    char key[1024];
+    size_t len;
+    int ii;
+
+    len = (size_t)snprintf(key, sizeof(key), "bulk %s", format);
+    for (ii = 0; ii < ngroups; ++ii) {
+        size_t glen = strlen(groups[ii]);
+        if (len + 1 + glen >= sizeof(key)) {
+            fprintf(stderr, "Too many stat groups\n");
+            exit(1);
+        }
+        key[len++] = ' ';
+        memcpy(key + len, groups[ii], glen + 1);
+        len += glen;
+    }
+
+    request_stat(bio, key, strcmp(format, "json") == 0 ?
+                 print_bulk_json : print_bulk_binary);
 }
 
 int main(int argc, char** argv) {
@@ -83,11 +204,12 @@ int main(int argc, char** argv) {
     SSL_CTX* ctx;
     BIO* bio;
     bool tcp_nodelay = false;
+    const char *bulk = NULL;
 
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "Th:p:u:P:s")) != EOF) {
+    while ((cmd = getopt(argc, argv, "Th:p:u:P:sjb")) != EOF) {
         switch (cmd) {
         case 'T' :
             tcp_nodelay = true;
@@ -112,9 +234,17 @@ int main(int argc, char** argv) {
         case 's':
             secure = 1;
             break;
+        case 'j':
+            bulk = "json";
+            break;
+        case 'b':
+            bulk = "binary";
+            break;
         default:
             fprintf(stderr,
-                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [-T] [statkey]*\n");
+                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [-T] [-j|-b] [statkey]*\n"
+                    "    -j  all of the stat groups in one JSON document\n"
+                    "    -b  all of the stat groups in one binary document\n");
             return 1;
         }
     }
@@ -127,12 +257,14 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (optind == argc) {
-        request_stat(bio, NULL);
+    if (bulk != NULL) {
+        request_bulk_stats(bio, bulk, argc - optind, argv + optind);
+    } else if (optind == argc) {
+        request_stat(bio, NULL, print);
     } else {
         int ii;
         for (ii = optind; ii < argc; ++ii) {
-            request_stat(bio, argv[ii]);
+            request_stat(bio, argv[ii], print);
         }
     }
 
@@ -30,10 +30,47 @@ typedef struct timings_st {
     uint32_t wayout;
 
     uint64_t total;
+
+    /* The percentiles (ns), if the server computes them */
+    int have_percentiles;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t p100;
 } timings_t;
 
 timings_t timings;
 
+static const char *format_time(char *buffer, size_t size, uint64_t ns)
+{
+    if (ns < 1000) {
+        snprintf(buffer, size, "%"PRIu64"ns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buffer, size, "%.1fus", ns / 1000.0);
+    } else if (ns < 1000000000) {
+        snprintf(buffer, size, "%.2fms", ns / 1000000.0);
+    } else {
+        snprintf(buffer, size, "%.2fs", ns / 1000000000.0);
+    }
+    return buffer;
+}
+
+static void dump_percentiles(const char *cmd)
+{
+    char mean[32], p50[32], p90[32], p99[32], p999[32], p100[32];
+
+    fprintf(stdout, "%s: %"PRIu64" operations, mean %s, p50 %s, p90 %s, "
+            "p99 %s, p99.9 %s, max %s\n", cmd, timings.total,
+            format_time(mean, sizeof(mean), timings.mean),
+            format_time(p50, sizeof(p50), timings.p50),
+            format_time(p90, sizeof(p90), timings.p90),
+            format_time(p99, sizeof(p99), timings.p99),
+            format_time(p999, sizeof(p999), timings.p999),
+            format_time(p100, sizeof(p100), timings.p100));
+}
+
 static void callback(const char *timeunit, uint32_t min, uint32_t max, uint32_t total)
 {
     if (total > 0) {
@@ -168,25 +205,56 @@ static int json2internal(cJSON *r)
         timings.max = timings.wayout;
     }
 
+    /* Older servers only send the histogram */
+    timings.have_percentiles = 0;
+    if ((i = cJSON_GetObjectItem(r, "count")) != NULL) {
+        timings.total = (uint64_t)i->valuedouble;
+        timings.have_percentiles = 1;
+        if ((i = cJSON_GetObjectItem(r, "mean")) != NULL) {
+            timings.mean = (uint64_t)i->valuedouble;
+        }
+        if ((i = cJSON_GetObjectItem(r, "p50")) != NULL) {
+            timings.p50 = (uint64_t)i->valuedouble;
+        }
+        if ((i = cJSON_GetObjectItem(r, "p90")) != NULL) {
+            timings.p90 = (uint64_t)i->valuedouble;
+        }
+        if ((i = cJSON_GetObjectItem(r, "p99")) != NULL) {
+            timings.p99 = (uint64_t)i->valuedouble;
+        }
+        if ((i = cJSON_GetObjectItem(r, "p99.9")) != NULL) {
+            timings.p999 = (uint64_t)i->valuedouble;
+        }
+        if ((i = cJSON_GetObjectItem(r, "max")) != NULL) {
+            timings.p100 = (uint64_t)i->valuedouble;
+        }
+    }
+
     return 0;
 }
 
-static void request_timings(BIO *bio, uint8_t opcode, int verbose, int skip)
+static void request_timings(BIO *bio, uint8_t opcode, const char *mode,
+                            int verbose, int skip)
 {
     uint32_t buffsize;
     char *buffer;
     protocol_binary_request_get_cmd_timer request;
     protocol_binary_response_no_extras response;
+    uint16_t nmode = mode ? (uint16_t)strlen(mode) : 0;
     cJSON *json, *obj;
 
     memset(&request, 0, sizeof(request));
     request.message.header.request.magic = PROTOCOL_BINARY_REQ;
     request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_CMD_TIMER;
     request.message.header.request.extlen = 1;
-    request.message.header.request.bodylen = htonl(1);
+    request.message.header.request.keylen = htons(nmode);
+    request.message.header.request.bodylen = htonl(1 + nmode);
     request.message.body.opcode = opcode;
 
     ensure_send(bio, &request, sizeof(request.bytes));
+    if (nmode > 0) {
+        ensure_send(bio, mode, nmode);
+    }
 
     ensure_recv(bio, &response, sizeof(response.bytes));
     buffsize = ntohl(response.message.header.response.bodylen);
@@ -236,7 +304,14 @@ static void request_timings(BIO *bio, uint8_t opcode, int verbose, int skip)
                         "The following data is collected for \"%s\"\n",
                         cmd);
                 dump_histogram();
-                fprintf(stderr, "Total: %"PRIu64" operations\n", timings.total);
+                if (timings.have_percentiles) {
+                    dump_percentiles("Total");
+                } else {
+                    fprintf(stderr, "Total: %"PRIu64" operations\n",
+                            timings.total);
+                }
+            } else if (timings.have_percentiles) {
+                dump_percentiles(cmd);
             } else {
                 fprintf(stderr, "%s: %"PRIu64" operations\n", cmd, timings.total);
             }
@@ -257,6 +332,7 @@ int main(int argc, char** argv) {
     const char *pass = NULL;
     int verbose = 0;
     int secure = 0;
+    const char *mode = NULL;
     char *ptr;
     SSL_CTX* ctx;
     BIO* bio;
@@ -264,7 +340,7 @@ int main(int argc, char** argv) {
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:u:P:sv")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:u:P:svir")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -289,9 +365,17 @@ int main(int argc, char** argv) {
         case 'v':
             verbose = 1;
             break;
+        case 'i':
+            mode = "interval";
+            break;
+        case 'r':
+            mode = "reset";
+            break;
         default:
             fprintf(stderr,
-                    "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-s] -v [opcode]*\n");
+                    "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-s] -v [-i|-r] [opcode]*\n"
+                    "    -i  only the timings since the previous -i\n"
+                    "    -r  clear the timings after reading them\n");
             return 1;
         }
     }
@@ -302,12 +386,12 @@ int main(int argc, char** argv) {
 
     if (optind == argc) {
         for (int ii = 0; ii < 256; ++ii) {
-            request_timings(bio, (uint8_t)ii, verbose, 1);
+            request_timings(bio, (uint8_t)ii, mode, verbose, 1);
         }
     } else {
         for (; optind < argc; ++optind) {
             request_timings(bio, memcached_text_2_opcode(argv[optind]),
-                            verbose, 0);
+                            mode, verbose, 0);
         }
     }
 
@@ -10,6 +10,9 @@
 #include <time.h>
 #include <evutil.h>
 #include <snappy-c.h>
+#ifdef HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
 #include <cJSON.h>
 
 
@@ -362,6 +365,23 @@ static enum test_return test_safe_strtof(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_parse_cpu_list(void) {
+    int cpus[8];
+
+    cb_assert(parse_cpu_list("3", cpus, 8) == 1);
+    cb_assert(cpus[0] == 3);
+    cb_assert(parse_cpu_list("0-2,8", cpus, 8) == 4);
+    cb_assert(cpus[0] == 0 && cpus[1] == 1 && cpus[2] == 2 && cpus[3] == 8);
+    cb_assert(parse_cpu_list("", cpus, 8) == 0);
+    cb_assert(parse_cpu_list("0-8", cpus, 8) == -1); /* too many */
+    cb_assert(parse_cpu_list("2-1", cpus, 8) == -1);
+    cb_assert(parse_cpu_list("1,", cpus, 8) == -1);
+    cb_assert(parse_cpu_list("1,,2", cpus, 8) == -1);
+    cb_assert(parse_cpu_list("-1", cpus, 8) == -1);
+    cb_assert(parse_cpu_list("1 2", cpus, 8) == -1);
+    return TEST_PASS;
+}
+
 #ifdef WIN32
 static void log_network_error(const char* prefix) {
     LPVOID error_msg;
@@ -1109,9 +1129,7 @@ static enum test_return test_connect_to_server(void) {
     return TEST_PASS;
 }
 
-static enum test_return stop_memcached_server(void) {
-    closesocket(sock);
-    sock = INVALID_SOCKET;
+static void kill_server(void) {
 #ifdef WIN32
     TerminateProcess(server_pid, 0);
 #else
@@ -1123,6 +1141,12 @@ static enum test_return stop_memcached_server(void) {
         }
     }
 #endif
+}
+
+static enum test_return stop_memcached_server(void) {
+    closesocket(sock);
+    sock = INVALID_SOCKET;
+    kill_server();
 
     remove(config_file);
     remove(isasl_file);
@@ -1345,6 +1369,8 @@ static off_t raw_command(char* buf,
         request->message.header.request.extlen = 8;
     } else if (cmd == PROTOCOL_BINARY_CMD_AUDIT_PUT) {
         request->message.header.request.extlen = 4;
+    } else if (cmd == PROTOCOL_BINARY_CMD_GET_CMD_TIMER) {
+        request->message.header.request.extlen = 1;
     }
     request->message.header.request.magic = PROTOCOL_BINARY_REQ;
     request->message.header.request.opcode = cmd;
@@ -2272,48 +2298,198 @@ static enum test_return test_stat(void) {
     return TEST_PASS;
 }
 
-static enum test_return test_stat_connections(void) {
+/*
+ * Look up a counter in the general stats.
+ * @return false if the server doesn't report it
+ */
+static bool get_general_stat(const char *counter, uint64_t *value) {
     union {
         protocol_binary_request_no_extras request;
         protocol_binary_response_no_extras response;
         char bytes[1024];
     } buffer;
+    bool found = false;
 
     size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
                              PROTOCOL_BINARY_CMD_STAT,
-                             "connections", strlen("connections"), NULL, 0);
+                             NULL, 0, NULL, 0);
 
     safe_send(buffer.bytes, len, false);
     do {
         safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
         validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
                                  PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen != 0) {
+            uint16_t keylen = buffer.response.message.header.response.keylen;
+            uint32_t vallen = buffer.response.message.header.response.bodylen - keylen;
+            const char *key = buffer.bytes + sizeof(buffer.response);
+            char val[64];
+
+            if (keylen == strlen(counter) &&
+                strncmp(key, counter, keylen) == 0 && vallen < sizeof(val)) {
+                memcpy(val, key + keylen, vallen);
+                val[vallen] = '\0';
+                *value = strtoull(val, NULL, 10);
+                found = true;
+            }
+        }
     } while (buffer.response.message.header.response.keylen != 0);
 
-    return TEST_PASS;
+    return found;
 }
 
-static enum test_return test_scrub(void) {
+/*
+ * The counters (including the slab stats) read zero after "stats reset",
+ * and count from there.
+ */
+static enum test_return test_stat_reset(void) {
+    const char *key = "test_stat_reset";
     union {
         protocol_binary_request_no_extras request;
         protocol_binary_response_no_extras response;
         char bytes[1024];
     } buffer;
+    uint64_t counter = 0;
+    size_t len;
 
-    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_SCRUB,
-                             NULL, 0, NULL, 0);
+    len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), "value", 5, 0, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(get_general_stat("cmd_set", &counter));
+    cb_assert(counter > 0);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_STAT, "reset", 5, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
+    cb_assert(get_general_stat("cmd_set", &counter));
+    cb_assert(counter == 0);
+    cb_assert(get_general_stat("cmd_get", &counter));
+    cb_assert(counter == 0);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET, key, strlen(key), NULL, 0);
     safe_send(buffer.bytes, len, false);
     safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SCRUB,
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_GET,
                              PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
+    cb_assert(get_general_stat("cmd_get", &counter));
+    cb_assert(counter == 1);
+    cb_assert(get_general_stat("get_hits", &counter));
+    cb_assert(counter == 1);
     return TEST_PASS;
 }
 
+/*
+ * Send a 64k batch of pipelined commands and check that they are all
+ * answered, and that the read buffer counters are reported.
+ */
+static enum test_return test_stat_read_buffers(void) {
+    const size_t count = 65536 / sizeof(protocol_binary_request_no_extras);
+    protocol_binary_request_no_extras *batch = calloc(count, sizeof(*batch));
+    protocol_binary_response_no_extras response;
+    uint64_t read_calls = 0;
+    uint64_t bytes_per_read = 0;
+    uint64_t grown;
+    size_t ii;
+
+    cb_assert(batch != NULL);
+    for (ii = 0; ii < count; ++ii) {
+        raw_command((char*)(batch + ii), sizeof(*batch),
+                    PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    }
+    safe_send(batch, count * sizeof(*batch), false);
+    for (ii = 0; ii < count; ++ii) {
+        safe_recv_packet(&response, sizeof(response));
+        validate_response_header(&response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    free(batch);
 
-static enum test_return test_roles(void) {
+    cb_assert(get_general_stat("read_calls", &read_calls));
+    cb_assert(read_calls > 0);
+    cb_assert(get_general_stat("bytes_per_read", &bytes_per_read));
+    cb_assert(bytes_per_read > 0);
+    cb_assert(get_general_stat("rbufs_grown", &grown));
+    return TEST_PASS;
+}
+
+/*
+ * Send a pipeline of GETKs (with a value big enough to be referenced from
+ * the item rather than copied) and NOOPs in one go, and check that the
+ * responses (which the server sends together) arrive intact and in order.
+ */
+static enum test_return test_pipeline_coalescing(void) {
+    const char *key = "test_pipeline_coalescing";
+    const size_t value_size = 2048;
+    const int count = 32;
+    const size_t getk_size = sizeof(protocol_binary_request_no_extras) +
+        strlen(key);
+    const size_t bufsz = count * getk_size + 8192;
+    char *buffer = malloc(bufsz);
+    char *value = malloc(value_size);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    size_t len = 0;
+    int ii;
+
+    cb_assert(buffer != NULL && value != NULL);
+    memset(value, 'c', value_size);
+    len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), value, value_size, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(get_general_stat("responses_coalesced", &before));
+
+    len = 0;
+    for (ii = 0; ii < count; ++ii) {
+        if (ii % 2 == 0) {
+            len += raw_command(buffer + len, bufsz - len,
+                               PROTOCOL_BINARY_CMD_GETK,
+                               key, strlen(key), NULL, 0);
+        } else {
+            len += raw_command(buffer + len, bufsz - len,
+                               PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+        }
+    }
+    safe_send(buffer, len, false);
+
+    for (ii = 0; ii < count; ++ii) {
+        safe_recv_packet(buffer, bufsz);
+        if (ii % 2 == 0) {
+            const char *body = buffer + sizeof(*response) + 4;
+            validate_response_header(response, PROTOCOL_BINARY_CMD_GETK,
+                                     PROTOCOL_BINARY_RESPONSE_SUCCESS);
+            cb_assert(response->message.header.response.bodylen ==
+                      4 + strlen(key) + value_size);
+            cb_assert(memcmp(body, key, strlen(key)) == 0);
+            cb_assert(memcmp(body + strlen(key), value, value_size) == 0);
+        } else {
+            validate_response_header(response, PROTOCOL_BINARY_CMD_NOOP,
+                                     PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        }
+    }
+
+    cb_assert(get_general_stat("responses_coalesced", &after));
+    cb_assert(after > before);
+
+    free(value);
+    free(buffer);
+    return TEST_PASS;
+}
+
+static enum test_return test_stat_connections(void) {
     union {
         protocol_binary_request_no_extras request;
         protocol_binary_response_no_extras response;
@@ -2321,136 +2497,1125 @@ static enum test_return test_roles(void) {
     } buffer;
 
     size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
-                             "unknownrole", 11, NULL, 0);
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "connections", strlen("connections"), NULL, 0);
 
     safe_send(buffer.bytes, len, false);
-    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
-                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    } while (buffer.response.message.header.response.keylen != 0);
 
+    return TEST_PASS;
+}
 
-    /* assume the statistics role */
-    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
-                             "statistics", 10, NULL, 0);
+/* Number of counters "stats threads" reports per worker thread */
+#define THREAD_STATS 8
+#define MAX_TEST_THREADS 256
 
-    safe_send(buffer.bytes, len, false);
-    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
-                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+static enum test_return test_stat_threads(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    int num_stats = 0;
 
-    /* At this point I should get an EACCESS if I tried to run NOOP */
-    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                      PROTOCOL_BINARY_CMD_NOOP,
-                      NULL, 0, NULL, 0);
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             "threads", strlen("threads"), NULL, 0);
 
     safe_send(buffer.bytes, len, false);
-    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
-                             PROTOCOL_BINARY_RESPONSE_EACCESS);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen != 0) {
+            const char *key = buffer.bytes + sizeof(buffer.response);
+            cb_assert(strncmp(key, "thread_", strlen("thread_")) == 0);
+            ++num_stats;
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
 
-    /* But I should be allowed to run a stat */
-    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+    cb_assert(num_stats > 0 && (num_stats % THREAD_STATS) == 0);
+    return TEST_PASS;
+}
+
+/*
+ * Collect one of the per thread counters reported by "stats threads"
+ * into values (indexed by thread id).
+ * @return the number of worker threads
+ */
+static int get_thread_stats(const char *counter, uint64_t *values, int max) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    int nthreads = 0;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
                              PROTOCOL_BINARY_CMD_STAT,
-                             NULL, 0, NULL, 0);
+                             "threads", strlen("threads"), NULL, 0);
 
     safe_send(buffer.bytes, len, false);
     do {
         safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
         validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
                                  PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (buffer.response.message.header.response.keylen != 0) {
+            uint16_t keylen = buffer.response.message.header.response.keylen;
+            uint32_t vallen = buffer.response.message.header.response.bodylen - keylen;
+            const char *key = buffer.bytes + sizeof(buffer.response);
+            char name[256];
+            char value[64];
+            char *suffix;
+            int tid;
+
+            cb_assert(keylen < sizeof(name) && vallen < sizeof(value));
+            memcpy(name, key, keylen);
+            name[keylen] = '\0';
+            memcpy(value, key + keylen, vallen);
+            value[vallen] = '\0';
+
+            cb_assert(sscanf(name, "thread_%d_", &tid) == 1);
+            suffix = strchr(name + strlen("thread_"), '_') + 1;
+            if (tid < max && strcmp(suffix, counter) == 0) {
+                values[tid] = strtoull(value, NULL, 10);
+                if (tid >= nthreads) {
+                    nthreads = tid + 1;
+                }
+            }
+        }
     } while (buffer.response.message.header.response.keylen != 0);
 
-    /* Drop the role */
-    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
-                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
-                             NULL, 0, NULL, 0);
+    return nthreads;
+}
+
+/*
+ * Closed connections are kept by their worker to be reused for the next
+ * client rather than freed.
+ */
+static enum test_return test_connection_pool(void) {
+    uint64_t pooled[MAX_TEST_THREADS] = {0};
+    uint64_t size = 0;
+    uint64_t total;
+    SOCKET main_sock = sock;
+    SOCKET conns[8];
+    time_t deadline;
+    int nthreads;
+    int ii;
+
+    cb_assert(get_general_stat("connection_structure_size", &size));
+    cb_assert(size > 0);
+
+    for (ii = 0; ii < 8; ++ii) {
+        conns[ii] = create_connect_plain_socket("127.0.0.1", port, false);
+        cb_assert(conns[ii] != INVALID_SOCKET);
+        sock = conns[ii];
+        test_noop();
+    }
+    sock = main_sock;
+    for (ii = 0; ii < 8; ++ii) {
+        closesocket(conns[ii]);
+    }
+
+    /* The workers notice the clients are gone asynchronously */
+    deadline = time(NULL) + 10;
+    do {
+        nthreads = get_thread_stats("pooled_conns", pooled, MAX_TEST_THREADS);
+        total = 0;
+        for (ii = 0; ii < nthreads; ++ii) {
+            total += pooled[ii];
+        }
+    } while (total == 0 && time(NULL) < deadline);
+    cb_assert(total > 0);
+
+    return TEST_PASS;
+}
+
+static void reload_config_with(cJSON *config) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char *config_string = cJSON_Print(config);
+    size_t len;
+
+    cb_assert(write_config_to_file(config_string, config_file) != -1);
+    cJSON_Free(config_string);
 
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_CONFIG_RELOAD, NULL, 0, NULL, 0);
     safe_send(buffer.bytes, len, false);
     safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
-    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_CONFIG_RELOAD,
                              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+}
 
-    /* And noop should work again! */
-    return test_noop();
+/*
+ * Restart the server with the given configuration (for the settings which
+ * can't be reloaded) and connect to it again. The tests restart it with
+ * generate_config() when they're done.
+ */
+static void restart_server_with(cJSON *config) {
+    char *config_string = cJSON_Print(config);
+
+    kill_server();
+    cb_assert(write_config_to_file(config_string, config_file) != -1);
+    cJSON_Free(config_string);
+    server_pid = start_server(&port, &ssl_port, false, 600);
+    reconnect_to_server(false);
 }
 
-volatile bool hickup_thread_running;
+/*
+ * With a time budget too small for more than a request or two, a pipeline
+ * is served in many short timeslices (and every response still arrives).
+ */
+static enum test_return test_time_slice(void) {
+    const int count = 512;
+    protocol_binary_request_no_extras *batch = calloc(count, sizeof(*batch));
+    protocol_binary_response_no_extras response;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    cJSON *config;
+    int ii;
 
-static void binary_hickup_recv_verification_thread(void *arg) {
-    protocol_binary_response_no_extras *response = malloc(65*1024);
-    if (response != NULL) {
-        while (safe_recv_packet(response, 65*1024)) {
-            /* Just validate the packet format */
-            validate_response_header(response,
-                                     response->message.header.response.opcode,
-                                     response->message.header.response.status);
-        }
-        free(response);
+    cb_assert(batch != NULL);
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "time_slice_usec", 1);
+    reload_config_with(config);
+    cJSON_Delete(config);
+    cb_assert(get_general_stat("conn_time_yields", &before));
+
+    for (ii = 0; ii < count; ++ii) {
+        raw_command((char*)(batch + ii), sizeof(*batch),
+                    PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
     }
-    hickup_thread_running = false;
-    allow_closed_read = false;
+    safe_send(batch, count * sizeof(*batch), false);
+    for (ii = 0; ii < count; ++ii) {
+        safe_recv_packet(&response, sizeof(response));
+        validate_response_header(&response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    free(batch);
+
+    cb_assert(get_general_stat("conn_time_yields", &after));
+    cb_assert(after > before);
+
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "time_slice_usec", 0);
+    reload_config_with(config);
+    cJSON_Delete(config);
+    return TEST_PASS;
 }
 
-static enum test_return test_pipeline_hickup_chunk(void *buffer, size_t buffersize) {
-    off_t offset = 0;
-    char *key[256];
-    uint64_t value = 0xfeedfacedeadbeef;
+/*
+ * With reuseport every worker accepts its own clients, in batches of up
+ * to 16 per event; connect more clients than that at once and check that
+ * every one of them is served.
+ */
+static enum test_return test_reuseport(void) {
+    SOCKET conns[64];
+    const int count = (int)(sizeof(conns) / sizeof(conns[0]));
+    SOCKET main_sock;
+    cJSON *config;
+    int ii;
 
-    while (hickup_thread_running &&
-           offset + sizeof(protocol_binary_request_no_extras) < buffersize) {
-        union {
-            protocol_binary_request_no_extras request;
-            char bytes[65 * 1024];
-        } command;
-        uint8_t cmd = (uint8_t)(rand() & 0xff);
-        size_t len;
-        size_t keylen = (rand() % 250) + 1;
+    config = generate_config();
+    cJSON_AddTrueToObject(config, "reuseport");
+    restart_server_with(config);
+    cJSON_Delete(config);
+    main_sock = sock;
 
-        switch (cmd) {
-        case PROTOCOL_BINARY_CMD_ADD:
-        case PROTOCOL_BINARY_CMD_ADDQ:
-        case PROTOCOL_BINARY_CMD_REPLACE:
-        case PROTOCOL_BINARY_CMD_REPLACEQ:
-        case PROTOCOL_BINARY_CMD_SET:
-        case PROTOCOL_BINARY_CMD_SETQ:
-            len = storage_command(command.bytes, sizeof(command.bytes), cmd,
-                                  key, keylen , &value, sizeof(value),
-                                  0, 0);
-            break;
-        case PROTOCOL_BINARY_CMD_APPEND:
-        case PROTOCOL_BINARY_CMD_APPENDQ:
-        case PROTOCOL_BINARY_CMD_PREPEND:
-        case PROTOCOL_BINARY_CMD_PREPENDQ:
-            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
-                              key, keylen, &value, sizeof(value));
-            break;
-        case PROTOCOL_BINARY_CMD_FLUSH:
-        case PROTOCOL_BINARY_CMD_FLUSHQ:
-            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
-                              NULL, 0, NULL, 0);
-            break;
-        case PROTOCOL_BINARY_CMD_NOOP:
-            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
-                              NULL, 0, NULL, 0);
-            break;
-        case PROTOCOL_BINARY_CMD_DELETE:
-        case PROTOCOL_BINARY_CMD_DELETEQ:
-            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
-                             key, keylen, NULL, 0);
-            break;
-        case PROTOCOL_BINARY_CMD_DECREMENT:
-        case PROTOCOL_BINARY_CMD_DECREMENTQ:
-        case PROTOCOL_BINARY_CMD_INCREMENT:
-        case PROTOCOL_BINARY_CMD_INCREMENTQ:
-            len = arithmetic_command(command.bytes, sizeof(command.bytes), cmd,
-                                     key, keylen, 1, 0, 0);
-            break;
-        case PROTOCOL_BINARY_CMD_VERSION:
-            len = raw_command(command.bytes, sizeof(command.bytes),
-                             PROTOCOL_BINARY_CMD_VERSION,
-                             NULL, 0, NULL, 0);
+    for (ii = 0; ii < count; ++ii) {
+        conns[ii] = create_connect_plain_socket("127.0.0.1", port, false);
+        cb_assert(conns[ii] != INVALID_SOCKET);
+    }
+    for (ii = 0; ii < count; ++ii) {
+        sock = conns[ii];
+        test_noop();
+    }
+    sock = main_sock;
+    for (ii = 0; ii < count; ++ii) {
+        closesocket(conns[ii]);
+    }
+
+    config = generate_config();
+    restart_server_with(config);
+    cJSON_Delete(config);
+    return TEST_PASS;
+}
+
+/*
+ * The stats and FLUSH run on the aux pool (and a request pipelined behind
+ * them is still answered after them).
+ */
+static enum test_return test_aux_pool(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    size_t len;
+
+    cb_assert(get_general_stat("aux_jobs", &before));
+
+    len = flush_command(send.bytes, sizeof(send.bytes),
+                        PROTOCOL_BINARY_CMD_FLUSH, 0, false);
+    len += raw_command(send.bytes + len, sizeof(send.bytes) - len,
+                       PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_FLUSH,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* The first stats call and the flush */
+    cb_assert(get_general_stat("aux_jobs", &after));
+    cb_assert(after >= before + 2);
+    cb_assert(get_general_stat("aux_pool_queue_max", &after));
+    cb_assert(after > 0);
+    cb_assert(get_general_stat("aux_job_max_usec", &after));
+    return TEST_PASS;
+}
+
+/* Send pipelined NOOPs and wait for all of the responses */
+static void send_noops(size_t count) {
+    protocol_binary_request_no_extras request;
+    protocol_binary_response_no_extras response;
+    size_t ii;
+
+    for (ii = 0; ii < count; ++ii) {
+        raw_command((char*)&request, sizeof(request),
+                    PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+        safe_send(&request, sizeof(request), false);
+    }
+    for (ii = 0; ii < count; ++ii) {
+        safe_recv_packet(&response, sizeof(response));
+        validate_response_header(&response, PROTOCOL_BINARY_CMD_NOOP,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+}
+
+/* Get the NOOP timings (mode is NULL, "interval" or "reset") */
+static cJSON *get_noop_timings(const char *mode) {
+    union {
+        protocol_binary_request_get_cmd_timer request;
+        protocol_binary_response_no_extras response;
+        char bytes[4096];
+    } buffer;
+    size_t nmode = mode ? strlen(mode) : 0;
+    size_t len;
+    cJSON *json;
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET_CMD_TIMER, mode, nmode,
+                      NULL, 0);
+    buffer.request.message.body.opcode = PROTOCOL_BINARY_CMD_NOOP;
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_GET_CMD_TIMER,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    buffer.bytes[sizeof(buffer.response) +
+                 buffer.response.message.header.response.bodylen] = '\0';
+    json = cJSON_Parse(buffer.bytes + sizeof(buffer.response));
+    cb_assert(json != NULL);
+    return json;
+}
+
+static uint64_t timings_value(cJSON *json, const char *name) {
+    cJSON *obj = cJSON_GetObjectItem(json, name);
+    cb_assert(obj != NULL);
+    return (uint64_t)obj->valuedouble;
+}
+
+/*
+ * The command timings are reported with ordered percentiles, can be reset
+ * and can be read for the interval since the previous read.
+ */
+static enum test_return test_cmd_timings(void) {
+    cJSON *json;
+
+    send_noops(10);
+    json = get_noop_timings(NULL);
+    cb_assert(timings_value(json, "count") >= 10);
+    cb_assert(timings_value(json, "p50") <= timings_value(json, "p90"));
+    cb_assert(timings_value(json, "p90") <= timings_value(json, "p99"));
+    cb_assert(timings_value(json, "p99") <= timings_value(json, "p99.9"));
+    cb_assert(timings_value(json, "p99.9") <= timings_value(json, "max"));
+    cb_assert(timings_value(json, "max") > 0);
+    cJSON_Delete(json);
+
+    json = get_noop_timings("reset");
+    cb_assert(timings_value(json, "count") >= 10);
+    cJSON_Delete(json);
+    json = get_noop_timings(NULL);
+    cb_assert(timings_value(json, "count") == 0);
+    cb_assert(timings_value(json, "max") == 0);
+    cJSON_Delete(json);
+
+    send_noops(5);
+    json = get_noop_timings("interval");
+    cb_assert(timings_value(json, "count") == 5);
+    cJSON_Delete(json);
+    send_noops(3);
+    json = get_noop_timings("interval");
+    cb_assert(timings_value(json, "count") == 3);
+    cJSON_Delete(json);
+    json = get_noop_timings(NULL);
+    cb_assert(timings_value(json, "count") == 8);
+    cJSON_Delete(json);
+
+    return TEST_PASS;
+}
+
+/*
+ * A command slower than slow_cmd_usec shows up in "stats slow" with its
+ * key and phases.
+ */
+static enum test_return test_slow_log(void) {
+    const char *key = "test_slow_log";
+    const size_t value_size = 256 * 1024;
+    const size_t bufsz = sizeof(protocol_binary_request_set) + strlen(key) +
+        value_size;
+    char *buffer = malloc(bufsz);
+    char *value = calloc(1, value_size);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    bool found = false;
+    cJSON *config;
+    size_t len;
+
+    cb_assert(buffer != NULL && value != NULL);
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "slow_cmd_usec", 1);
+    cJSON_AddTrueToObject(config, "slow_cmd_keys");
+    reload_config_with(config);
+    cJSON_Delete(config);
+
+    len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), value, value_size, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_STAT,
+                      "slow", 4, NULL, 0);
+    safe_send(buffer, len, false);
+    do {
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        if (response->message.header.response.keylen != 0) {
+            char *val = buffer + sizeof(*response) +
+                response->message.header.response.keylen;
+            cJSON *json, *obj;
+
+            val[response->message.header.response.bodylen -
+                response->message.header.response.keylen] = '\0';
+            json = cJSON_Parse(val);
+            cb_assert(json != NULL);
+            obj = cJSON_GetObjectItem(json, "key");
+            if (obj != NULL && strcmp(obj->valuestring, key) == 0) {
+                obj = cJSON_GetObjectItem(json, "opcode");
+                cb_assert(obj != NULL && strcmp(obj->valuestring, "SET") == 0);
+                obj = cJSON_GetObjectItem(json, "total_usec");
+                cb_assert(obj != NULL && obj->valueint >= 1);
+                cb_assert(cJSON_GetObjectItem(json, "wait_usec") != NULL);
+                cb_assert(cJSON_GetObjectItem(json, "engine_usec") != NULL);
+                cb_assert(cJSON_GetObjectItem(json, "blocked_usec") != NULL);
+                cb_assert(cJSON_GetObjectItem(json, "transmit_usec") != NULL);
+                found = true;
+            }
+            cJSON_Delete(json);
+        }
+    } while (response->message.header.response.keylen != 0);
+    cb_assert(found);
+
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "slow_cmd_usec", 0);
+    cJSON_AddFalseToObject(config, "slow_cmd_keys");
+    reload_config_with(config);
+    cJSON_Delete(config);
+    free(value);
+    free(buffer);
+    return TEST_PASS;
+}
+
+/*
+ * Request the stats in a single document, first as JSON and then in the
+ * binary form, and check that the plain stats and "slabs" are in both.
+ */
+static enum test_return test_bulk_stats(void) {
+    const size_t bufsz = 256 * 1024;
+    char *buffer = malloc(bufsz);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    const char *keys[] = { "bulk", "bulk json general slabs" };
+    const unsigned char *ptr, *end;
+    cJSON *json, *obj;
+    size_t len;
+    int ii;
+
+    cb_assert(buffer != NULL);
+    for (ii = 0; ii < 2; ++ii) {
+        len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_STAT,
+                          keys[ii], strlen(keys[ii]), NULL, 0);
+        safe_send(buffer, len, false);
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(response->message.header.response.keylen == 4);
+        cb_assert(memcmp(buffer + sizeof(*response), "bulk", 4) == 0);
+        buffer[sizeof(*response) + response->message.header.response.bodylen] = '\0';
+        json = cJSON_Parse(buffer + sizeof(*response) + 4);
+        cb_assert(json != NULL);
+        obj = cJSON_GetObjectItem(json, "general");
+        cb_assert(obj != NULL && cJSON_GetObjectItem(obj, "pid") != NULL);
+        cb_assert(cJSON_GetObjectItem(json, "slabs") != NULL);
+        cJSON_Delete(json);
+
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(response->message.header.response.keylen == 0);
+    }
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_STAT,
+                      "bulk binary general", 19, NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(response->message.header.response.keylen == 4);
+    ptr = (const unsigned char*)buffer + sizeof(*response) + 4;
+    end = (const unsigned char*)buffer + sizeof(*response) +
+        response->message.header.response.bodylen;
+    cb_assert(end - ptr > 4);
+    cb_assert(memcmp(ptr, PROTOCOL_BINARY_BULK_STATS_MAGIC, 4) == 0);
+    ptr += 4;
+    cb_assert(ptr[0] == PROTOCOL_BINARY_BULK_STATS_GROUP && ptr[1] == 7);
+    cb_assert(memcmp(ptr + 2, "general", 7) == 0);
+    ptr += 9;
+    len = 0;
+    while (ptr < end) {
+        uint32_t klen = 0, vlen = 0;
+        int shift = 0;
+        cb_assert(*ptr++ == PROTOCOL_BINARY_BULK_STATS_STAT);
+        do {
+            klen |= (uint32_t)(*ptr & 0x7f) << shift;
+            shift += 7;
+        } while (*ptr++ & 0x80);
+        if (klen == 3 && memcmp(ptr, "pid", 3) == 0) {
+            ++len;
+        }
+        ptr += klen;
+        shift = 0;
+        do {
+            vlen |= (uint32_t)(*ptr & 0x7f) << shift;
+            shift += 7;
+        } while (*ptr++ & 0x80);
+        ptr += vlen;
+    }
+    cb_assert(ptr == end);
+    cb_assert(len == 1);
+
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(response->message.header.response.keylen == 0);
+
+    /* Only "bulk" itself is the bulk stats */
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_STAT,
+                      "bulkfoo", 7, NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_STAT,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    free(buffer);
+    return TEST_PASS;
+}
+
+/*
+ * Get two stored keys and a missing one with a single multi-get, and
+ * check the bitmap of the missing keys and the entries of the others.
+ */
+static enum test_return test_mget(void) {
+    const char *keys[] = { "test_mget_1", "test_mget_missing", "test_mget_2" };
+    const char *values[] = { "value 1", NULL, "the second value" };
+    union {
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char body[256];
+    protocol_binary_mget_key key;
+    protocol_binary_mget_entry entry;
+    const char *ptr;
+    size_t len, nbody = 0;
+    int ii;
+
+    for (ii = 0; ii < 3; ++ii) {
+        if (values[ii] != NULL) {
+            len = storage_command(buffer.bytes, sizeof(buffer.bytes),
+                                  PROTOCOL_BINARY_CMD_SET,
+                                  keys[ii], strlen(keys[ii]),
+                                  values[ii], strlen(values[ii]), ii, 0);
+            safe_send(buffer.bytes, len, false);
+            safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+            validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SET,
+                                     PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        }
+        key.key.vbucket = 0;
+        key.key.keylen = htons((uint16_t)strlen(keys[ii]));
+        memcpy(body + nbody, key.bytes, sizeof(key.bytes));
+        memcpy(body + nbody + sizeof(key.bytes), keys[ii], strlen(keys[ii]));
+        nbody += sizeof(key.bytes) + strlen(keys[ii]);
+    }
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_MGET, NULL, 0, body, nbody);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_MGET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.bodylen ==
+              1 + 2 * sizeof(entry.bytes) + strlen(values[0]) +
+              strlen(values[2]));
+
+    ptr = buffer.bytes + sizeof(buffer.response);
+    cb_assert(*ptr++ == 0x2);
+    for (ii = 0; ii < 3; ii += 2) {
+        memcpy(entry.bytes, ptr, sizeof(entry.bytes));
+        ptr += sizeof(entry.bytes);
+        cb_assert(ntohs(entry.entry.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(entry.entry.cas != 0);
+        cb_assert(ntohl(entry.entry.flags) == (uint32_t)ii);
+        cb_assert(ntohl(entry.entry.vallen) == strlen(values[ii]));
+        cb_assert(memcmp(ptr, values[ii], strlen(values[ii])) == 0);
+        ptr += strlen(values[ii]);
+    }
+
+    /* A key running past the end of the body */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_MGET, NULL, 0, body, nbody - 1);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_MGET,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
+    return TEST_PASS;
+}
+
+/*
+ * Fetch a value big enough to be sent with zero-copy, and check that it
+ * arrives intact and that the zero-copy counters are reported.
+ */
+static enum test_return test_zerocopy_get(void) {
+    const char *key = "test_zerocopy_get";
+    const size_t value_size = 512 * 1024;
+    const size_t bufsz = sizeof(protocol_binary_request_set) + strlen(key) +
+        value_size;
+    char *buffer = malloc(bufsz);
+    char *value = malloc(value_size);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    uint64_t counter;
+    cJSON *config;
+    size_t len;
+    size_t ii;
+
+    cb_assert(buffer != NULL && value != NULL);
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "zerocopy_threshold", 65536);
+    reload_config_with(config);
+    cJSON_Delete(config);
+
+    for (ii = 0; ii < value_size; ++ii) {
+        value[ii] = 'a' + (ii % 26);
+    }
+    len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), value, value_size, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* Twice, so the second one is sent while the first may be pinned */
+    for (ii = 0; ii < 2; ++ii) {
+        len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                          key, strlen(key), NULL, 0);
+        safe_send(buffer, len, false);
+        safe_recv_packet(buffer, bufsz);
+        validate_response_header(response, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(response->message.header.response.bodylen == 4 + value_size);
+        cb_assert(memcmp(buffer + sizeof(*response) + 4, value,
+                         value_size) == 0);
+    }
+
+    cb_assert(get_general_stat("bytes_zerocopy", &counter));
+    cb_assert(get_general_stat("bytes_copied", &counter));
+    cb_assert(get_general_stat("zerocopy_copied", &counter));
+
+    config = generate_config();
+    reload_config_with(config);
+    cJSON_Delete(config);
+    free(value);
+    free(buffer);
+    return TEST_PASS;
+}
+
+/*
+ * Reconnect with kTLS enabled and check that a large value makes it through
+ * intact (the kernel does the encryption if it can, OpenSSL otherwise).
+ */
+static enum test_return test_ktls_get(void) {
+    const char *key = "test_ktls_get";
+    const size_t value_size = 256 * 1024;
+    const size_t bufsz = sizeof(protocol_binary_request_set) + strlen(key) +
+        value_size;
+    char *buffer = malloc(bufsz);
+    char *value = malloc(value_size);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    uint64_t counter;
+    cJSON *config;
+    size_t len;
+    size_t ii;
+
+    cb_assert(buffer != NULL && value != NULL);
+    config = generate_config();
+    cJSON_AddTrueToObject(config, "ktls");
+    reload_config_with(config);
+    cJSON_Delete(config);
+    reconnect_to_server(false);
+
+    for (ii = 0; ii < value_size; ++ii) {
+        value[ii] = 'a' + (ii % 26);
+    }
+    len = storage_command(buffer, bufsz, PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), value, value_size, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsz, PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsz);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(response->message.header.response.bodylen == 4 + value_size);
+    cb_assert(memcmp(buffer + sizeof(*response) + 4, value, value_size) == 0);
+
+    cb_assert(get_general_stat("ktls_conns", &counter));
+
+    config = generate_config();
+    reload_config_with(config);
+    cJSON_Delete(config);
+    reconnect_to_server(false);
+    free(value);
+    free(buffer);
+    return TEST_PASS;
+}
+
+/*
+ * Run the handshakes off the worker threads (the pool is started with the
+ * server); check that the handshake of our connection was accounted for,
+ * and that the certificate refresh (which runs on the pool as well)
+ * succeeds.
+ */
+static enum test_return test_ssl_handshake_pool(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    uint64_t handshakes = 0;
+    uint64_t counter;
+    cJSON *config;
+    size_t len;
+
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "ssl_handshake_threads", 2);
+    restart_server_with(config);
+    cJSON_Delete(config);
+
+    cb_assert(get_general_stat("ssl_handshakes", &handshakes));
+    cb_assert(handshakes > 0);
+    cb_assert(get_general_stat("ssl_pool_queue", &counter));
+    cb_assert(get_general_stat("ssl_pool_queue_max", &counter));
+    cb_assert(counter > 0);
+    cb_assert(get_general_stat("ssl_handshake_avg_usec", &counter));
+    cb_assert(get_general_stat("ssl_handshake_max_usec", &counter));
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH,
+                      NULL, 0, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    config = generate_config();
+    restart_server_with(config);
+    cJSON_Delete(config);
+    return TEST_PASS;
+}
+
+/*
+ * Connect to the SSL port with a connection of our own (resuming the
+ * given session, if any) and run a NOOP over it, so the server is done
+ * with the handshake. Returns the session to resume the next time.
+ */
+static SSL_SESSION *ssl_noop_session(SSL_CTX *ctx, SSL_SESSION *session,
+                                     bool *reused) {
+    protocol_binary_response_no_extras response;
+    char buffer[1024];
+    SOCKET sfd = create_connect_plain_socket("127.0.0.1", ssl_port, false);
+    SSL *client = SSL_new(ctx);
+    SSL_SESSION *ret;
+    size_t len;
+    int nr = 0;
+
+    cb_assert(sfd != INVALID_SOCKET && client != NULL);
+    SSL_set_fd(client, (int)sfd);
+    if (session != NULL) {
+        SSL_set_session(client, session);
+    }
+    cb_assert(SSL_connect(client) == 1);
+    *reused = SSL_session_reused(client);
+
+    len = raw_command(buffer, sizeof(buffer), PROTOCOL_BINARY_CMD_NOOP,
+                      NULL, 0, NULL, 0);
+    cb_assert(SSL_write(client, buffer, (int)len) == (int)len);
+    while (nr < (int)sizeof(response.bytes)) {
+        int n = SSL_read(client, response.bytes + nr,
+                         (int)sizeof(response.bytes) - nr);
+        cb_assert(n > 0);
+        nr += n;
+    }
+    validate_response_header(&response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    ret = SSL_get1_session(client);
+    SSL_shutdown(client);
+    SSL_free(client);
+    closesocket(sfd);
+    return ret;
+}
+
+/*
+ * Reconnect with the session of an earlier connection, once with the
+ * session id (looked up in the server's session cache) and once with a
+ * session ticket, and check that both resume the session.
+ */
+static enum test_return test_ssl_session_resumption(void) {
+    uint64_t resumed_before = 0;
+    uint64_t resumed = 0;
+    uint64_t full = 0;
+    uint64_t cached = 0;
+    bool reused;
+    int ii;
+
+    cb_assert(get_general_stat("ssl_handshakes_resumed", &resumed_before));
+
+    for (ii = 0; ii < 2; ++ii) {
+        SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+        SSL_SESSION *session;
+        SSL_SESSION *next;
+
+        cb_assert(ctx != NULL);
+#ifdef SSL_OP_NO_TLSv1_3
+        /* TLS 1.3 only sends the tickets after the handshake */
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_3);
+#endif
+        if (ii == 0) {
+            SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        }
+
+        session = ssl_noop_session(ctx, NULL, &reused);
+        cb_assert(!reused && session != NULL);
+        next = ssl_noop_session(ctx, session, &reused);
+        cb_assert(reused);
+
+        SSL_SESSION_free(next);
+        SSL_SESSION_free(session);
+        SSL_CTX_free(ctx);
+
+        if (ii == 0) {
+            cb_assert(get_general_stat("ssl_session_cache_entries", &cached));
+            cb_assert(cached > 0);
+        }
+    }
+
+    cb_assert(get_general_stat("ssl_handshakes_resumed", &resumed));
+    cb_assert(resumed == resumed_before + 2);
+    cb_assert(get_general_stat("ssl_handshakes_full", &full));
+    cb_assert(full > 0);
+
+    return TEST_PASS;
+}
+
+/*
+ * Put two busy connections on the same worker and check that one of them
+ * is moved to another worker, so that the load ends up spread over (at
+ * least) two of them.
+ */
+static enum test_return test_connection_migration(void) {
+    uint64_t migrated_before[MAX_TEST_THREADS] = {0};
+    uint64_t migrated[MAX_TEST_THREADS] = {0};
+    uint64_t busy_before[MAX_TEST_THREADS] = {0};
+    uint64_t busy[MAX_TEST_THREADS] = {0};
+    uint64_t max_busy = 0;
+    uint64_t moved;
+    SOCKET main_sock = sock;
+    SOCKET *conns;
+    cJSON *config;
+    time_t deadline;
+    int nthreads;
+    int spread = 0;
+    int ii;
+
+    nthreads = get_thread_stats("migrated_out", migrated_before,
+                                MAX_TEST_THREADS);
+    if (nthreads < 2) {
+        return TEST_SKIP;
+    }
+
+    /* Move connections away from workers busy more than 1% of the time */
+    config = generate_config();
+    cJSON_AddNumberToObject(config, "connection_migration", 1);
+    reload_config_with(config);
+    cJSON_Delete(config);
+
+    /*
+     * New connections are placed round robin, so the first and the last
+     * of nthreads + 1 connections are served by the same worker.
+     */
+    conns = calloc(nthreads + 1, sizeof(SOCKET));
+    cb_assert(conns != NULL);
+    for (ii = 0; ii <= nthreads; ++ii) {
+        conns[ii] = create_connect_plain_socket("127.0.0.1", port, false);
+        cb_assert(conns[ii] != INVALID_SOCKET);
+    }
+
+    deadline = time(NULL) + 30;
+    do {
+        for (ii = 0; ii < 1000; ++ii) {
+            sock = conns[(ii & 1) ? nthreads : 0];
+            test_noop();
+        }
+        sock = main_sock;
+        get_thread_stats("migrated_out", migrated, MAX_TEST_THREADS);
+        moved = 0;
+        for (ii = 0; ii < nthreads; ++ii) {
+            moved += migrated[ii] - migrated_before[ii];
+        }
+    } while (moved == 0 && time(NULL) < deadline);
+    cb_assert(moved > 0);
+
+    /* Measure how the same load is spread over the workers now */
+    get_thread_stats("busy_usec", busy_before, MAX_TEST_THREADS);
+    for (ii = 0; ii < 20000; ++ii) {
+        sock = conns[(ii & 1) ? nthreads : 0];
+        test_noop();
+    }
+    sock = main_sock;
+    get_thread_stats("busy_usec", busy, MAX_TEST_THREADS);
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        busy[ii] -= busy_before[ii];
+        if (busy[ii] > max_busy) {
+            max_busy = busy[ii];
+        }
+    }
+    for (ii = 0; ii < nthreads; ++ii) {
+        if (busy[ii] * 4 >= max_busy) {
+            ++spread;
+        }
+    }
+    cb_assert(spread >= 2);
+
+    for (ii = 0; ii <= nthreads; ++ii) {
+        closesocket(conns[ii]);
+    }
+    free(conns);
+
+    config = generate_config();
+    reload_config_with(config);
+    cJSON_Delete(config);
+
+    return TEST_PASS;
+}
+
+static enum test_return test_scrub(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_SCRUB,
+                             NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_SCRUB,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
+
+static enum test_return test_roles(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             "unknownrole", 11, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+
+    /* assume the statistics role */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             "statistics", 10, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* At this point I should get an EACCESS if I tried to run NOOP */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP,
+                      NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_EACCESS);
+
+    /* But I should be allowed to run a stat */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    do {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    /* Drop the role */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_ASSUME_ROLE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* And noop should work again! */
+    return test_noop();
+}
+
+volatile bool hickup_thread_running;
+
+static void binary_hickup_recv_verification_thread(void *arg) {
+    protocol_binary_response_no_extras *response = malloc(65*1024);
+    if (response != NULL) {
+        while (safe_recv_packet(response, 65*1024)) {
+            /* Just validate the packet format */
+            validate_response_header(response,
+                                     response->message.header.response.opcode,
+                                     response->message.header.response.status);
+        }
+        free(response);
+    }
+    hickup_thread_running = false;
+    allow_closed_read = false;
+}
+
+static enum test_return test_pipeline_hickup_chunk(void *buffer, size_t buffersize) {
+    off_t offset = 0;
+    char *key[256];
+    uint64_t value = 0xfeedfacedeadbeef;
+
+    while (hickup_thread_running &&
+           offset + sizeof(protocol_binary_request_no_extras) < buffersize) {
+        union {
+            protocol_binary_request_no_extras request;
+            char bytes[65 * 1024];
+        } command;
+        uint8_t cmd = (uint8_t)(rand() & 0xff);
+        size_t len;
+        size_t keylen = (rand() % 250) + 1;
+
+        switch (cmd) {
+        case PROTOCOL_BINARY_CMD_ADD:
+        case PROTOCOL_BINARY_CMD_ADDQ:
+        case PROTOCOL_BINARY_CMD_REPLACE:
+        case PROTOCOL_BINARY_CMD_REPLACEQ:
+        case PROTOCOL_BINARY_CMD_SET:
+        case PROTOCOL_BINARY_CMD_SETQ:
+            len = storage_command(command.bytes, sizeof(command.bytes), cmd,
+                                  key, keylen , &value, sizeof(value),
+                                  0, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_APPEND:
+        case PROTOCOL_BINARY_CMD_APPENDQ:
+        case PROTOCOL_BINARY_CMD_PREPEND:
+        case PROTOCOL_BINARY_CMD_PREPENDQ:
+            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
+                              key, keylen, &value, sizeof(value));
+            break;
+        case PROTOCOL_BINARY_CMD_FLUSH:
+        case PROTOCOL_BINARY_CMD_FLUSHQ:
+            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
+                              NULL, 0, NULL, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_NOOP:
+            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
+                              NULL, 0, NULL, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_DELETE:
+        case PROTOCOL_BINARY_CMD_DELETEQ:
+            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
+                             key, keylen, NULL, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_DECREMENT:
+        case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        case PROTOCOL_BINARY_CMD_INCREMENT:
+        case PROTOCOL_BINARY_CMD_INCREMENTQ:
+            len = arithmetic_command(command.bytes, sizeof(command.bytes), cmd,
+                                     key, keylen, 1, 0, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_VERSION:
+            len = raw_command(command.bytes, sizeof(command.bytes),
+                             PROTOCOL_BINARY_CMD_VERSION,
+                             NULL, 0, NULL, 0);
             break;
         case PROTOCOL_BINARY_CMD_GET:
         case PROTOCOL_BINARY_CMD_GETK:
@@ -2634,6 +3799,42 @@ static enum test_return test_config_validate(void) {
                                  PROTOCOL_BINARY_RESPONSE_EINVAL);
     }
 
+    /* 'reuseport' cannot be changed */
+    {
+        cJSON *dynamic = cJSON_CreateObject();
+        char* dyn_string = NULL;
+        cJSON_AddTrueToObject(dynamic, "reuseport");
+        dyn_string = cJSON_Print(dynamic);
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_CONFIG_VALIDATE, NULL, 0,
+                          dyn_string, strlen(dyn_string));
+        free(dyn_string);
+
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response,
+                                 PROTOCOL_BINARY_CMD_CONFIG_VALIDATE,
+                                 PROTOCOL_BINARY_RESPONSE_EINVAL);
+    }
+
+    /* 'io_backend' cannot be changed */
+    {
+        cJSON *dynamic = cJSON_CreateObject();
+        char* dyn_string = NULL;
+        cJSON_AddStringToObject(dynamic, "io_backend", "io_uring");
+        dyn_string = cJSON_Print(dynamic);
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_CONFIG_VALIDATE, NULL, 0,
+                          dyn_string, strlen(dyn_string));
+        free(dyn_string);
+
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response,
+                                 PROTOCOL_BINARY_CMD_CONFIG_VALIDATE,
+                                 PROTOCOL_BINARY_RESPONSE_EINVAL);
+    }
+
     /* 'interfaces' - should be able to change max connections */
     {
         cJSON *dynamic = generate_config();
@@ -3021,6 +4222,71 @@ static enum test_return test_write(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_write_cas(void) {
+    union {
+        protocol_binary_request_read request;
+        protocol_binary_response_read response;
+        char bytes[1024];
+    } buffer;
+    size_t len;
+    uint64_t cas;
+
+    store_object("hello", "world");
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      write_command, "hello",
+                      strlen("hello"), "zz", 2);
+    buffer.request.message.body.offset = htonl(1);
+    buffer.request.message.body.length = htonl(2);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, write_command,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cas = buffer.response.message.header.response.cas;
+    cb_assert(cas != 0);
+
+    /* The read sees the new value and CAS */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      read_command, "hello",
+                      strlen("hello"), NULL, 0);
+    buffer.request.message.body.offset = htonl(0);
+    buffer.request.message.body.length = htonl(5);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, read_command,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.cas == cas);
+    cb_assert(memcmp(buffer.bytes + sizeof(buffer.response), "wzzld", 5) == 0);
+
+    /* A write with the current CAS gets a new one */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      write_command, "hello",
+                      strlen("hello"), "o", 1);
+    buffer.request.message.body.offset = htonl(1);
+    buffer.request.message.body.length = htonl(1);
+    buffer.request.message.header.request.cas = cas;
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, write_command,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.cas != cas);
+    validate_object("hello", "wozld");
+
+    /* ... so the old one no longer works */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      write_command, "hello",
+                      strlen("hello"), "r", 1);
+    buffer.request.message.body.offset = htonl(2);
+    buffer.request.message.body.length = htonl(1);
+    buffer.request.message.header.request.cas = cas;
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, write_command,
+                             PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+    validate_object("hello", "wozld");
+    return TEST_PASS;
+}
+
 static enum test_return test_hello(void) {
     union {
         protocol_binary_request_hello request;
@@ -3081,6 +4347,136 @@ static enum test_return test_hello(void) {
     return TEST_PASS;
 }
 
+/*
+ * Negotiate unordered execution, and check that a pipeline of gets is
+ * answered (the default engine never blocks, so in order) with the
+ * terminating NOOP last.
+ */
+static enum test_return test_hello_unordered(void) {
+    union {
+        protocol_binary_request_hello request;
+        protocol_binary_response_hello response;
+        char bytes[1024];
+    } buffer;
+    uint16_t feature = htons(PROTOCOL_BINARY_FEATURE_UNORDERED_EXECUTION);
+    char pipeline[1024];
+    size_t len, nsend = 0;
+    uint32_t ii;
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_HELLO, "unordered", 9,
+                      &feature, sizeof(feature));
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_HELLO,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.bodylen == 2);
+    cb_assert(memcmp(buffer.bytes + sizeof(buffer.response), &feature,
+                     sizeof(feature)) == 0);
+
+    store_object("test_hello_unordered", "value");
+    for (ii = 0; ii < 4; ++ii) {
+        protocol_binary_request_no_extras *req = (void*)(pipeline + nsend);
+        nsend += raw_command(pipeline + nsend, sizeof(pipeline) - nsend,
+                             ii < 3 ? PROTOCOL_BINARY_CMD_GETK :
+                             PROTOCOL_BINARY_CMD_NOOP,
+                             ii < 3 ? "test_hello_unordered" : NULL,
+                             ii < 3 ? 20 : 0, NULL, 0);
+        req->message.header.request.opaque = ii;
+    }
+    safe_send(pipeline, nsend, false);
+    for (ii = 0; ii < 4; ++ii) {
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        cb_assert(buffer.response.message.header.response.opaque == ii);
+        cb_assert(buffer.response.message.header.response.status ==
+                  PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        cb_assert(buffer.response.message.header.response.opcode ==
+                  (ii < 3 ? PROTOCOL_BINARY_CMD_GETK :
+                   PROTOCOL_BINARY_CMD_NOOP));
+    }
+
+    /* A hello without it turns it off again */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_HELLO, "unordered", 9, NULL, 0);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_HELLO,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(buffer.response.message.header.response.bodylen == 0);
+    return TEST_PASS;
+}
+
+static enum test_return test_hello_stream_compression(void) {
+    union {
+        protocol_binary_request_hello request;
+        protocol_binary_response_hello response;
+        protocol_binary_response_no_extras noop;
+        char bytes[1024];
+    } buffer;
+    uint16_t feature = htons(PROTOCOL_BINARY_FEATURE_STREAM_COMPRESSION);
+    size_t len;
+#ifdef HAVE_LZ4FRAME_H
+    LZ4F_compressionContext_t cctx;
+    LZ4F_decompressionContext_t dctx;
+    LZ4F_preferences_t prefs;
+    char request[sizeof(protocol_binary_request_no_extras)];
+    char compressed[1024];
+    size_t done = 0;
+#endif
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_HELLO, "stream", 6,
+                      &feature, sizeof(feature));
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_HELLO,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    if (buffer.response.message.header.response.bodylen == 0) {
+        /* The server was built without LZ4 */
+        return TEST_PASS;
+    }
+    cb_assert(buffer.response.message.header.response.bodylen == 2);
+    cb_assert(memcmp(buffer.bytes + sizeof(buffer.response), &feature,
+                     sizeof(feature)) == 0);
+
+#ifdef HAVE_LZ4FRAME_H
+    /* A noop through the compressed stream */
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.autoFlush = 1;
+    cb_assert(!LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)));
+    cb_assert(!LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)));
+    raw_command(request, sizeof(request), PROTOCOL_BINARY_CMD_NOOP,
+                NULL, 0, NULL, 0);
+    len = LZ4F_compressBegin(cctx, compressed, sizeof(compressed), &prefs);
+    cb_assert(!LZ4F_isError(len));
+    done = LZ4F_compressUpdate(cctx, compressed + len, sizeof(compressed) - len,
+                               request, sizeof(request), NULL);
+    cb_assert(!LZ4F_isError(done));
+    safe_send(compressed, len + done, false);
+
+    /* Feed the response to the decompressor a byte at a time */
+    done = 0;
+    while (done < sizeof(buffer.noop)) {
+        char byte;
+        size_t src = 1;
+        size_t dst = sizeof(buffer.noop) - done;
+
+        safe_recv(&byte, 1);
+        cb_assert(!LZ4F_isError(LZ4F_decompress(dctx, buffer.bytes + done, &dst,
+                                                &byte, &src, NULL)));
+        done += dst;
+    }
+    validate_response_header(&buffer.noop, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    LZ4F_freeCompressionContext(cctx);
+    LZ4F_freeDecompressionContext(dctx);
+#endif
+
+    /* It can't be turned off again */
+    reconnect_to_server(false);
+    return TEST_PASS;
+}
+
 static void set_datatype_feature(bool enable) {
     union {
         protocol_binary_request_hello request;
@@ -4128,6 +5524,7 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN("strtoll", test_safe_strtoll),
     TESTCASE_PLAIN("strtoul", test_safe_strtoul),
     TESTCASE_PLAIN("strtoull", test_safe_strtoull),
+    TESTCASE_PLAIN("parse_cpu_list", test_parse_cpu_list),
     TESTCASE_PLAIN("vperror", test_vperror),
     TESTCASE_PLAIN("config_parser", test_config_parser),
     /* The following tests all run towards the same server */
@@ -4171,16 +5568,33 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("prependq", test_prependq),
     TESTCASE_PLAIN_AND_SSL("stat", test_stat),
     TESTCASE_PLAIN_AND_SSL("stat_connections", test_stat_connections),
+    TESTCASE_PLAIN_AND_SSL("stat_threads", test_stat_threads),
+    TESTCASE_PLAIN_AND_SSL("stat_read_buffers", test_stat_read_buffers),
+    TESTCASE_PLAIN("stat_reset", test_stat_reset),
+    TESTCASE_PLAIN_AND_SSL("pipeline_coalescing", test_pipeline_coalescing),
+    TESTCASE_PLAIN("connection_pool", test_connection_pool),
+    TESTCASE_PLAIN("time_slice", test_time_slice),
+    TESTCASE_PLAIN("reuseport", test_reuseport),
+    TESTCASE_PLAIN("aux_pool", test_aux_pool),
+    TESTCASE_PLAIN("cmd_timings", test_cmd_timings),
+    TESTCASE_PLAIN("slow_log", test_slow_log),
+    TESTCASE_PLAIN("bulk_stats", test_bulk_stats),
+    TESTCASE_PLAIN("mget", test_mget),
+    TESTCASE_PLAIN("connection_migration", test_connection_migration),
+    TESTCASE_PLAIN("zerocopy_get", test_zerocopy_get),
     TESTCASE_PLAIN_AND_SSL("roles", test_roles),
     TESTCASE_PLAIN_AND_SSL("scrub", test_scrub),
     TESTCASE_PLAIN_AND_SSL("verbosity", test_verbosity),
     TESTCASE_PLAIN_AND_SSL("read", test_read),
     TESTCASE_PLAIN_AND_SSL("write", test_write),
+    TESTCASE_PLAIN_AND_SSL("write_cas", test_write_cas),
     TESTCASE_PLAIN_AND_SSL("MB-10114", test_mb_10114),
     TESTCASE_PLAIN_AND_SSL("dcp_noop", test_dcp_noop),
     TESTCASE_PLAIN_AND_SSL("dcp_buffer_acknowledgment", test_dcp_buffer_ack),
     TESTCASE_PLAIN_AND_SSL("dcp_control", test_dcp_control),
     TESTCASE_PLAIN_AND_SSL("hello", test_hello),
+    TESTCASE_PLAIN("hello_unordered", test_hello_unordered),
+    TESTCASE_PLAIN("hello_stream_compression", test_hello_stream_compression),
     TESTCASE_PLAIN_AND_SSL("isasl_refresh", test_isasl_refresh),
 
     TESTCASE_PLAIN_AND_SSL("ioctl", test_ioctl),
@@ -4202,6 +5616,9 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("set_e2big", test_set_e2big),
     TESTCASE_PLAIN_AND_SSL("pipeline_huge",  test_pipeline_huge),
     TESTCASE_SSL("pipeline_mb-11203",test_pipeline_set),
+    TESTCASE_SSL("ktls_get", test_ktls_get),
+    TESTCASE_SSL("ssl_handshake_pool", test_ssl_handshake_pool),
+    TESTCASE_SSL("ssl_session_resumption", test_ssl_session_resumption),
     TESTCASE_PLAIN_AND_SSL("pipeline_1", test_pipeline_set_get_del),
     TESTCASE_PLAIN_AND_SSL("pipeline_2", test_pipeline_set_del),
     TESTCASE_CLEANUP("stop_server", stop_memcached_server),
@@ -371,6 +371,142 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static void mt_get_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         const char *key, size_t nkey) {
+    item *test_item = NULL;
+    item_info info;
+    uint64_t cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, nkey, nkey, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+    memcpy(info.value[0].iov_base, key, nkey);
+    cb_assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+}
+
+static void mt_get_writer_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+    int ii;
+
+    for (ii = 0; ii < 20000; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_get_key_%d", ii % 128);
+        uint64_t cas = 0;
+
+        if (ii % 3 == 0) {
+            h1->remove(h, NULL, key, nkey, &cas, 0);
+        } else {
+            mt_get_store(h, h1, key, nkey);
+        }
+    }
+}
+
+static void mt_get_reader_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+    int ii;
+
+    for (ii = 0; ii < 50000; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_get_key_%d", ii % 128);
+        item *test_item = NULL;
+
+        if (h1->get(h, NULL, &test_item, key, (int)nkey, 0) == ENGINE_SUCCESS) {
+            item_info info;
+            info.nvalue = 1;
+            cb_assert(h1->get_item_info(h, NULL, test_item, &info));
+            /* The value must still be the one we stored */
+            cb_assert(info.nkey == nkey);
+            cb_assert(info.value[0].iov_len == nkey);
+            cb_assert(memcmp(info.value[0].iov_base, key, nkey) == 0);
+            h1->release(h, NULL, test_item);
+        }
+    }
+}
+
+/*
+ * Make sure that readers can run concurrently with a writer replacing and
+ * removing the same keys, and never see a recycled item
+ */
+static enum test_result mt_get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+#define num_readers 8
+    cb_thread_t readers[num_readers];
+    cb_thread_t writer;
+    int ii;
+
+    cb_assert(cb_create_thread(&writer, mt_get_writer_main, h, 0) == 0);
+    for (ii = 0; ii < num_readers; ++ii) {
+        cb_assert(cb_create_thread(&readers[ii], mt_get_reader_main, h, 0) == 0);
+    }
+
+    cb_assert(cb_join_thread(writer) == 0);
+    for (ii = 0; ii < num_readers; ++ii) {
+        cb_assert(cb_join_thread(readers[ii]) == 0);
+    }
+
+    return SUCCESS;
+}
+
+static void mt_overwrite_writer_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+    int ii;
+
+    for (ii = 0; ii < 20000; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_overwrite_key_%d", ii % 128);
+        mt_get_store(h, h1, key, nkey);
+    }
+}
+
+static void mt_overwrite_reader_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+    int ii;
+
+    for (ii = 0; ii < 50000; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_overwrite_key_%d", ii % 128);
+        item *test_item = NULL;
+
+        /* The key is only ever overwritten, so it must always be there */
+        cb_assert(h1->get(h, NULL, &test_item, key, (int)nkey, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+}
+
+/*
+ * Make sure that readers never miss a key while a writer keeps
+ * overwriting it
+ */
+static enum test_result mt_overwrite_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t readers[num_readers];
+    cb_thread_t writer;
+    int ii;
+
+    for (ii = 0; ii < 128; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_overwrite_key_%d", ii);
+        mt_get_store(h, h1, key, nkey);
+    }
+
+    cb_assert(cb_create_thread(&writer, mt_overwrite_writer_main, h, 0) == 0);
+    for (ii = 0; ii < num_readers; ++ii) {
+        cb_assert(cb_create_thread(&readers[ii], mt_overwrite_reader_main, h, 0) == 0);
+    }
+
+    cb_assert(cb_join_thread(writer) == 0);
+    for (ii = 0; ii < num_readers; ++ii) {
+        cb_assert(cb_join_thread(readers[ii]) == 0);
+    }
+
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -441,6 +577,52 @@ static enum test_result get_item_info_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h
     return SUCCESS;
 }
 
+/*
+ * Overwrite part of an item in place, which is only done while nobody
+ * else holds a reference to it
+ */
+static enum test_result write_range_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char *key = "write_range_test_key";
+    uint64_t cas = 0;
+    uint64_t newcas;
+    item_info ii;
+
+    ii.nvalue = 1;
+    cb_assert(h1->write_range != NULL);
+    cb_assert(h1->write_range(h, NULL, key, (int)strlen(key), 0, "x", 1,
+                              &cas, 0) == ENGINE_KEY_ENOENT);
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 5, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    memcpy(ii.value[0].iov_base, "world", 5);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+
+    /* We still hold a reference */
+    newcas = cas;
+    cb_assert(h1->write_range(h, NULL, key, (int)strlen(key), 1, "zz", 2,
+                              &newcas, 0) == ENGINE_NOT_STORED);
+    h1->release(h, NULL, test_item);
+
+    cb_assert(h1->write_range(h, NULL, key, (int)strlen(key), 4, "zz", 2,
+                              &newcas, 0) == ENGINE_ERANGE);
+    newcas = cas + 1;
+    cb_assert(h1->write_range(h, NULL, key, (int)strlen(key), 1, "zz", 2,
+                              &newcas, 0) == ENGINE_KEY_EEXISTS);
+    newcas = cas;
+    cb_assert(h1->write_range(h, NULL, key, (int)strlen(key), 1, "zz", 2,
+                              &newcas, 0) == ENGINE_SUCCESS);
+    cb_assert(newcas != cas);
+
+    cb_assert(h1->get(h, NULL, &test_item, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    cb_assert(ii.cas == newcas);
+    cb_assert(memcmp(ii.value[0].iov_base, "wzzld", 5) == 0);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
 static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
     char *key = "item_set_cas_test_key";
@@ -842,10 +1024,13 @@ engine_test_t* get_tests(void) {
         {"release test", release_test, NULL, NULL, NULL},
         {"incr test", incr_test, NULL, NULL, NULL},
         {"mt incr test", mt_incr_test, NULL, NULL, NULL},
+        {"mt get test", mt_get_test, NULL, NULL, NULL},
+        {"mt overwrite test", mt_overwrite_test, NULL, NULL, NULL},
         {"decr test", decr_test, NULL, NULL, NULL},
         {"flush test", flush_test, NULL, NULL, NULL},
         {"get item info test", get_item_info_test, NULL, NULL, NULL},
         {"set cas test", item_set_cas_test, NULL, NULL, NULL},
+        {"write range test", write_range_test, NULL, NULL, NULL},
         {"LRU test", lru_test, NULL, NULL, "cache_size=48"},
         {"get stats test", get_stats_test, NULL, NULL, NULL},
         {"reset stats test", reset_stats_test, NULL, NULL, NULL},
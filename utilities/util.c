@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+/* for the CPU_* macros and sched_setaffinity() */
+#define _GNU_SOURCE
+#endif
 #include "config.h"
 #include <stdio.h>
 #include <ctype.h>
@@ -6,6 +10,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
 #include "memcached/util.h"
 
 /* Avoid warnings on solaris, where isspace() is an index into an array, and gcc uses signed chars */
@@ -160,6 +168,69 @@ bool safe_strtof(const char *str, float *out) {
 #endif
 }
 
+int parse_cpu_list(const char *list, int *cpus, int max) {
+    const char *ptr = list;
+    int count = 0;
+
+    cb_assert(list != NULL);
+    while (*ptr != '\0') {
+        char *end;
+        long first, last, cpu;
+
+        if (!isdigit((unsigned char)*ptr)) {
+            return -1;
+        }
+        first = last = strtol(ptr, &end, 10);
+        ptr = end;
+        if (*ptr == '-') {
+            ++ptr;
+            if (!isdigit((unsigned char)*ptr)) {
+                return -1;
+            }
+            last = strtol(ptr, &end, 10);
+            ptr = end;
+            if (last < first) {
+                return -1;
+            }
+        }
+        for (cpu = first; cpu <= last; ++cpu) {
+            if (count == max) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        if (*ptr == ',' && ptr[1] != '\0') {
+            ++ptr;
+        } else if (*ptr != '\0') {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+bool bind_thread_to_cpus(const int *cpus, int count) {
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    int ii;
+
+    CPU_ZERO(&set);
+    for (ii = 0; ii < count; ++ii) {
+        if (cpus[ii] < 0 || cpus[ii] >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return false;
+        }
+        CPU_SET(cpus[ii], &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    (void)count;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
 void vperror(const char *fmt, ...) {
     int old_errno = errno;
     char buf[1024];